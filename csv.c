@@ -14,6 +14,10 @@
 */
 #if !defined(SQLITE_CORE) || defined(SQLITE_ENABLE_CSV)
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE               /* O_DIRECT */
+#endif
+
 #ifndef SQLITE_CORE
   #include "sqlite3ext.h"
   SQLITE_EXTENSION_INIT1
@@ -24,6 +28,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(__linux__)
+# include <poll.h>
+# include <sys/inotify.h>
+# define CSV_HAVE_WATCH 1
+#endif
 
 #ifndef SQLITE_AMALGAMATION
 #include "csv.h"
@@ -33,12 +50,632 @@
 #define UNUSED_PARAMETER(x) (void)(x)
 #endif
 
+/*
+** The SQL functions that run SQL of their own, write shadow tables or
+** change settings of the process are registered SQLITE_DIRECTONLY: they
+** cannot be called by the views and triggers of a schema, which may come
+** from an untrusted database file.
+*/
+#ifndef SQLITE_DIRECTONLY
+# define SQLITE_DIRECTONLY 0
+#endif
+
+/*
+** SQLITE_CSV_MAX_OPEN_FILES is the default number of idle file descriptors
+** kept open by the process-wide pool shared by all CSV tables. It can be
+** changed at runtime with csv_config('max_open_files', N).
+**
+** SQLITE_CSV_READ_BUFFER is the size in bytes of the read buffer of each
+** cursor. Scans fill it at once, while rowid lookups read only
+** SQLITE_CSV_LOOKUP_READ bytes at a time.
+*/
+#ifndef SQLITE_CSV_MAX_OPEN_FILES
+# define SQLITE_CSV_MAX_OPEN_FILES 64
+#endif
+#ifndef SQLITE_CSV_READ_BUFFER
+# define SQLITE_CSV_READ_BUFFER 65536
+#endif
+#ifndef SQLITE_CSV_LOOKUP_READ
+# define SQLITE_CSV_LOOKUP_READ 4096
+#endif
+
+/*
+** Scans of tables declared with IO_POLICY=sequential drop the pages of the
+** file they have read from the page cache, SQLITE_CSV_DROP_BEHIND bytes
+** at a time. With IO_POLICY=direct, reads bypass the page cache and must
+** be aligned on CSV_IO_ALIGN bytes, as must the read buffer.
+*/
+#ifndef SQLITE_CSV_DROP_BEHIND
+# define SQLITE_CSV_DROP_BEHIND (4*1024*1024)
+#endif
+#define CSV_IO_ALIGN 4096
+
+/*
+** Lookups (column indexes, the KEY hash index and rowid IN lists) read
+** ahead: up to SQLITE_CSV_IO_DEPTH reads per cursor are handed to a pool
+** of SQLITE_CSV_IO_THREADS worker threads shared by the process. The
+** number of threads can be changed at runtime with
+** csv_config('io_threads', N); with none, reads are done in line.
+*/
+#ifndef SQLITE_CSV_IO_DEPTH
+# define SQLITE_CSV_IO_DEPTH 32
+#endif
+#ifndef SQLITE_CSV_IO_THREADS
+# define SQLITE_CSV_IO_THREADS 4
+#endif
+#define CSV_IO_MAX_THREADS 64
+
+/*
+** SQLITE_CSV_WATCH is the default of csv_config('watch', N): 0 to stat()
+** the file at the start of every scan, 1 to have a thread watch the files
+** of the pool with inotify and stat() a file only once it was changed,
+** 2 to also read the files that were rewritten or replaced into the page
+** cache, SQLITE_CSV_PREWARM_READ bytes at a time, before they are queried.
+** Only available on Linux.
+*/
+#ifndef SQLITE_CSV_WATCH
+# define SQLITE_CSV_WATCH 0
+#endif
+#ifndef SQLITE_CSV_PREWARM_READ
+# define SQLITE_CSV_PREWARM_READ (1024*1024)
+#endif
+
+/*
+** SQLITE_CSV_MEMORY_BUDGET is the default number of bytes the caches of
+** all the CSV tables of the process may use, 0 for no limit other than
+** the soft heap limit of SQLite. It can be changed at runtime with
+** csv_config('memory_budget', N).
+*/
+#ifndef SQLITE_CSV_MEMORY_BUDGET
+# define SQLITE_CSV_MEMORY_BUDGET 0
+#endif
+
+/*
+** Scans read and tokenize rows by batches of up to SQLITE_CSV_BATCH_ROWS
+** rows or about SQLITE_CSV_BATCH_BYTES bytes, whichever comes first, and
+** fewer for wide tables: the offset, length and flags of the values of a
+** batch are kept column by column, in at most CSV_BATCH_CELLS entries.
+*/
+#ifndef SQLITE_CSV_BATCH_ROWS
+# define SQLITE_CSV_BATCH_ROWS 1024
+#endif
+#ifndef SQLITE_CSV_BATCH_BYTES
+# define SQLITE_CSV_BATCH_BYTES (256*1024)
+#endif
+#define CSV_BATCH_CELLS 65536
+#define CSV_CELL_NULL       0x01   /* No such column in the row, or NULLS */
+#define CSV_CELL_ESCAPED    0x02   /* Quoted value with "" to unescape */
+#define CSV_CELL_UNESCAPED  0x04   /* Offset is in zCellBuf, not zRow */
+
+/*
+** Hidden columns, declared after those of the file, by their position
+** from pCSV->nColumn on:
+**
+**   _resume_from   argument of t(OFFSET), the row a scan starts at
+**   _raw           text of the row as in the file, without its line ending
+**   _json          the row as a JSON object keyed by column name
+*/
+#define CSV_HIDDEN_RESUME   0
+#define CSV_HIDDEN_RAW      1
+#define CSV_HIDDEN_JSON     2
+
+/*
+** The index built by csv_refresh() summarizes the file by blocks of
+** SQLITE_CSV_BLOCK_ROWS rows. A Bloom filter is kept for the values of a
+** column in a block only if no more than one row in SQLITE_CSV_BLOOM_RATIO
+** has a distinct value; otherwise the min/max range is all there is.
+*/
+#ifndef SQLITE_CSV_BLOCK_ROWS
+# define SQLITE_CSV_BLOCK_ROWS 4096
+#endif
+#ifndef SQLITE_CSV_BLOOM_RATIO
+# define SQLITE_CSV_BLOOM_RATIO 4
+#endif
+
+/*
+** The column statistics of csv_analyze() and csv_refresh() include an
+** equi-depth histogram of SQLITE_CSV_HIST_BUCKETS buckets per column,
+** drawn from a random sample of SQLITE_CSV_STAT_SAMPLE values. Only the
+** first CSV_STAT_PREFIX bytes of sampled values are kept.
+*/
+#ifndef SQLITE_CSV_HIST_BUCKETS
+# define SQLITE_CSV_HIST_BUCKETS 16
+#endif
+#ifndef SQLITE_CSV_STAT_SAMPLE
+# define SQLITE_CSV_STAT_SAMPLE 1024
+#endif
+#define CSV_STAT_PREFIX 64
+
+
+/*
+** When SQLITE_ENABLE_CSV_PROFILE is defined, the scan loop is instrumented
+** with fine-grained timers and histograms that can be read back with the
+** csv_profile() SQL function.  Otherwise the CSV_PROFILE_* macros expand
+** to nothing and there is no cost at all.
+**
+** Timings are in CPU cycles (rdtsc) on x86 and in nanoseconds elsewhere.
+*/
+#ifdef SQLITE_ENABLE_CSV_PROFILE
+# if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define CSV_PROFILE_CLOCK_NAME "rdtsc"
+#  define csvProfileClock() ((sqlite3_uint64)__rdtsc())
+# else
+#  include <time.h>
+#  define CSV_PROFILE_CLOCK_NAME "ns"
+static sqlite3_uint64 csvProfileClock(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (sqlite3_uint64)t.tv_sec*1000000000 + (sqlite3_uint64)t.tv_nsec;
+}
+# endif
+# define CSV_PROFILE_START(v)      sqlite3_uint64 v = csvProfileClock()
+# define CSV_PROFILE_END(p, e, v)  csvProfileAdd(&(p)->prof, e, csvProfileClock()-(v))
+# define CSV_PROFILE_ROW(p, v, n)  csvProfileRow(&(p)->prof, csvProfileClock()-(v), n)
+#else
+# define CSV_PROFILE_START(v)
+# define CSV_PROFILE_END(p, e, v)
+# define CSV_PROFILE_ROW(p, v, n)
+#endif
+
 
 /* 
 ** The CSV virtual-table types.
 */
 typedef struct CSV CSV;
+typedef struct CSVBlock CSVBlock;
+typedef struct CSVCache CSVCache;
+typedef struct CSVCell CSVCell;
+typedef struct CSVColIdx CSVColIdx;
+typedef struct CSVColStat CSVColStat;
+typedef struct CSVColType CSVColType;
 typedef struct CSVCursor CSVCursor;
+typedef struct CSVError CSVError;
+typedef struct CSVFile CSVFile;
+typedef struct CSVGlobal CSVGlobal;
+typedef struct CSVHandle CSVHandle;
+typedef struct CSVIoJob CSVIoJob;
+typedef struct CSVNull CSVNull;
+typedef struct CSVNullSet CSVNullSet;
+typedef struct CSVProfile CSVProfile;
+
+
+/*
+** Instrumented phases of the scan loop (see SQLITE_ENABLE_CSV_PROFILE).
+*/
+#define CSV_PHASE_GETLINE   0      /* Reading rows (csv_readline()) */
+#define CSV_PHASE_TOKENIZE  1      /* Splitting rows (csvBatchRow()) */
+#define CSV_PHASE_COLUMN    2      /* csvColumn() conversion and unescape */
+#define CSV_PHASE_READ      3      /* Reading the file (csvCursorFill()) */
+#define CSV_NPHASE          4
+
+/*
+** Query plans, as chosen by csvBestIndex() and passed to csvFilter() in
+** idxNum. The matching idxStr describes the plan for EXPLAIN QUERY PLAN
+** and csv_explain(), as a list of "key=value" pairs separated by ';':
+**
+**   plan=NAME      scan, rowid, key or index
+**   idx=N          column of the index read by an index plan
+**   cons=LIST      constraints passed to xFilter, in the order of argv:
+**                  "rowid=", "resume", "offset", "limit", or a column number
+**                  followed by one of = < <= > >= (e.g. "2>=")
+**   order=DIR      asc or desc, if the rows are returned in the order of
+**                  the ORDER BY clause (orderByConsumed)
+**   cols=LIST      columns used by the statement (colUsed), e.g. "0,2"
+**   est=N          estimated number of rows
+*/
+#define CSV_PLAN_SCAN       0      /* Full scan from the first row */
+#define CSV_PLAN_ROWID      1      /* Seek to the row at offset argv[0] */
+#define CSV_PLAN_KEY        2      /* Look up argv[0] in the KEY hash index */
+#define CSV_PLAN_INDEX      3      /* Read rows in the order of a column index */
+
+/*
+** I/O policies of the scans of a table (IO_POLICY option), applied to
+** the reads of full scans only:
+**
+**   default     Plain reads through the page cache.
+**   sequential  Readahead hinted with POSIX_FADV_SEQUENTIAL, and the pages
+**               read dropped from the cache behind the cursor.
+**   direct      Reads with a private O_DIRECT descriptor (F_NOCACHE where
+**               there is no O_DIRECT), which leave the page cache alone.
+*/
+#define CSV_IO_DEFAULT      0
+#define CSV_IO_SEQUENTIAL   1
+#define CSV_IO_DIRECT       2
+static const char *const azIoPolicy[] = { "default", "sequential", "direct" };
+
+/*
+** Huge pages for the large in-memory structures of a table (HUGE_PAGES
+** option), which for now is the hash index of the KEY column, probed at
+** random and so prone to TLB misses:
+**
+**   off       Allocated with sqlite3_malloc().
+**   on        An anonymous mapping aligned on CSV_HUGE_PAGE and advised
+**             MADV_HUGEPAGE, for transparent huge pages.
+**   hugetlb   A MAP_HUGETLB mapping from the reserved huge pages, or as
+**             for "on" if there are none.
+**
+** Structures smaller than CSV_HUGE_PAGE, or whose mapping fails, fall
+** back to sqlite3_malloc(). The CSV_MAP_* values tell how one was
+** actually allocated.
+*/
+#define CSV_HUGE_OFF        0
+#define CSV_HUGE_ON         1
+#define CSV_HUGE_TLB        2
+static const char *const azHugePages[] = { "off", "on", "hugetlb" };
+#define CSV_MAP_HEAP        0
+#define CSV_MAP_THP         1
+#define CSV_MAP_HUGETLB     2
+static const char *const azMap[] = { "heap", "thp", "hugetlb" };
+#define CSV_HUGE_PAGE (2*1024*1024)
+
+/*
+** What scans do with a malformed record (ON_ERROR option): an unclosed
+** quote, text between a closing quote and the next delimiter, or a row
+** longer than SQLITE_LIMIT_LENGTH.
+**
+**   fail   The statement fails with an error giving the offset.
+**   skip   The record is logged and skipped.
+**   null   The record is logged and returned as a row of NULLs.
+**
+** After a skipped or NULL record, the scan resumes at the next line. The
+** log of a table keeps the first SQLITE_CSV_MAX_ERRORS records, and is
+** queried with the csv_errors table-valued function.
+*/
+#define CSV_ONERR_FAIL      0
+#define CSV_ONERR_SKIP      1
+#define CSV_ONERR_NULL      2
+static const char *const azOnError[] = { "fail", "skip", "null" };
+#ifndef SQLITE_CSV_MAX_ERRORS
+# define SQLITE_CSV_MAX_ERRORS 1000
+#endif
+
+/*
+** Typed columns, named by the TIMESTAMP and DECIMAL options, are declared
+** INTEGER and their values converted to integers by csvCellInt(). Empty
+** values are NULL, and those that do not convert are returned as text.
+**
+** A TIMESTAMP column holds dates and times, in ISO-8601 or in the format
+** given with the option (see csvTimeParse()), returned as the number of
+** seconds, milliseconds or microseconds since 1970-01-01 00:00:00 UTC,
+** depending on the TIMESTAMP_UNIT option.
+**
+** A DECIMAL(p,s) column holds numbers of at most p digits, s of them after
+** the decimal separator, returned exactly as the integer number of
+** 1/10^s units (see csvDecimalParse()). The DECIMAL_SEPARATOR and
+** GROUP_SEPARATOR options of the table tell how they are written.
+*/
+#define CSV_TYPE_TEXT       0
+#define CSV_TYPE_TIMESTAMP  1
+#define CSV_TYPE_DECIMAL    2
+struct CSVColType {
+  int eType;                   /* One of CSV_TYPE_* */
+  char *zFmt;                  /* Format of a TIMESTAMP, "" for ISO-8601 */
+  int nPrec, nScale;           /* Precision and scale of a DECIMAL */
+};
+#define CSV_UNIT_S          0
+#define CSV_UNIT_MS         1
+#define CSV_UNIT_US         2
+static const char *const azTimeUnit[] = { "s", "ms", "us" };
+#define CSV_DECIMAL_MAX     18 /* Most digits of a DECIMAL, to fit in 64 bits */
+#define csvIsInt(pCSV, i) \
+  ((pCSV)->aType && (pCSV)->aType[i].eType!=CSV_TYPE_TEXT)
+
+/*
+** Values of the NULLS option, read as NULL when they appear unquoted in
+** the file (a quoted "" is an empty string, not NULL). csvBatchRow() and
+** csvAggSplit() test them as they split the rows, see csvIsNull().
+*/
+struct CSVNull {
+  int n;                       /* Length of z in bytes */
+  const char *z;               /* Sentinel, not nul-terminated */
+};
+struct CSVNullSet {
+  int nNull;                   /* Number of sentinels in aNull[] */
+  CSVNull *aNull;              /* NULLS option, or NULL */
+  sqlite3_uint64 mNullLen;     /* Bit n set if a sentinel is n bytes long */
+};
+#define CSV_NULL_MAXLEN 64     /* Sentinels are shorter than this */
+
+/*
+** A malformed record, logged by a table with ON_ERROR=skip or null.
+*/
+struct CSVError {
+  sqlite3_int64 iOff;          /* Offset of the record */
+  const char *zReason;         /* Static description of the problem */
+};
+
+/*
+** A value of the current row of a cursor, as converted by csvCell() for
+** xColumn(). SQLite may ask for the same column several times per row (for
+** the WHERE clause, the result and an ORDER BY), and each one after the
+** first is answered from here. Entries are valid while iRow matches the
+** iCellRow of the cursor, which every new row increments.
+*/
+struct CSVCell {
+  sqlite3_uint64 iRow;         /* Row of the cursor the value is for */
+  int eType;                   /* SQLITE_TEXT, SQLITE_INTEGER, SQLITE_NULL,
+                               ** or 0 if too big */
+  int n;                       /* Length of z in bytes */
+  const char *z;               /* Text of the value, in the row buffer */
+  sqlite3_int64 iVal;          /* Value of a typed column */
+};
+
+/*
+** The hash index of the KEY column maps the hash of a key to the offsets of
+** the rows that hold it. Each slot of the open-addressing table is a single
+** 64-bit word: the top bits of the hash of the key, as a tag, and the
+** offset of the row plus one in the low CSV_KEY_OFFSET_BITS bits. Zero is
+** an empty slot.
+*/
+#define CSV_KEY_OFFSET_BITS 40
+#define CSV_KEY_OFFSET_MASK (((sqlite3_uint64)1<<CSV_KEY_OFFSET_BITS)-1)
+
+/*
+** Shadow tables of a CSV table, named "<table>_<suffix>":
+**
+**   schema   Declaration of the table and what was learnt from the first
+**            row of the file (see csvSaveSchema()).
+**   file     Identity (size, mtime and checksum) of the file the index
+**            below was built from, by csv_refresh().
+**   block    One row per block of SQLITE_CSV_BLOCK_ROWS rows: offset of
+**            the block, number of rows and offsets of the rows in it.
+**   zone     Per block and column: min and max values, Bloom filter and
+**            number of NULLs.
+**   stat     Per column: number of rows, of empty values and of distinct
+**            values, min, max and histogram, written by csv_analyze()
+**            and csv_refresh().
+**   colidx   Per column indexed by csv_create_index(): identity of the
+**            file the index was built from and number of rows.
+**   colkey   Entries of the column indexes: (column, value, offset of the
+**            row), in the order of the primary key.
+*/
+static const char *const azShadow[] = {
+  "schema", "file", "block", "zone", "stat", "colidx", "colkey"
+};
+#define CSV_NSHADOW ((int)(sizeof(azShadow)/sizeof(azShadow[0])))
+
+/*
+** A block of rows of the index, as loaded from the %_block shadow table.
+*/
+struct CSVBlock {
+  sqlite3_int64 iOff;          /* Offset of the first row of the block */
+  sqlite3_int64 iFirstRow;     /* Number of rows before the block */
+  int nRow;                    /* Number of rows in the block */
+};
+
+/*
+** A sorted index of a column built by csv_create_index(), as loaded from
+** the %_colidx shadow table. Its entries stay in the %_colkey table.
+*/
+struct CSVColIdx {
+  int iCol;                    /* Column indexed */
+  int bValid;                  /* True if the index describes the file */
+  sqlite3_int64 nSize;         /* Identity of the file it was built from */
+  sqlite3_int64 iMtime;
+  sqlite3_int64 iChecksum;
+  sqlite3_int64 nRow;          /* Number of rows of the file */
+  sqlite3_int64 nNull;         /* Rows without the column, not indexed */
+};
+
+/*
+** Statistics of a column, as loaded from the %_stat shadow table. The
+** histogram aHist[] is a list of nHist bounds, each a varint length
+** followed by the bytes of the value: bucket i holds the values greater
+** than bound i-1 and not greater than bound i, and all buckets hold about
+** the same number of rows.
+*/
+struct CSVColStat {
+  sqlite3_int64 nEmpty;        /* Number of empty or missing values */
+  sqlite3_int64 nDistinct;     /* Estimated number of distinct values */
+  char *zMin, *zMax;           /* Range of the non-empty values, or NULL */
+  int nMin, nMax;
+  unsigned char *aHist;        /* Bounds of the histogram buckets */
+  int nHistByte;               /* Size of aHist[] in bytes */
+  int nHist;                   /* Number of buckets */
+};
+
+/*
+** Timers and histograms collected when SQLITE_ENABLE_CSV_PROFILE is
+** defined.  Histogram bucket i counts the samples in [2^(i-1), 2^i).
+*/
+struct CSVProfile {
+  sqlite3_uint64 aCall[CSV_NPHASE];     /* Number of timed calls per phase */
+  sqlite3_uint64 aTick[CSV_NPHASE];     /* Total ticks per phase */
+  sqlite3_uint64 aMax[CSV_NPHASE];      /* Slowest call per phase */
+  sqlite3_uint64 aRowTick[64];          /* Per-row latency histogram */
+  sqlite3_uint64 aRowLen[64];           /* Row length histogram (bytes) */
+};
+
+
+/*
+** An instance of this structure is shared by all CSV tables and SQL
+** functions of a database connection.  It is the client data of the
+** "csv" module.
+*/
+struct CSVGlobal {
+  sqlite3 *db;                 /* Host database connection */
+  CSV *pTables;                /* List of connected CSV tables */
+  sqlite3_str *pExplain;       /* Scan records collected by csv_explain() */
+  int nExplain;                /* Number of records in pExplain */
+};
+
+
+/*
+** Files are shared by all the CSV tables of the process through a pool.
+** There is one CSVFile per path name, referenced by the tables declared
+** on it, and at most one open CSVHandle per CSVFile. A table holds no file
+** descriptor: its cursors acquire the handle of the file at the start of
+** each scan and release it at the end, so the descriptor is shared by all
+** the scans of the file and can be closed while the tables are idle.
+**
+** Cursors read with pread(), so that any number of them can use the same
+** descriptor at the same time, from any thread. Idle handles are kept in
+** LRU order and closed once there are more than csvPool.nMaxOpen of them.
+**
+** The path is stat()ed whenever the handle is acquired. If the file has
+** been replaced (new device or inode number), the handle is detached from
+** the CSVFile, to be closed by its last user, and a new one is opened:
+** scans in progress finish reading the old file and new scans read the
+** new one. If the size or modification time have changed, the file gets a
+** new generation, unique in the process, which tells the tables to check
+** the file against their declaration again.
+**
+** CSVFiles are found by the device and inode numbers of the file when a
+** table is declared, so that two spellings of the path of a file share a
+** CSVFile and its descriptor. The first path is the one stat()ed: a table
+** declared with another one checks that its own path still names the
+** same file at the start of each scan, and moves to the CSVFile of its
+** own path once it does not.
+*/
+struct CSVHandle {
+  int fd;                      /* Open file descriptor */
+  int nActive;                 /* Number of cursors using the descriptor */
+  sqlite3_int64 iDev;          /* Device number of the open file */
+  sqlite3_int64 iIno;          /* Inode number of the open file */
+  CSVFile *pFile;              /* Owner, or NULL once the file was replaced */
+  CSVHandle *pLruPrev;         /* Previous idle handle (more recently used) */
+  CSVHandle *pLruNext;         /* Next idle handle (less recently used) */
+};
+
+struct CSVFile {
+  char *zPath;                 /* Path name of the file */
+  int nRef;                    /* Number of CSV tables using this file */
+  CSVHandle *pHandle;          /* Open handle, or NULL */
+  sqlite3_int64 iGeneration;   /* Changed whenever the file changes */
+  sqlite3_int64 iDev;          /* Identity of the file at the last acquire */
+  sqlite3_int64 iIno;
+  sqlite3_int64 nSize;
+  sqlite3_int64 iMtime;
+  int wdFile;                  /* csvWatch descriptor of the file, or -1 */
+  int wdDir;                   /* csvWatch descriptor of its directory, or -1 */
+  int bStale;                  /* True if changed since the last stat() */
+  int bPrewarm;                /* True if rewritten and not read back yet */
+  CSVFile *pNext;              /* Next file in csvPool.pFiles */
+};
+
+static struct CSVPool {
+  pthread_mutex_t mutex;       /* Protects everything below */
+  CSVFile *pFiles;             /* All the files in use */
+  CSVHandle *pLruFirst;        /* Most recently used idle handle */
+  CSVHandle *pLruLast;         /* Least recently used idle handle */
+  int nOpen;                   /* Number of open descriptors */
+  int nIdle;                   /* Number of idle handles */
+  int nMaxOpen;                /* Maximum number of idle open descriptors */
+  sqlite3_int64 nOpenCall;     /* Number of descriptors opened */
+  sqlite3_int64 nReuse;        /* Number of acquires of an open descriptor */
+  sqlite3_int64 nReplace;      /* Number of files found replaced */
+  sqlite3_int64 nEvict;        /* Number of idle descriptors closed */
+  sqlite3_int64 iGeneration;   /* Last generation given to a file */
+} csvPool = {
+  PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, SQLITE_CSV_MAX_OPEN_FILES,
+  0, 0, 0, 0, 0
+};
+
+/*
+** The watcher of csv_config('watch'). While it runs, each file of the pool
+** has an inotify watch on itself, which sees writes through any path, and
+** one on its directory, which sees the path being replaced by a rename or
+** a new symbolic link. Any event marks the file stale, and only a stale
+** file is stat()ed again by csvFileAcquire(), which reads the pending
+** events itself before looking: a change made before a scan starts is
+** always seen by the scan. The thread keeps the queue short and, in mode
+** 2, reads back the files that were closed after a write or renamed into
+** place.
+**
+** Changes the kernel does not report go unnoticed: those made on another
+** host of a network file system, and the rename of a directory above the
+** one of the file.
+*/
+static struct CSVWatch {
+  int eMode;                   /* Setting: 0 off, 1 watch, 2 also prewarm */
+  int fd;                      /* inotify descriptor, or -1 if not running */
+  int aPipe[2];                /* Wakes the thread up */
+  int bStop;                   /* True while csvWatchStop() runs */
+  int bThread;                 /* True if the thread was started */
+  sqlite3_int64 nEvent;        /* Number of events read */
+  sqlite3_int64 nSkip;         /* Acquires that did not stat() the file */
+  sqlite3_int64 nPrewarm;      /* Bytes read back by the thread */
+  pthread_t thread;            /* The watcher thread */
+} csvWatch = { SQLITE_CSV_WATCH, -1, {-1, -1}, 0, 0, 0, 0, 0, 0 };
+
+
+/*
+** A read issued ahead of a lookup, done by a worker thread of csvIoPool.
+** The cursor waits for the reads in the order they were issued.
+*/
+struct CSVIoJob {
+  CSVIoJob *pNext;             /* Next job in the queue of csvIoPool */
+  int fd;                      /* Descriptor to read */
+  char *aBuf;                  /* Buffer of nRead bytes */
+  int nRead;                   /* Bytes to read */
+  int nPage;                   /* Pages of the cursor taken by aBuf */
+  sqlite3_int64 iRead;         /* Offset of the read */
+  sqlite3_int64 iOff;          /* Offset of the row looked up */
+  int n;                       /* Bytes read, or -1 on error */
+  int eState;                  /* One of CSV_JOB_* */
+};
+#define CSV_JOB_QUEUED      0      /* In the queue of csvIoPool */
+#define CSV_JOB_RUNNING     1      /* Being read by a worker thread */
+#define CSV_JOB_DONE        2      /* Read, or cancelled */
+#define CSV_JOB_SHARED      3      /* No read: in the page of the job before */
+
+static struct CSVIoPool {
+  pthread_mutex_t mutex;       /* Protects everything below */
+  pthread_cond_t work;         /* Signalled when a job is queued */
+  pthread_cond_t done;         /* Broadcast when a job is done */
+  CSVIoJob *pFirst;            /* Queue of jobs waiting for a worker */
+  CSVIoJob *pLast;
+  int nThread;                 /* Number of worker threads */
+  int nMaxThread;              /* Number of worker threads wanted */
+  int nStop;                   /* Number of csvIoStop() calls running */
+  sqlite3_int64 nRead;         /* Number of reads done by the workers */
+  pthread_t aThread[CSV_IO_MAX_THREADS];  /* The worker threads */
+} csvIoPool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, 0, 0, 0, SQLITE_CSV_IO_THREADS, 0, 0, {0}
+};
+
+/*
+** The caches that can be rebuilt from the file -- the hash indexes of KEY
+** columns -- are charged to a memory budget shared by all the CSV tables
+** of the process. A cache is charged before it is allocated: if the other
+** caches cannot be evicted to make room for it within the budget, nor
+** within the soft heap limit of SQLite, it is not built and its queries
+** fall back to the plan they would use without it.
+**
+** Caches are evicted by GreedyDual-Size: each gets the priority
+** rClock + nCost/nByte when it is built or used, where nCost is the number
+** of bytes of file read to build it, the cache of lowest priority is
+** evicted first, and rClock becomes its priority. Caches that are cheap to
+** rebuild for their size go first, and the others age out once unused.
+** A cache in use by a cursor is pinned and never evicted.
+**
+** csvMem is protected by its own mutex, which may be locked while holding
+** csvPool.mutex but not the other way around.
+*/
+struct CSVCache {
+  CSV *pCSV;                   /* Table of the cache */
+  void (*xFree)(CSV*);         /* Free the cache of the table */
+  sqlite3_int64 nByte;         /* Bytes charged to the budget, 0 if none */
+  sqlite3_int64 nCost;         /* Bytes of file read to build the cache */
+  double rPrio;                /* Caches of lower priority are evicted first */
+  int nPin;                    /* Number of cursors using the cache */
+  CSVCache *pNext;             /* Next charged cache in csvMem.pCaches */
+};
+
+static struct CSVMem {
+  pthread_mutex_t mutex;       /* Protects everything below */
+  sqlite3_int64 nBudget;       /* Bytes the caches may use, 0 for no limit */
+  sqlite3_int64 nUsed;         /* Bytes charged */
+  double rClock;               /* Priority of the last cache evicted */
+  CSVCache *pCaches;           /* The charged caches */
+  int nCache;                  /* Number of caches in pCaches */
+  sqlite3_int64 nEvict;        /* Number of caches evicted */
+  sqlite3_int64 nRefuse;       /* Number of caches not built for lack of room */
+} csvMem = {
+  PTHREAD_MUTEX_INITIALIZER, SQLITE_CSV_MEMORY_BUDGET, 0, 0.0, 0, 0, 0, 0
+};
 
 
 /* 
@@ -51,25 +688,139 @@ struct CSV {
   char *zName;                 /* Name of CSV table */ 
   char *zFile;                 /* Name of CSV file */ 
   int nBusy;                   /* Current number of users of this structure */
-  FILE *f;                     /* File pointer for source CSV file */
-  long offsetFirstRow;         /* ftell position of first row */
-  int eof;                     /* True when at end of file */
-  int maxRow;                  /* Size of zRow buffer */
-  char *zRow;                  /* Buffer for current CSV row */
+  CSVFile *pFile;              /* Pooled file, shared with other tables */
+  sqlite3_int64 iGeneration;   /* Generation of pFile last checked, or 0 */
+  sqlite3_int64 nFileSize;     /* Size of the file when it was checked */
+  sqlite3_int64 offsetFirstRow; /* Offset of the first row */
+  sqlite3_int64 nFirstRowLen;  /* Length of the first row, for estimates */
+  int bUseHeaderRow;           /* True if the first row holds column names */
+  int nColumn;                 /* Number of columns in the declaration */
+  int bShadow;                 /* True if the %_schema shadow table exists */
+  sqlite3_int64 nScanRow;      /* Rows seen by the last full scan, or 0 */
   char cDelim;                 /* Character to use for delimiting columns */
-  int nCol;                    /* Number of columns in current row */
-  int maxCol;                  /* Size of aCols array */
-  char **aCols;                /* Array of parsed columns */
-  int *aEscapedQuotes;         /* Number of escaped quotes for each column in aCols */
+  int eIoPolicy;               /* IO_POLICY option, one of CSV_IO_* */
+  int eHugePages;              /* HUGE_PAGES option, one of CSV_HUGE_* */
+  int eOnError;                /* ON_ERROR option, one of CSV_ONERR_* */
+  CSVColType *aType;           /* Type of each column, or NULL if all text */
+  int eTimeUnit;               /* TIMESTAMP_UNIT option, one of CSV_UNIT_* */
+  char cDecimal;               /* DECIMAL_SEPARATOR option */
+  char cGroup;                 /* GROUP_SEPARATOR option, or 0 */
+  CSVNullSet nulls;            /* NULLS option */
+  int nErr;                    /* Number of records in aErr[] */
+  CSVError *aErr;              /* Malformed records by offset, or NULL */
+  sqlite3_int64 iErrGeneration; /* Generation of pFile aErr[] is about */
+  sqlite3_int64 iCheckpoint;   /* Offset after the last row scanned, or -1 */
+  sqlite3_int64 nScan;         /* Number of xFilter calls, for csv_stats() */
+  sqlite3_int64 nReadRow;      /* Number of rows read, for csv_stats() */
+  sqlite3_int64 nReadByte;     /* Number of bytes read, for csv_stats() */
+  sqlite3_int64 nCellConv;     /* Values converted by csvCell() */
+  sqlite3_int64 nCellHit;      /* Values it found already converted */
+  int nCursor;                 /* Number of open cursors */
+  int nBlock;                  /* Number of blocks in aBlock[] */
+  CSVBlock *aBlock;            /* Blocks of the index, or NULL if none */
+  sqlite3_int64 nIndexSize;    /* Identity of the file the index describes */
+  sqlite3_int64 iIndexMtime;
+  sqlite3_int64 iIndexChecksum;
+  sqlite3_int64 iIndexGeneration; /* Generation of pFile checked against it */
+  int bIndexValid;             /* True if the index describes the file */
+  int iRowBlock;               /* Block whose row offsets are in aRowOff[] */
+  sqlite3_int64 *aRowOff;      /* Offsets of the rows of block iRowBlock */
+  sqlite3_stmt *pZoneStmt;     /* SELECT from %_zone for a column */
+  sqlite3_int64 nStatRow;      /* Rows counted by the column statistics */
+  CSVColStat *aStat;           /* Statistics of each column, or NULL */
+  int iKeyCol;                 /* Column of the KEY option, or -1 */
+  sqlite3_uint64 *aKey;        /* Hash index of column iKeyCol, or NULL */
+  sqlite3_int64 nKeySlot;      /* Number of slots in aKey[], a power of 2 */
+  sqlite3_int64 nKeyEntry;     /* Number of rows in aKey[] */
+  sqlite3_int64 iKeyGeneration; /* Generation of pFile aKey[] was built from */
+  int eKeyMap;                 /* How aKey[] was allocated, one of CSV_MAP_* */
+  CSVCache keyCache;           /* Charge of aKey[] to the memory budget */
+  int nColIdx;                 /* Number of column indexes in aColIdx[] */
+  CSVColIdx *aColIdx;          /* Indexes of csv_create_index(), or NULL */
+  char *zJsonKey;              /* "name": of each column, for _json */
+  int *aJsonKey;               /* Offset of each in zJsonKey, and of its end */
+  CSVGlobal *pGlobal;          /* Module data shared by the connection */
+  CSV *pNext;                  /* Next table in pGlobal->pTables */
+#ifdef SQLITE_ENABLE_CSV_PROFILE
+  CSVProfile prof;             /* Timers and histograms of the scan loop */
+#endif
 };
 
 
 /* 
-** An CSV cursor object.
+** An CSV cursor object. Each cursor reads and parses the file on its own,
+** so several cursors can scan the same table at the same time (as in a
+** self-join).
 */
 struct CSVCursor {
   sqlite3_vtab_cursor base;    /* Must be first */
-  long csvpos;                 /* ftell position of current zRow */
+  CSVHandle *pHandle;          /* File handle, held while a scan is active */
+  char *aBuf;                  /* Read buffer of SQLITE_CSV_READ_BUFFER bytes */
+  char *aBufAlloc;             /* Allocation of aBuf, which is aligned */
+  sqlite3_int64 iBufOff;       /* File offset of aBuf[0] */
+  int nData;                   /* Number of valid bytes in aBuf */
+  int iPos;                    /* Read position in aBuf */
+  int nReadSize;               /* Bytes to read at a time, at most the above */
+  sqlite3_int64 iBufGeneration; /* Generation of the file in aBuf */
+  sqlite3_int64 csvpos;        /* File offset of current zRow */
+  int eof;                     /* True when at end of file */
+  int maxRow;                  /* Size of zRow buffer */
+  char *zRow;                  /* Buffer for current CSV row */
+  int bTooLong;                /* True if csv_readline() met too long a row */
+  int nCol;                    /* Number of columns in current row */
+  int idxNum;                  /* Plan of the current scan (CSV_PLAN_*) */
+  char *zPlan;                 /* Copy of idxStr, for csv_explain() */
+  sqlite3_int64 iLimit;        /* Rows left to return, or -1 if no limit */
+  sqlite3_int64 nSkipRow;      /* Rows left to skip for OFFSET */
+  sqlite3_int64 nFilter;       /* Number of xFilter calls */
+  sqlite3_int64 nRow;          /* Number of rows returned by all scans */
+  sqlite3_int64 nFilterRow;    /* Number of rows returned by this scan */
+  sqlite3_int64 nBlockSkip;    /* Number of blocks skipped by all scans */
+  int bFullScan;               /* True if the scan reads every row */
+  unsigned char *aMatch;       /* Blocks that may hold matching rows, or NULL */
+  int iBlock;                  /* Current block, when aMatch is not NULL */
+  int nBlockRow;               /* Rows left to read in block iBlock */
+  char *zKey;                  /* Key looked up by a CSV_PLAN_KEY scan */
+  int bKeyPin;                 /* True if the KEY hash index is pinned */
+  int nKey;                    /* Length of zKey in bytes */
+  sqlite3_uint64 iKeyHash;     /* Hash of zKey */
+  sqlite3_int64 iKeySlot;      /* Next slot of aKey[] to probe */
+  int bIndexScan;              /* True if the rows come from pIdxStmt */
+  sqlite3_stmt *pIdxStmt;      /* SELECT from %_colkey of a CSV_PLAN_INDEX scan */
+  int eIo;                     /* I/O policy of the current scan, CSV_IO_* */
+  int fdDirect;                /* Descriptor of CSV_IO_DIRECT reads */
+  sqlite3_int64 iDropOff;      /* Start of the pages not yet dropped */
+  CSVIoJob *aJob;              /* Ring of SQLITE_CSV_IO_DEPTH reads ahead */
+  char *aJobBuf;               /* SQLITE_CSV_IO_DEPTH pages for the reads */
+  int iPage;                   /* Next page of aJobBuf[] to use */
+  int nPage;                   /* Number of pages in use */
+  int iJob;                    /* First job in the ring */
+  int nJob;                    /* Number of jobs in the ring */
+  int bLookupEof;              /* True once all the lookups are issued */
+  sqlite3_int64 *aRowidOff;    /* Offsets of a rowid IN list, or NULL */
+  int nRowidOff;               /* Number of entries in aRowidOff[] */
+  int iRowidOff;               /* Next entry of aRowidOff[] to look up */
+  sqlite3_int64 iJobRead;      /* Offset of the last read issued, or -1 */
+  int nJobRead;                /* Size of the last read issued */
+  sqlite3_int64 iResume;       /* _resume_from of the current scan, or -1 */
+  int bBatch;                  /* True if rows are read by batches */
+  int nBatch;                  /* Number of rows in the batch */
+  int iBatch;                  /* Current row of the batch */
+  int nBatchStride;            /* Rows allocated per column of the batch */
+  int *aBatchOff;              /* Offset in zRow of each value, by column */
+  int *aBatchLen;              /* Length in bytes of each value, by column */
+  unsigned char *aBatchFlag;   /* CSV_CELL_* flags of each value, by column */
+  int *aBatchPos;              /* Offset in zRow of each row, and of the end */
+  sqlite3_int64 *aBatchRowOff; /* File offset of each row, and of the end */
+  const char *zBatchBad;       /* Why the last row of the batch is malformed */
+  sqlite3_uint64 iCellRow;     /* Incremented for each row, for aCell[] */
+  CSVCell *aCell;              /* Converted values, one per column */
+  char *zCellBuf;              /* Unescaped values of the current row */
+  int nCellBuf;                /* Size of zCellBuf */
+  int nCellUsed;               /* Bytes of zCellBuf in use */
+  sqlite3_uint64 iCellBufRow;  /* iCellRow zCellBuf is about */
+  char *zJson;                 /* Buffer of the _json value */
+  int nJson;                   /* Size of zJson */
 };
 
 
@@ -79,7 +830,7 @@ struct CSVCursor {
 static int csvNext( sqlite3_vtab_cursor* pVtabCursor );
 static int csvInit(
   sqlite3 *db,                        /* Database connection */
-  void *pAux,                         /* Unused */
+  void *pAux,                         /* Pointer to the CSVGlobal object */
   int argc, const char *const*argv,   /* Parameters to CREATE TABLE statement */
   sqlite3_vtab **ppVtab,              /* OUT: New virtual table */
   char **pzErr,                       /* OUT: Error message, if any */
@@ -87,475 +838,7258 @@ static int csvInit(
 );
 static void csvReference( CSV *pCSV );
 static int csvRelease( CSV *pCSV );
+static int csvOpenFile( CSV *pCSV, CSVCursor *pCsr, char **pzErr );
+static void csvIndexCheck( CSVCursor*, sqlite3_int64, sqlite3_int64 );
+static void csvIoStop( int nKeep );
+static CSV *csvFindTable( CSVGlobal*, const char*, char** );
+static int csvNullsOption( CSVNullSet*, const char*, char** );
 
 
-/* 
-** Abstract out file io routines for porting 
+/*
+** Error messages reported by xCreate/xConnect and when the file is opened.
 */
-static FILE *csv_open( CSV *pCSV ){
-  return fopen( pCSV->zFile, "rb" );
-}
-static void csv_close( CSV *pCSV ){
-  if( pCSV->f ) fclose( pCSV->f );
-}
-static int csv_seek( CSV *pCSV, long pos ){
-  return fseek( pCSV->f, pos, SEEK_SET );
-}
-static long csv_tell( CSV *pCSV ){
-  return ftell( pCSV->f );
-}
+static const char *const aErrMsg[] = {
+  0,                                                    /* 0 */
+  "No CSV file specified",                              /* 1 */
+  "Error opening CSV file: '%s'",                       /* 2 */
+  "No columns found",                                   /* 3 */
+  "No column name found",                               /* 4 */
+  "Out of memory",                                      /* 5 */
+  "CSV file '%s' has %d columns instead of %d",         /* 6 */
+  "Unknown CSV option: '%s'",                           /* 7 */
+  "No such KEY column: '%s'",                           /* 8 */
+  "Unknown IO_POLICY: '%s'",                            /* 9 */
+  "Unknown HUGE_PAGES: '%s'",                           /* 10 */
+  "Unknown ON_ERROR: '%s'",                             /* 11 */
+  "Malformed CSV record at offset %lld: %s",            /* 12 */
+  "Not the offset of a CSV record: '%s'",               /* 13 */
+  "No such CSV column: '%.*s'",                         /* 14 */
+  "Unknown CSV aggregate: '%.*s'",                      /* 15 */
+  "Too many CSV %s (the most is %d)",                   /* 16 */
+  "Bad %s option: '%s'",                                /* 17 */
+  "Unknown TIMESTAMP_UNIT: '%s'",                       /* 18 */
+};
 
 
+#ifdef SQLITE_ENABLE_CSV_PROFILE
 /*
-** This routine reads a line of text from FILE in, stores
-** the text in memory obtained from malloc() and returns a pointer
-** to the text.  NULL is returned at end of file, or if malloc()
-** fails.
-**
-** The interface is like "readline" but no command-line editing
-** is done.
-**
-** This code was modified from existing code in shell.c of the sqlite3 CLI.
+** Return the histogram bucket of value v, i.e. the number of significant
+** bits of v.
 */
-static char *csv_getline( CSV *pCSV ){
-  int n = 0;
-  int bEol = 0;
-  int bShrink = 0;
-  int bQuotedCol = 0;
-
-  /* allocate initial row buffer */
-  if( pCSV->maxRow < 1 ){
-    pCSV->zRow = sqlite3_malloc( 100 );
-    if( pCSV->zRow ){
-      pCSV->maxRow = 100;
-    }
-  }
-  if( !pCSV->zRow ) {
-      sqlite3_log(SQLITE_NOMEM, "Error while reading CSV line (1)");
-      return 0;
-  }
-
-  /* read until eol */
-  while( !bEol ){
-    /* grow row buffer as needed */
-    if( n+100>pCSV->maxRow ){
-      int newSize = pCSV->maxRow*2 + 100;
-      if( newSize>= sqlite3_limit(pCSV->db, SQLITE_LIMIT_LENGTH, -1) ){
-        sqlite3_log(SQLITE_ERROR, "CSV row is too long (> %d)", pCSV->maxRow);
-        return 0;
-      }
-      char *p = sqlite3_realloc(pCSV->zRow, newSize);
-      if( !p ) {
-        sqlite3_log(SQLITE_NOMEM, "Error while reading CSV line (2)");
-        return 0;
-      }
-      pCSV->maxRow = newSize;
-      pCSV->zRow = p;
-      bShrink = -1;
-    }
-    if( fgets(&pCSV->zRow[n], pCSV->maxRow-n, pCSV->f)==0 ){
-      if( n==0 ){
-        break;
-      }
-      pCSV->zRow[n] = '\0';
-      bEol = -1;
-      break;
-    }
-    /* look for line delimiter */
-    while( pCSV->zRow[n] ){
-      if( pCSV->zRow[n]=='\"' ){
-        if( bQuotedCol ) {
-          if( pCSV->zRow[n+1]=='\"' ) { /* escaped */
-            n++;
-          }else{
-            bQuotedCol = 0;
-          }
-        }else if( n==0 || pCSV->zRow[n-1]==pCSV->cDelim ){
-          bQuotedCol = 1;
-        }
-      }
-      n++;
-    }
-    /* uniform line ending */
-    if( (n>0) && ((pCSV->zRow[n-1]=='\n') || (pCSV->zRow[n-1]=='\r')) && !bQuotedCol ){
-      if( (n>1) && ((pCSV->zRow[n-1]=='\n') && (pCSV->zRow[n-2]=='\r')) ){
-        pCSV->zRow[n-2] = '\n';
-        pCSV->zRow[n-1] = '\0';
-        bEol = -1;
-      }else{
-        pCSV->zRow[n-1] = '\n';
-        pCSV->zRow[n] = '\0';
-        bEol = -1;
-      }
-    }
+static int csvProfileBucket( sqlite3_uint64 v ){
+  int i = 0;
+  while( v && i<63 ){
+    i++;
+    v >>= 1;
   }
-  if( bShrink ){ 
-    pCSV->zRow = sqlite3_realloc( pCSV->zRow, n+1 ); 
-    pCSV->maxRow = n+1;
-  }
-  return bEol ? pCSV->zRow : 0;
-}
-
-
-/* 
-** CSV virtual table module xCreate method.
-*/
-static int csvCreate(
-  sqlite3* db, 
-  void *pAux,
-  int argc, 
-  const char *const *argv,
-  sqlite3_vtab **ppVtab, 
-  char **pzErr 
-){
-  return csvInit( db, pAux, argc, argv, ppVtab, pzErr, 1 );
+  return i;
 }
 
-
-/* 
-** CSV virtual table module xConnect method.
+/*
+** Record a call to phase ePhase of the scan loop that took nTick ticks.
 */
-static int csvConnect(
-  sqlite3 *db,
-  void *pAux,
-  int argc, const char *const*argv,
-  sqlite3_vtab **ppVtab,
-  char **pzErr
-){
-  return csvInit(db, pAux, argc, argv, ppVtab, pzErr, 0);
+static void csvProfileAdd( CSVProfile *p, int ePhase, sqlite3_uint64 nTick ){
+  p->aCall[ePhase]++;
+  p->aTick[ePhase] += nTick;
+  if( nTick>p->aMax[ePhase] ) p->aMax[ePhase] = nTick;
 }
 
-
 /*
-** CSV virtual table module xBestIndex method.
+** Record a row of nByte bytes that took nTick ticks to read and tokenize.
 */
-static int csvBestIndex( sqlite3_vtab *pVtab, sqlite3_index_info* info )
-{
-  UNUSED_PARAMETER(pVtab);
-  UNUSED_PARAMETER(info);
-
-  /* TBD */
-
-  return SQLITE_OK;
+static void csvProfileRow( CSVProfile *p, sqlite3_uint64 nTick, sqlite3_uint64 nByte ){
+  p->aRowTick[csvProfileBucket(nTick)]++;
+  p->aRowLen[csvProfileBucket(nByte)]++;
 }
+#endif
 
 
 /* 
-** CSV virtual table module xDisconnect method.
+** Abstract out file io routines for porting 
 */
-static int csvDisconnect( sqlite3_vtab *pVtab ){
-  return csvRelease( (CSV *)pVtab );
+static int csv_open( const char *zPath ){
+  int flags = O_RDONLY;
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+  return open( zPath, flags );
 }
+static int csv_open_direct( const char *zPath ){
+#if defined(O_DIRECT)
+  int flags = O_RDONLY|O_DIRECT;
+# ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+# endif
+  return open( zPath, flags );
+#elif defined(F_NOCACHE)
+  int fd = csv_open( zPath );
+  if( fd>=0 ) fcntl( fd, F_NOCACHE, 1 );
+  return fd;
+#else
+  UNUSED_PARAMETER(zPath);
+  return -1;
+#endif
+}
+static void csv_advise( int fd, sqlite3_int64 iOff, sqlite3_int64 n, int bDrop ){
+#if defined(POSIX_FADV_SEQUENTIAL) && defined(POSIX_FADV_DONTNEED)
+  posix_fadvise( fd, (off_t)iOff, (off_t)n,
+                 bDrop ? POSIX_FADV_DONTNEED : POSIX_FADV_SEQUENTIAL );
+#else
+  UNUSED_PARAMETER(fd);
+  UNUSED_PARAMETER(iOff);
+  UNUSED_PARAMETER(n);
+  UNUSED_PARAMETER(bDrop);
+#endif
+}
+static void csv_close( int fd ){
+  if( fd>=0 ) close( fd );
+}
+static int csv_read( int fd, char *aBuf, int nBuf, sqlite3_int64 iOff ){
+  ssize_t n;
+  do{
+    n = pread( fd, aBuf, (size_t)nBuf, (off_t)iOff );
+  }while( n<0 && errno==EINTR );
+  return (int)n;
+}
+static size_t csv_map_size( sqlite3_int64 n ){
+  return (size_t)((n + CSV_HUGE_PAGE - 1) & ~(sqlite3_int64)(CSV_HUGE_PAGE-1));
+}
+static void *csv_map( sqlite3_int64 n, int eHuge, int *peMap ){
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+  size_t sz = csv_map_size( n );
+  size_t nHead;
+  char *p;
+  if( eHuge==CSV_HUGE_OFF || n<CSV_HUGE_PAGE ) return 0;
+# ifdef MAP_HUGETLB
+  if( eHuge==CSV_HUGE_TLB ){
+    p = mmap( 0, sz, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0 );
+    if( p!=MAP_FAILED ){
+      *peMap = CSV_MAP_HUGETLB;
+      return p;
+    }
+  }
+# endif
+  /* map one huge page more and trim, so that the mapping is aligned */
+  p = mmap( 0, sz+CSV_HUGE_PAGE, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+  if( p==MAP_FAILED ) return 0;
+  nHead = (CSV_HUGE_PAGE - (size_t)p%CSV_HUGE_PAGE) % CSV_HUGE_PAGE;
+  if( nHead ) munmap( p, nHead );
+  munmap( p+nHead+sz, CSV_HUGE_PAGE-nHead );
+  p += nHead;
+  madvise( p, sz, MADV_HUGEPAGE );
+  *peMap = CSV_MAP_THP;
+  return p;
+#else
+  UNUSED_PARAMETER(n);
+  UNUSED_PARAMETER(eHuge);
+  UNUSED_PARAMETER(peMap);
+  return 0;
+#endif
+}
+static void csv_unmap( void *p, sqlite3_int64 n ){
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+  munmap( p, csv_map_size( n ) );
+#else
+  UNUSED_PARAMETER(p);
+  UNUSED_PARAMETER(n);
+#endif
+}
+
+
+/*
+** Modification time of struct stat st, in nanoseconds where available.
+*/
+#if defined(__linux__)
+# define CSV_MTIME(st) \
+   ((sqlite3_int64)(st).st_mtim.tv_sec*1000000000 + (st).st_mtim.tv_nsec)
+#else
+# define CSV_MTIME(st) ((sqlite3_int64)(st).st_mtime)
+#endif
+
+
+/*
+** Unlink handle h from the list of idle handles of the pool.
+*/
+static void csvPoolUnlink( CSVHandle *h ){
+  if( h->pLruPrev ){
+    h->pLruPrev->pLruNext = h->pLruNext;
+  }else{
+    csvPool.pLruFirst = h->pLruNext;
+  }
+  if( h->pLruNext ){
+    h->pLruNext->pLruPrev = h->pLruPrev;
+  }else{
+    csvPool.pLruLast = h->pLruPrev;
+  }
+  h->pLruPrev = h->pLruNext = 0;
+  csvPool.nIdle--;
+}
+
+/*
+** Close handle h, which is not in the list of idle handles.
+*/
+static void csvPoolClose( CSVHandle *h ){
+  if( h->pFile ) h->pFile->pHandle = 0;
+  csv_close( h->fd );
+  csvPool.nOpen--;
+  sqlite3_free( h );
+}
+
+/*
+** Close the least recently used idle handles until there are no more
+** than csvPool.nMaxOpen of them. Handles in use are never closed.
+*/
+static void csvPoolEvict( void ){
+  while( csvPool.nIdle>csvPool.nMaxOpen && csvPool.pLruLast ){
+    CSVHandle *h = csvPool.pLruLast;
+    csvPoolUnlink( h );
+    csvPoolClose( h );
+    csvPool.nEvict++;
+  }
+}
+
+#ifdef CSV_HAVE_WATCH
+#define CSV_WATCH_FILE (IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_MOVE_SELF \
+                        |IN_DELETE_SELF)
+#define CSV_WATCH_DIR  (CSV_WATCH_FILE|IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE \
+                        |IN_DELETE|IN_ONLYDIR)
+
+/*
+** Remove watch wd, unless another file of the pool shares it: the watches
+** of a directory, or of a file with several paths, are only added once.
+*/
+static void csvWatchRemove( CSVFile *pExcept, int wd ){
+  CSVFile *p;
+  if( wd<0 || csvWatch.fd<0 ) return;
+  for(p=csvPool.pFiles; p; p=p->pNext){
+    if( p!=pExcept && (p->wdFile==wd || p->wdDir==wd) ) return;
+  }
+  inotify_rm_watch( csvWatch.fd, wd );
+}
+
+/*
+** Watch file p and its directory, before it is stat()ed. A change made
+** after this is reported by an event, one made before by the stat().
+*/
+static void csvWatchAdd( CSVFile *p ){
+  int wd;
+  if( p->wdDir<0 ){
+    const char *zBase = strrchr(p->zPath, '/');
+    char *zDir;
+    if( !zBase ){
+      zDir = sqlite3_mprintf(".");
+    }else{
+      zDir = sqlite3_mprintf("%.*s", zBase==p->zPath ? 1 : (int)(zBase-p->zPath),
+                             p->zPath);
+    }
+    if( zDir ) p->wdDir = inotify_add_watch( csvWatch.fd, zDir, CSV_WATCH_DIR );
+    sqlite3_free( zDir );
+  }
+  wd = inotify_add_watch( csvWatch.fd, p->zPath, CSV_WATCH_FILE );
+  if( wd!=p->wdFile ){
+    /* a new file at the same path */
+    csvWatchRemove( p, p->wdFile );
+    p->wdFile = wd;
+  }
+  p->bStale = 0;
+}
+
+/*
+** Read the pending events of the watcher and mark the files they are about
+** stale. Return the number of files that are to be read back.
+*/
+static int csvWatchDrain( void ){
+  union {
+    struct inotify_event e;
+    char a[4096];
+  } u;
+  int nPrewarm = 0;
+  ssize_t n;
+
+  while( (n = read( csvWatch.fd, u.a, sizeof(u.a) ))>0 ){
+    ssize_t i = 0;
+    while( i+(ssize_t)sizeof(struct inotify_event)<=n ){
+      const struct inotify_event *e = (const struct inotify_event *)&u.a[i];
+      CSVFile *p;
+      csvWatch.nEvent++;
+      for(p=csvPool.pFiles; p; p=p->pNext){
+        int bMatch = (e->mask & IN_Q_OVERFLOW)!=0;
+        if( e->wd==p->wdFile ){
+          bMatch = 1;
+          if( e->mask & IN_IGNORED ) p->wdFile = -1;
+        }
+        if( e->wd==p->wdDir ){
+          if( e->len==0 ){
+            /* the directory itself moved or went away */
+            bMatch = 1;
+            if( e->mask & IN_IGNORED ) p->wdDir = -1;
+          }else{
+            const char *zBase = strrchr(p->zPath, '/');
+            bMatch = strcmp(e->name, zBase ? &zBase[1] : p->zPath)==0;
+          }
+        }
+        if( bMatch ){
+          p->bStale = 1;
+          if( (e->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) && !p->bPrewarm ){
+            p->bPrewarm = 1;
+            nPrewarm++;
+          }
+        }
+      }
+      i += (ssize_t)sizeof(struct inotify_event) + e->len;
+    }
+  }
+  return nPrewarm;
+}
+
+/*
+** Read file zPath through, to have it in the page cache. This is done by
+** the watcher thread, without the mutex, and stops early if the watcher is
+** being stopped.
+*/
+static void csvWatchPrewarm( const char *zPath ){
+  int fd = csv_open( zPath );
+  char *aBuf = fd>=0 ? (char *)sqlite3_malloc( SQLITE_CSV_PREWARM_READ ) : 0;
+  sqlite3_int64 iOff = 0;
+  int bStop = 0;
+  int n;
+
+  while( aBuf && !bStop
+      && (n = csv_read( fd, aBuf, SQLITE_CSV_PREWARM_READ, iOff ))>0 ){
+    iOff += n;
+    pthread_mutex_lock( &csvPool.mutex );
+    csvWatch.nPrewarm += n;
+    bStop = csvWatch.bStop;
+    pthread_mutex_unlock( &csvPool.mutex );
+  }
+  sqlite3_free( aBuf );
+  csv_close( fd );
+}
+
+/*
+** The watcher thread: wait for events, or to be woken up through the pipe,
+** until csvWatchStop() is called.
+*/
+static void *csvWatchThread( void *pArg ){
+  UNUSED_PARAMETER(pArg);
+  pthread_mutex_lock( &csvPool.mutex );
+  while( !csvWatch.bStop ){
+    struct pollfd aPoll[2];
+    char aByte[64];
+    CSVFile *p;
+    aPoll[0].fd = csvWatch.fd;
+    aPoll[1].fd = csvWatch.aPipe[0];
+    aPoll[0].events = aPoll[1].events = POLLIN;
+    aPoll[0].revents = aPoll[1].revents = 0;
+    pthread_mutex_unlock( &csvPool.mutex );
+    poll( aPoll, 2, -1 );
+    while( read( aPoll[1].fd, aByte, sizeof(aByte) )>0 );
+    pthread_mutex_lock( &csvPool.mutex );
+    if( csvWatch.bStop ) break;
+    csvWatchDrain();
+    for(;;){
+      char *zPath;
+      for(p=csvPool.pFiles; p && !p->bPrewarm; p=p->pNext);
+      if( !p || csvWatch.bStop ) break;
+      p->bPrewarm = 0;
+      if( csvWatch.eMode<2 ) continue;
+      zPath = sqlite3_mprintf("%s", p->zPath);
+      pthread_mutex_unlock( &csvPool.mutex );
+      if( zPath ) csvWatchPrewarm( zPath );
+      sqlite3_free( zPath );
+      pthread_mutex_lock( &csvPool.mutex );
+    }
+  }
+  pthread_mutex_unlock( &csvPool.mutex );
+  return 0;
+}
+
+/*
+** Start the watcher, if it is wanted and not running. Called with the mutex
+** held. If it cannot be started, the setting is turned off.
+*/
+static void csvWatchStart( void ){
+  if( csvWatch.eMode==0 || csvWatch.fd>=0 || csvWatch.bStop ) return;
+  csvWatch.fd = inotify_init1( IN_NONBLOCK|IN_CLOEXEC );
+  if( csvWatch.fd>=0 && pipe2( csvWatch.aPipe, O_NONBLOCK|O_CLOEXEC )==0 ){
+    csvWatch.bThread = pthread_create( &csvWatch.thread, 0, csvWatchThread, 0 )==0;
+    if( csvWatch.bThread ) return;
+    csv_close( csvWatch.aPipe[0] );
+    csv_close( csvWatch.aPipe[1] );
+  }
+  csv_close( csvWatch.fd );
+  csvWatch.fd = csvWatch.aPipe[0] = csvWatch.aPipe[1] = -1;
+  csvWatch.eMode = 0;
+}
+
+/*
+** Wake the watcher thread up, to read back the files of csvWatchDrain().
+*/
+static void csvWatchWake( void ){
+  char c = 0;
+  if( write( csvWatch.aPipe[1], &c, 1 )<0 ){
+    /* the pipe is full: the thread has yet to wake up anyway */
+  }
+}
+#endif /* CSV_HAVE_WATCH */
+
+/*
+** Stop the watcher thread and wait for it to exit. Its watches are dropped
+** and the files of the pool are stat()ed again by their next scans.
+*/
+static void csvWatchStop( void ){
+#ifdef CSV_HAVE_WATCH
+  CSVFile *p;
+  pthread_mutex_lock( &csvPool.mutex );
+  if( csvWatch.fd<0 || csvWatch.bStop ){
+    pthread_mutex_unlock( &csvPool.mutex );
+    return;
+  }
+  csvWatch.bStop = 1;
+  csvWatchWake();
+  pthread_mutex_unlock( &csvPool.mutex );
+  pthread_join( csvWatch.thread, 0 );
+  pthread_mutex_lock( &csvPool.mutex );
+  csv_close( csvWatch.fd );
+  csv_close( csvWatch.aPipe[0] );
+  csv_close( csvWatch.aPipe[1] );
+  csvWatch.fd = csvWatch.aPipe[0] = csvWatch.aPipe[1] = -1;
+  csvWatch.bThread = 0;
+  for(p=csvPool.pFiles; p; p=p->pNext){
+    p->wdFile = p->wdDir = -1;
+    p->bPrewarm = 0;
+  }
+  csvWatch.bStop = 0;
+  pthread_mutex_unlock( &csvPool.mutex );
+#endif
+}
+
+/*
+** Return the pooled file for path zPath, the one of the same path or of
+** the same file, with its reference count incremented, or NULL if out of
+** memory.
+*/
+static CSVFile *csvFileRef( const char *zPath ){
+  struct stat st;
+  int bStat = stat( zPath, &st )==0;
+  CSVFile *p;
+  pthread_mutex_lock( &csvPool.mutex );
+  for(p=csvPool.pFiles; p; p=p->pNext){
+    if( strcmp(p->zPath, zPath)==0 ) break;
+  }
+  if( !p && bStat ){
+    /* another path to the same file */
+    for(p=csvPool.pFiles; p; p=p->pNext){
+      if( p->iDev==(sqlite3_int64)st.st_dev
+       && p->iIno==(sqlite3_int64)st.st_ino
+      ){
+        break;
+      }
+    }
+  }
+  if( !p ){
+    int nPath = (int)strlen(zPath);
+    p = (CSVFile *)sqlite3_malloc( (int)sizeof(CSVFile) + nPath + 1 );
+    if( p ){
+      memset(p, 0, sizeof(CSVFile));
+      p->wdFile = p->wdDir = -1;
+      if( bStat ){
+        p->iDev = (sqlite3_int64)st.st_dev;
+        p->iIno = (sqlite3_int64)st.st_ino;
+      }
+      p->zPath = (char *)&p[1];
+      memcpy(p->zPath, zPath, nPath+1);
+      p->pNext = csvPool.pFiles;
+      csvPool.pFiles = p;
+    }
+  }
+  if( p ) p->nRef++;
+  pthread_mutex_unlock( &csvPool.mutex );
+  return p;
+}
+
+/*
+** Release a reference to pooled file p. The last reference closes its
+** handle, unless a cursor still uses it. Once no file is left in use,
+** the worker threads of csvIoPool and the watcher are stopped.
+*/
+static void csvFileUnref( CSVFile *p ){
+  int bLast;
+  if( !p ) return;
+  pthread_mutex_lock( &csvPool.mutex );
+  if( --p->nRef<=0 ){
+    CSVFile **pp;
+    for(pp=&csvPool.pFiles; *pp!=p; pp=&(*pp)->pNext);
+    *pp = p->pNext;
+    if( p->pHandle ){
+      CSVHandle *h = p->pHandle;
+      h->pFile = 0;
+      if( h->nActive==0 ){
+        csvPoolUnlink( h );
+        csvPoolClose( h );
+      }
+    }
+#ifdef CSV_HAVE_WATCH
+    csvWatchRemove( p, p->wdFile );
+    csvWatchRemove( p, p->wdDir );
+#endif
+    sqlite3_free( p );
+  }
+  bLast = csvPool.pFiles==0;
+  pthread_mutex_unlock( &csvPool.mutex );
+  if( bLast ){
+    csvIoStop( 0 );
+    csvWatchStop();
+  }
+}
+
+/*
+** Acquire the handle of pooled file p for a scan, opening the file if
+** needed, and set *piGeneration and *pnSize to the generation and the
+** size of the file. Return SQLITE_OK, or SQLITE_ERROR if the file cannot
+** be opened. If the watcher runs and reported no change of the file since
+** it was last stat()ed, its open handle is reused without a stat().
+*/
+static int csvFileAcquire(
+  CSVFile *p,
+  CSVHandle **ph,
+  sqlite3_int64 *piGeneration,
+  sqlite3_int64 *pnSize
+){
+  struct stat st;
+  CSVHandle *h;
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock( &csvPool.mutex );
+  h = p->pHandle;
+#ifdef CSV_HAVE_WATCH
+  csvWatchStart();
+  if( csvWatch.fd>=0 ){
+    if( csvWatchDrain()>0 && csvWatch.eMode>1 ) csvWatchWake();
+    if( h && !p->bStale && p->wdFile>=0 && p->wdDir>=0 && p->iGeneration>0 ){
+      if( h->nActive==0 ) csvPoolUnlink( h );
+      h->nActive++;
+      csvPool.nReuse++;
+      csvWatch.nSkip++;
+      *piGeneration = p->iGeneration;
+      *pnSize = p->nSize;
+      *ph = h;
+      pthread_mutex_unlock( &csvPool.mutex );
+      return SQLITE_OK;
+    }
+    csvWatchAdd( p );
+  }
+#endif
+  if( stat( p->zPath, &st ) ){
+    rc = SQLITE_ERROR;
+  }else if( h && ((sqlite3_int64)st.st_dev!=h->iDev
+                  || (sqlite3_int64)st.st_ino!=h->iIno) ){
+    /* the file was replaced: let the scans in progress finish with the old
+    ** one, and open the new one */
+    csvPool.nReplace++;
+    p->pHandle = 0;
+    h->pFile = 0;
+    if( h->nActive==0 ){
+      csvPoolUnlink( h );
+      csvPoolClose( h );
+    }
+    h = 0;
+  }
+  if( rc==SQLITE_OK && h ){
+    if( h->nActive==0 ) csvPoolUnlink( h );
+    csvPool.nReuse++;
+  }else if( rc==SQLITE_OK ){
+    int fd = csv_open( p->zPath );
+    h = fd>=0 ? (CSVHandle *)sqlite3_malloc( sizeof(CSVHandle) ) : 0;
+    if( !h || fstat( fd, &st ) ){
+      csv_close( fd );
+      sqlite3_free( h );
+      h = 0;
+      rc = SQLITE_ERROR;
+    }else{
+      memset(h, 0, sizeof(CSVHandle));
+      h->fd = fd;
+      h->iDev = (sqlite3_int64)st.st_dev;
+      h->iIno = (sqlite3_int64)st.st_ino;
+      h->pFile = p;
+      p->pHandle = h;
+      csvPool.nOpen++;
+      csvPool.nOpenCall++;
+    }
+  }
+  if( rc==SQLITE_OK ){
+    if( p->iGeneration==0
+     || p->iDev!=(sqlite3_int64)st.st_dev || p->iIno!=(sqlite3_int64)st.st_ino
+     || p->nSize!=(sqlite3_int64)st.st_size
+     || p->iMtime!=CSV_MTIME(st)
+    ){
+      p->iGeneration = ++csvPool.iGeneration;
+      p->iDev = (sqlite3_int64)st.st_dev;
+      p->iIno = (sqlite3_int64)st.st_ino;
+      p->nSize = (sqlite3_int64)st.st_size;
+      p->iMtime = CSV_MTIME(st);
+    }
+    *piGeneration = p->iGeneration;
+    *pnSize = p->nSize;
+    h->nActive++;
+    csvPoolEvict();
+  }else{
+    p->bStale = 1;
+  }
+  *ph = h;
+  pthread_mutex_unlock( &csvPool.mutex );
+  return rc;
+}
+
+/*
+** Release handle h, acquired by csvFileAcquire(). A handle that is no
+** longer used becomes idle, or is closed if its file was replaced.
+*/
+static void csvHandleRelease( CSVHandle *h ){
+  if( !h ) return;
+  pthread_mutex_lock( &csvPool.mutex );
+  if( --h->nActive==0 ){
+    if( h->pFile ){
+      h->pLruNext = csvPool.pLruFirst;
+      if( h->pLruNext ){
+        h->pLruNext->pLruPrev = h;
+      }else{
+        csvPool.pLruLast = h;
+      }
+      csvPool.pLruFirst = h;
+      csvPool.nIdle++;
+      csvPoolEvict();
+    }else{
+      csvPoolClose( h );
+    }
+  }
+  pthread_mutex_unlock( &csvPool.mutex );
+}
+
+
+/*
+** Worker thread iThread of csvIoPool: do the reads of the queue until
+** csvIoStop() leaves fewer threads than that.
+*/
+static void *csvIoWorker( void *pArg ){
+  int iThread = (int)(size_t)pArg;
+  pthread_mutex_lock( &csvIoPool.mutex );
+  while( iThread<csvIoPool.nThread ){
+    CSVIoJob *p = csvIoPool.pFirst;
+    int n;
+    if( !p ){
+      pthread_cond_wait( &csvIoPool.work, &csvIoPool.mutex );
+      continue;
+    }
+    csvIoPool.pFirst = p->pNext;
+    if( !csvIoPool.pFirst ) csvIoPool.pLast = 0;
+    p->eState = CSV_JOB_RUNNING;
+    pthread_mutex_unlock( &csvIoPool.mutex );
+    n = csv_read( p->fd, p->aBuf, p->nRead, p->iRead );
+    pthread_mutex_lock( &csvIoPool.mutex );
+    p->n = n;
+    p->eState = CSV_JOB_DONE;
+    csvIoPool.nRead++;
+    pthread_cond_broadcast( &csvIoPool.done );
+  }
+  pthread_mutex_unlock( &csvIoPool.mutex );
+  return 0;
+}
+
+/*
+** Stop the worker threads of csvIoPool beyond the first nKeep, and wait
+** for them to exit. The threads must all be gone before the library can
+** be unloaded, so this is done once the last CSV table is disconnected.
+*/
+static void csvIoStop( int nKeep ){
+  pthread_mutex_lock( &csvIoPool.mutex );
+  csvIoPool.nStop++;
+  pthread_cond_broadcast( &csvIoPool.work );
+  while( csvIoPool.nThread>nKeep ){
+    pthread_t t = csvIoPool.aThread[--csvIoPool.nThread];
+    pthread_cond_broadcast( &csvIoPool.work );
+    pthread_mutex_unlock( &csvIoPool.mutex );
+    pthread_join( t, 0 );
+    pthread_mutex_lock( &csvIoPool.mutex );
+  }
+  csvIoPool.nStop--;
+  pthread_mutex_unlock( &csvIoPool.mutex );
+}
+
+/*
+** Queue job p for a worker thread, starting the threads wanted if they
+** are not running yet. Without threads, do the read now.
+*/
+static void csvIoSubmit( CSVIoJob *p ){
+  pthread_mutex_lock( &csvIoPool.mutex );
+  while( csvIoPool.nStop==0 && csvIoPool.nThread<csvIoPool.nMaxThread ){
+    int i = csvIoPool.nThread;
+    if( pthread_create( &csvIoPool.aThread[i], 0, csvIoWorker,
+                        (void *)(size_t)i ) ){
+      break;
+    }
+    csvIoPool.nThread++;
+  }
+  if( csvIoPool.nThread==0 ){
+    pthread_mutex_unlock( &csvIoPool.mutex );
+    p->n = csv_read( p->fd, p->aBuf, p->nRead, p->iRead );
+    p->eState = CSV_JOB_DONE;
+    return;
+  }
+  p->pNext = 0;
+  p->eState = CSV_JOB_QUEUED;
+  if( csvIoPool.pLast ){
+    csvIoPool.pLast->pNext = p;
+  }else{
+    csvIoPool.pFirst = p;
+  }
+  csvIoPool.pLast = p;
+  pthread_cond_signal( &csvIoPool.work );
+  pthread_mutex_unlock( &csvIoPool.mutex );
+}
+
+/*
+** Wait for job p to be done. If bCancel is true and it is still queued,
+** remove it from the queue instead.
+*/
+static void csvIoWait( CSVIoJob *p, int bCancel ){
+  pthread_mutex_lock( &csvIoPool.mutex );
+  if( bCancel && p->eState==CSV_JOB_QUEUED ){
+    CSVIoJob **pp;
+    CSVIoJob *pPrev = 0;
+    for(pp=&csvIoPool.pFirst; *pp!=p; pp=&(*pp)->pNext) pPrev = *pp;
+    *pp = p->pNext;
+    if( csvIoPool.pLast==p ) csvIoPool.pLast = pPrev;
+    p->n = -1;
+    p->eState = CSV_JOB_DONE;
+  }
+  while( p->eState==CSV_JOB_QUEUED || p->eState==CSV_JOB_RUNNING ){
+    pthread_cond_wait( &csvIoPool.done, &csvIoPool.mutex );
+  }
+  pthread_mutex_unlock( &csvIoPool.mutex );
+}
+
+/*
+** Cancel the reads issued ahead by cursor pCsr, which must be done before
+** its file handle is released or its buffers freed.
+*/
+static void csvLookupReset( CSVCursor *pCsr ){
+  while( pCsr->nJob>0 ){
+    csvIoWait( &pCsr->aJob[pCsr->iJob], 1 );
+    pCsr->iJob = (pCsr->iJob+1) % SQLITE_CSV_IO_DEPTH;
+    pCsr->nJob--;
+  }
+  pCsr->iJob = 0;
+  pCsr->iPage = pCsr->nPage = 0;
+  pCsr->iJobRead = -1;
+  pCsr->bLookupEof = 0;
+}
+
+
+/*
+** Drop from the page cache the pages read by the CSV_IO_SEQUENTIAL scan of
+** cursor pCsr, except those of its buffer unless bAll is true. Pages are
+** dropped SQLITE_CSV_DROP_BEHIND bytes at a time, and at the end.
+*/
+static void csvIoDrop( CSVCursor *pCsr, int bAll ){
+  sqlite3_int64 iEnd = pCsr->iBufOff + (bAll ? pCsr->nData : 0);
+  if( pCsr->eIo==CSV_IO_SEQUENTIAL && pCsr->pHandle
+   && iEnd-pCsr->iDropOff>=(bAll ? 1 : SQLITE_CSV_DROP_BEHIND)
+  ){
+    csv_advise( pCsr->pHandle->fd, pCsr->iDropOff, iEnd-pCsr->iDropOff, 1 );
+    pCsr->iDropOff = iEnd;
+  }
+}
+
+/*
+** Apply the IO_POLICY of its table to the full scan that cursor pCsr is
+** about to start from its current position. A policy that cannot be
+** applied falls back to the next weaker one.
+*/
+static void csvIoBegin( CSVCursor *pCsr ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+
+  pCsr->eIo = pCSV->eIoPolicy;
+  pCsr->iDropOff = pCsr->iBufOff + pCsr->iPos;
+  if( pCsr->eIo==CSV_IO_DIRECT ){
+    /* the private descriptor must be on the file of the handle */
+    struct stat st;
+    int fd = csv_open_direct( pCSV->zFile );
+    if( fd<0 || fstat( fd, &st )
+     || (sqlite3_int64)st.st_dev!=pCsr->pHandle->iDev
+     || (sqlite3_int64)st.st_ino!=pCsr->pHandle->iIno
+    ){
+      csv_close( fd );
+      pCsr->eIo = CSV_IO_SEQUENTIAL;
+    }else{
+      pCsr->fdDirect = fd;
+    }
+  }
+  if( pCsr->eIo==CSV_IO_SEQUENTIAL ){
+    csv_advise( pCsr->pHandle->fd, pCsr->iDropOff, 0, 0 );
+  }
+}
+
+/*
+** End the scan of cursor pCsr: release its file handle, after the pages
+** read are dropped and the O_DIRECT descriptor closed, as its I/O policy
+** requires.
+*/
+static void csvCursorRelease( CSVCursor *pCsr ){
+  csvLookupReset( pCsr );
+  csvIoDrop( pCsr, 1 );
+  if( pCsr->eIo==CSV_IO_DIRECT ){
+    csv_close( pCsr->fdDirect );
+  }
+  pCsr->eIo = CSV_IO_DEFAULT;
+  csvHandleRelease( pCsr->pHandle );
+  pCsr->pHandle = 0;
+}
+
+/*
+** Start a scan with cursor pCsr: acquire the handle of the file of its
+** table. If the file changed since the table last checked it (or was
+** never checked), read its first row again with csvOpenFile(). On error,
+** leave a message in *pzErr.
+*/
+static int csvCursorAcquire( CSVCursor *pCsr, char **pzErr ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_int64 iGeneration = 0;
+  sqlite3_int64 nSize = 0;
+  int rc;
+
+  csvCursorRelease( pCsr );
+  rc = csvFileAcquire( pCSV->pFile, &pCsr->pHandle, &iGeneration, &nSize );
+  if( rc==SQLITE_OK && strcmp(pCSV->zFile, pCSV->pFile->zPath)!=0 ){
+    /* the file was found through another path: check that the path of
+    ** the table still names it */
+    struct stat st;
+    int bSame;
+    pthread_mutex_lock( &csvPool.mutex );
+    bSame = stat( pCSV->zFile, &st )==0
+         && pCSV->pFile->iDev==(sqlite3_int64)st.st_dev
+         && pCSV->pFile->iIno==(sqlite3_int64)st.st_ino;
+    pthread_mutex_unlock( &csvPool.mutex );
+    if( !bSame ){
+      CSVFile *pFile = csvFileRef( pCSV->zFile );
+      csvCursorRelease( pCsr );
+      if( !pFile ){
+        *pzErr = sqlite3_mprintf("%s", aErrMsg[5]);
+        return SQLITE_NOMEM;
+      }
+      csvFileUnref( pCSV->pFile );
+      pCSV->pFile = pFile;
+      rc = csvFileAcquire( pFile, &pCsr->pHandle, &iGeneration, &nSize );
+    }
+  }
+  if( iGeneration!=pCsr->iBufGeneration ){
+    /* the buffered data is only valid for an unchanged file */
+    pCsr->nData = pCsr->iPos = 0;
+    pCsr->iBufOff = 0;
+    pCsr->iBufGeneration = iGeneration;
+  }
+  if( rc!=SQLITE_OK ){
+    *pzErr = sqlite3_mprintf(aErrMsg[2], pCSV->zFile);
+    return rc;
+  }
+  if( iGeneration!=pCSV->iGeneration ){
+    pCSV->nFileSize = nSize;
+    rc = csvOpenFile( pCSV, pCsr, pzErr );
+    if( rc!=SQLITE_OK ){
+      csvCursorRelease( pCsr );
+      return rc;
+    }
+    pCSV->iGeneration = iGeneration;
+    pCSV->nScanRow = 0;
+  }
+  if( (pCSV->nBlock>0 || pCSV->nColIdx>0)
+   && pCSV->iIndexGeneration!=iGeneration
+  ){
+    /* check the indexes of csv_refresh() and csv_create_index() against
+    ** the file */
+    sqlite3_int64 iMtime;
+    pthread_mutex_lock( &csvPool.mutex );
+    iMtime = pCSV->pFile->iMtime;
+    pthread_mutex_unlock( &csvPool.mutex );
+    csvIndexCheck( pCsr, nSize, iMtime );
+    pCSV->iIndexGeneration = iGeneration;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Free the buffers of cursor pCsr and release its file handle.
+*/
+static void csvCursorFree( CSVCursor *pCsr ){
+  csvCursorRelease( pCsr );
+  sqlite3_free( pCsr->aJob );
+  sqlite3_free( pCsr->aJobBuf );
+  sqlite3_free( pCsr->aRowidOff );
+  sqlite3_free( pCsr->aBufAlloc );
+  sqlite3_free( pCsr->zRow );
+  sqlite3_free( pCsr->aBatchOff );
+  sqlite3_free( pCsr->aBatchLen );
+  sqlite3_free( pCsr->aBatchFlag );
+  sqlite3_free( pCsr->aBatchPos );
+  sqlite3_free( pCsr->aBatchRowOff );
+  sqlite3_free( pCsr->aCell );
+  sqlite3_free( pCsr->zCellBuf );
+  sqlite3_free( pCsr->zJson );
+}
+
+/*
+** Position cursor pCsr at offset iOff of the file. Nothing is read until
+** the next call to csv_readline(), and nothing at all if iOff is within the
+** data already buffered.
+*/
+static void csv_seek( CSVCursor *pCsr, sqlite3_int64 iOff ){
+  if( iOff>=pCsr->iBufOff && iOff<pCsr->iBufOff+pCsr->nData ){
+    pCsr->iPos = (int)(iOff - pCsr->iBufOff);
+  }else{
+    pCsr->iBufOff = iOff;
+    pCsr->nData = pCsr->iPos = 0;
+  }
+}
+static sqlite3_int64 csv_tell( CSVCursor *pCsr ){
+  return pCsr->iBufOff + pCsr->iPos;
+}
+
+/*
+** Allocate the read buffer of cursor pCsr, aligned on CSV_IO_ALIGN bytes,
+** if it does not have one yet. Return zero if malloc() fails.
+*/
+static int csvCursorBuffer( CSVCursor *pCsr ){
+  if( !pCsr->aBuf ){
+    pCsr->aBufAlloc = sqlite3_malloc( SQLITE_CSV_READ_BUFFER + CSV_IO_ALIGN );
+    if( !pCsr->aBufAlloc ) return 0;
+    pCsr->aBuf = pCsr->aBufAlloc + CSV_IO_ALIGN
+               - (int)((size_t)pCsr->aBufAlloc % CSV_IO_ALIGN);
+  }
+  return 1;
+}
+
+/*
+** Read the data following the buffer of cursor pCsr into the buffer.
+** Return the number of bytes read, 0 at end of file or -1 on error.
+**
+** CSV_IO_DIRECT reads start at the aligned offset before the data, so the
+** read position is then past the start of the buffer. If the file system
+** rejects them, the scan goes on with CSV_IO_SEQUENTIAL.
+*/
+static int csvCursorFill( CSVCursor *pCsr ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_int64 iOff = pCsr->iBufOff + pCsr->nData;
+  int nSkip = 0;
+  int n = -1;
+  CSV_PROFILE_START(t0);
+
+  if( !csvCursorBuffer( pCsr ) ) return -1;
+  if( pCsr->eIo==CSV_IO_DIRECT ){
+    sqlite3_int64 iAligned = iOff - iOff%CSV_IO_ALIGN;
+    n = csv_read( pCsr->fdDirect, pCsr->aBuf, SQLITE_CSV_READ_BUFFER, iAligned );
+    if( n<0 ){
+      csv_close( pCsr->fdDirect );
+      pCsr->eIo = CSV_IO_SEQUENTIAL;
+      pCsr->iDropOff = iOff;
+    }else{
+      nSkip = (int)(iOff - iAligned);
+      iOff = iAligned;
+    }
+  }
+  if( pCsr->eIo!=CSV_IO_DIRECT ){
+    n = csv_read( pCsr->pHandle->fd, pCsr->aBuf,
+                  pCsr->nReadSize>0 ? pCsr->nReadSize : SQLITE_CSV_READ_BUFFER,
+                  iOff );
+  }
+  pCsr->iBufOff = iOff;
+  pCsr->nData = 0;
+  pCsr->iPos = nSkip;
+  if( n>nSkip ){
+    pCsr->nData = n;
+    pCSV->nReadByte += n - nSkip;
+    csvIoDrop( pCsr, 0 );
+  }else{
+    /* nothing read: stay at the same offset for the next attempt */
+    pCsr->iBufOff += nSkip;
+    pCsr->iPos = 0;
+  }
+  CSV_PROFILE_END(pCSV, CSV_PHASE_READ, t0);
+  return n<0 ? n : (n>nSkip ? n-nSkip : 0);
+}
+
+
+/*
+** Append string z to pStr as a JSON string literal.
+*/
+static void csvJsonString( sqlite3_str *pStr, const char *z ){
+  sqlite3_str_appendchar(pStr, 1, '"');
+  for(; z && *z; z++){
+    if( *z=='"' || *z=='\\' ){
+      sqlite3_str_appendf(pStr, "\\%c", *z);
+    }else if( (unsigned char)*z<0x20 ){
+      sqlite3_str_appendf(pStr, "\\u%04x", *z);
+    }else{
+      sqlite3_str_appendchar(pStr, 1, *z);
+    }
+  }
+  sqlite3_str_appendchar(pStr, 1, '"');
+}
+
+
+/*
+** Append a JSON description of the scans done by cursor pCsr to the
+** records collected by csv_explain(). The plan is decoded from the idxStr
+** built by csvBestIndex(); lists become JSON arrays. Each key of azKey[]
+** is followed by its JSON name and type: string, number or list.
+*/
+static void csvExplainCursor( CSVGlobal *pGlobal, CSVCursor *pCsr ){
+  static const char *azKey[] = {
+    "plan", "plan", "s",   "idx", "index_column", "n",
+    "cons", "constraints", "l",   "order", "order", "s",
+    "cols", "columns", "l",   "est", "estimated_rows", "n"
+  };
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_str *pStr = pGlobal->pExplain;
+  const char *z = pCsr->zPlan;
+
+  sqlite3_str_appendall(pStr, pGlobal->nExplain++ ? ",{\"table\":" : "{\"table\":");
+  csvJsonString(pStr, pCSV->zName);
+  while( z && *z ){
+    int nKey = (int)strcspn(z, "=;");
+    int nVal = 0;
+    int i;
+    if( z[nKey]=='=' ) nVal = (int)strcspn(&z[nKey+1], ";");
+    for(i=0; i<(int)(sizeof(azKey)/sizeof(azKey[0])); i+=3){
+      if( (int)strlen(azKey[i])==nKey && memcmp(azKey[i], z, nKey)==0 ) break;
+    }
+    if( i<(int)(sizeof(azKey)/sizeof(azKey[0])) ){
+      char *zVal = sqlite3_mprintf("%.*s", nVal, &z[nKey+1]);
+      sqlite3_str_appendf(pStr, ",\"%s\":", azKey[i+1]);
+      if( zVal && azKey[i+2][0]=='s' ){
+        csvJsonString(pStr, zVal);
+      }else if( zVal && azKey[i+2][0]=='n' ){
+        sqlite3_str_appendall(pStr, zVal);
+      }else if( zVal ){
+        /* comma-separated list: numbers stay numbers */
+        char *zItem = zVal;
+        sqlite3_str_appendchar(pStr, 1, '[');
+        while( *zItem ){
+          int n = (int)strcspn(zItem, ",");
+          char c = zItem[n];
+          zItem[n] = '\0';
+          if( zItem!=zVal ) sqlite3_str_appendchar(pStr, 1, ',');
+          if( strspn(zItem, "0123456789")==(size_t)n ){
+            sqlite3_str_appendall(pStr, zItem);
+          }else{
+            csvJsonString(pStr, zItem);
+          }
+          zItem += n + (c ? 1 : 0);
+        }
+        sqlite3_str_appendchar(pStr, 1, ']');
+      }
+      sqlite3_free(zVal);
+    }
+    z += nKey + (z[nKey]=='=' ? nVal+1 : 0);
+    if( *z==';' ) z++;
+  }
+  sqlite3_str_appendf(pStr,
+      ",\"filters\":%lld,\"actual_rows\":%lld,\"blocks_skipped\":%lld}",
+      pCsr->nFilter, pCsr->nRow, pCsr->nBlockSkip);
+}
+
+
+/*
+** This routine reads the next row of cursor pCsr into pCsr->zRow, from
+** offset n on, with its line ending replaced by a single '\n' followed by
+** a '\0', and returns the offset just after the '\n'. A row ends with the
+** first newline that is not inside a quoted value. A last row with no
+** newline is terminated as if it had one. n is returned at end of file,
+** and -1 if malloc() fails or if the row is longer than
+** SQLITE_LIMIT_LENGTH, in which case pCsr->bTooLong is set.
+**
+** This code was modified from existing code in shell.c of the sqlite3 CLI.
+*/
+static int csv_readline( CSVCursor *pCsr, int n ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  const int n0 = n;
+  int bEol = 0;
+  int bQuotedCol = 0;      /* True inside a quoted value */
+  int bClosed = 0;         /* True just after the end of a quoted value */
+  char cPrev = pCSV->cDelim;
+
+  /* read until eol */
+  while( !bEol ){
+    const char *a;
+    int i, j;
+
+    if( pCsr->iPos>=pCsr->nData && csvCursorFill( pCsr )<=0 ){
+      if( n==n0 ) return n0;
+      /* unterminated last row */
+      if( pCsr->zRow[n-1]!='\n' ) pCsr->zRow[n++] = '\n';
+      break;
+    }
+
+    /* look for line delimiter */
+    a = pCsr->aBuf;
+    i = pCsr->iPos;
+    for(j=i; j<pCsr->nData; j++){
+      char c;
+      if( bQuotedCol ){
+        /* fast path: skip to the next quote */
+        const char *pQuote = memchr(&a[j], '\"', pCsr->nData-j);
+        if( !pQuote ){
+          j = pCsr->nData;
+          break;
+        }
+        j = (int)(pQuote-a);
+      }else if( !bClosed ){
+        /* fast path: skip to the next newline, unless there is a quote
+        ** before it */
+        const char *pEol = memchr(&a[j], '\n', pCsr->nData-j);
+        int iEnd = pEol ? (int)(pEol-a) : pCsr->nData;
+        const char *pQuote = memchr(&a[j], '\"', iEnd-j);
+        if( !pQuote ){
+          if( iEnd>j ) cPrev = a[iEnd-1];
+          j = iEnd;
+          if( pEol ){
+            j++;
+            bEol = 1;
+          }
+          break;
+        }
+        if( pQuote>&a[j] ) cPrev = pQuote[-1];
+        j = (int)(pQuote-a);
+      }
+      c = a[j];
+      if( c=='\"' ){
+        if( bQuotedCol ){
+          bQuotedCol = 0;
+          bClosed = 1;
+        }else if( bClosed ){ /* escaped */
+          bQuotedCol = 1;
+          bClosed = 0;
+        }else if( cPrev==pCSV->cDelim ){
+          bQuotedCol = 1;
+        }
+      }else{
+        bClosed = 0;
+        if( c=='\n' && !bQuotedCol ){
+          j++;
+          bEol = 1;
+          break;
+        }
+      }
+      cPrev = c;
+    }
+
+    /* grow row buffer as needed */
+    if( n+(j-i)+2>pCsr->maxRow ){
+      int mxLen = sqlite3_limit(pCSV->db, SQLITE_LIMIT_LENGTH, -1);
+      int newSize = pCsr->maxRow*2 + (j-i) + 100;
+      char *p;
+      if( (n-n0)+(j-i)+100>=mxLen ){
+        sqlite3_log(SQLITE_ERROR, "CSV row is too long (> %d)", n-n0);
+        pCsr->bTooLong = 1;
+        return -1;
+      }
+      if( newSize-n0>=mxLen ) newSize = n + (j-i) + 100;
+      p = sqlite3_realloc(pCsr->zRow, newSize);
+      if( !p ) {
+        sqlite3_log(SQLITE_NOMEM, "Error while reading CSV line");
+        return -1;
+      }
+      pCsr->maxRow = newSize;
+      pCsr->zRow = p;
+    }
+    memcpy(&pCsr->zRow[n], &a[i], j-i);
+    n += j-i;
+    pCsr->iPos = j;
+  }
+
+  /* uniform line ending */
+  if( n-n0>1 && pCsr->zRow[n-2]=='\r' ){
+    pCsr->zRow[n-2] = '\n';
+    n--;
+  }
+  pCsr->zRow[n] = '\0';
+  return n;
+}
+
+
+/*
+** Allocate the vectors of the batch of pCsr, if not already done. They
+** hold the offset, length and flags of nBatchStride rows per column.
+*/
+static int csvBatchAlloc( CSVCursor *pCsr ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  int nCell;
+
+  if( pCsr->nBatchStride==0 ){
+    pCsr->nBatchStride = SQLITE_CSV_BATCH_ROWS;
+    if( pCsr->nBatchStride*pCSV->nColumn>CSV_BATCH_CELLS ){
+      pCsr->nBatchStride = CSV_BATCH_CELLS/pCSV->nColumn;
+      if( pCsr->nBatchStride<1 ) pCsr->nBatchStride = 1;
+    }
+  }
+  nCell = pCsr->nBatchStride*pCSV->nColumn;
+  if( !pCsr->aBatchOff ){
+    pCsr->aBatchOff = (int *)sqlite3_malloc64( sizeof(int)*nCell );
+  }
+  if( !pCsr->aBatchLen ){
+    pCsr->aBatchLen = (int *)sqlite3_malloc64( sizeof(int)*nCell );
+  }
+  if( !pCsr->aBatchFlag ){
+    pCsr->aBatchFlag = (unsigned char *)sqlite3_malloc64( nCell );
+  }
+  if( !pCsr->aBatchPos ){
+    pCsr->aBatchPos = (int *)sqlite3_malloc64(
+        sizeof(int)*(pCsr->nBatchStride+1) );
+  }
+  if( !pCsr->aBatchRowOff ){
+    pCsr->aBatchRowOff = (sqlite3_int64 *)sqlite3_malloc64(
+        sizeof(sqlite3_int64)*(pCsr->nBatchStride+1) );
+  }
+  if( !pCsr->aBatchOff || !pCsr->aBatchLen || !pCsr->aBatchFlag
+   || !pCsr->aBatchPos || !pCsr->aBatchRowOff
+  ){
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Make all the values of row r of the batch NULL, as for a malformed row.
+** Other rows always have a first value.
+*/
+static void csvBatchNull( CSVCursor *pCsr, int r ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  int iCol;
+  for(iCol=0; iCol<pCSV->nColumn; iCol++){
+    pCsr->aBatchFlag[iCol*pCsr->nBatchStride + r] = CSV_CELL_NULL;
+  }
+}
+
+/*
+** Return true if the n bytes at z are one of the NULLS sentinels of pSet.
+** Most values are told apart by their length alone, with the bits of
+** pSet->mNullLen, and the others by their first byte.
+*/
+static int csvIsNull( const CSVNullSet *pSet, const char *z, int n ){
+  int i;
+  if( n>=CSV_NULL_MAXLEN || !(pSet->mNullLen & ((sqlite3_uint64)1<<n)) ){
+    return 0;
+  }
+  for(i=0; i<pSet->nNull; i++){
+    const CSVNull *p = &pSet->aNull[i];
+    if( p->n==n && (n==0 || (p->z[0]==z[0] && memcmp(p->z, z, n)==0)) ){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Split the row of pCsr->zRow from iStart to iEnd, as read by
+** csv_readline(), into row r of the batch: the offsets, lengths and flags
+** of its values are stored column by column. The row is left as it was
+** read, for the _raw column; quoted values are unescaped elsewhere when
+** they are used (see csvCursorText()). Columns past the end of the row
+** and NULLS sentinels are NULL, and columns past the declared ones are
+** parsed but dropped: pCsr->nCol is set to the number of values of the
+** row. If the row is malformed, all its values are NULL and *pzBad says
+** why.
+*/
+static int csvBatchRow(
+  CSVCursor *pCsr,
+  int r, int iStart, int iEnd,
+  const char **pzBad
+){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  const char *z = pCsr->zRow;
+  const char cDelim = pCSV->cDelim;
+  const int nCol = pCSV->nColumn;
+  const int nStride = pCsr->nBatchStride;
+  int i = iStart;
+  int iCol = 0;
+
+  pCsr->aBatchPos[r] = iStart;
+  pCsr->aBatchPos[r+1] = iEnd;
+  while( 1 ){
+    int iOff;
+    unsigned char f = 0;
+    if( z[i]=='\"' ){
+      /* quoted value, which may hold delimiters, newlines and "" */
+      iOff = ++i;
+      while( 1 ){
+        const char *pQuote = memchr(&z[i], '\"', iEnd-i);
+        if( !pQuote ){
+          *pzBad = "unclosed quote";
+          csvBatchNull( pCsr, r );
+          return SQLITE_OK;
+        }
+        i = (int)(pQuote-z);
+        if( z[i+1]!='\"' ) break;
+        f = CSV_CELL_ESCAPED;
+        i += 2;
+      }
+      if( iCol<nCol ){
+        pCsr->aBatchLen[iCol*nStride + r] = i-iOff;
+      }
+      i++;
+      if( z[i]!=cDelim && z[i]!='\n' ){
+        *pzBad = "missing delimiter";
+        csvBatchNull( pCsr, r );
+        return SQLITE_OK;
+      }
+    }else{
+      /* the row ends with a newline, which stops the loop */
+      iOff = i;
+      while( z[i]!=cDelim && z[i]!='\n' ) i++;
+      if( iCol<nCol ){
+        pCsr->aBatchLen[iCol*nStride + r] = i-iOff;
+        if( pCSV->nulls.mNullLen
+         && csvIsNull( &pCSV->nulls, &z[iOff], i-iOff )
+        ){
+          f = CSV_CELL_NULL;
+        }
+      }
+    }
+    if( iCol<nCol ){
+      pCsr->aBatchOff[iCol*nStride + r] = iOff;
+      pCsr->aBatchFlag[iCol*nStride + r] = f;
+    }else if( iCol+1>=sqlite3_limit(pCSV->db, SQLITE_LIMIT_COLUMN, -1) ){
+      return SQLITE_ERROR;
+    }
+    iCol++;
+    if( z[i++]=='\n' ) break;
+  }
+  pCsr->nCol = iCol;
+  for(; iCol<nCol; iCol++){
+    pCsr->aBatchFlag[iCol*nStride + r] = CSV_CELL_NULL;
+  }
+  return SQLITE_OK;
+}
+
+
+/*
+** Read and split the next batch of rows of pCsr, from its current position
+** in the file, into pCsr->zRow and the column vectors of the batch. There
+** are no more rows than the OFFSET and LIMIT of the scan still call for.
+** A malformed row ends the batch, with pCsr->zBatchBad set; csvNext() then
+** deals with it as with any other. pCsr->nBatch is zero at end of file.
+*/
+static int csvBatchFill( CSVCursor *pCsr ){
+  int nMax;
+  int n = 0;
+  int r;
+  int rc;
+
+  rc = csvBatchAlloc( pCsr );
+  if( rc!=SQLITE_OK ) return rc;
+  nMax = pCsr->nBatchStride;
+  if( pCsr->iLimit>0 && pCsr->iLimit+pCsr->nSkipRow<nMax ){
+    nMax = (int)(pCsr->iLimit+pCsr->nSkipRow);
+  }
+
+  pCsr->nBatch = 0;
+  pCsr->iBatch = 0;
+  pCsr->zBatchBad = 0;
+  for(r=0; r<nMax && n<SQLITE_CSV_BATCH_BYTES; r++){
+    int iEnd;
+    CSV_PROFILE_START(tRow);
+    pCsr->aBatchRowOff[r] = csv_tell( pCsr );
+    iEnd = csv_readline( pCsr, n );
+    CSV_PROFILE_END((CSV *)pCsr->base.pVtab, CSV_PHASE_GETLINE, tRow);
+    if( iEnd<0 ){
+      if( !pCsr->bTooLong ) return SQLITE_NOMEM;
+      pCsr->bTooLong = 0;
+      pCsr->zBatchBad = "row too long";
+      pCsr->aBatchPos[r] = pCsr->aBatchPos[r+1] = n;
+      csvBatchNull( pCsr, r );
+      r++;
+      break;
+    }
+    if( iEnd==n ) break;
+    {
+      CSV_PROFILE_START(tTokenize);
+      rc = csvBatchRow( pCsr, r, n, iEnd, &pCsr->zBatchBad );
+      CSV_PROFILE_END((CSV *)pCsr->base.pVtab, CSV_PHASE_TOKENIZE, tTokenize);
+    }
+    CSV_PROFILE_ROW((CSV *)pCsr->base.pVtab, tRow, (sqlite3_uint64)(iEnd-n));
+    if( rc!=SQLITE_OK ) return rc;
+    n = iEnd;
+    if( pCsr->zBatchBad ){
+      r++;
+      break;
+    }
+  }
+  pCsr->nBatch = r;
+  pCsr->aBatchRowOff[r] = csv_tell( pCsr );
+  return rc;
+}
+
+
+/*
+** Move cursor pCsr past the next newline, or to the end of the file.
+*/
+static void csvSkipLine( CSVCursor *pCsr ){
+  while( pCsr->iPos<pCsr->nData || csvCursorFill( pCsr )>0 ){
+    const char *pEol = memchr(&pCsr->aBuf[pCsr->iPos], '\n',
+                              pCsr->nData - pCsr->iPos);
+    if( pEol ){
+      pCsr->iPos = (int)(pEol - pCsr->aBuf) + 1;
+      return;
+    }
+    pCsr->iPos = pCsr->nData;
+  }
+}
+
+/*
+** Add the record at offset iOff to the log of malformed records of table
+** pCSV, unless it is there already or the log is full. The log is about
+** the current generation of the file only.
+*/
+static void csvErrorLog( CSV *pCSV, sqlite3_int64 iOff, const char *zReason ){
+  int lo = 0;
+  int hi;
+  if( pCSV->iErrGeneration!=pCSV->iGeneration ){
+    pCSV->nErr = 0;
+    pCSV->iErrGeneration = pCSV->iGeneration;
+  }
+  hi = pCSV->nErr;
+  while( lo<hi ){
+    int mid = (lo+hi)/2;
+    if( pCSV->aErr[mid].iOff<iOff ){
+      lo = mid+1;
+    }else{
+      hi = mid;
+    }
+  }
+  if( lo<pCSV->nErr && pCSV->aErr[lo].iOff==iOff ) return;
+  if( pCSV->nErr>=SQLITE_CSV_MAX_ERRORS ) return;
+  if( !pCSV->aErr ){
+    pCSV->aErr = sqlite3_malloc( sizeof(CSVError)*SQLITE_CSV_MAX_ERRORS );
+    if( !pCSV->aErr ) return;
+  }
+  memmove(&pCSV->aErr[lo+1], &pCSV->aErr[lo], sizeof(CSVError)*(pCSV->nErr-lo));
+  pCSV->aErr[lo].iOff = iOff;
+  pCSV->aErr[lo].zReason = zReason;
+  pCSV->nErr++;
+}
+
+/*
+** Handle the malformed record of cursor pCsr according to the ON_ERROR
+** option of its table: fail with an error message, or log the record and
+** move the cursor to the next line.
+*/
+static int csvMalformed( CSVCursor *pCsr, const char *zReason ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  if( pCSV->eOnError==CSV_ONERR_FAIL ){
+    sqlite3_free( pCSV->base.zErrMsg );
+    pCSV->base.zErrMsg = sqlite3_mprintf(aErrMsg[12], pCsr->csvpos, zReason);
+    return SQLITE_ERROR;
+  }
+  csvErrorLog( pCSV, pCsr->csvpos, zReason );
+  csv_seek( pCsr, pCsr->csvpos );
+  csvSkipLine( pCsr );
+  return SQLITE_OK;
+}
+
+/*
+** Return the text of column i of the current row of cursor pCsr and set
+** *pn to its length in bytes, or return NULL if the row has no column i.
+** Escaped quotes are unescaped once, into zCellBuf, as the row is kept as
+** read for _raw. The values of a batch are not nul-terminated, but those
+** unescaped are.
+*/
+static const char *csvCursorText( CSVCursor *pCsr, int i, int *pn ){
+  int r = pCsr->iBatch;
+  int k;
+  char *z;
+  if( i<0 || i>=((CSV *)pCsr->base.pVtab)->nColumn ) return 0;
+  k = i*pCsr->nBatchStride + r;
+  if( pCsr->aBatchFlag[k] & CSV_CELL_NULL ) return 0;
+  if( pCsr->aBatchFlag[k] & CSV_CELL_ESCAPED ){
+    /* the unescaped values of a row take less room than the row, so
+    ** zCellBuf is sized once per row and what it holds stays put */
+    int nRow = pCsr->aBatchPos[r+1] - pCsr->aBatchPos[r];
+    const char *zIn = &pCsr->zRow[pCsr->aBatchOff[k]];
+    int j, n;
+    if( pCsr->iCellBufRow!=pCsr->iCellRow ){
+      if( pCsr->nCellBuf<nRow+1 ){
+        char *zNew = sqlite3_realloc( pCsr->zCellBuf, nRow+1 );
+        if( !zNew ) return 0;
+        pCsr->zCellBuf = zNew;
+        pCsr->nCellBuf = nRow+1;
+      }
+      pCsr->nCellUsed = 0;
+      pCsr->iCellBufRow = pCsr->iCellRow;
+    }
+    z = &pCsr->zCellBuf[pCsr->nCellUsed];
+    for(j=0, n=0; j<pCsr->aBatchLen[k]; j++){
+      z[n++] = zIn[j];
+      if( zIn[j]=='\"' ) j++;
+    }
+    z[n] = 0;
+    pCsr->aBatchOff[k] = pCsr->nCellUsed;
+    pCsr->aBatchLen[k] = n;
+    pCsr->aBatchFlag[k] = CSV_CELL_UNESCAPED;
+    pCsr->nCellUsed += n+1;
+  }
+  if( pCsr->aBatchFlag[k] & CSV_CELL_UNESCAPED ){
+    z = &pCsr->zCellBuf[pCsr->aBatchOff[k]];
+  }else{
+    z = &pCsr->zRow[pCsr->aBatchOff[k]];
+  }
+  *pn = pCsr->aBatchLen[k];
+  return z;
+}
+
+
+/*
+** Compare two strings with the BINARY collation.
+*/
+static int csvTextCmp( const char *a, int na, const char *b, int nb ){
+  int c = memcmp(a, b, na<nb ? na : nb);
+  return c ? c : na-nb;
+}
+
+/*
+** FNV-1a hash of the n bytes at z, continuing from hash h.
+*/
+static sqlite3_uint64 csvHash( sqlite3_uint64 h, const char *z, int n ){
+  int i;
+  for(i=0; i<n; i++){
+    h = (h ^ (unsigned char)z[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+#define CSV_HASH_INIT 0xcbf29ce484222325ULL
+
+/*
+** Bloom filters are arrays of a power of two bits, each value setting the
+** CSV_BLOOM_K bits derived from its hash by double hashing.
+*/
+#define CSV_BLOOM_K 4
+static int csvBloomBit( sqlite3_uint64 h, int k, int nBit ){
+  sqlite3_uint64 h1 = h & 0xffffffff;
+  sqlite3_uint64 h2 = (h>>32) | 1;
+  return (int)((h1 + (sqlite3_uint64)k*h2) & (sqlite3_uint64)(nBit-1));
+}
+static int csvBloomTest( const unsigned char *a, int nByte, sqlite3_uint64 h ){
+  int k;
+  for(k=0; k<CSV_BLOOM_K; k++){
+    int i = csvBloomBit(h, k, nByte*8);
+    if( (a[i/8] & (1<<(i%8)))==0 ) return 0;
+  }
+  return 1;
+}
+
+/*
+** Variable-length integers (7 bits per byte, least significant first)
+** used for the row offsets of the %_block shadow table.
+*/
+static void csvPutVarint( sqlite3_str *pStr, sqlite3_uint64 v ){
+  char a[10];
+  int n = 0;
+  do{
+    a[n++] = (char)((v & 0x7f) | (v>0x7f ? 0x80 : 0));
+    v >>= 7;
+  }while( v );
+  sqlite3_str_append(pStr, a, n);
+}
+static int csvGetVarint( const unsigned char *a, int n, sqlite3_uint64 *pv ){
+  sqlite3_uint64 v = 0;
+  int i;
+  for(i=0; i<n && i<10; i++){
+    v |= (sqlite3_uint64)(a[i] & 0x7f) << (7*i);
+    if( (a[i] & 0x80)==0 ){
+      *pv = v;
+      return i+1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+** Compute a checksum of the file open in cursor pCsr, of size nSize, from
+** up to 64 pages sampled evenly across it. This tells a file that was only
+** copied or touched since the index was built from one that was modified,
+** without reading it all.
+*/
+static int csvChecksum(
+  CSVCursor *pCsr,
+  sqlite3_int64 nSize,
+  sqlite3_int64 *piSum
+){
+  const int nPage = 4096;
+  sqlite3_uint64 h = csvHash(CSV_HASH_INIT, (const char *)&nSize, sizeof(nSize));
+  char *aPage = sqlite3_malloc( nPage );
+  int i;
+
+  if( !aPage ) return SQLITE_NOMEM;
+  for(i=0; i<64; i++){
+    sqlite3_int64 iOff = nSize>nPage ? (nSize-nPage)/63*i : 0;
+    int n = csv_read( pCsr->pHandle->fd, aPage, nPage, iOff );
+    if( n<0 ){
+      sqlite3_free( aPage );
+      return SQLITE_IOERR;
+    }
+    h = csvHash(h, aPage, n);
+    if( nSize<=nPage ) break;
+  }
+  sqlite3_free( aPage );
+  *piSum = (sqlite3_int64)h;
+  return SQLITE_OK;
+}
+
+
+/*
+** Finalize the statements that table pCSV keeps prepared on its shadow
+** tables. This must be done before the shadow tables are dropped or
+** renamed.
+*/
+static void csvFinalizeStmts( CSV *pCSV ){
+  sqlite3_finalize( pCSV->pZoneStmt );
+  pCSV->pZoneStmt = 0;
+}
+
+
+/*
+** Load the index of table pCSV from its %_file and %_block shadow tables,
+** if csv_refresh() built one. The index is only used once the file has
+** been found to match it, by csvIndexCheck().
+*/
+static int csvIndexLoad( CSV *pCSV ){
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
+  int rc;
+
+  sqlite3_free( pCSV->aBlock );
+  sqlite3_free( pCSV->aRowOff );
+  pCSV->aBlock = 0;
+  pCSV->aRowOff = 0;
+  pCSV->nBlock = 0;
+  pCSV->iRowBlock = -1;
+  pCSV->bIndexValid = 0;
+  pCSV->iIndexGeneration = 0;
+
+  zSql = sqlite3_mprintf(
+      "SELECT size, mtime, checksum, (SELECT count(*) FROM \"%w\".\"%w_block\")"
+      " FROM \"%w\".\"%w_file\"",
+      pCSV->zDb, pCSV->zName, pCSV->zDb, pCSV->zName);
+  if( !zSql ) return SQLITE_NOMEM;
+  if( sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 )!=SQLITE_OK ){
+    /* no index */
+    sqlite3_free( zSql );
+    return SQLITE_OK;
+  }
+  sqlite3_free( zSql );
+  if( sqlite3_step( pStmt )==SQLITE_ROW && sqlite3_column_int( pStmt, 3 )>0 ){
+    int nBlock = sqlite3_column_int( pStmt, 3 );
+    pCSV->nIndexSize = sqlite3_column_int64( pStmt, 0 );
+    pCSV->iIndexMtime = sqlite3_column_int64( pStmt, 1 );
+    pCSV->iIndexChecksum = sqlite3_column_int64( pStmt, 2 );
+    sqlite3_finalize( pStmt );
+    pCSV->aBlock = (CSVBlock *)sqlite3_malloc64( sizeof(CSVBlock)*nBlock );
+    if( !pCSV->aBlock ) return SQLITE_NOMEM;
+    zSql = sqlite3_mprintf(
+        "SELECT offset, nrow FROM \"%w\".\"%w_block\" ORDER BY block",
+        pCSV->zDb, pCSV->zName);
+    rc = zSql ? sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 ) : SQLITE_NOMEM;
+    sqlite3_free( zSql );
+    if( rc!=SQLITE_OK ) return rc;
+    while( pCSV->nBlock<nBlock && sqlite3_step( pStmt )==SQLITE_ROW ){
+      CSVBlock *p = &pCSV->aBlock[pCSV->nBlock];
+      p->iOff = sqlite3_column_int64( pStmt, 0 );
+      p->nRow = sqlite3_column_int( pStmt, 1 );
+      p->iFirstRow = pCSV->nBlock ? p[-1].iFirstRow + p[-1].nRow : 0;
+      pCSV->nBlock++;
+    }
+  }
+  return sqlite3_finalize( pStmt );
+}
+
+/*
+** Return true if an index built from a file of size nIdxSize, modification
+** time iIdxMtime and checksum iIdxSum describes the file open in cursor
+** pCsr, whose size and modification time are nSize and iMtime: the sizes
+** must be equal and, unless the modification times are too, the
+** checksums. The checksum of the file is computed into *piSum the first
+** time it is needed, *pbSum recording whether that was done (1) or failed
+** (-1).
+*/
+static int csvIndexMatch(
+  CSVCursor *pCsr,
+  sqlite3_int64 nSize,
+  sqlite3_int64 iMtime,
+  sqlite3_int64 nIdxSize,
+  sqlite3_int64 iIdxMtime,
+  sqlite3_int64 iIdxSum,
+  sqlite3_int64 *piSum,
+  int *pbSum
+){
+  if( nSize!=nIdxSize ) return 0;
+  if( iMtime==iIdxMtime ) return 1;
+  if( *pbSum==0 ){
+    *pbSum = csvChecksum( pCsr, nSize, piSum )==SQLITE_OK ? 1 : -1;
+  }
+  return *pbSum>0 && *piSum==iIdxSum;
+}
+
+/*
+** Decide whether the index of csv_refresh() and each column index of
+** csv_create_index() of table pCSV describe the file open in cursor pCsr,
+** whose size and modification time are nSize and iMtime.
+*/
+static void csvIndexCheck(
+  CSVCursor *pCsr,
+  sqlite3_int64 nSize,
+  sqlite3_int64 iMtime
+){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_int64 iSum = 0;
+  int bSum = 0;
+  int i;
+
+  pCSV->bIndexValid = pCSV->nBlock>0
+      && csvIndexMatch( pCsr, nSize, iMtime, pCSV->nIndexSize,
+                        pCSV->iIndexMtime, pCSV->iIndexChecksum, &iSum, &bSum );
+  for(i=0; i<pCSV->nColIdx; i++){
+    CSVColIdx *p = &pCSV->aColIdx[i];
+    p->bValid = csvIndexMatch( pCsr, nSize, iMtime, p->nSize, p->iMtime,
+                               p->iChecksum, &iSum, &bSum );
+  }
+}
+
+/*
+** Load the offsets of the rows of block iBlock of the index of table pCSV
+** into pCSV->aRowOff[].
+*/
+static int csvIndexRows( CSV *pCSV, int iBlock ){
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
+  int rc;
+
+  if( pCSV->iRowBlock==iBlock && pCSV->aRowOff ) return SQLITE_OK;
+  if( !pCSV->aRowOff ){
+    pCSV->aRowOff = sqlite3_malloc64( sizeof(sqlite3_int64)*SQLITE_CSV_BLOCK_ROWS );
+    if( !pCSV->aRowOff ) return SQLITE_NOMEM;
+  }
+  pCSV->iRowBlock = -1;
+  zSql = sqlite3_mprintf("SELECT rows FROM \"%w\".\"%w_block\" WHERE block=%d",
+                         pCSV->zDb, pCSV->zName, iBlock);
+  rc = zSql ? sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 ) : SQLITE_NOMEM;
+  sqlite3_free( zSql );
+  if( rc!=SQLITE_OK ) return rc;
+  if( sqlite3_step( pStmt )==SQLITE_ROW ){
+    const unsigned char *a = sqlite3_column_blob( pStmt, 0 );
+    int n = sqlite3_column_bytes( pStmt, 0 );
+    int nRow = pCSV->aBlock[iBlock].nRow;
+    sqlite3_int64 iOff = pCSV->aBlock[iBlock].iOff;
+    int i, j;
+    for(i=0, j=0; i<nRow && i<SQLITE_CSV_BLOCK_ROWS; i++){
+      sqlite3_uint64 v;
+      int k = csvGetVarint( &a[j], n-j, &v );
+      if( k==0 ) break;
+      j += k;
+      iOff += (sqlite3_int64)v;
+      pCSV->aRowOff[i] = iOff;
+    }
+    if( i==nRow ) pCSV->iRowBlock = iBlock;
+  }
+  sqlite3_finalize( pStmt );
+  return pCSV->iRowBlock==iBlock ? SQLITE_OK : SQLITE_CORRUPT_VTAB;
+}
+
+/*
+** Return the block of the index of table pCSV that holds the row at offset
+** iOff, or -1.
+*/
+static int csvIndexBlock( CSV *pCSV, sqlite3_int64 iOff ){
+  int lo = 0, hi = pCSV->nBlock-1;
+  while( lo<=hi ){
+    int mid = (lo+hi)/2;
+    if( pCSV->aBlock[mid].iOff<=iOff ){
+      lo = mid+1;
+    }else{
+      hi = mid-1;
+    }
+  }
+  return hi;
+}
+
+/*
+** With a valid index, return true if offset iOff is the start of a row of
+** table pCSV.
+*/
+static int csvIndexIsRow( CSV *pCSV, sqlite3_int64 iOff ){
+  int iBlock = csvIndexBlock( pCSV, iOff );
+  int lo, hi;
+
+  if( iBlock<0 || csvIndexRows( pCSV, iBlock )!=SQLITE_OK ) return 0;
+  lo = 0;
+  hi = pCSV->aBlock[iBlock].nRow-1;
+  while( lo<=hi ){
+    int mid = (lo+hi)/2;
+    if( pCSV->aRowOff[mid]==iOff ){
+      return 1;
+    }else if( pCSV->aRowOff[mid]<iOff ){
+      lo = mid+1;
+    }else{
+      hi = mid-1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Position cursor pCsr at the row that follows the first iRow rows of the
+** table, for OFFSET. With a valid index this is a seek, and pCsr->eof is
+** set if there are not that many rows. Otherwise csvNext() reads the rows
+** and skips them, so that malformed records are dealt with as by a scan.
+*/
+static int csvSeekRow( CSVCursor *pCsr, sqlite3_int64 iRow ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+
+  if( pCSV->bIndexValid ){
+    int lo = 0, hi = pCSV->nBlock-1;
+    int rc;
+    while( lo<=hi ){
+      int mid = (lo+hi)/2;
+      if( pCSV->aBlock[mid].iFirstRow<=iRow ){
+        lo = mid+1;
+      }else{
+        hi = mid-1;
+      }
+    }
+    if( hi<0 || iRow>=pCSV->aBlock[hi].iFirstRow+pCSV->aBlock[hi].nRow ){
+      pCsr->eof = -1;
+      return SQLITE_OK;
+    }
+    rc = csvIndexRows( pCSV, hi );
+    if( rc==SQLITE_OK ){
+      csv_seek( pCsr, pCSV->aRowOff[iRow - pCSV->aBlock[hi].iFirstRow] );
+    }
+    return rc;
+  }
+
+  csv_seek( pCsr, pCSV->offsetFirstRow );
+  pCsr->nSkipRow = iRow;
+  return SQLITE_OK;
+}
+
+/*
+** Read from 1 to nMax digits of z[*pi..n-1], at least nMin, into *pv, and
+** advance *pi past them. Return 0 if there are fewer than nMin.
+*/
+static int csvTimeDigits(
+  const char *z, int n, int *pi,
+  int nMin, int nMax,
+  sqlite3_int64 *pv
+){
+  int i = *pi;
+  sqlite3_int64 v = 0;
+  while( i<n && i-*pi<nMax && z[i]>='0' && z[i]<='9' ){
+    v = v*10 + (z[i++] - '0');
+  }
+  if( i-*pi<nMin ) return 0;
+  *pi = i;
+  *pv = v;
+  return 1;
+}
+
+/*
+** Read a fraction of a second after the decimal point from z[*pi..n-1],
+** as a number of microseconds, into *pv. Digits after the sixth are read
+** but ignored.
+*/
+static int csvTimeFraction( const char *z, int n, int *pi, sqlite3_int64 *pv ){
+  sqlite3_int64 v;
+  int i = *pi;
+  if( !csvTimeDigits( z, n, pi, 1, 6, &v ) ) return 0;
+  for(i=*pi-i; i<6; i++) v *= 10;
+  while( *pi<n && z[*pi]>='0' && z[*pi]<='9' ) (*pi)++;
+  *pv = v;
+  return 1;
+}
+
+/*
+** Read a time zone from z[*pi..n-1], "Z" or an offset "+HH", "+HHMM" or
+** "+HH:MM" (or "-"), into *pv, as the number of seconds to subtract from
+** the local time to get UTC.
+*/
+static int csvTimeZone( const char *z, int n, int *pi, sqlite3_int64 *pv ){
+  sqlite3_int64 h, m = 0;
+  int i = *pi;
+  int bNeg;
+  if( i<n && z[i]=='Z' ){
+    *pi = i+1;
+    *pv = 0;
+    return 1;
+  }
+  if( i>=n || (z[i]!='+' && z[i]!='-') ) return 0;
+  bNeg = z[i++]=='-';
+  if( !csvTimeDigits( z, n, &i, 2, 2, &h ) || h>23 ) return 0;
+  if( i<n && z[i]==':' ) i++;
+  if( i<n && (!csvTimeDigits( z, n, &i, 2, 2, &m ) || m>59) ) return 0;
+  *pi = i;
+  *pv = (bNeg ? -1 : 1) * (h*3600 + m*60);
+  return 1;
+}
+
+/*
+** Return the number of days from 1970-01-01 to date y-m-d of the proleptic
+** Gregorian calendar.
+*/
+static sqlite3_int64 csvTimeDays( sqlite3_int64 y, int m, int d ){
+  /* years start in March, so that the leap day is the last one, and come
+  ** in eras of 400 years of 146097 days */
+  sqlite3_int64 nEra, nYear, nDay;
+  if( m<=2 ) y--;
+  nEra = (y>=0 ? y : y-399) / 400;
+  nYear = y - nEra*400;
+  nDay = (153*(m>2 ? m-3 : m+9) + 2)/5 + d-1;
+  return nEra*146097 + nYear*365 + nYear/4 - nYear/100 + nDay - 719468;
+}
+
+/*
+** Parse value z of n bytes of a TIMESTAMP column with format zFmt, and
+** store it in *piVal in unit eUnit (one of CSV_UNIT_*). zFmt is "" for
+** ISO-8601: "YYYY-MM-DD", optionally followed by "T" or a space,
+** "HH:MM[:SS[.fff]]" and a time zone, "Z" or "+HH[:MM]". Otherwise it is
+** made of these conversions, and of characters that must appear as is:
+**
+**   %Y  year, 4 digits          %H  hour, 1 or 2 digits
+**   %m  month, 1 or 2 digits    %M  minute, 1 or 2 digits
+**   %d  day, 1 or 2 digits      %S  second, 1 or 2 digits
+**   %f  fraction of a second    %s  seconds since 1970, instead of a date
+**   %z  time zone, as above     %%  a "%" character
+**
+** Values without a time zone are UTC. Return 1 if z matches the whole
+** format and is a valid date, or 0 otherwise.
+*/
+static int csvTimeParse(
+  const char *zFmt,
+  const char *z,
+  int n,
+  int eUnit,
+  sqlite3_int64 *piVal
+){
+  static const unsigned char aMonthDays[] = {
+    31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+  };
+  sqlite3_int64 y = 1970, mo = 1, d = 1, h = 0, mi = 0, sec = 0;
+  sqlite3_int64 iFrac = 0;     /* Microseconds */
+  sqlite3_int64 iZone = 0;     /* Offset of the time zone in seconds */
+  sqlite3_int64 iEpoch = 0;    /* Value of %s */
+  int bEpoch = 0;
+  int i = 0;
+
+  if( zFmt[0]==0 ){
+    if( !csvTimeDigits( z, n, &i, 4, 4, &y )
+     || i>=n || z[i++]!='-' || !csvTimeDigits( z, n, &i, 2, 2, &mo )
+     || i>=n || z[i++]!='-' || !csvTimeDigits( z, n, &i, 2, 2, &d )
+    ){
+      return 0;
+    }
+    if( i<n && (z[i]=='T' || z[i]==' ') ){
+      i++;
+      if( !csvTimeDigits( z, n, &i, 2, 2, &h )
+       || i>=n || z[i++]!=':' || !csvTimeDigits( z, n, &i, 2, 2, &mi )
+      ){
+        return 0;
+      }
+      if( i<n && z[i]==':' ){
+        i++;
+        if( !csvTimeDigits( z, n, &i, 2, 2, &sec ) ) return 0;
+        if( i<n && z[i]=='.' ){
+          i++;
+          if( !csvTimeFraction( z, n, &i, &iFrac ) ) return 0;
+        }
+      }
+      if( i<n && !csvTimeZone( z, n, &i, &iZone ) ) return 0;
+    }
+  }else{
+    for(; *zFmt; zFmt++){
+      int ok;
+      if( *zFmt!='%' || zFmt[1]=='%' ){
+        if( *zFmt=='%' ) zFmt++;
+        if( i>=n || z[i]!=*zFmt ) return 0;
+        i++;
+        continue;
+      }
+      switch( *++zFmt ){
+        case 'Y': ok = csvTimeDigits( z, n, &i, 4, 4, &y );   break;
+        case 'm': ok = csvTimeDigits( z, n, &i, 1, 2, &mo );  break;
+        case 'd': ok = csvTimeDigits( z, n, &i, 1, 2, &d );   break;
+        case 'H': ok = csvTimeDigits( z, n, &i, 1, 2, &h );   break;
+        case 'M': ok = csvTimeDigits( z, n, &i, 1, 2, &mi );  break;
+        case 'S': ok = csvTimeDigits( z, n, &i, 1, 2, &sec ); break;
+        case 'f': ok = csvTimeFraction( z, n, &i, &iFrac );   break;
+        case 'z': ok = csvTimeZone( z, n, &i, &iZone );       break;
+        case 's': {
+          int bNeg = i<n && z[i]=='-';
+          /* at most 12 digits, so that any unit fits in 64 bits */
+          i += bNeg;
+          ok = csvTimeDigits( z, n, &i, 1, 12, &iEpoch );
+          if( bNeg ) iEpoch = -iEpoch;
+          bEpoch = 1;
+          break;
+        }
+        default:  ok = 0; break;
+      }
+      if( !ok ) return 0;
+    }
+  }
+  if( i<n || mo<1 || mo>12 || d<1 || d>aMonthDays[mo-1] || h>23 || mi>59
+   || sec>59
+  ){
+    return 0;
+  }
+  if( mo==2 && d==29 && (y%4!=0 || (y%100==0 && y%400!=0)) ) return 0;
+
+  if( !bEpoch ){
+    iEpoch = csvTimeDays( y, (int)mo, (int)d )*86400 + h*3600 + mi*60 + sec;
+  }
+  iEpoch -= iZone;
+  switch( eUnit ){
+    case CSV_UNIT_S:  *piVal = iEpoch;                          break;
+    case CSV_UNIT_MS: *piVal = iEpoch*1000 + iFrac/1000;        break;
+    default:          *piVal = iEpoch*1000000 + iFrac;          break;
+  }
+  return 1;
+}
+
+/*
+** Return 1 if zFmt is a valid format for csvTimeParse(), or 0 otherwise.
+*/
+static int csvTimeFormatCheck( const char *zFmt ){
+  for(; *zFmt; zFmt++){
+    if( *zFmt=='%' && !strchr("YmdHMSfsz%", *++zFmt) ) return 0;
+    if( *zFmt==0 ) return 0;
+  }
+  return 1;
+}
+
+/*
+** Parse value z of n bytes of DECIMAL column pType, written with decimal
+** separator cDecimal and, optionally, separator cGroup between groups of
+** three digits of the integer part, and store it in *piVal as the number of
+** 1/10^s units. z needs no nul terminator. Return 0 if z is not a number
+** of at most p digits, s after the separator, or if it has more decimals
+** that are not zeros, as the value would not be exact.
+*/
+static int csvDecimalParse(
+  const CSVColType *pType,
+  char cDecimal,
+  char cGroup,
+  const char *z,
+  int n,
+  sqlite3_int64 *piVal
+){
+  static const sqlite3_int64 aPow10[CSV_DECIMAL_MAX+1] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+    1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL
+  };
+  const sqlite3_int64 iMax = aPow10[pType->nPrec];
+  sqlite3_int64 v = 0;
+  int nFrac = -1;              /* Digits after the separator, or -1 */
+  int nDigit = 0;
+  int nRun = 0;                /* Digits since the last group separator */
+  int bGroup = 0;              /* True after a group separator */
+  int bNeg = 0;
+  int i = 0;
+
+  if( n>0 && (z[0]=='-' || z[0]=='+') ) bNeg = z[i++]=='-';
+  for(; i<n; i++){
+    char c = z[i];
+    if( c>='0' && c<='9' ){
+      nDigit++;
+      nRun++;
+      if( nFrac==pType->nScale ){
+        if( c!='0' ) return 0;
+        continue;
+      }
+      if( nFrac>=0 ) nFrac++;
+      v = v*10 + (c - '0');
+      if( v>=iMax ) return 0;
+    }else if( c==cDecimal && nFrac<0 ){
+      if( bGroup && nRun!=3 ) return 0;
+      nFrac = 0;
+    }else if( c==cGroup && nFrac<0 && nRun>0 && nRun<=3
+           && (!bGroup || nRun==3)
+    ){
+      bGroup = 1;
+      nRun = 0;
+    }else{
+      return 0;
+    }
+  }
+  if( nDigit==0 || (bGroup && nFrac<0 && nRun!=3) ) return 0;
+  for(nFrac = nFrac<0 ? 0 : nFrac; nFrac<pType->nScale; nFrac++){
+    v *= 10;
+    if( v>=iMax ) return 0;
+  }
+  *piVal = bNeg ? -v : v;
+  return 1;
+}
+
+/*
+** Convert value z of n bytes of typed column i of table pCSV to an integer
+** in *piVal. Return 1 if it converts, or 0 if it is to be returned as text.
+*/
+static int csvCellInt(
+  CSV *pCSV,
+  int i,
+  const char *z,
+  int n,
+  sqlite3_int64 *piVal
+){
+  const CSVColType *p = &pCSV->aType[i];
+  if( p->eType==CSV_TYPE_TIMESTAMP ){
+    return csvTimeParse( p->zFmt, z, n, pCSV->eTimeUnit, piVal );
+  }
+  return csvDecimalParse( p, pCSV->cDecimal, pCSV->cGroup, z, n, piVal );
+}
+
+/*
+** Clear the entries of pCsr->aMatch[] for the blocks in which no value of
+** column iCol can satisfy constraint "iCol <eOp> pVal", according to the
+** min/max values and Bloom filters of the %_zone shadow table. pVal is a
+** text value, compared with the BINARY collation, or an integer for a
+** typed column.
+*/
+static int csvZoneFilter(
+  CSVCursor *pCsr,
+  int iCol,
+  int eOp,
+  sqlite3_value *pVal
+){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  int bInt = csvIsInt( pCSV, iCol );
+  sqlite3_int64 iVal = sqlite3_value_int64( pVal );
+  const char *zVal = bInt ? 0 : (const char *)sqlite3_value_text( pVal );
+  int nVal = sqlite3_value_bytes( pVal );
+  sqlite3_uint64 h;
+  sqlite3_stmt *pStmt;
+  int rc;
+
+  if( bInt ){
+    h = csvHash( CSV_HASH_INIT, (const char *)&iVal, sizeof(iVal) );
+  }else{
+    if( !zVal ) return SQLITE_NOMEM;
+    h = csvHash( CSV_HASH_INIT, zVal, nVal );
+  }
+  if( !pCsr->aMatch ){
+    pCsr->aMatch = (unsigned char *)sqlite3_malloc( pCSV->nBlock );
+    if( !pCsr->aMatch ) return SQLITE_NOMEM;
+    memset( pCsr->aMatch, 1, pCSV->nBlock );
+  }
+  if( !pCSV->pZoneStmt ){
+    char *zSql = sqlite3_mprintf(
+        "SELECT block, min, max, bloom FROM \"%w\".\"%w_zone\" WHERE col=?1",
+        pCSV->zDb, pCSV->zName);
+    rc = zSql ? sqlite3_prepare_v2( pCSV->db, zSql, -1, &pCSV->pZoneStmt, 0 )
+              : SQLITE_NOMEM;
+    sqlite3_free( zSql );
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  pStmt = pCSV->pZoneStmt;
+  sqlite3_bind_int( pStmt, 1, iCol );
+  while( sqlite3_step( pStmt )==SQLITE_ROW ){
+    int iBlock = sqlite3_column_int( pStmt, 0 );
+    int bSkip = 0;
+    int cMin, cMax;
+    if( iBlock<0 || iBlock>=pCSV->nBlock ) continue;
+    /* a block without a min and max is NULL in every row */
+    if( bInt ){
+      sqlite3_int64 iMin = sqlite3_column_int64( pStmt, 1 );
+      sqlite3_int64 iMax = sqlite3_column_int64( pStmt, 2 );
+      bSkip = sqlite3_column_type( pStmt, 1 )==SQLITE_NULL;
+      cMin = iVal<iMin ? -1 : iVal>iMin;
+      cMax = iVal<iMax ? -1 : iVal>iMax;
+    }else{
+      const char *zMin = (const char *)sqlite3_column_text( pStmt, 1 );
+      int nMin = sqlite3_column_bytes( pStmt, 1 );
+      const char *zMax = (const char *)sqlite3_column_text( pStmt, 2 );
+      int nMax = sqlite3_column_bytes( pStmt, 2 );
+      bSkip = !zMin || !zMax;
+      cMin = bSkip ? 0 : csvTextCmp( zVal, nVal, zMin, nMin );
+      cMax = bSkip ? 0 : csvTextCmp( zVal, nVal, zMax, nMax );
+    }
+    if( !bSkip ){
+      switch( eOp ){
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+          bSkip = cMin<0 || cMax>0;
+          if( !bSkip && sqlite3_column_type( pStmt, 3 )==SQLITE_BLOB ){
+            const unsigned char *a = sqlite3_column_blob( pStmt, 3 );
+            bSkip = !csvBloomTest( a, sqlite3_column_bytes( pStmt, 3 ), h );
+          }
+          break;
+        case SQLITE_INDEX_CONSTRAINT_LT: bSkip = cMin<=0; break;
+        case SQLITE_INDEX_CONSTRAINT_LE: bSkip = cMin<0;  break;
+        case SQLITE_INDEX_CONSTRAINT_GT: bSkip = cMax>=0; break;
+        case SQLITE_INDEX_CONSTRAINT_GE: bSkip = cMax>0;  break;
+      }
+    }
+    if( bSkip ) pCsr->aMatch[iBlock] = 0;
+  }
+  return sqlite3_reset( pStmt );
+}
+
+
+/*
+** Clear the entries of pCsr->aMatch[] for the blocks in which no value of
+** column iCol can satisfy "iCol IS NULL" (if bNull is true) or "iCol IS
+** NOT NULL", according to the %_zone shadow table: those without NULLs,
+** or those where the column is NULL in every row. Zones built by earlier
+** versions of this module have no count of NULLs, and skip no block.
+*/
+static int csvZoneFilterNull( CSVCursor *pCsr, int iCol, int bNull ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
+  int rc;
+
+  zSql = sqlite3_mprintf(
+      "SELECT block FROM \"%w\".\"%w_zone\" WHERE col=%d AND %s",
+      pCSV->zDb, pCSV->zName, iCol, bNull ? "nnull=0" : "min IS NULL");
+  if( !zSql ) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 );
+  sqlite3_free( zSql );
+  if( rc!=SQLITE_OK ) return SQLITE_OK;
+  if( !pCsr->aMatch ){
+    pCsr->aMatch = (unsigned char *)sqlite3_malloc( pCSV->nBlock );
+    if( !pCsr->aMatch ){
+      sqlite3_finalize( pStmt );
+      return SQLITE_NOMEM;
+    }
+    memset(pCsr->aMatch, 1, pCSV->nBlock);
+  }
+  while( sqlite3_step( pStmt )==SQLITE_ROW ){
+    int iBlock = sqlite3_column_int( pStmt, 0 );
+    if( iBlock>=0 && iBlock<pCSV->nBlock ) pCsr->aMatch[iBlock] = 0;
+  }
+  return sqlite3_finalize( pStmt );
+}
+
+/*
+** State of csvIndexBuild() for one column: min/max of the current block
+** and the hashes of its values.
+*/
+typedef struct CSVZone CSVZone;
+struct CSVZone {
+  char *zMin, *zMax;           /* Range of the block, or NULL */
+  int nMin, nMax;
+  sqlite3_uint64 *aHash;       /* Hashes of the values of the block */
+  int nHash;
+  int nNull;                   /* Number of NULLs in the block */
+  int bInt;                    /* True for a typed column */
+  int nInt;                    /* Number of integers in the block */
+  int bText;                   /* True if a value of it is not an integer */
+  sqlite3_int64 iMin, iMax;    /* Range of the integers of the block */
+};
+
+/*
+** Set *pz (of length *pn) to a copy of the n bytes at z.
+*/
+static int csvZoneSet( char **pz, int *pn, const char *z, int n ){
+  char *p = sqlite3_realloc( *pz, n+1 );
+  if( !p ) return SQLITE_NOMEM;
+  memcpy(p, z, n);
+  p[n] = 0;
+  *pz = p;
+  *pn = n;
+  return SQLITE_OK;
+}
+
+static int csvHashCmp( const void *a, const void *b ){
+  sqlite3_uint64 x = *(const sqlite3_uint64 *)a;
+  sqlite3_uint64 y = *(const sqlite3_uint64 *)b;
+  return x<y ? -1 : x>y;
+}
+
+static int csvOffsetCmp( const void *a, const void *b ){
+  sqlite3_int64 x = *(const sqlite3_int64 *)a;
+  sqlite3_int64 y = *(const sqlite3_int64 *)b;
+  return x<y ? -1 : x>y;
+}
+
+/*
+** Mix the bits of hash h, so that all of them depend on all the bytes
+** hashed. Also the pseudo-random generator of csvStatRandom().
+*/
+static sqlite3_uint64 csvMix( sqlite3_uint64 z ){
+  z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+  return z ^ (z>>31);
+}
+
+/*
+** Pseudo-random numbers for the reservoir samples of csvStatAdd(). The
+** sequence is fixed, so that the same file always gives the same
+** statistics.
+*/
+static sqlite3_uint64 csvStatRandom( sqlite3_uint64 *pState ){
+  return csvMix( *pState += 0x9E3779B97F4A7C15ULL );
+}
+
+/*
+** HyperLogLog sketches of 2^CSV_HLL_BITS registers estimate numbers of
+** distinct values: csvHllAdd() adds the value of hash h, and csvHllCount()
+** returns the estimate for the nValue values added. Two sketches merge
+** by keeping the largest of each pair of registers.
+*/
+#define CSV_HLL_BITS 10
+static void csvHllAdd( unsigned char *aReg, sqlite3_uint64 h ){
+  sqlite3_uint64 x = csvMix( h );
+  int i = (int)(x >> (64-CSV_HLL_BITS));
+  int nRank;
+
+  /* the register picked by the first bits keeps the longest run of zero
+  ** bits seen after them */
+  x <<= CSV_HLL_BITS;
+  for(nRank=1; nRank<=64-CSV_HLL_BITS && (x>>63)==0; nRank++) x <<= 1;
+  if( nRank>aReg[i] ) aReg[i] = (unsigned char)nRank;
+}
+static sqlite3_int64 csvHllCount( const unsigned char *aReg,
+                                  sqlite3_int64 nValue ){
+  const double m = (double)(1<<CSV_HLL_BITS);
+  double rSum = 0.0;
+  double rEst;
+  int nZero = 0;
+  int i;
+  sqlite3_int64 n;
+
+  for(i=0; i<(1<<CSV_HLL_BITS); i++){
+    rSum += 1.0 / (double)((sqlite3_uint64)1 << aReg[i]);
+    if( aReg[i]==0 ) nZero++;
+  }
+  rEst = 0.7213 / (1.0 + 1.079/m) * m * m / rSum;
+  if( rEst<=2.5*m && nZero>0 ){
+    /* linear counting is more accurate for small cardinalities */
+    rEst = m * log(m / (double)nZero);
+  }
+  n = (sqlite3_int64)(rEst + 0.5);
+  if( n>nValue ) n = nValue;
+  if( n<1 && nValue>0 ) n = 1;
+  return n;
+}
+
+/*
+** State of the column statistics for one column while the file is being
+** scanned: the number of distinct values is estimated with a HyperLogLog
+** sketch of 2^CSV_HLL_BITS registers, and the histogram is drawn from a
+** reservoir sample of the non-empty values.
+*/
+typedef struct CSVSample CSVSample;
+struct CSVSample {
+  char *z;                     /* Prefix of a sampled value */
+  int n;                       /* Length of z in bytes */
+};
+typedef struct CSVStatAcc CSVStatAcc;
+struct CSVStatAcc {
+  sqlite3_int64 nEmpty;        /* Number of empty or missing values */
+  sqlite3_int64 nValue;        /* Number of non-empty values */
+  char *zMin, *zMax;           /* Range of the values, or NULL */
+  int nMin, nMax;
+  unsigned char aReg[1<<CSV_HLL_BITS];  /* HyperLogLog registers */
+  CSVSample *aSample;          /* Reservoir of SQLITE_CSV_STAT_SAMPLE values */
+  int nSample;                 /* Number of values in aSample[] */
+};
+
+/*
+** Allocate the statistics state for nCol columns.
+*/
+static CSVStatAcc *csvStatNew( int nCol ){
+  CSVStatAcc *aAcc = (CSVStatAcc *)sqlite3_malloc64( sizeof(CSVStatAcc)*nCol );
+  int i;
+  if( !aAcc ) return 0;
+  memset(aAcc, 0, sizeof(CSVStatAcc)*nCol);
+  for(i=0; i<nCol; i++){
+    aAcc[i].aSample = (CSVSample *)sqlite3_malloc64(
+        sizeof(CSVSample)*SQLITE_CSV_STAT_SAMPLE );
+    if( !aAcc[i].aSample ) break;
+  }
+  if( i<nCol ){
+    while( i>0 ) sqlite3_free( aAcc[--i].aSample );
+    sqlite3_free( aAcc );
+    return 0;
+  }
+  return aAcc;
+}
+
+static void csvStatFreeAcc( CSVStatAcc *aAcc, int nCol ){
+  int i, j;
+  for(i=0; aAcc && i<nCol; i++){
+    for(j=0; j<aAcc[i].nSample; j++) sqlite3_free( aAcc[i].aSample[j].z );
+    sqlite3_free( aAcc[i].aSample );
+    sqlite3_free( aAcc[i].zMin );
+    sqlite3_free( aAcc[i].zMax );
+  }
+  sqlite3_free( aAcc );
+}
+
+/*
+** Add value z (n bytes, or NULL if the row has no such column) with hash
+** h to the statistics p of its column. pRand is the state of the
+** pseudo-random generator.
+*/
+static int csvStatAdd(
+  CSVStatAcc *p,
+  sqlite3_uint64 *pRand,
+  const char *z,
+  int n,
+  sqlite3_uint64 h
+){
+  sqlite3_int64 i;
+  int rc = SQLITE_OK;
+
+  if( !z || n==0 ) p->nEmpty++;
+  if( !z ) return SQLITE_OK;
+  if( !p->zMin || csvTextCmp(z, n, p->zMin, p->nMin)<0 ){
+    rc = csvZoneSet( &p->zMin, &p->nMin, z, n );
+  }
+  if( rc==SQLITE_OK && (!p->zMax || csvTextCmp(z, n, p->zMax, p->nMax)>0) ){
+    rc = csvZoneSet( &p->zMax, &p->nMax, z, n );
+  }
+  if( rc!=SQLITE_OK || n==0 ) return rc;
+  csvHllAdd( p->aReg, h );
+
+  /* value number nValue replaces a sampled one with probability
+  ** SQLITE_CSV_STAT_SAMPLE/nValue */
+  p->nValue++;
+  if( p->nSample<SQLITE_CSV_STAT_SAMPLE ){
+    i = p->nSample++;
+    p->aSample[i].z = 0;
+  }else{
+    i = (sqlite3_int64)(csvStatRandom( pRand ) % (sqlite3_uint64)p->nValue);
+    if( i>=SQLITE_CSV_STAT_SAMPLE ) return SQLITE_OK;
+  }
+  return csvZoneSet( &p->aSample[i].z, &p->aSample[i].n, z,
+                     n<CSV_STAT_PREFIX ? n : CSV_STAT_PREFIX );
+}
+
+/*
+** Return the number of distinct non-empty values estimated from the
+** HyperLogLog registers of p.
+*/
+static sqlite3_int64 csvStatDistinct( const CSVStatAcc *p ){
+  return csvHllCount( p->aReg, p->nValue );
+}
+
+static int csvSampleCmp( const void *a, const void *b ){
+  const CSVSample *x = (const CSVSample *)a;
+  const CSVSample *y = (const CSVSample *)b;
+  return csvTextCmp( x->z, x->n, y->z, y->n );
+}
+
+/*
+** Store the statistics aAcc[] of the nRow rows of table pCSV in its %_stat
+** shadow table, which is created if needed. This is called within a
+** savepoint.
+*/
+static int csvStatWrite( CSV *pCSV, CSVStatAcc *aAcc, sqlite3_int64 nRow ){
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_str *pHist;
+  char *zSql;
+  int rc;
+  int i, k;
+
+  zSql = sqlite3_mprintf(
+      "CREATE TABLE IF NOT EXISTS \"%w\".\"%w_stat\"(col INTEGER PRIMARY KEY,"
+      " nrow INTEGER, nempty INTEGER, ndv INTEGER, min, max, hist BLOB);"
+      "DELETE FROM \"%w\".\"%w_stat\";",
+      pCSV->zDb, pCSV->zName, pCSV->zDb, pCSV->zName);
+  rc = zSql ? sqlite3_exec( pCSV->db, zSql, 0, 0, 0 ) : SQLITE_NOMEM;
+  sqlite3_free( zSql );
+  if( rc!=SQLITE_OK ) return rc;
+  zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w\".\"%w_stat\" VALUES(?, ?, ?, ?, ?, ?, ?)",
+      pCSV->zDb, pCSV->zName);
+  rc = zSql ? sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 ) : SQLITE_NOMEM;
+  sqlite3_free( zSql );
+  if( rc!=SQLITE_OK ) return rc;
+
+  pHist = sqlite3_str_new( pCSV->db );
+  for(i=0; rc==SQLITE_OK && i<pCSV->nColumn; i++){
+    CSVStatAcc *p = &aAcc[i];
+    int nHist = p->nSample<SQLITE_CSV_HIST_BUCKETS ? p->nSample
+                                                   : SQLITE_CSV_HIST_BUCKETS;
+
+    /* bound k of the histogram is the sampled value of rank (k+1)/nHist */
+    qsort(p->aSample, p->nSample, sizeof(CSVSample), csvSampleCmp);
+    sqlite3_str_reset( pHist );
+    for(k=0; k<nHist; k++){
+      const CSVSample *pBound = &p->aSample[(k+1)*p->nSample/nHist - 1];
+      csvPutVarint( pHist, (sqlite3_uint64)pBound->n );
+      sqlite3_str_append( pHist, pBound->z, pBound->n );
+    }
+    if( sqlite3_str_errcode( pHist ) ){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+
+    sqlite3_bind_int( pStmt, 1, i );
+    sqlite3_bind_int64( pStmt, 2, nRow );
+    sqlite3_bind_int64( pStmt, 3, p->nEmpty );
+    sqlite3_bind_int64( pStmt, 4, csvStatDistinct( p ) );
+    sqlite3_bind_text( pStmt, 5, p->zMin, p->nMin, SQLITE_STATIC );
+    sqlite3_bind_text( pStmt, 6, p->zMax, p->nMax, SQLITE_STATIC );
+    if( nHist>0 ){
+      sqlite3_bind_blob( pStmt, 7, sqlite3_str_value( pHist ),
+                         sqlite3_str_length( pHist ), SQLITE_STATIC );
+    }else{
+      sqlite3_bind_null( pStmt, 7 );
+    }
+    sqlite3_step( pStmt );
+    rc = sqlite3_reset( pStmt );
+  }
+  sqlite3_free( sqlite3_str_finish( pHist ) );
+  sqlite3_finalize( pStmt );
+  return rc;
+}
+
+/*
+** Free the column statistics of table pCSV.
+*/
+static void csvStatFree( CSV *pCSV ){
+  int i;
+  for(i=0; pCSV->aStat && i<pCSV->nColumn; i++){
+    sqlite3_free( pCSV->aStat[i].zMin );
+    sqlite3_free( pCSV->aStat[i].zMax );
+    sqlite3_free( pCSV->aStat[i].aHist );
+  }
+  sqlite3_free( pCSV->aStat );
+  pCSV->aStat = 0;
+  pCSV->nStatRow = 0;
+}
+
+/*
+** Copy the n bytes at z into memory obtained from sqlite3_malloc() and
+** set *pz to it, or leave *pz NULL if z is NULL.
+*/
+static int csvStatCopy( char **pz, const void *z, int n ){
+  if( !z ) return SQLITE_OK;
+  *pz = sqlite3_malloc( n+1 );
+  if( !*pz ) return SQLITE_NOMEM;
+  memcpy(*pz, z, n);
+  (*pz)[n] = 0;
+  return SQLITE_OK;
+}
+
+/*
+** Load the column statistics of table pCSV from its %_stat shadow table,
+** if csv_analyze() or csv_refresh() wrote them.
+*/
+static int csvStatLoad( CSV *pCSV ){
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
+  int rc = SQLITE_OK;
+
+  csvStatFree( pCSV );
+  zSql = sqlite3_mprintf(
+      "SELECT col, nrow, nempty, ndv, min, max, hist FROM \"%w\".\"%w_stat\"",
+      pCSV->zDb, pCSV->zName);
+  if( !zSql ) return SQLITE_NOMEM;
+  if( sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 )!=SQLITE_OK ){
+    /* no statistics */
+    sqlite3_free( zSql );
+    return SQLITE_OK;
+  }
+  sqlite3_free( zSql );
+  while( rc==SQLITE_OK && sqlite3_step( pStmt )==SQLITE_ROW ){
+    int iCol = sqlite3_column_int( pStmt, 0 );
+    CSVColStat *p;
+    const unsigned char *a;
+    int n, i;
+    if( iCol<0 || iCol>=pCSV->nColumn ) continue;
+    if( !pCSV->aStat ){
+      pCSV->aStat = (CSVColStat *)sqlite3_malloc64(
+          sizeof(CSVColStat)*pCSV->nColumn );
+      if( !pCSV->aStat ){
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      memset(pCSV->aStat, 0, sizeof(CSVColStat)*pCSV->nColumn);
+    }
+    p = &pCSV->aStat[iCol];
+    pCSV->nStatRow = sqlite3_column_int64( pStmt, 1 );
+    p->nEmpty = sqlite3_column_int64( pStmt, 2 );
+    p->nDistinct = sqlite3_column_int64( pStmt, 3 );
+    rc = csvStatCopy( &p->zMin, sqlite3_column_text( pStmt, 4 ),
+                      p->nMin = sqlite3_column_bytes( pStmt, 4 ) );
+    if( rc==SQLITE_OK ){
+      rc = csvStatCopy( &p->zMax, sqlite3_column_text( pStmt, 5 ),
+                        p->nMax = sqlite3_column_bytes( pStmt, 5 ) );
+    }
+    if( rc==SQLITE_OK ){
+      a = (const unsigned char *)sqlite3_column_blob( pStmt, 6 );
+      p->nHistByte = sqlite3_column_bytes( pStmt, 6 );
+      rc = csvStatCopy( (char **)&p->aHist, a, p->nHistByte );
+    }
+    /* count the bounds */
+    for(i=0; rc==SQLITE_OK && i<p->nHistByte; p->nHist++){
+      sqlite3_uint64 v;
+      n = csvGetVarint( &p->aHist[i], p->nHistByte-i, &v );
+      if( n==0 || v>(sqlite3_uint64)(p->nHistByte-i-n) ) break;
+      i += n + (int)v;
+    }
+  }
+  sqlite3_finalize( pStmt );
+  if( rc!=SQLITE_OK ) csvStatFree( pCSV );
+  return rc;
+}
+
+/*
+** Write the zone of column iCol for block iBlock with statement pStmt
+** (INSERT INTO %_zone), and reset the block state of pZone.
+*/
+static int csvZoneFlush(
+  sqlite3_stmt *pStmt,
+  CSVZone *pZone,
+  int iCol,
+  int iBlock,
+  int nRow
+){
+  unsigned char *aBloom = 0;
+  int nBloom = 0;
+  int nDistinct = 0;
+  int i;
+
+  if( pZone->bText ){
+    /* a typed column with values that are text: no zone for the block */
+    pZone->nHash = pZone->nInt = pZone->bText = pZone->nNull = 0;
+    return SQLITE_OK;
+  }
+
+  /* a Bloom filter is only worth it for columns with few distinct values */
+  qsort(pZone->aHash, pZone->nHash, sizeof(sqlite3_uint64), csvHashCmp);
+  for(i=0; i<pZone->nHash; i++){
+    if( i==0 || pZone->aHash[i]!=pZone->aHash[i-1] ) nDistinct++;
+  }
+  if( nDistinct>0 && nDistinct*SQLITE_CSV_BLOOM_RATIO<=nRow ){
+    int nBit = 64;
+    while( nBit<nDistinct*10 ) nBit *= 2;
+    nBloom = nBit/8;
+    aBloom = sqlite3_malloc( nBloom );
+    if( !aBloom ) return SQLITE_NOMEM;
+    memset(aBloom, 0, nBloom);
+    for(i=0; i<pZone->nHash; i++){
+      int k;
+      for(k=0; k<CSV_BLOOM_K; k++){
+        int iBit = csvBloomBit(pZone->aHash[i], k, nBit);
+        aBloom[iBit/8] |= (unsigned char)(1<<(iBit%8));
+      }
+    }
+  }
+
+  sqlite3_bind_int( pStmt, 1, iCol );
+  sqlite3_bind_int( pStmt, 2, iBlock );
+  if( pZone->bInt ){
+    /* the zone of a typed column is the range of its integer values */
+    if( pZone->nInt ){
+      sqlite3_bind_int64( pStmt, 3, pZone->iMin );
+      sqlite3_bind_int64( pStmt, 4, pZone->iMax );
+    }else{
+      sqlite3_bind_null( pStmt, 3 );
+      sqlite3_bind_null( pStmt, 4 );
+    }
+  }else if( pZone->zMin ){
+    sqlite3_bind_text( pStmt, 3, pZone->zMin, pZone->nMin, SQLITE_STATIC );
+    sqlite3_bind_text( pStmt, 4, pZone->zMax, pZone->nMax, SQLITE_STATIC );
+  }else{
+    sqlite3_bind_null( pStmt, 3 );
+    sqlite3_bind_null( pStmt, 4 );
+  }
+  if( aBloom ){
+    sqlite3_bind_blob( pStmt, 5, aBloom, nBloom, sqlite3_free );
+  }else{
+    sqlite3_bind_null( pStmt, 5 );
+  }
+  sqlite3_bind_int( pStmt, 6, pZone->nNull );
+  sqlite3_step( pStmt );
+  sqlite3_free( pZone->zMin );
+  sqlite3_free( pZone->zMax );
+  pZone->zMin = pZone->zMax = 0;
+  pZone->nHash = pZone->nInt = pZone->nNull = 0;
+  return sqlite3_reset( pStmt );
+}
+
+/*
+** Build the index of table pCSV with a full scan of its file, and store it
+** in the %_file, %_block and %_zone shadow tables, which are created if
+** needed, together with the column statistics in %_stat. Set *pnRow to the
+** number of rows indexed.
+*/
+static int csvIndexBuild( CSV *pCSV, sqlite3_int64 *pnRow, char **pzErr ){
+  CSVCursor csr;
+  sqlite3_stmt *pBlock = 0;    /* INSERT INTO %_block */
+  sqlite3_stmt *pZone = 0;     /* INSERT INTO %_zone */
+  sqlite3_str *pRows = 0;      /* Row offsets of the current block */
+  CSVZone *aZone = 0;
+  CSVStatAcc *aAcc = 0;
+  sqlite3_uint64 iRand = 0;
+  sqlite3_int64 nRow = 0;
+  sqlite3_int64 iBlockOff = 0;
+  sqlite3_int64 iPrevOff = 0;
+  sqlite3_int64 iSum = 0;
+  sqlite3_int64 nSize, iMtime;
+  int nBlockRow = 0;
+  int nBlock = 0;
+  int nCol = pCSV->nColumn;
+  char *zSql;
+  int rc;
+  int i;
+
+  memset(&csr, 0, sizeof(csr));
+  csr.base.pVtab = (sqlite3_vtab *)pCSV;
+  rc = csvCursorAcquire( &csr, pzErr );
+  if( rc!=SQLITE_OK ){
+    csvCursorFree( &csr );
+    return rc;
+  }
+  pthread_mutex_lock( &csvPool.mutex );
+  nSize = pCSV->pFile->nSize;
+  iMtime = pCSV->pFile->iMtime;
+  pthread_mutex_unlock( &csvPool.mutex );
+  rc = csvChecksum( &csr, nSize, &iSum );
+
+  csvFinalizeStmts( pCSV );
+  if( rc==SQLITE_OK ){
+    zSql = sqlite3_mprintf(
+        "SAVEPOINT csv_refresh;"
+        "CREATE TABLE IF NOT EXISTS \"%w\".\"%w_file\"(size INTEGER,"
+        " mtime INTEGER, checksum INTEGER, nrow INTEGER, block_rows INTEGER);"
+        "CREATE TABLE IF NOT EXISTS \"%w\".\"%w_block\"(block INTEGER PRIMARY KEY,"
+        " offset INTEGER, nrow INTEGER, rows BLOB);"
+        "DROP TABLE IF EXISTS \"%w\".\"%w_zone\";"
+        "CREATE TABLE \"%w\".\"%w_zone\"(col INTEGER, block INTEGER,"
+        " min, max, bloom BLOB, nnull INTEGER, PRIMARY KEY(col, block))"
+        " WITHOUT ROWID;"
+        "DELETE FROM \"%w\".\"%w_file\";"
+        "DELETE FROM \"%w\".\"%w_block\";",
+        pCSV->zDb, pCSV->zName, pCSV->zDb, pCSV->zName,
+        pCSV->zDb, pCSV->zName, pCSV->zDb, pCSV->zName,
+        pCSV->zDb, pCSV->zName, pCSV->zDb, pCSV->zName);
+    rc = zSql ? sqlite3_exec( pCSV->db, zSql, 0, 0, 0 ) : SQLITE_NOMEM;
+    sqlite3_free( zSql );
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(pCSV->db));
+      csvCursorFree( &csr );
+      return rc;
+    }
+  }
+
+  /* prepare the INSERT statements */
+  for(i=0; rc==SQLITE_OK && i<2; i++){
+    static const char *azInsert[] = {
+      "INSERT INTO \"%w\".\"%w_block\" VALUES(?, ?, ?, ?)",
+      "INSERT INTO \"%w\".\"%w_zone\" VALUES(?, ?, ?, ?, ?, ?)"
+    };
+    sqlite3_stmt **ppStmt = i==0 ? &pBlock : &pZone;
+    zSql = sqlite3_mprintf(azInsert[i], pCSV->zDb, pCSV->zName);
+    rc = zSql ? sqlite3_prepare_v2( pCSV->db, zSql, -1, ppStmt, 0 ) : SQLITE_NOMEM;
+    sqlite3_free( zSql );
+  }
+  if( rc==SQLITE_OK ){
+    aZone = (CSVZone *)sqlite3_malloc64( sizeof(CSVZone)*nCol );
+    aAcc = csvStatNew( nCol );
+    pRows = sqlite3_str_new( pCSV->db );
+    if( !aZone || !aAcc ){
+      rc = SQLITE_NOMEM;
+    }else{
+      memset(aZone, 0, sizeof(CSVZone)*nCol);
+      for(i=0; i<nCol; i++){
+        aZone[i].aHash = sqlite3_malloc64(
+            sizeof(sqlite3_uint64)*SQLITE_CSV_BLOCK_ROWS );
+        aZone[i].bInt = csvIsInt( pCSV, i );
+        if( !aZone[i].aHash ) rc = SQLITE_NOMEM;
+      }
+    }
+  }
+
+  /* scan the file */
+  if( rc==SQLITE_OK ){
+    csr.nReadSize = SQLITE_CSV_READ_BUFFER;
+    csr.iLimit = -1;
+    csr.eof = 0;
+    csr.bBatch = 1;
+    csv_seek( &csr, pCSV->offsetFirstRow );
+    csvIoBegin( &csr );
+    rc = csvNext( (sqlite3_vtab_cursor *)&csr );
+  }
+  while( rc==SQLITE_OK && (!csr.eof || nBlockRow>0) ){
+    if( csr.eof || nBlockRow==SQLITE_CSV_BLOCK_ROWS ){
+      /* flush the block */
+      sqlite3_bind_int( pBlock, 1, nBlock );
+      sqlite3_bind_int64( pBlock, 2, iBlockOff );
+      sqlite3_bind_int( pBlock, 3, nBlockRow );
+      sqlite3_bind_blob( pBlock, 4, sqlite3_str_value( pRows ),
+                         sqlite3_str_length( pRows ), SQLITE_STATIC );
+      sqlite3_step( pBlock );
+      rc = sqlite3_reset( pBlock );
+      for(i=0; rc==SQLITE_OK && i<nCol; i++){
+        rc = csvZoneFlush( pZone, &aZone[i], i, nBlock, nBlockRow );
+      }
+      sqlite3_str_reset( pRows );
+      nBlock++;
+      nBlockRow = 0;
+      continue;
+    }
+    if( nBlockRow==0 ){
+      iBlockOff = iPrevOff = csr.csvpos;
+    }
+    csvPutVarint( pRows, (sqlite3_uint64)(csr.csvpos - iPrevOff) );
+    iPrevOff = csr.csvpos;
+    for(i=0; rc==SQLITE_OK && i<nCol; i++){
+      CSVZone *p = &aZone[i];
+      int n;
+      const char *z = csvCursorText( &csr, i, &n );
+      sqlite3_uint64 h;
+      if( !z ){
+        p->nNull++;
+        rc = csvStatAdd( &aAcc[i], &iRand, 0, 0, 0 );
+        continue;
+      }
+      if( p->bInt ){
+        sqlite3_int64 v;
+        if( n>0 && csvCellInt( pCSV, i, z, n, &v ) ){
+          if( p->nInt==0 || v<p->iMin ) p->iMin = v;
+          if( p->nInt==0 || v>p->iMax ) p->iMax = v;
+          p->nInt++;
+          p->aHash[p->nHash++] = csvHash( CSV_HASH_INIT, (const char *)&v,
+                                          sizeof(v) );
+        }else if( n>0 ){
+          p->bText = 1;
+        }else{
+          p->nNull++;
+        }
+        rc = csvStatAdd( &aAcc[i], &iRand, z, n, csvHash(CSV_HASH_INIT, z, n) );
+        continue;
+      }
+      if( !p->zMin || csvTextCmp(z, n, p->zMin, p->nMin)<0 ){
+        rc = csvZoneSet( &p->zMin, &p->nMin, z, n );
+      }
+      if( rc==SQLITE_OK && (!p->zMax || csvTextCmp(z, n, p->zMax, p->nMax)>0) ){
+        rc = csvZoneSet( &p->zMax, &p->nMax, z, n );
+      }
+      h = csvHash( CSV_HASH_INIT, z, n );
+      p->aHash[p->nHash++] = h;
+      if( rc==SQLITE_OK ) rc = csvStatAdd( &aAcc[i], &iRand, z, n, h );
+    }
+    nBlockRow++;
+    nRow++;
+    if( rc==SQLITE_OK ) rc = csvNext( (sqlite3_vtab_cursor *)&csr );
+  }
+  if( rc==SQLITE_OK && sqlite3_str_errcode( pRows ) ) rc = SQLITE_NOMEM;
+
+  /* column statistics and identity of the file */
+  if( rc==SQLITE_OK ){
+    rc = csvStatWrite( pCSV, aAcc, nRow );
+  }
+  if( rc==SQLITE_OK ){
+    zSql = sqlite3_mprintf(
+        "INSERT INTO \"%w\".\"%w_file\" VALUES(%lld, %lld, %lld, %lld, %d)",
+        pCSV->zDb, pCSV->zName, nSize, iMtime, iSum, nRow,
+        SQLITE_CSV_BLOCK_ROWS);
+    rc = zSql ? sqlite3_exec( pCSV->db, zSql, 0, 0, 0 ) : SQLITE_NOMEM;
+    sqlite3_free( zSql );
+  }
+  if( rc!=SQLITE_OK && !*pzErr ){
+    *pzErr = sqlite3_mprintf("%s", rc==SQLITE_NOMEM ? aErrMsg[5]
+                                   : sqlite3_errmsg(pCSV->db));
+  }
+
+  sqlite3_finalize( pBlock );
+  sqlite3_finalize( pZone );
+  sqlite3_free( sqlite3_str_finish( pRows ) );
+  for(i=0; aZone && i<nCol; i++){
+    sqlite3_free( aZone[i].zMin );
+    sqlite3_free( aZone[i].zMax );
+    sqlite3_free( aZone[i].aHash );
+  }
+  sqlite3_free( aZone );
+  csvStatFreeAcc( aAcc, nCol );
+
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_exec( pCSV->db, "RELEASE csv_refresh", 0, 0, 0 );
+  }else{
+    sqlite3_exec( pCSV->db, "ROLLBACK TO csv_refresh; RELEASE csv_refresh",
+                  0, 0, 0 );
+  }
+  if( rc==SQLITE_OK ){
+    pCSV->nScanRow = nRow;
+    rc = csvIndexLoad( pCSV );
+    if( rc==SQLITE_OK ) rc = csvStatLoad( pCSV );
+    csvIndexCheck( &csr, nSize, iMtime );
+    pCSV->iIndexGeneration = pCSV->iGeneration;
+  }
+  csvCursorFree( &csr );
+  *pnRow = nRow;
+  return rc;
+}
+
+
+/*
+** Compute the column statistics of table pCSV with a full scan of its
+** file, and store them in the %_stat shadow table, which is created if
+** needed. Set *pnRow to the number of rows scanned.
+*/
+static int csvStatScan( CSV *pCSV, sqlite3_int64 *pnRow, char **pzErr ){
+  CSVCursor csr;
+  CSVStatAcc *aAcc;
+  sqlite3_uint64 iRand = 0;
+  sqlite3_int64 nRow = 0;
+  int nCol = pCSV->nColumn;
+  int rc;
+  int i;
+
+  memset(&csr, 0, sizeof(csr));
+  csr.base.pVtab = (sqlite3_vtab *)pCSV;
+  rc = csvCursorAcquire( &csr, pzErr );
+  if( rc!=SQLITE_OK ){
+    csvCursorFree( &csr );
+    return rc;
+  }
+  aAcc = csvStatNew( nCol );
+  if( !aAcc ) rc = SQLITE_NOMEM;
+
+  if( rc==SQLITE_OK ){
+    csr.nReadSize = SQLITE_CSV_READ_BUFFER;
+    csr.iLimit = -1;
+    csr.eof = 0;
+    csr.bBatch = 1;
+    csv_seek( &csr, pCSV->offsetFirstRow );
+    csvIoBegin( &csr );
+    rc = csvNext( (sqlite3_vtab_cursor *)&csr );
+  }
+  while( rc==SQLITE_OK && !csr.eof ){
+    for(i=0; rc==SQLITE_OK && i<nCol; i++){
+      int n;
+      const char *z = csvCursorText( &csr, i, &n );
+      rc = csvStatAdd( &aAcc[i], &iRand, z, n,
+                       z ? csvHash( CSV_HASH_INIT, z, n ) : 0 );
+    }
+    nRow++;
+    if( rc==SQLITE_OK ) rc = csvNext( (sqlite3_vtab_cursor *)&csr );
+  }
+
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_exec( pCSV->db, "SAVEPOINT csv_analyze", 0, 0, 0 );
+    if( rc==SQLITE_OK ){
+      rc = csvStatWrite( pCSV, aAcc, nRow );
+      if( rc==SQLITE_OK ){
+        rc = sqlite3_exec( pCSV->db, "RELEASE csv_analyze", 0, 0, 0 );
+      }else{
+        sqlite3_exec( pCSV->db, "ROLLBACK TO csv_analyze; RELEASE csv_analyze",
+                      0, 0, 0 );
+      }
+    }
+  }
+  if( rc!=SQLITE_OK && !*pzErr ){
+    *pzErr = sqlite3_mprintf("%s", rc==SQLITE_NOMEM ? aErrMsg[5]
+                                   : sqlite3_errmsg(pCSV->db));
+  }
+  csvStatFreeAcc( aAcc, nCol );
+  csvCursorFree( &csr );
+
+  if( rc==SQLITE_OK ){
+    pCSV->nScanRow = nRow;
+    rc = csvStatLoad( pCSV );
+  }
+  *pnRow = nRow;
+  return rc;
+}
+
+
+/*
+** Evict the unpinned caches of lowest priority until nByte more bytes fit
+** in the budget and under the soft heap limit. Called with csvMem.mutex
+** held. Return true if they fit.
+*/
+static int csvCacheEvict( sqlite3_int64 nByte ){
+  while( 1 ){
+    sqlite3_int64 nLimit = sqlite3_soft_heap_limit64( -1 );
+    CSVCache **pp, **ppMin = 0;
+    CSVCache *p;
+    if( (csvMem.nBudget<=0 || csvMem.nUsed+nByte<=csvMem.nBudget)
+     && (nLimit<=0 || sqlite3_memory_used()+nByte<=nLimit)
+    ){
+      return 1;
+    }
+    for(pp=&csvMem.pCaches; *pp; pp=&(*pp)->pNext){
+      if( (*pp)->nPin==0 && (!ppMin || (*pp)->rPrio<(*ppMin)->rPrio) ){
+        ppMin = pp;
+      }
+    }
+    if( !ppMin ) return 0;
+    p = *ppMin;
+    *ppMin = p->pNext;
+    csvMem.nUsed -= p->nByte;
+    csvMem.nCache--;
+    csvMem.nEvict++;
+    if( p->rPrio>csvMem.rClock ) csvMem.rClock = p->rPrio;
+    p->nByte = 0;
+    p->xFree( p->pCSV );
+  }
+}
+
+/*
+** Charge cache p, about to be built with nByte bytes from nCost bytes of
+** file, to the budget, evicting other caches if needed, and pin it for the
+** caller. Return SQLITE_OK, or SQLITE_FULL if there is no room for it.
+*/
+static int csvCacheCharge(
+  CSVCache *p,
+  sqlite3_int64 nByte,
+  sqlite3_int64 nCost
+){
+  int rc = SQLITE_FULL;
+  pthread_mutex_lock( &csvMem.mutex );
+  if( p->nByte==0 && nByte>0 && csvCacheEvict( nByte ) ){
+    p->nByte = nByte;
+    p->nCost = nCost;
+    p->rPrio = csvMem.rClock + (double)nCost/(double)nByte;
+    p->nPin++;
+    p->pNext = csvMem.pCaches;
+    csvMem.pCaches = p;
+    csvMem.nUsed += nByte;
+    csvMem.nCache++;
+    rc = SQLITE_OK;
+  }else{
+    csvMem.nRefuse++;
+  }
+  pthread_mutex_unlock( &csvMem.mutex );
+  return rc;
+}
+
+/*
+** Pin cache p for a cursor, if it is built. Return true if it was. Using
+** a cache raises its priority.
+*/
+static int csvCachePin( CSVCache *p ){
+  int bPin;
+  pthread_mutex_lock( &csvMem.mutex );
+  bPin = p->nByte>0;
+  if( bPin ){
+    p->nPin++;
+    p->rPrio = csvMem.rClock + (double)p->nCost/(double)p->nByte;
+  }
+  pthread_mutex_unlock( &csvMem.mutex );
+  return bPin;
+}
+
+/*
+** Unpin cache p, pinned by csvCachePin() or csvCacheCharge().
+*/
+static void csvCacheUnpin( CSVCache *p ){
+  pthread_mutex_lock( &csvMem.mutex );
+  p->nPin--;
+  pthread_mutex_unlock( &csvMem.mutex );
+}
+
+/*
+** Free cache p and uncharge it from the budget, unless a cursor still has
+** it pinned. Return SQLITE_OK, or SQLITE_BUSY if it is pinned.
+*/
+static int csvCacheRelease( CSVCache *p ){
+  CSVCache **pp;
+  pthread_mutex_lock( &csvMem.mutex );
+  if( p->nPin>0 ){
+    pthread_mutex_unlock( &csvMem.mutex );
+    return SQLITE_BUSY;
+  }
+  if( p->nByte>0 ){
+    for(pp=&csvMem.pCaches; *pp!=p; pp=&(*pp)->pNext);
+    *pp = p->pNext;
+    csvMem.nUsed -= p->nByte;
+    csvMem.nCache--;
+    p->nByte = 0;
+  }
+  p->xFree( p->pCSV );
+  pthread_mutex_unlock( &csvMem.mutex );
+  return SQLITE_OK;
+}
+
+/*
+** Free the hash index of the KEY column of table pCSV, if any. This is the
+** xFree of pCSV->keyCache, called with csvMem.mutex held.
+*/
+static void csvKeyFree( CSV *pCSV ){
+  if( pCSV->eKeyMap!=CSV_MAP_HEAP ){
+    csv_unmap( pCSV->aKey, sizeof(sqlite3_uint64)*pCSV->nKeySlot );
+  }else{
+    sqlite3_free( pCSV->aKey );
+  }
+  pCSV->aKey = 0;
+  pCSV->eKeyMap = CSV_MAP_HEAP;
+  pCSV->nKeySlot = 0;
+  pCSV->nKeyEntry = 0;
+}
+
+/*
+** Build the hash index of the KEY column of table pCSV with a full scan of
+** its file. The (hash, offset) pairs are collected first, so that the
+** table can be sized for a load factor of at most 3/4. If some row is too
+** far into the file for its offset to fit in a slot, or if there is no room
+** for the index in the memory budget, no index is built and pCSV->aKey is
+** left NULL. An index that is built is left pinned for the caller.
+**
+** Return SQLITE_BUSY, without building anything, if another cursor still
+** probes the index of the previous version of the file: it is freed only
+** once no cursor uses it.
+*/
+static int csvKeyBuild( CSV *pCSV, char **pzErr ){
+  CSVCursor csr;
+  sqlite3_uint64 *aPair = 0;   /* Hash and offset of each row */
+  sqlite3_int64 nPair = 0;
+  sqlite3_int64 nAlloc = 0;
+  sqlite3_int64 nSlot;
+  sqlite3_int64 i;
+  int rc;
+
+  if( csvCacheRelease( &pCSV->keyCache )!=SQLITE_OK ) return SQLITE_BUSY;
+
+  memset(&csr, 0, sizeof(csr));
+  csr.base.pVtab = (sqlite3_vtab *)pCSV;
+  rc = csvCursorAcquire( &csr, pzErr );
+  if( rc==SQLITE_OK ){
+    csr.nReadSize = SQLITE_CSV_READ_BUFFER;
+    csr.iLimit = -1;
+    csr.eof = 0;
+    csr.bBatch = 1;
+    csv_seek( &csr, pCSV->offsetFirstRow );
+    csvIoBegin( &csr );
+    rc = csvNext( (sqlite3_vtab_cursor *)&csr );
+  }
+  while( rc==SQLITE_OK && !csr.eof ){
+    int n;
+    const char *z = csvCursorText( &csr, pCSV->iKeyCol, &n );
+    if( (sqlite3_uint64)csr.csvpos>=CSV_KEY_OFFSET_MASK ){
+      /* too large a file */
+      nPair = -1;
+      break;
+    }
+    if( z ){
+      if( nPair>=nAlloc ){
+        sqlite3_uint64 *aNew;
+        nAlloc = nAlloc ? nAlloc*2 : 4096;
+        aNew = sqlite3_realloc64( aPair, sizeof(sqlite3_uint64)*2*nAlloc );
+        if( !aNew ){
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        aPair = aNew;
+      }
+      aPair[nPair*2] = csvMix( csvHash( CSV_HASH_INIT, z, n ) );
+      aPair[nPair*2+1] = (sqlite3_uint64)csr.csvpos;
+      nPair++;
+    }
+    rc = csvNext( (sqlite3_vtab_cursor *)&csr );
+  }
+  csvCursorFree( &csr );
+
+  if( rc==SQLITE_OK && nPair>=0 ){
+    sqlite3_int64 nByte;
+    for(nSlot=1024; nSlot*3<nPair*4; nSlot*=2);
+    nByte = sizeof(sqlite3_uint64)*nSlot;
+    if( csvCacheCharge( &pCSV->keyCache, nByte, pCSV->nFileSize )!=SQLITE_OK ){
+      /* no room: lookups scan the file */
+    }else{
+      pCSV->eKeyMap = CSV_MAP_HEAP;
+      pCSV->aKey = (sqlite3_uint64 *)csv_map( nByte, pCSV->eHugePages,
+                                              &pCSV->eKeyMap );
+      if( !pCSV->aKey ){
+        pCSV->aKey = (sqlite3_uint64 *)sqlite3_malloc64( nByte );
+        if( pCSV->aKey ) memset(pCSV->aKey, 0, nByte);
+      }
+    }
+    if( !pCSV->aKey ){
+      if( pCSV->keyCache.nByte>0 ){
+        csvCacheUnpin( &pCSV->keyCache );
+        csvCacheRelease( &pCSV->keyCache );
+        rc = SQLITE_NOMEM;
+      }
+    }else{
+      for(i=0; i<nPair; i++){
+        sqlite3_uint64 h = aPair[i*2];
+        sqlite3_int64 iSlot = (sqlite3_int64)(h & (sqlite3_uint64)(nSlot-1));
+        while( pCSV->aKey[iSlot] ) iSlot = (iSlot+1) & (nSlot-1);
+        pCSV->aKey[iSlot] = (h & ~CSV_KEY_OFFSET_MASK) | (aPair[i*2+1]+1);
+      }
+      pCSV->nKeySlot = nSlot;
+      pCSV->nKeyEntry = nPair;
+      pCSV->iKeyGeneration = pCSV->iGeneration;
+    }
+  }
+  sqlite3_free( aPair );
+  if( rc==SQLITE_NOMEM && !*pzErr ){
+    *pzErr = sqlite3_mprintf("%s", aErrMsg[5]);
+  }
+  return rc;
+}
+
+/*
+** Return the offset of the next row of the hash index whose key has the
+** hash of the key looked up by cursor pCsr, or -1 if there is none. The
+** rows of a key are found in the order of the file.
+*/
+static sqlite3_int64 csvKeyProbe( CSVCursor *pCsr ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_uint64 iTag = pCsr->iKeyHash & ~CSV_KEY_OFFSET_MASK;
+  sqlite3_int64 mSlot = pCSV->nKeySlot-1;
+  while( 1 ){
+    sqlite3_uint64 w = pCSV->aKey[pCsr->iKeySlot & mSlot];
+    if( w==0 ) return -1;
+    pCsr->iKeySlot = (pCsr->iKeySlot+1) & mSlot;
+    if( (w & ~CSV_KEY_OFFSET_MASK)==iTag ){
+      return (sqlite3_int64)(w & CSV_KEY_OFFSET_MASK) - 1;
+    }
+  }
+}
+
+/*
+** Set up cursor pCsr to return the rows whose KEY column is pVal, building
+** the hash index first if there is none for the current file. If no index
+** can be built, fall back to a full scan: the constraint is checked by
+** SQLite anyway. The index stays pinned until csvKeyUnpin().
+*/
+static int csvKeyFilter( CSVCursor *pCsr, sqlite3_value *pVal, char **pzErr ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  const char *z;
+  int n;
+  int rc = SQLITE_OK;
+  int bPin = csvCachePin( &pCSV->keyCache );
+
+  if( bPin && pCSV->iKeyGeneration!=pCSV->iGeneration ){
+    csvCacheUnpin( &pCSV->keyCache );
+    bPin = 0;
+  }
+  if( !bPin ){
+    rc = csvKeyBuild( pCSV, pzErr );
+    if( rc==SQLITE_OK ){
+      bPin = pCSV->aKey!=0;
+    }else if( rc==SQLITE_BUSY ){
+      /* the index of the old file is still in use: scan this time */
+      rc = SQLITE_OK;
+    }else{
+      return rc;
+    }
+  }
+  if( !bPin ){
+    pCsr->nReadSize = SQLITE_CSV_READ_BUFFER;
+    csv_seek( pCsr, pCSV->offsetFirstRow );
+    return SQLITE_OK;
+  }
+  pCsr->bKeyPin = 1;
+  if( sqlite3_value_type( pVal )==SQLITE_NULL ){
+    pCsr->eof = -1;
+    return SQLITE_OK;
+  }
+  z = (const char *)sqlite3_value_text( pVal );
+  n = sqlite3_value_bytes( pVal );
+  pCsr->zKey = sqlite3_malloc( n+1 );
+  if( !z || !pCsr->zKey ) return SQLITE_NOMEM;
+  memcpy(pCsr->zKey, z, n+1);
+  pCsr->nKey = n;
+  pCsr->iKeyHash = csvMix( csvHash( CSV_HASH_INIT, z, n ) );
+  pCsr->iKeySlot = (sqlite3_int64)(pCsr->iKeyHash
+                                   & (sqlite3_uint64)(pCSV->nKeySlot-1));
+  pCsr->nReadSize = SQLITE_CSV_LOOKUP_READ;
+  return SQLITE_OK;
+}
+
+/*
+** Unpin the KEY hash index, if pinned by csvKeyFilter() for cursor pCsr.
+*/
+static void csvKeyUnpin( CSVCursor *pCsr ){
+  if( pCsr->bKeyPin ){
+    csvCacheUnpin( &((CSV *)pCsr->base.pVtab)->keyCache );
+    pCsr->bKeyPin = 0;
+  }
+}
+
+
+/*
+** Load the column indexes of table pCSV from its %_colidx shadow table, if
+** csv_create_index() built any. Like the index of csv_refresh(), they are
+** only used once the file has been found to match them, by
+** csvIndexCheck().
+*/
+static int csvColIdxLoad( CSV *pCSV ){
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
+  int nAlloc = 0;
+
+  sqlite3_free( pCSV->aColIdx );
+  pCSV->aColIdx = 0;
+  pCSV->nColIdx = 0;
+  pCSV->iIndexGeneration = 0;
+
+  zSql = sqlite3_mprintf(
+      "SELECT col, size, mtime, checksum, nrow, nnull"
+      " FROM \"%w\".\"%w_colidx\" ORDER BY col",
+      pCSV->zDb, pCSV->zName);
+  if( !zSql ) return SQLITE_NOMEM;
+  if( sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 )!=SQLITE_OK ){
+    /* no column index */
+    sqlite3_free( zSql );
+    return SQLITE_OK;
+  }
+  sqlite3_free( zSql );
+  while( sqlite3_step( pStmt )==SQLITE_ROW ){
+    CSVColIdx *p;
+    if( pCSV->nColIdx>=nAlloc ){
+      CSVColIdx *aNew;
+      nAlloc = nAlloc ? nAlloc*2 : 4;
+      aNew = (CSVColIdx *)sqlite3_realloc( pCSV->aColIdx,
+                                           sizeof(CSVColIdx)*nAlloc );
+      if( !aNew ){
+        sqlite3_finalize( pStmt );
+        return SQLITE_NOMEM;
+      }
+      pCSV->aColIdx = aNew;
+    }
+    p = &pCSV->aColIdx[pCSV->nColIdx++];
+    p->iCol = sqlite3_column_int( pStmt, 0 );
+    p->bValid = 0;
+    p->nSize = sqlite3_column_int64( pStmt, 1 );
+    p->iMtime = sqlite3_column_int64( pStmt, 2 );
+    p->iChecksum = sqlite3_column_int64( pStmt, 3 );
+    p->nRow = sqlite3_column_int64( pStmt, 4 );
+    p->nNull = sqlite3_column_int64( pStmt, 5 );
+  }
+  return sqlite3_finalize( pStmt );
+}
+
+/*
+** Return the column index of column iCol of table pCSV, or NULL if there
+** is none.
+*/
+static CSVColIdx *csvColIdxFind( CSV *pCSV, int iCol ){
+  int i;
+  for(i=0; i<pCSV->nColIdx; i++){
+    if( pCSV->aColIdx[i].iCol==iCol ) return &pCSV->aColIdx[i];
+  }
+  return 0;
+}
+
+/*
+** Check the column indexes of table pCSV against its file, if the file
+** changed since they were last checked, so that queries are not planned
+** with an index that is out of date. This costs a stat() of the file.
+*/
+static void csvColIdxCheck( CSV *pCSV ){
+  CSVCursor csr;
+  char *zErr = 0;
+  int i;
+
+  memset(&csr, 0, sizeof(csr));
+  csr.base.pVtab = (sqlite3_vtab *)pCSV;
+  if( csvCursorAcquire( &csr, &zErr )!=SQLITE_OK ){
+    for(i=0; i<pCSV->nColIdx; i++) pCSV->aColIdx[i].bValid = 0;
+  }
+  sqlite3_free( zErr );
+  csvCursorFree( &csr );
+}
+
+/*
+** Build the sorted index of column iCol of table pCSV, whose name is zCol,
+** and store it in the %_colidx and %_colkey shadow tables, which are
+** created if needed. The entries are inserted by an INSERT ... SELECT from
+** the table itself, in the order of the external merge sort of SQLite:
+** memory use is bounded by the page cache, and the sort uses worker
+** threads as allowed by PRAGMA threads. Rows without the column are not
+** indexed. Set *pnRow to the number of rows indexed.
+*/
+static int csvColIdxBuild(
+  CSV *pCSV,
+  int iCol,
+  const char *zCol,
+  sqlite3_int64 *pnRow,
+  char **pzErr
+){
+  CSVCursor csr;
+  sqlite3_int64 nSize, iMtime;
+  sqlite3_int64 iSum = 0;
+  sqlite3_int64 nRow = 0;
+  CSVColIdx *p;
+  char *zSql;
+  int rc;
+
+  /* identity of the file the index is built from */
+  memset(&csr, 0, sizeof(csr));
+  csr.base.pVtab = (sqlite3_vtab *)pCSV;
+  rc = csvCursorAcquire( &csr, pzErr );
+  if( rc==SQLITE_OK ){
+    pthread_mutex_lock( &csvPool.mutex );
+    nSize = pCSV->pFile->nSize;
+    iMtime = pCSV->pFile->iMtime;
+    pthread_mutex_unlock( &csvPool.mutex );
+    rc = csvChecksum( &csr, nSize, &iSum );
+  }
+  csvCursorFree( &csr );
+  if( rc!=SQLITE_OK ){
+    if( !*pzErr ) *pzErr = sqlite3_mprintf("%s", sqlite3_errstr(rc));
+    return rc;
+  }
+
+  /* forget the index being replaced, so that the scan does not read it */
+  p = csvColIdxFind( pCSV, iCol );
+  if( p ){
+    *p = pCSV->aColIdx[--pCSV->nColIdx];
+  }
+
+  zSql = sqlite3_mprintf(
+      "SAVEPOINT csv_index;"
+      "CREATE TABLE IF NOT EXISTS \"%w\".\"%w_colidx\"(col INTEGER PRIMARY KEY,"
+      " size INTEGER, mtime INTEGER, checksum INTEGER, nrow INTEGER,"
+      " nnull INTEGER);"
+      "CREATE TABLE IF NOT EXISTS \"%w\".\"%w_colkey\"(col INTEGER, key,"
+      " offset INTEGER, PRIMARY KEY(col, key, offset)) WITHOUT ROWID;"
+      "DELETE FROM \"%w\".\"%w_colidx\" WHERE col=%d;"
+      "DELETE FROM \"%w\".\"%w_colkey\" WHERE col=%d;"
+      "INSERT INTO \"%w\".\"%w_colkey\" SELECT %d, \"%w\", rowid"
+      " FROM \"%w\".\"%w\" WHERE \"%w\" IS NOT NULL ORDER BY 2, 3;",
+      pCSV->zDb, pCSV->zName, pCSV->zDb, pCSV->zName,
+      pCSV->zDb, pCSV->zName, iCol, pCSV->zDb, pCSV->zName, iCol,
+      pCSV->zDb, pCSV->zName, iCol, zCol, pCSV->zDb, pCSV->zName, zCol);
+  rc = zSql ? sqlite3_exec( pCSV->db, zSql, 0, 0, 0 ) : SQLITE_NOMEM;
+  sqlite3_free( zSql );
+  if( rc==SQLITE_OK ){
+    /* the INSERT read every row, which set pCSV->nScanRow */
+    sqlite3_int64 nNull;
+    nRow = sqlite3_changes64( pCSV->db );
+    nNull = pCSV->nScanRow>nRow ? pCSV->nScanRow-nRow : 0;
+    zSql = sqlite3_mprintf(
+        "INSERT INTO \"%w\".\"%w_colidx\" VALUES(%d, %lld, %lld, %lld, %lld, %lld)",
+        pCSV->zDb, pCSV->zName, iCol, nSize, iMtime, iSum, nRow+nNull, nNull);
+    rc = zSql ? sqlite3_exec( pCSV->db, zSql, 0, 0, 0 ) : SQLITE_NOMEM;
+    sqlite3_free( zSql );
+  }
+  if( rc!=SQLITE_OK && !*pzErr ){
+    *pzErr = sqlite3_mprintf("%s", rc==SQLITE_NOMEM ? aErrMsg[5]
+                                   : sqlite3_errmsg(pCSV->db));
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_exec( pCSV->db, "RELEASE csv_index", 0, 0, 0 );
+  }else{
+    sqlite3_exec( pCSV->db, "ROLLBACK TO csv_index; RELEASE csv_index",
+                  0, 0, 0 );
+  }
+  {
+    int rc2 = csvColIdxLoad( pCSV );
+    if( rc==SQLITE_OK ) rc = rc2;
+  }
+  if( rc==SQLITE_OK ) csvColIdxCheck( pCSV );
+  *pnRow = nRow;
+  return rc;
+}
+
+/*
+** Set up cursor pCsr for a CSV_PLAN_INDEX scan, as described by idxStr
+** (see csvBestIndex()): return the rows whose offsets are read from the
+** index of a column, in its order, between the bounds in argv[]. If the
+** file changed since the index was built, fall back to a full scan, since
+** SQLite checks the constraints anyway, unless the plan relies on the
+** order of the rows.
+*/
+static int csvColIdxFilter(
+  CSVCursor *pCsr,
+  const char *idxStr,
+  int argc, sqlite3_value **argv,
+  char **pzErr
+){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  const char *z = strstr(idxStr, "idx=");
+  int iCol = z ? atoi(&z[4]) : -1;
+  CSVColIdx *p = csvColIdxFind( pCSV, iCol );
+  int rc = SQLITE_OK;
+  int i;
+
+  if( !p || !p->bValid ){
+    if( strstr(idxStr, ";order=") ){
+      *pzErr = sqlite3_mprintf(
+          "index on column %d of CSV table %s is out of date", iCol+1,
+          pCSV->zName);
+      return SQLITE_ERROR;
+    }
+    pCsr->bFullScan = 1;
+    pCsr->nReadSize = SQLITE_CSV_READ_BUFFER;
+    csv_seek( pCsr, pCSV->offsetFirstRow );
+    return SQLITE_OK;
+  }
+
+  if( !pCsr->pIdxStmt ){
+    /* the plan of a cursor does not change: prepare its query once */
+    const char *zDir = strstr(idxStr, ";order=desc") ? " DESC" : "";
+    sqlite3_str *pStr = sqlite3_str_new( pCSV->db );
+    sqlite3_str_appendf(pStr,
+        "SELECT offset FROM \"%w\".\"%w_colkey\" WHERE col=%d",
+        pCSV->zDb, pCSV->zName, iCol);
+    z = strstr(idxStr, "cons=");
+    if( z ) z += 5;
+    for(i=0; z && *z && *z!=';' && i<argc; i++){
+      int n = (int)strcspn(z, ",;");
+      const char *zOp = z + strspn(z, "0123456789");
+      sqlite3_str_appendf(pStr, " AND key%.*s?%d", n-(int)(zOp-z), zOp, i+1);
+      z += n;
+      if( *z==',' ) z++;
+    }
+    sqlite3_str_appendf(pStr, " ORDER BY key%s, offset%s", zDir, zDir);
+    z = sqlite3_str_finish( pStr );
+    rc = z ? sqlite3_prepare_v2( pCSV->db, z, -1, &pCsr->pIdxStmt, 0 )
+           : SQLITE_NOMEM;
+    sqlite3_free( (char *)z );
+    if( rc!=SQLITE_OK ){
+      *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(pCSV->db));
+      return rc;
+    }
+  }
+  sqlite3_reset( pCsr->pIdxStmt );
+  for(i=0; rc==SQLITE_OK && i<argc; i++){
+    rc = sqlite3_bind_value( pCsr->pIdxStmt, i+1, argv[i] );
+  }
+  pCsr->bIndexScan = 1;
+  pCsr->nReadSize = SQLITE_CSV_LOOKUP_READ;
+  return rc;
+}
+
+
+/*
+** Return the offset of the next row that the lookup scan of cursor pCsr
+** (a column index, KEY or rowid IN list scan) reads, or -1 if there are no
+** more. If an error occurs, set *pRc.
+*/
+static sqlite3_int64 csvLookupOffset( CSVCursor *pCsr, int *pRc ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  if( pCsr->bIndexScan ){
+    int rc = sqlite3_step( pCsr->pIdxStmt );
+    if( rc==SQLITE_ROW ) return sqlite3_column_int64( pCsr->pIdxStmt, 0 );
+    rc = sqlite3_reset( pCsr->pIdxStmt );
+    if( rc!=SQLITE_OK ){
+      sqlite3_free( pCSV->base.zErrMsg );
+      pCSV->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(pCSV->db));
+      *pRc = rc;
+    }
+    return -1;
+  }
+  if( pCsr->zKey ){
+    return csvKeyProbe( pCsr );
+  }
+  if( pCsr->iRowidOff<pCsr->nRowidOff ){
+    return pCsr->aRowidOff[pCsr->iRowidOff++];
+  }
+  return -1;
+}
+
+/*
+** Extend read p, issued for a rowid of the sorted IN list of cursor pCsr,
+** to cover the rowids that follow it in the list as long as they are less
+** than two pages apart, and the read fits in nPage pages.
+*/
+static void csvRowidSpan( CSVCursor *pCsr, CSVIoJob *p, int nPage ){
+  sqlite3_int64 iFirst = p->iOff;
+  sqlite3_int64 iLast = p->iOff;
+  int i;
+
+  for(i=pCsr->iRowidOff; i<pCsr->nRowidOff; i++){
+    sqlite3_int64 iOff = pCsr->aRowidOff[i];
+    sqlite3_int64 iLo = iOff<iFirst ? iOff : iFirst;
+    sqlite3_int64 iHi = iOff>iLast ? iOff : iLast;
+    if( iOff-iLast>=2*SQLITE_CSV_LOOKUP_READ
+     || iFirst-iOff>=2*SQLITE_CSV_LOOKUP_READ
+     || iHi-iLo+SQLITE_CSV_LOOKUP_READ>(sqlite3_int64)nPage*SQLITE_CSV_LOOKUP_READ
+    ){
+      break;
+    }
+    iFirst = iLo;
+    iLast = iHi;
+  }
+  p->iRead = iFirst;
+  p->nRead = (int)(iLast - iFirst) + SQLITE_CSV_LOOKUP_READ;
+}
+
+/*
+** Position cursor pCsr at the next row of its lookup scan, or set *pbEof
+** if there is none. The reads of the rows that follow are issued ahead,
+** up to SQLITE_CSV_IO_DEPTH of them, and complete in any order; they are
+** consumed in the order of the lookups. A row within the bytes read for
+** the one before is not read again.
+**
+** The reads go to the SQLITE_CSV_IO_DEPTH pages of the cursor, used in
+** turn. The rowids of an IN list are sorted, so the rows that follow
+** closely are read at once, into as many consecutive pages as needed up
+** to SQLITE_CSV_READ_BUFFER bytes, and then parsed in a single forward
+** sweep of the buffer.
+*/
+static int csvLookupNext( CSVCursor *pCsr, int *pbEof ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  int rc = SQLITE_OK;
+
+  if( !pCsr->aJob ){
+    pCsr->aJob = (CSVIoJob *)sqlite3_malloc( sizeof(CSVIoJob)*SQLITE_CSV_IO_DEPTH );
+    pCsr->aJobBuf = (char *)sqlite3_malloc( SQLITE_CSV_LOOKUP_READ*SQLITE_CSV_IO_DEPTH );
+    if( !pCsr->aJob || !pCsr->aJobBuf ) return SQLITE_NOMEM;
+    memset(pCsr->aJob, 0, sizeof(CSVIoJob)*SQLITE_CSV_IO_DEPTH);
+  }
+  if( !csvCursorBuffer( pCsr ) ) return SQLITE_NOMEM;
+
+  while( 1 ){
+    CSVIoJob *p;
+
+    /* issue the reads of the lookups that follow */
+    while( pCsr->nJob<SQLITE_CSV_IO_DEPTH && pCsr->nPage<SQLITE_CSV_IO_DEPTH
+        && !pCsr->bLookupEof
+    ){
+      int i = (pCsr->iJob+pCsr->nJob) % SQLITE_CSV_IO_DEPTH;
+      sqlite3_int64 iRow = csvLookupOffset( pCsr, &rc );
+      if( iRow<0 ){
+        pCsr->bLookupEof = 1;
+        break;
+      }
+      p = &pCsr->aJob[i];
+      p->iOff = iRow;
+      if( pCsr->iJobRead>=0 && p->iOff>=pCsr->iJobRead
+       && p->iOff<pCsr->iJobRead+pCsr->nJobRead
+      ){
+        p->eState = CSV_JOB_SHARED;
+      }else{
+        /* the free pages that follow iPage, without wrapping around */
+        int nFree = SQLITE_CSV_IO_DEPTH - pCsr->iPage;
+        if( nFree>SQLITE_CSV_IO_DEPTH-pCsr->nPage ){
+          nFree = SQLITE_CSV_IO_DEPTH - pCsr->nPage;
+        }
+        if( nFree>SQLITE_CSV_READ_BUFFER/SQLITE_CSV_LOOKUP_READ ){
+          nFree = SQLITE_CSV_READ_BUFFER/SQLITE_CSV_LOOKUP_READ;
+        }
+        p->fd = pCsr->pHandle->fd;
+        p->aBuf = &pCsr->aJobBuf[pCsr->iPage*SQLITE_CSV_LOOKUP_READ];
+        p->iRead = p->iOff;
+        p->nRead = SQLITE_CSV_LOOKUP_READ;
+        if( pCsr->aRowidOff ){
+          csvRowidSpan( pCsr, p, nFree );
+        }
+        p->nPage = (p->nRead + SQLITE_CSV_LOOKUP_READ - 1)/SQLITE_CSV_LOOKUP_READ;
+        pCsr->iPage = (pCsr->iPage + p->nPage) % SQLITE_CSV_IO_DEPTH;
+        pCsr->nPage += p->nPage;
+        p->n = 0;
+        csvIoSubmit( p );
+        pCsr->iJobRead = p->iRead;
+        pCsr->nJobRead = p->nRead;
+      }
+      pCsr->nJob++;
+    }
+    if( rc!=SQLITE_OK ) return rc;
+    if( pCsr->nJob==0 ){
+      *pbEof = 1;
+      return SQLITE_OK;
+    }
+
+    /* take the first one */
+    p = &pCsr->aJob[pCsr->iJob];
+    pCsr->iJob = (pCsr->iJob+1) % SQLITE_CSV_IO_DEPTH;
+    pCsr->nJob--;
+    if( p->eState!=CSV_JOB_SHARED ){
+      csvIoWait( p, 0 );
+      pCsr->nPage -= p->nPage;
+      if( p->n>0 ){
+        memcpy(pCsr->aBuf, p->aBuf, p->n);
+        pCsr->iBufOff = p->iRead;
+        pCsr->nData = p->n;
+        pCsr->iPos = 0;
+        pCSV->nReadByte += p->n;
+      }
+    }
+    csv_seek( pCsr, p->iOff );
+    return SQLITE_OK;
+  }
+}
+
+
+/*
+** Keep only those of the *pn sorted offsets of aOff[] at which a scan of
+** the table starts a row, and set *pn to their number. This is for tables
+** without a valid index: a line that starts inside a quoted value spanning
+** several lines is not a row, so the rows are read and split from the
+** first one up to the last offset. A malformed record ends at the next
+** line, as in csvMalformed().
+*/
+static int csvRowStarts( CSVCursor *pCsr, sqlite3_int64 *aOff, int *pn ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  int nReadSize = pCsr->nReadSize;
+  int n = *pn;
+  int i = 0, j = 0;
+  int rc = csvBatchAlloc( pCsr );
+
+  pCsr->nReadSize = SQLITE_CSV_READ_BUFFER;
+  csv_seek( pCsr, pCSV->offsetFirstRow );
+  while( rc==SQLITE_OK ){
+    sqlite3_int64 iRow = csv_tell( pCsr );
+    const char *zBad = 0;
+    int iEnd;
+    while( i<n && aOff[i]<iRow ) i++;
+    if( i<n && aOff[i]==iRow ) aOff[j++] = aOff[i++];
+    if( i>=n ) break;
+    iEnd = csv_readline( pCsr, 0 );
+    if( iEnd==0 ) break;
+    if( iEnd<0 ){
+      if( !pCsr->bTooLong ){
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      pCsr->bTooLong = 0;
+      zBad = "row too long";
+    }else{
+      rc = csvBatchRow( pCsr, 0, 0, iEnd, &zBad );
+    }
+    if( zBad ){
+      csv_seek( pCsr, iRow );
+      csvSkipLine( pCsr );
+    }
+  }
+  pCsr->nReadSize = nReadSize;
+  *pn = j;
+  return rc;
+}
+
+/*
+** Set up cursor pCsr to return the rows whose rowids are in the IN list
+** pList, all at once (see sqlite3_vtab_in()). The values that are not
+** the rowid of a row are dropped, as checked by the index or by
+** csvRowStarts(). The rowids are sorted and duplicates dropped, so that
+** the reads move forward through the file, or backward if bDesc is true
+** (for ORDER BY rowid DESC).
+*/
+static int csvRowidList( CSVCursor *pCsr, sqlite3_value *pList, int bDesc ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_value *pVal = 0;
+  int nAlloc = 0;
+  int rc;
+
+  pCsr->nRowidOff = pCsr->iRowidOff = 0;
+  for(rc=sqlite3_vtab_in_first(pList, &pVal);
+      rc==SQLITE_OK;
+      rc=sqlite3_vtab_in_next(pList, &pVal)
+  ){
+    sqlite3_int64 iOff;
+    if( sqlite3_value_numeric_type(pVal)!=SQLITE_INTEGER ) continue;
+    iOff = sqlite3_value_int64(pVal);
+    if( iOff<pCSV->offsetFirstRow || iOff>=pCSV->nFileSize ) continue;
+    if( pCSV->bIndexValid && !csvIndexIsRow( pCSV, iOff ) ) continue;
+    if( pCsr->nRowidOff>=nAlloc ){
+      sqlite3_int64 *aNew;
+      nAlloc = nAlloc ? nAlloc*2 : 64;
+      aNew = sqlite3_realloc64( pCsr->aRowidOff, sizeof(sqlite3_int64)*nAlloc );
+      if( !aNew ) return SQLITE_NOMEM;
+      pCsr->aRowidOff = aNew;
+    }
+    pCsr->aRowidOff[pCsr->nRowidOff++] = iOff;
+  }
+  if( rc!=SQLITE_DONE ) return rc;
+  if( pCsr->nRowidOff>1 ){
+    sqlite3_int64 *a = pCsr->aRowidOff;
+    int i, j;
+    qsort(a, pCsr->nRowidOff, sizeof(sqlite3_int64), csvOffsetCmp);
+    for(i=j=1; i<pCsr->nRowidOff; i++){
+      if( a[i]!=a[j-1] ) a[j++] = a[i];
+    }
+    pCsr->nRowidOff = j;
+  }
+  if( !pCSV->bIndexValid && pCsr->nRowidOff>0 ){
+    rc = csvRowStarts( pCsr, pCsr->aRowidOff, &pCsr->nRowidOff );
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  if( bDesc && pCsr->nRowidOff>1 ){
+    sqlite3_int64 *a = pCsr->aRowidOff;
+    int i, j;
+    for(i=0, j=pCsr->nRowidOff-1; i<j; i++, j--){
+      sqlite3_int64 t = a[i];
+      a[i] = a[j];
+      a[j] = t;
+    }
+  }
+  if( !pCsr->aRowidOff ){
+    /* an empty list is still a lookup scan */
+    pCsr->aRowidOff = sqlite3_malloc( sizeof(sqlite3_int64) );
+    if( !pCsr->aRowidOff ) return SQLITE_NOMEM;
+  }
+  pCsr->nReadSize = SQLITE_CSV_LOOKUP_READ;
+  return SQLITE_OK;
+}
+
+
+/*
+** Position cursor pCsr at the start of the row whose rowid is pVal, and
+** set *pbRow, or clear it if pVal is not the rowid of a row. The rowid of
+** a row is its offset in the file, so this is a seek once the offset has
+** been checked by the index, or by csvRowStarts() without one.
+*/
+static int csvSeekRowid( CSVCursor *pCsr, sqlite3_value *pVal, int *pbRow ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  sqlite3_int64 iOff;
+  int n = 1;
+  int rc = SQLITE_OK;
+
+  *pbRow = 0;
+  if( sqlite3_value_numeric_type(pVal)!=SQLITE_INTEGER ) return SQLITE_OK;
+  iOff = sqlite3_value_int64(pVal);
+  if( iOff<pCSV->offsetFirstRow || iOff>=pCSV->nFileSize ) return SQLITE_OK;
+  if( pCSV->bIndexValid ){
+    /* the index knows where every row starts */
+    n = csvIndexIsRow( pCSV, iOff );
+  }else{
+    rc = csvRowStarts( pCsr, &iOff, &n );
+  }
+  if( rc==SQLITE_OK && n ){
+    csv_seek( pCsr, iOff );
+    *pbRow = 1;
+  }
+  return rc;
+}
+
+
+/*
+** Position cursor pCsr at the row whose offset is pVal, the _resume_from
+** argument of a scan, then have csvNext() skip the first nSkip rows from
+** there, as for OFFSET (see csvSeekRow()). A NULL starts at the first row,
+** and the size of the file (where a scan that read it all resumes) at its
+** end. Anything else must be the offset of a row, as checked by
+** csvSeekRowid(), or the scan fails.
+*/
+static int csvSeekResume(
+  CSVCursor *pCsr,
+  sqlite3_value *pVal,
+  sqlite3_int64 nSkip
+){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  int bRow;
+  int rc;
+
+  if( sqlite3_value_type(pVal)==SQLITE_NULL ){
+    csv_seek( pCsr, pCSV->offsetFirstRow );
+  }else if( sqlite3_value_numeric_type(pVal)==SQLITE_INTEGER
+         && sqlite3_value_int64(pVal)==pCSV->nFileSize ){
+    pCsr->iResume = pCSV->nFileSize;
+    pCsr->eof = -1;
+    return SQLITE_OK;
+  }else if( (rc = csvSeekRowid( pCsr, pVal, &bRow ))!=SQLITE_OK ){
+    return rc;
+  }else if( bRow ){
+    pCsr->iResume = sqlite3_value_int64(pVal);
+  }else{
+    sqlite3_free( pCsr->base.pVtab->zErrMsg );
+    pCsr->base.pVtab->zErrMsg = sqlite3_mprintf(aErrMsg[13],
+                                                sqlite3_value_text(pVal));
+    return SQLITE_ERROR;
+  }
+  pCsr->nSkipRow = nSkip;
+  return SQLITE_OK;
+}
+
+
+/* 
+** CSV virtual table module xCreate method.
+*/
+static int csvCreate(
+  sqlite3* db, 
+  void *pAux,
+  int argc, 
+  const char *const *argv,
+  sqlite3_vtab **ppVtab, 
+  char **pzErr 
+){
+  return csvInit( db, pAux, argc, argv, ppVtab, pzErr, 1 );
+}
+
+
+/* 
+** CSV virtual table module xConnect method.
+*/
+static int csvConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  return csvInit(db, pAux, argc, argv, ppVtab, pzErr, 0);
+}
+
+
+/*
+** Return the idxStr spelling of constraint operator eOp if an index can
+** skip blocks with it, or NULL.
+*/
+static const char *csvIndexOp( int eOp ){
+  switch( eOp ){
+    case SQLITE_INDEX_CONSTRAINT_EQ: return "=";
+    case SQLITE_INDEX_CONSTRAINT_LT: return "<";
+    case SQLITE_INDEX_CONSTRAINT_LE: return "<=";
+    case SQLITE_INDEX_CONSTRAINT_GT: return ">";
+    case SQLITE_INDEX_CONSTRAINT_GE: return ">=";
+    case SQLITE_INDEX_CONSTRAINT_ISNULL:    return " isnull";
+    case SQLITE_INDEX_CONSTRAINT_ISNOTNULL: return " notnull";
+  }
+  return 0;
+}
+
+
+/*
+** Return the position of z within the range [zLo, zHi], from 0.0 to 1.0.
+** The first bytes that follow the common prefix of the bounds are read as
+** the digits of a fraction, in a base that spans the byte values found
+** there, so that a bucket of the histogram can be split by interpolation
+** as with numbers: "02000" is a fifth of the way from "01875" to "02500".
+*/
+static double csvTextPos(
+  const char *z, int n,
+  const char *zLo, int nLo,
+  const char *zHi, int nHi
+){
+  double x = 0.0, lo = 0.0, hi = 0.0, f = 1.0;
+  int cMin = 255, cMax = 0;
+  int i = 0;
+  int k;
+  while( i<nLo && i<nHi && zLo[i]==zHi[i] ) i++;
+  for(k=i; k<i+4; k++){
+    int c;
+    if( k<n ){ c = (unsigned char)z[k]; if( c<cMin ) cMin = c; if( c>cMax ) cMax = c; }
+    if( k<nLo ){ c = (unsigned char)zLo[k]; if( c<cMin ) cMin = c; if( c>cMax ) cMax = c; }
+    if( k<nHi ){ c = (unsigned char)zHi[k]; if( c<cMin ) cMin = c; if( c>cMax ) cMax = c; }
+  }
+  if( cMax<=cMin ) return 0.5;
+  for(k=i; k<i+4; k++){
+    f /= (double)(cMax - cMin + 1);
+    x  += f * (k<n   ? (unsigned char)z[k]   - cMin : 0);
+    lo += f * (k<nLo ? (unsigned char)zLo[k] - cMin : 0);
+    hi += f * (k<nHi ? (unsigned char)zHi[k] - cMin : 0);
+  }
+  if( hi<=lo ) return 0.5;
+  x = (x - lo) / (hi - lo);
+  return x<0.0 ? 0.0 : x>1.0 ? 1.0 : x;
+}
+
+/*
+** Estimate from the column statistics of table pCSV the fraction of the
+** rows whose value of column iCol is less than text value pVal, and the
+** fraction of those equal to it. If pVal is NULL, as for a join where it
+** is not known when the plan is made, only the fraction of the rows equal
+** to the value is estimated, as for an average value.
+*/
+static void csvStatRank(
+  CSV *pCSV,
+  int iCol,
+  sqlite3_value *pVal,
+  double *prLt,
+  double *prEq
+){
+  const CSVColStat *p = &pCSV->aStat[iCol];
+  double rEmpty = pCSV->nStatRow>0 ? (double)p->nEmpty/pCSV->nStatRow : 0.0;
+  double rValue = 1.0 - rEmpty;
+  double rLt, rEq;
+  const char *z;
+  int n;
+
+  if( !pVal ){
+    *prLt = 0.0;
+    *prEq = p->nDistinct>0 ? rValue/p->nDistinct : 0.0;
+    return;
+  }
+  z = (const char *)sqlite3_value_text( pVal );
+  n = sqlite3_value_bytes( pVal );
+
+  /* rLt is the fraction of the rows less than z and rEq of those equal */
+  if( !z || n==0 ){
+    rLt = 0.0;
+    rEq = rEmpty;
+  }else if( !p->zMin || csvTextCmp(z, n, p->zMin, p->nMin)<0 ){
+    rLt = rEmpty;
+    rEq = 0.0;
+  }else if( csvTextCmp(z, n, p->zMax, p->nMax)>0 ){
+    rLt = 1.0;
+    rEq = 0.0;
+  }else{
+    double rBucket = p->nHist>0 ? 1.0/p->nHist : 1.0;
+    int nLt = 0;               /* Bounds of the histogram less than z */
+    int nEq = 0;               /* Bounds equal to z */
+    const char *zLo = p->zMin; /* Bounds of the bucket of z */
+    const char *zHi = p->zMax;
+    int nLo = p->nMin;
+    int nHi = p->nMax;
+    int i = 0;
+    while( i<p->nHistByte ){
+      sqlite3_uint64 v;
+      int nByte = csvGetVarint( &p->aHist[i], p->nHistByte-i, &v );
+      const char *zBound;
+      int c;
+      if( nByte==0 || v>(sqlite3_uint64)(p->nHistByte-i-nByte) ) break;
+      zBound = (const char *)&p->aHist[i+nByte];
+      c = csvTextCmp( zBound, (int)v, z, n );
+      if( c<0 ){
+        nLt++;
+        zLo = zBound;
+        nLo = (int)v;
+      }else if( zHi==p->zMax ){
+        zHi = zBound;
+        nHi = (int)v;
+      }
+      if( c==0 ) nEq++;
+      i += nByte + (int)v;
+    }
+    /* a value that is the bound of several buckets fills all but one */
+    rEq = p->nDistinct>0 ? 1.0/p->nDistinct : 1.0;
+    if( nEq>1 && (nEq-1)*rBucket>rEq ) rEq = (nEq-1)*rBucket;
+    if( csvTextCmp(z, n, p->zMin, p->nMin)==0 ){
+      rLt = 0.0;
+    }else if( nEq ){
+      /* z ends bucket nLt, so the rest of that bucket is less than z */
+      rLt = (nLt+1)*rBucket - rEq;
+      if( rLt<nLt*rBucket ) rLt = nLt*rBucket;
+    }else{
+      rLt = (nLt + csvTextPos(z, n, zLo, nLo, zHi, nHi))*rBucket;
+    }
+    rLt = rEmpty + rValue*rLt;
+    rEq = rValue*rEq;
+    if( rLt+rEq>1.0 ) rLt = 1.0 - rEq;
+  }
+  *prLt = rLt;
+  *prEq = rEq;
+}
+
+/*
+** Return the estimated fraction of the rows of table pCSV that satisfy
+** the constraints of info->aConstraint[] flagged in aUsed[], which are
+** constraints on columns. Range constraints on the same column are
+** combined into one interval, the others are assumed independent. The
+** flags are cleared.
+*/
+static double csvStatSelectivity(
+  CSV *pCSV,
+  sqlite3_index_info *info,
+  unsigned char *aUsed
+){
+  double rSel = 1.0;
+  int i, j;
+
+  for(i=0; i<info->nConstraint; i++){
+    int iCol = info->aConstraint[i].iColumn;
+    double rLo = 0.0;          /* Fraction of the rows below the interval */
+    double rHi = 1.0;          /* Fraction below or within the interval */
+    int bRange = 0;
+    if( !aUsed[i] ) continue;
+    for(j=i; j<info->nConstraint; j++){
+      const struct sqlite3_index_constraint *p = &info->aConstraint[j];
+      sqlite3_value *pVal = 0;
+      double rLt, rEq;
+      double a, b;             /* Interval of the constraint */
+      if( !aUsed[j] || p->iColumn!=iCol ) continue;
+      aUsed[j] = 0;
+      if( p->op==SQLITE_INDEX_CONSTRAINT_ISNULL
+       || p->op==SQLITE_INDEX_CONSTRAINT_ISNOTNULL
+      ){
+        /* NULLs are among the empty values counted by the statistics */
+        double rNull = pCSV->nStatRow>0 ?
+            (double)pCSV->aStat[iCol].nEmpty/(double)pCSV->nStatRow : 0.0;
+        rSel *= p->op==SQLITE_INDEX_CONSTRAINT_ISNULL ? rNull : 1.0-rNull;
+        continue;
+      }
+      if( sqlite3_vtab_rhs_value(info, j, &pVal)!=SQLITE_OK
+       || sqlite3_value_type(pVal)!=SQLITE_TEXT
+      ){
+        pVal = 0;
+      }
+      csvStatRank(pCSV, iCol, pVal, &rLt, &rEq);
+      if( !pVal ){
+        rSel *= p->op==SQLITE_INDEX_CONSTRAINT_EQ ? rEq : 1.0/3.0;
+        continue;
+      }
+      switch( p->op ){
+        case SQLITE_INDEX_CONSTRAINT_EQ: a = rLt;     b = rLt+rEq; break;
+        case SQLITE_INDEX_CONSTRAINT_LT: a = 0.0;     b = rLt;     break;
+        case SQLITE_INDEX_CONSTRAINT_LE: a = 0.0;     b = rLt+rEq; break;
+        case SQLITE_INDEX_CONSTRAINT_GT: a = rLt+rEq; b = 1.0;     break;
+        default:                         a = rLt;     b = 1.0;     break;
+      }
+      if( a>rLo ) rLo = a;
+      if( b<rHi ) rHi = b;
+      bRange = 1;
+    }
+    if( bRange ) rSel *= rHi>rLo ? rHi-rLo : 0.0;
+  }
+  return rSel;
+}
+
+
+/*
+** Plan a scan of table pCSV that reads the rows in the order of column
+** index p: find the constraints of info on its column that the index can
+** answer, at most one equality or one lower and one upper bound, and
+** whether it returns the rows in the order of the ORDER BY clause. On
+** return, aCons[] holds the constraints (equality, lower bound and upper
+** bound, or -1), *peOrder is 0, 1 for ascending or 2 for descending order
+** and *pnEst the estimated number of rows. Return the estimated cost, or
+** a negative value if the index is of no use or a full scan is cheaper.
+*/
+static double csvColIdxPlan(
+  CSV *pCSV,
+  sqlite3_index_info *info,
+  CSVColIdx *p,
+  int *aCons,
+  int *peOrder,
+  sqlite3_int64 *pnEst
+){
+  double rEst = (double)p->nRow;
+  double rScan;
+  double rCost;
+  int i;
+
+  aCons[0] = aCons[1] = aCons[2] = -1;
+  *peOrder = 0;
+  /* the index is in the order of the text, not of the integers */
+  if( !p->bValid || csvIsInt(pCSV, p->iCol) ) return -1.0;
+  for(i=0; i<info->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &info->aConstraint[i];
+    int j;
+    if( !pCons->usable || pCons->iColumn!=p->iCol ) continue;
+    switch( pCons->op ){
+      case SQLITE_INDEX_CONSTRAINT_EQ: j = 0; break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE: j = 1; break;
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_LE: j = 2; break;
+      default: continue;
+    }
+    if( aCons[j]>=0 ) continue;
+    if( sqlite3_stricmp(sqlite3_vtab_collation(info, i), "BINARY") ) continue;
+    aCons[j] = i;
+  }
+  if( aCons[0]>=0 ) aCons[1] = aCons[2] = -1;
+
+  /* rows without the column are not in the index, but would come first
+  ** in an ascending ORDER BY: without constraint, the order can only be
+  ** consumed if there are none */
+  if( info->nOrderBy==1 && info->aOrderBy[0].iColumn==p->iCol
+   && (aCons[0]>=0 || aCons[1]>=0 || aCons[2]>=0 || p->nNull==0)
+  ){
+    *peOrder = info->aOrderBy[0].desc ? 2 : 1;
+  }
+  if( aCons[0]<0 && aCons[1]<0 && aCons[2]<0 && !*peOrder ) return -1.0;
+
+  if( pCSV->aStat && info->nConstraint>0 ){
+    unsigned char *aUsed = (unsigned char *)sqlite3_malloc( info->nConstraint );
+    if( !aUsed ) return -1.0;
+    memset(aUsed, 0, info->nConstraint);
+    for(i=0; i<3; i++){
+      if( aCons[i]>=0 ) aUsed[aCons[i]] = 1;
+    }
+    rEst *= csvStatSelectivity(pCSV, info, aUsed);
+    sqlite3_free( aUsed );
+  }else if( aCons[0]>=0 ){
+    rEst /= 10;
+  }else{
+    if( aCons[1]>=0 ) rEst /= 3;
+    if( aCons[2]>=0 ) rEst /= 3;
+  }
+  if( rEst<1.0 ) rEst = 1.0;
+  *pnEst = (sqlite3_int64)(rEst + 0.5);
+
+  /* each row is a seek and a small read, after a search of the index; a
+  ** scan reads every row (or every block that may match), and the rows
+  ** must then be sorted if ORDER BY is not consumed */
+  rCost = log((double)p->nRow + 1.0)/log(2.0) + 2.0*rEst;
+  if( pCSV->nBlock>0 ){
+    rScan = (double)pCSV->nFileSize/4096.0*rEst/(double)(p->nRow+1) + rEst;
+  }else{
+    rScan = (double)pCSV->nFileSize/4096.0 + (double)p->nRow;
+  }
+  if( *peOrder ) rScan += rEst*log(rEst + 1.0)/log(2.0);
+  return rCost<rScan ? rCost : -1.0;
+}
+
+
+/*
+** CSV virtual table module xBestIndex method.
+*/
+static int csvBestIndex( sqlite3_vtab *pVtab, sqlite3_index_info* info )
+{
+  CSV *pCSV = (CSV *)pVtab;
+  sqlite3_int64 nEst;
+  sqlite3_str *pStr;
+  const char *zSep = "";
+  int iRowid = -1;
+  int iKey = -1;
+  int iResume = -1;        /* Equality on the hidden _resume_from column */
+  int bResume = 0;         /* True if there is one, usable or not */
+  CSVColIdx *pIdx = 0;     /* Column index to read, if any */
+  int aIdxCons[3];         /* Constraints answered by pIdx */
+  int eIdxOrder = 0;       /* ORDER BY consumed by pIdx: 1 asc, 2 desc */
+  sqlite3_int64 nIdxEst = 0;
+  int nOther = 0;          /* Constraints other than LIMIT and OFFSET */
+  int nArg = 0;
+  int i;
+
+  /* the rowid is the offset of the row in the file, so an equality
+  ** constraint on it can be answered with a single seek */
+  for(i=0; i<info->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &info->aConstraint[i];
+    if( pCons->iColumn==pCSV->nColumn+CSV_HIDDEN_RESUME ){
+      /* _resume_from, the offset a scan starts at */
+      if( pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+        bResume = 1;
+        if( pCons->usable ) iResume = i;
+      }
+      continue;
+    }
+    if( pCons->op!=SQLITE_INDEX_CONSTRAINT_LIMIT
+     && pCons->op!=SQLITE_INDEX_CONSTRAINT_OFFSET
+    ){
+      nOther++;
+    }
+    if( iRowid<0 && pCons->usable && pCons->iColumn<0
+     && pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+      iRowid = i;
+    }
+    if( iKey<0 && pCons->usable && pCons->iColumn==pCSV->iKeyCol
+     && pCons->iColumn>=0 && pCons->op==SQLITE_INDEX_CONSTRAINT_EQ
+     && !csvIsInt(pCSV, pCons->iColumn)
+     && sqlite3_stricmp(sqlite3_vtab_collation(info, i), "BINARY")==0 ){
+      iKey = i;
+    }
+  }
+
+  /* a scan resumed at an offset reads the file in order from there, so
+  ** there is no plan without that offset */
+  if( bResume && iResume<0 ) return SQLITE_CONSTRAINT;
+  if( iResume>=0 ){
+    iRowid = iKey = -1;
+  }
+
+  /* a column index answers =, <, <=, > and >= on its column and returns
+  ** the rows in order, if that is cheaper than a scan */
+  if( iRowid<0 && iKey<0 && iResume<0 && pCSV->nColIdx>0 ){
+    double rIdxCost = 0.0;
+    csvColIdxCheck( pCSV );
+    for(i=0; i<pCSV->nColIdx; i++){
+      int aCons[3];
+      int eOrder;
+      sqlite3_int64 nEst1;
+      double r = csvColIdxPlan(pCSV, info, &pCSV->aColIdx[i], aCons, &eOrder,
+                               &nEst1);
+      if( r>=0.0 && (!pIdx || r<rIdxCost) ){
+        pIdx = &pCSV->aColIdx[i];
+        memcpy(aIdxCons, aCons, sizeof(aCons));
+        eIdxOrder = eOrder;
+        nIdxEst = nEst1;
+        rIdxCost = r;
+      }
+    }
+    if( pIdx ) info->estimatedCost = rIdxCost;
+  }
+
+  pStr = sqlite3_str_new(pCSV->db);
+  if( iRowid>=0 ){
+    /* the rowids of an IN list are all passed at once, so that their
+    ** reads can be issued together, in the order of the file; that is
+    ** also the order of ORDER BY rowid */
+    int bList = sqlite3_vtab_in(info, iRowid, -1);
+    if( bList ){
+      sqlite3_vtab_in(info, iRowid, 1);
+    }
+    info->aConstraintUsage[iRowid].argvIndex = 1;
+    info->aConstraintUsage[iRowid].omit = 1;
+    info->idxNum = CSV_PLAN_ROWID;
+    info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    nEst = 1;
+    info->estimatedCost = 2.0;
+    sqlite3_str_appendall(pStr, "plan=rowid;cons=rowid=");
+    if( bList && info->nOrderBy==1 && info->aOrderBy[0].iColumn<0 ){
+      info->orderByConsumed = 1;
+      sqlite3_str_appendf(pStr, ";order=%s",
+                          info->aOrderBy[0].desc ? "desc" : "asc");
+    }
+  }else if( iKey>=0 ){
+    /* an equality on the KEY column is a lookup in its hash index, which
+    ** the first lookup builds with a scan, a cost shared by all of them;
+    ** SQLite still checks the rows returned */
+    info->aConstraintUsage[iKey].argvIndex = 1;
+    info->idxNum = CSV_PLAN_KEY;
+    nEst = 1;
+    if( pCSV->aStat ){
+      double rLt, rEq;
+      csvStatRank(pCSV, pCSV->iKeyCol, 0, &rLt, &rEq);
+      if( pCSV->nStatRow*rEq>1.0 ) nEst = (sqlite3_int64)(pCSV->nStatRow*rEq + 0.5);
+    }
+    info->estimatedCost = 5.0 + 2.0*(double)nEst;
+    sqlite3_str_appendf(pStr, "plan=key;cons=%d=", pCSV->iKeyCol);
+  }else if( pIdx ){
+    /* rows in the order of the index, SQLite still checks them */
+    info->idxNum = CSV_PLAN_INDEX;
+    nEst = nIdxEst;
+    sqlite3_str_appendf(pStr, "plan=index;idx=%d;cons=", pIdx->iCol);
+    for(i=0; i<3; i++){
+      int j = aIdxCons[i];
+      if( j<0 ) continue;
+      info->aConstraintUsage[j].argvIndex = ++nArg;
+      sqlite3_str_appendf(pStr, "%s%d%s", zSep, pIdx->iCol,
+                          csvIndexOp(info->aConstraint[j].op));
+      zSep = ",";
+    }
+    if( eIdxOrder ){
+      info->orderByConsumed = 1;
+      sqlite3_str_appendf(pStr, ";order=%s", eIdxOrder==2 ? "desc" : "asc");
+    }
+  }else{
+    sqlite3_int64 nRow;
+    double rEst;
+    unsigned char *aUsed = 0;  /* Constraints for the column statistics */
+    /* the cost of a full scan is driven by the number of pages read */
+    info->idxNum = CSV_PLAN_SCAN;
+    if( pCSV->nScanRow>0 ){
+      nRow = pCSV->nScanRow;
+    }else if( pCSV->nStatRow>0 ){
+      nRow = pCSV->nStatRow;
+    }else{
+      nRow = (pCSV->nFileSize - pCSV->offsetFirstRow)
+           / (pCSV->nFirstRowLen>0 ? pCSV->nFirstRowLen : 1);
+      if( nRow<1 ) nRow = 1;
+    }
+    rEst = (double)nRow;
+    sqlite3_str_appendall(pStr, "plan=scan;cons=");
+    if( iResume>=0 ){
+      info->aConstraintUsage[iResume].argvIndex = ++nArg;
+      info->aConstraintUsage[iResume].omit = 1;
+      sqlite3_str_appendall(pStr, "resume");
+      zSep = ",";
+      rEst /= 2;
+    }
+    if( pCSV->aStat && iResume<0 && info->nConstraint>0 ){
+      aUsed = (unsigned char *)sqlite3_malloc( info->nConstraint );
+      if( !aUsed ){
+        sqlite3_free( sqlite3_str_finish(pStr) );
+        return SQLITE_NOMEM;
+      }
+      memset(aUsed, 0, info->nConstraint);
+    }
+
+    /* with an index, text constraints on columns skip the blocks that
+    ** cannot match; SQLite still checks every row returned. With column
+    ** statistics, they are also taken so that the estimate of the rows
+    ** returned accounts for them */
+    for(i=0; (pCSV->nBlock>0 || pCSV->aStat) && iResume<0
+           && i<info->nConstraint; i++){
+      const struct sqlite3_index_constraint *pCons = &info->aConstraint[i];
+      const char *zOp = csvIndexOp(pCons->op);
+      if( !pCons->usable || pCons->iColumn<0 || !zOp ) continue;
+      if( pCons->iColumn>=pCSV->nColumn ) continue;
+      if( sqlite3_stricmp(sqlite3_vtab_collation(info, i), "BINARY") ) continue;
+      info->aConstraintUsage[i].argvIndex = ++nArg;
+      sqlite3_str_appendf(pStr, "%s%d%s", zSep, pCons->iColumn, zOp);
+      zSep = ",";
+      if( aUsed && pCons->iColumn<pCSV->nColumn ){
+        aUsed[i] = 1;
+      }else{
+        rEst /= pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ? 10 : 3;
+      }
+    }
+    if( aUsed ){
+      rEst *= csvStatSelectivity(pCSV, info, aUsed);
+      sqlite3_free( aUsed );
+    }
+    nEst = rEst<1.0 ? 1 : (sqlite3_int64)(rEst + 0.5);
+
+    /* LIMIT and OFFSET, when nothing else is constrained and there is no
+    ** ORDER BY to sort the rows by first: the rows before OFFSET are
+    ** skipped without being returned, or not even read if there is an
+    ** index */
+    for(i=0; nOther==0 && info->nOrderBy==0 && i<info->nConstraint; i++){
+      const struct sqlite3_index_constraint *pCons = &info->aConstraint[i];
+      if( !pCons->usable ) continue;
+      if( pCons->op==SQLITE_INDEX_CONSTRAINT_OFFSET ){
+        sqlite3_str_appendf(pStr, "%soffset", zSep);
+      }else if( pCons->op==SQLITE_INDEX_CONSTRAINT_LIMIT ){
+        sqlite3_str_appendf(pStr, "%slimit", zSep);
+      }else{
+        continue;
+      }
+      info->aConstraintUsage[i].argvIndex = ++nArg;
+      info->aConstraintUsage[i].omit = 1;
+      zSep = ",";
+    }
+    if( pCSV->nBlock>0 ){
+      info->estimatedCost = (double)pCSV->nFileSize/4096.0*nEst/nRow + (double)nEst;
+    }else{
+      info->estimatedCost = (double)pCSV->nFileSize/4096.0 + (double)nEst;
+    }
+  }
+  info->estimatedRows = nEst;
+
+  /* projected columns, for EXPLAIN QUERY PLAN */
+  zSep = "";
+  sqlite3_str_appendall(pStr, ";cols=");
+  for(i=0; i<64; i++){
+    /* bit 63 stands for all the columns from the 64th on */
+    if( info->colUsed & ((sqlite3_uint64)1<<i) ){
+      sqlite3_str_appendf(pStr, "%s%d%s", zSep, i, i==63 ? "+" : "");
+      zSep = ",";
+    }
+  }
+  sqlite3_str_appendf(pStr, ";est=%lld", nEst);
+
+  info->idxStr = sqlite3_str_finish(pStr);
+  if( !info->idxStr ) return SQLITE_NOMEM;
+  info->needToFreeIdxStr = 1;
+  return SQLITE_OK;
+}
+
+
+/* 
+** CSV virtual table module xDisconnect method.
+*/
+static int csvDisconnect( sqlite3_vtab *pVtab ){
+  return csvRelease( (CSV *)pVtab );
+}
+
+
+/* 
+** CSV virtual table module xDestroy method.
+*/
+static int csvDestroy( sqlite3_vtab *pVtab ){
+  CSV *pCSV = (CSV *)pVtab;
+  int rc = SQLITE_OK;
+  int i;
+
+  /* drop the shadow tables */
+  csvFinalizeStmts( pCSV );
+  for(i=0; rc==SQLITE_OK && i<CSV_NSHADOW; i++){
+    char *zSql = sqlite3_mprintf("DROP TABLE IF EXISTS \"%w\".\"%w_%s\"",
+                                 pCSV->zDb, pCSV->zName, azShadow[i]);
+    rc = zSql ? sqlite3_exec( pCSV->db, zSql, 0, 0, 0 ) : SQLITE_NOMEM;
+    sqlite3_free( zSql );
+  }
+  if( rc==SQLITE_OK ){
+    rc = csvDisconnect( pVtab );
+  }
+  return rc;
+}
+
+
+/*
+** CSV virtual table module xRename method.
+*/
+static int csvRename( sqlite3_vtab *pVtab, const char *zNew ){
+  CSV *pCSV = (CSV *)pVtab;
+  int rc = SQLITE_OK;
+  int i;
+
+  /* rename the shadow tables along with the table */
+  csvFinalizeStmts( pCSV );
+  for(i=0; rc==SQLITE_OK && i<CSV_NSHADOW; i++){
+    char *zOld = sqlite3_mprintf("%s_%s", pCSV->zName, azShadow[i]);
+    char *zSql = 0;
+    if( zOld && sqlite3_table_column_metadata( pCSV->db, pCSV->zDb, zOld,
+                                    0, 0, 0, 0, 0, 0 )==SQLITE_OK ){
+      zSql = sqlite3_mprintf(
+          "ALTER TABLE \"%w\".\"%w\" RENAME TO \"%w_%s\"",
+          pCSV->zDb, zOld, zNew, azShadow[i]);
+      rc = zSql ? sqlite3_exec( pCSV->db, zSql, 0, 0, 0 ) : SQLITE_NOMEM;
+    }else if( !zOld ){
+      rc = SQLITE_NOMEM;
+    }
+    sqlite3_free( zSql );
+    sqlite3_free( zOld );
+  }
+  return rc;
+}
+
+
+/*
+** CSV virtual table module xShadowName method. Shadow tables are read-only
+** to SQL statements when SQLITE_DBCONFIG_DEFENSIVE is on.
+*/
+static int csvShadowName( const char *zName ){
+  int i;
+  for(i=0; i<CSV_NSHADOW; i++){
+    if( sqlite3_stricmp(zName, azShadow[i])==0 ) return 1;
+  }
+  return 0;
+}
+
+
+/* 
+** CSV virtual table module xOpen method.
+*/
+static int csvOpen( sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppVtabCursor ){
+  int rc = SQLITE_NOMEM;
+  CSVCursor *pCsr;
+
+  /* create a new cursor object */
+  pCsr = (CSVCursor *)sqlite3_malloc(sizeof(CSVCursor));
+  if( pCsr ){
+    memset(pCsr, 0, sizeof(CSVCursor));
+    pCsr->base.pVtab = pVtab;
+    ((CSV *)pVtab)->nCursor++;
+    rc = SQLITE_OK;
+  }
+  *ppVtabCursor = (sqlite3_vtab_cursor *)pCsr;
+
+  return rc;
+}
+
+
+/* 
+** CSV virtual table module xClose method.
+*/
+static int csvClose( sqlite3_vtab_cursor *pVtabCursor ){
+  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
+
+  if( pCSV->pGlobal && pCSV->pGlobal->pExplain && pCsr->nFilter ){
+    csvExplainCursor( pCSV->pGlobal, pCsr );
+  }
+  csvCursorFree(pCsr);
+  sqlite3_free(pCsr->aMatch);
+  sqlite3_free(pCsr->zKey);
+  csvKeyUnpin(pCsr);
+  sqlite3_finalize(pCsr->pIdxStmt);
+  sqlite3_free(pCsr->zPlan);
+  sqlite3_free(pCsr);
+  pCSV->nCursor--;
+
+  return SQLITE_OK;
+}
+
+
+/*
+** Set up cursor pCsr for a scan with the constraints listed in idxStr
+** (see csvBestIndex()), whose values are in argv[]. Constraints on columns
+** select the blocks of the index to read, _resume_from and OFFSET position
+** the cursor and LIMIT bounds the number of rows.
+*/
+static int csvFilterScan(
+  CSVCursor *pCsr,
+  const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  const char *z = idxStr ? strstr(idxStr, "cons=") : 0;
+  sqlite3_int64 iOffset = 0;
+  sqlite3_value *pResume = 0;
+  int rc = SQLITE_OK;
+  int i;
+
+  pCsr->bFullScan = 1;
+  if( z ) z += 5;
+  for(i=0; rc==SQLITE_OK && z && *z && *z!=';' && i<argc; i++){
+    int n = (int)strcspn(z, ",;");
+    if( n==6 && memcmp(z, "offset", 6)==0 ){
+      iOffset = sqlite3_value_int64(argv[i]);
+      pCsr->bFullScan = 0;
+    }else if( n==6 && memcmp(z, "resume", 6)==0 ){
+      pResume = argv[i];
+      if( sqlite3_value_type(pResume)!=SQLITE_NULL ) pCsr->bFullScan = 0;
+    }else if( n==5 && memcmp(z, "limit", 5)==0 ){
+      sqlite3_int64 nLimit = sqlite3_value_int64(argv[i]);
+      pCsr->iLimit = nLimit<0 ? -1 : nLimit;
+      pCsr->bFullScan = 0;
+    }else if( pCSV->bIndexValid ){
+      int iCol = atoi(z);
+      const char *zOp = z + strspn(z, "0123456789");
+      int nOp = n - (int)(zOp-z);
+      int eOp = SQLITE_INDEX_CONSTRAINT_EQ;
+      if( nOp==1 && zOp[0]=='<' ) eOp = SQLITE_INDEX_CONSTRAINT_LT;
+      if( nOp==2 && zOp[0]=='<' ) eOp = SQLITE_INDEX_CONSTRAINT_LE;
+      if( nOp==1 && zOp[0]=='>' ) eOp = SQLITE_INDEX_CONSTRAINT_GT;
+      if( nOp==2 && zOp[0]=='>' ) eOp = SQLITE_INDEX_CONSTRAINT_GE;
+      if( nOp>2 ){
+        /* " isnull" or " notnull", without a value */
+        rc = csvZoneFilterNull( pCsr, iCol, zOp[1]=='i' );
+      }else if( sqlite3_value_type(argv[i])==(csvIsInt(pCSV, iCol) ?
+                                              SQLITE_INTEGER : SQLITE_TEXT) ){
+        rc = csvZoneFilter( pCsr, iCol, eOp, argv[i] );
+      }
+    }
+    z += n;
+    if( *z==',' ) z++;
+  }
+  if( rc!=SQLITE_OK ) return rc;
+
+  if( pResume ){
+    rc = csvSeekResume( pCsr, pResume, iOffset );
+  }else if( pCsr->aMatch ){
+    /* csvNext() moves to the first block that may match */
+    pCsr->bFullScan = 0;
+    pCsr->iBlock = -1;
+    pCsr->nBlockRow = 0;
+  }else if( iOffset>0 ){
+    rc = csvSeekRow( pCsr, iOffset );
+  }else{
+    /* seek back to start of first zRow */
+    csv_seek( pCsr, pCSV->offsetFirstRow );
+  }
+  return rc;
+}
+
+
+/*
+** Return true if pVal is the right-hand side of an IN operator, passed at
+** once (see sqlite3_vtab_in()). Before SQLite 3.41, sqlite3_vtab_in_first()
+** returns SQLITE_MISUSE rather than SQLITE_ERROR for any other value.
+*/
+static int csvIsInList( sqlite3_value *pVal ){
+  sqlite3_value *pFirst = 0;
+  int rc = sqlite3_vtab_in_first( pVal, &pFirst );
+  return rc==SQLITE_OK || rc==SQLITE_DONE;
+}
+
+
+/* 
+** CSV virtual table module xFilter method.
+*/
+static int csvFilter(
+  sqlite3_vtab_cursor *pVtabCursor, 
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
+  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+  int rc = SQLITE_OK;
+
+  csvReference( pCSV );
+  sqlite3_free( pCsr->aMatch );
+  sqlite3_free( pCsr->zKey );
+  csvKeyUnpin( pCsr );
+  pCsr->aMatch = 0;
+  pCsr->zKey = 0;
+  pCsr->bFullScan = 0;
+  pCsr->bIndexScan = 0;
+  pCsr->bBatch = 0;
+  sqlite3_free( pCsr->aRowidOff );
+  pCsr->aRowidOff = 0;
+
+  /* the file is (re)opened and checked by the first scan after a change */
+  {
+    char *zErr = 0;
+    rc = csvCursorAcquire( pCsr, &zErr );
+    if( rc!=SQLITE_OK ){
+      sqlite3_free( pVtabCursor->pVtab->zErrMsg );
+      pVtabCursor->pVtab->zErrMsg = zErr;
+      pCsr->eof = -1;
+      csvRelease( pCSV );
+      return rc;
+    }
+  }
+
+  pCsr->idxNum = idxNum;
+  if( !pCsr->zPlan && idxStr ){
+    pCsr->zPlan = sqlite3_mprintf("%s", idxStr);
+  }
+  pCsr->nFilter++;
+  pCsr->nFilterRow = 0;
+  pCsr->iLimit = -1;
+  pCsr->nSkipRow = 0;
+  pCsr->iResume = -1;
+  pCsr->eof = 0;
+  pCSV->nScan++;
+
+  if( idxNum==CSV_PLAN_ROWID && csvIsInList( argv[0] ) ){
+    /* all the rowids of an IN list at once */
+    rc = csvRowidList( pCsr, argv[0], idxStr && strstr(idxStr, ";order=desc")!=0 );
+  }else if( idxNum==CSV_PLAN_ROWID ){
+    /* seek to the requested row, if it is one */
+    int bRow;
+    pCsr->nReadSize = SQLITE_CSV_LOOKUP_READ;
+    rc = csvSeekRowid( pCsr, argv[0], &bRow );
+    if( rc==SQLITE_OK && bRow ){
+      pCsr->iLimit = 1;
+    }else{
+      pCsr->eof = -1;
+    }
+  }else if( idxNum==CSV_PLAN_KEY || idxNum==CSV_PLAN_INDEX ){
+    char *zErr = 0;
+    if( idxNum==CSV_PLAN_KEY ){
+      rc = csvKeyFilter( pCsr, argv[0], &zErr );
+    }else{
+      rc = csvColIdxFilter( pCsr, idxStr, argc, argv, &zErr );
+    }
+    if( zErr ){
+      sqlite3_free( pVtabCursor->pVtab->zErrMsg );
+      pVtabCursor->pVtab->zErrMsg = zErr;
+    }
+  }else{
+    pCsr->nReadSize = SQLITE_CSV_READ_BUFFER;
+    rc = csvFilterScan( pCsr, idxStr, argc, argv );
+  }
+  /* streaming reads from the current position apply the I/O policy, and
+  ** scans read the rows in order by batches */
+  if( rc==SQLITE_OK && !pCsr->eof && !pCsr->aMatch
+   && pCsr->nReadSize==SQLITE_CSV_READ_BUFFER
+  ){
+    csvIoBegin( pCsr );
+    if( idxNum==CSV_PLAN_SCAN ){
+      pCsr->bBatch = 1;
+      pCsr->nBatch = pCsr->iBatch = 0;
+    }
+  }
+  /* read and parse next line */
+  if( rc==SQLITE_OK && !pCsr->eof ){
+    rc = csvNext( pVtabCursor );
+  }
+  if( rc!=SQLITE_OK ){
+    pCsr->eof = -1;
+  }
+  if( pCsr->eof ){
+    csvCursorRelease( pCsr );
+  }
+
+  csvRelease( pCSV );
+
+  return rc;
+}
+
+
+/* 
+** CSV virtual table module xNext method.
+*/
+static int csvNext( sqlite3_vtab_cursor* pVtabCursor ){
+  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
+  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+  const char *zBad; /* what is wrong with a malformed record */
+  int iEnd;
+  int rc;
+
+  CSV_PROFILE_START(tRow);
+
+  if( pCsr->eof ){
+    return SQLITE_ERROR;
+  }
+  if( pCsr->iLimit==0 ){
+    pCsr->eof = -1;
+    csvCursorRelease( pCsr );
+    return SQLITE_OK;
+  }
+next_row:
+  pCsr->iCellRow++;
+  if( pCsr->bBatch ){
+    /* the next row of the batch, or of the next batch */
+    if( ++pCsr->iBatch>=pCsr->nBatch ){
+      rc = csvBatchFill( pCsr );
+      if( rc!=SQLITE_OK ){
+        pCsr->eof = -1;
+        return rc;
+      }
+      if( pCsr->nBatch==0 ) goto eof;
+    }
+    pCsr->csvpos = pCsr->aBatchRowOff[pCsr->iBatch];
+    if( pCsr->zBatchBad && pCsr->iBatch==pCsr->nBatch-1 ){
+      zBad = pCsr->zBatchBad;
+      pCsr->zBatchBad = 0;
+      goto malformed;
+    }
+    goto row_done;
+  }
+  if( pCsr->bIndexScan || pCsr->zKey || pCsr->aRowidOff ){
+    /* move on to the next row looked up: in the column index, that may
+    ** hold the key looked up, or of the rowid IN list */
+    int bEof = 0;
+    int rc = csvLookupNext( pCsr, &bEof );
+    if( rc!=SQLITE_OK || bEof ){
+      pCsr->eof = -1;
+      csvCursorRelease( pCsr );
+      return rc;
+    }
+  }else if( pCsr->aMatch ){
+    /* move on to the next block that may hold matching rows */
+    if( pCsr->nBlockRow==0 ){
+      int i = pCsr->iBlock+1;
+      while( i<pCSV->nBlock && !pCsr->aMatch[i] ){
+        pCsr->nBlockSkip++;
+        i++;
+      }
+      if( i>=pCSV->nBlock ){
+        pCsr->eof = -1;
+        csvCursorRelease( pCsr );
+        return SQLITE_OK;
+      }
+      csv_seek( pCsr, pCSV->aBlock[i].iOff );
+      pCsr->iBlock = i;
+      pCsr->nBlockRow = pCSV->aBlock[i].nRow;
+    }
+    pCsr->nBlockRow--;
+  }
+
+  /* update the cursor */
+  pCsr->csvpos = csv_tell( pCsr );
+
+  /* a row read on its own, as by lookups, is split as a batch of one */
+  rc = csvBatchAlloc( pCsr );
+  iEnd = rc==SQLITE_OK ? csv_readline( pCsr, 0 ) : -1;
+  CSV_PROFILE_END(pCSV, CSV_PHASE_GETLINE, tRow);
+  pCsr->iBatch = 0;
+  pCsr->nBatch = 1;
+  if( iEnd<0 && pCsr->bTooLong ){
+    pCsr->bTooLong = 0;
+    pCsr->aBatchPos[0] = pCsr->aBatchPos[1] = 0;
+    csvBatchNull( pCsr, 0 );
+    zBad = "row too long";
+    goto malformed;
+  }
+  if( iEnd<0 ){
+    pCsr->eof = -1;
+    return SQLITE_NOMEM;
+  }
+  if( iEnd==0 ){
+    /* end of file */
+eof:
+    pCsr->eof = -1;
+    if( pCsr->nFilter && pCsr->idxNum==CSV_PLAN_SCAN && !pCsr->aMatch ){
+      pCSV->iCheckpoint = csv_tell( pCsr );
+    }
+    csvCursorRelease( pCsr );
+    if( pCsr->bFullScan ){
+      /* remember the row count for the next estimates */
+      pCSV->nScanRow = pCsr->nFilterRow;
+    }
+    return SQLITE_OK;
+  }
+  {
+    CSV_PROFILE_START(tTokenize);
+    zBad = 0;
+    rc = csvBatchRow( pCsr, 0, 0, iEnd, &zBad );
+    CSV_PROFILE_END(pCSV, CSV_PHASE_TOKENIZE, tTokenize);
+  }
+  CSV_PROFILE_ROW(pCSV, tRow, (sqlite3_uint64)iEnd);
+  if( rc!=SQLITE_OK ){
+    pCsr->eof = -1;
+    return rc;
+  }
+  if( zBad ) goto malformed;
+  if( pCsr->zKey ){
+    int n;
+    const char *z = csvCursorText( pCsr, pCSV->iKeyCol, &n );
+    if( !z || n!=pCsr->nKey || memcmp(z, pCsr->zKey, n)!=0 ){
+      /* another key with the same hash tag */
+      goto next_row;
+    }
+  }
+row_done:
+  if( pCsr->nFilter && pCsr->bBatch ){
+    /* scans return rows in the order of the file, so a scan resumed at
+    ** the next one does not miss or repeat any */
+    pCSV->iCheckpoint = pCsr->aBatchRowOff[pCsr->iBatch+1];
+  }else if( pCsr->nFilter && pCsr->idxNum==CSV_PLAN_SCAN ){
+    pCSV->iCheckpoint = csv_tell( pCsr );
+  }
+  if( pCsr->nSkipRow>0 ){
+    /* a row before the OFFSET */
+    pCsr->nSkipRow--;
+    goto next_row;
+  }
+  pCSV->nReadRow++;
+  pCsr->nRow++;
+  pCsr->nFilterRow++;
+  if( pCsr->iLimit>0 ) pCsr->iLimit--;
+  return SQLITE_OK;
+
+malformed:
+  rc = csvMalformed( pCsr, zBad );
+  if( rc!=SQLITE_OK ){
+    pCsr->eof = -1;
+    return rc;
+  }
+  if( pCsr->bBatch ){
+    /* the rest of the batch follows the line skipped */
+    pCsr->nBatch = pCsr->iBatch+1;
+    pCsr->aBatchRowOff[pCsr->nBatch] = csv_tell( pCsr );
+  }
+  if( pCSV->eOnError==CSV_ONERR_SKIP ){
+    /* the row of a rowid lookup is the only one */
+    if( pCsr->idxNum==CSV_PLAN_ROWID && !pCsr->aRowidOff ) goto eof;
+    goto next_row;
+  }
+  pCsr->nCol = 0;  /* a row of NULLs */
+  goto row_done;
+}
+
+
+/*
+** CSV virtual table module xEof method.
+**
+** Return non-zero if the cursor does not currently point to a valid 
+** record (i.e if the scan has finished), or zero otherwise.
+*/
+static int csvEof( sqlite3_vtab_cursor *pVtabCursor )
+{
+  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+
+  return pCsr->eof;
+}
+
+
+/*
+** Return the value of column i of the current row of pCsr, converted on
+** the first call for the row only. Return NULL if out of memory.
+*/
+static const CSVCell *csvCell( CSVCursor *pCsr, int i ){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  CSVCell *p;
+
+  if( !pCsr->aCell ){
+    pCsr->aCell = (CSVCell *)sqlite3_malloc64( sizeof(CSVCell)*pCSV->nColumn );
+    if( !pCsr->aCell ) return 0;
+    memset(pCsr->aCell, 0, sizeof(CSVCell)*pCSV->nColumn);
+  }
+  p = &pCsr->aCell[i];
+  if( p->iRow==pCsr->iCellRow ){
+    pCSV->nCellHit++;
+    return p;
+  }
+
+  // TODO SQLite uses dynamic typing...
+  p->z = csvCursorText( pCsr, i, &p->n );
+  if( !p->z ){
+    p->eType = SQLITE_NULL;
+  }else if( csvIsInt(pCSV, i) && p->n==0 ){
+    p->eType = SQLITE_NULL;
+  }else if( csvIsInt(pCSV, i) && csvCellInt(pCSV, i, p->z, p->n, &p->iVal) ){
+    p->eType = SQLITE_INTEGER;
+  }else if( p->n>=sqlite3_limit(pCSV->db, SQLITE_LIMIT_LENGTH, -1) ){
+    p->eType = 0;
+  }else{
+    p->eType = SQLITE_TEXT; // FIXME sqlite3_result_int64/double
+  }
+  p->iRow = pCsr->iCellRow;
+  pCSV->nCellConv++;
+  return p;
+}
+
+
+/*
+** Write JSON string z of n bytes, with its quotes, to zOut, which has room
+** for 6*n+2 bytes. Return the number of bytes written.
+*/
+static int csvJsonQuote( char *zOut, const char *z, int n ){
+  static const char aHex[] = "0123456789abcdef";
+  char *zStart = zOut;
+  int i;
+  *zOut++ = '"';
+  for(i=0; i<n; i++){
+    unsigned char c = (unsigned char)z[i];
+    if( c=='"' || c=='\\' ){
+      *zOut++ = '\\';
+      *zOut++ = (char)c;
+    }else if( c<0x20 ){
+      memcpy(zOut, "\\u00", 4);
+      zOut[4] = aHex[c>>4];
+      zOut[5] = aHex[c&0xf];
+      zOut += 6;
+    }else{
+      *zOut++ = (char)c;
+    }
+  }
+  *zOut++ = '"';
+  return (int)(zOut - zStart);
+}
+
+/*
+** Set the result of ctx to hidden column iHidden (one of CSV_HIDDEN_*) of
+** the current row of pCsr. _raw and _json are NULL for a malformed row.
+*/
+static int csvColumnHidden(
+  CSVCursor *pCsr,
+  sqlite3_context *ctx,
+  int iHidden
+){
+  CSV *pCSV = (CSV *)pCsr->base.pVtab;
+  const int r = pCsr->iBatch;
+  sqlite3_int64 nMax;
+  int i;
+  char *z;
+
+  if( iHidden==CSV_HIDDEN_RESUME ){
+    if( pCsr->iResume>=0 ) sqlite3_result_int64( ctx, pCsr->iResume );
+    return SQLITE_OK;
+  }
+  if( pCsr->aBatchFlag[r] & CSV_CELL_NULL ){
+    return SQLITE_OK;
+  }
+  if( iHidden==CSV_HIDDEN_RAW ){
+    /* the row as read, without the newline that ends it */
+    sqlite3_result_text( ctx, &pCsr->zRow[pCsr->aBatchPos[r]],
+                         pCsr->aBatchPos[r+1] - pCsr->aBatchPos[r] - 1,
+                         SQLITE_TRANSIENT );
+    return SQLITE_OK;
+  }
+
+  /* _json: size the buffer for the worst case, then write it in one pass */
+  nMax = pCSV->aJsonKey[pCSV->nColumn] + 2;
+  for(i=0; i<pCSV->nColumn; i++){
+    const CSVCell *p = csvCell( pCsr, i );
+    if( !p ){
+      sqlite3_result_error_nomem( ctx );
+      return SQLITE_OK;
+    }
+    nMax += p->eType==SQLITE_TEXT ? 6*(sqlite3_int64)p->n + 3 : 21;
+  }
+  if( nMax>=sqlite3_limit(pCSV->db, SQLITE_LIMIT_LENGTH, -1)*(sqlite3_int64)6 ){
+    sqlite3_result_error_toobig( ctx );
+    return SQLITE_OK;
+  }
+  if( nMax>pCsr->nJson ){
+    char *zNew = sqlite3_realloc64( pCsr->zJson, nMax );
+    if( !zNew ){
+      sqlite3_result_error_nomem( ctx );
+      return SQLITE_OK;
+    }
+    pCsr->zJson = zNew;
+    pCsr->nJson = (int)nMax;
+  }
+  z = pCsr->zJson;
+  *z++ = '{';
+  for(i=0; i<pCSV->nColumn; i++){
+    const CSVCell *p = &pCsr->aCell[i];
+    int nKey = pCSV->aJsonKey[i+1] - pCSV->aJsonKey[i];
+    if( i ) *z++ = ',';
+    memcpy(z, &pCSV->zJsonKey[pCSV->aJsonKey[i]], nKey);
+    z += nKey;
+    if( p->eType==SQLITE_TEXT ){
+      z += csvJsonQuote( z, p->z, p->n );
+    }else if( p->eType==SQLITE_INTEGER ){
+      sqlite3_snprintf( 21, z, "%lld", p->iVal );
+      z += strlen(z);
+    }else{
+      memcpy(z, "null", 4);
+      z += 4;
+    }
+  }
+  *z++ = '}';
+  if( z-pCsr->zJson>=sqlite3_limit(pCSV->db, SQLITE_LIMIT_LENGTH, -1) ){
+    sqlite3_result_error_toobig( ctx );
+  }else{
+    sqlite3_result_text( ctx, pCsr->zJson, (int)(z-pCsr->zJson),
+                         SQLITE_TRANSIENT );
+  }
+  return SQLITE_OK;
+}
+
+
+/* 
+** CSV virtual table module xColumn method.
+*/
+static int csvColumn(sqlite3_vtab_cursor *pVtabCursor, sqlite3_context *ctx, int i){
+  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
+  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+  const CSVCell *p;
+  CSV_PROFILE_START(t0);
+
+  if( i>=pCSV->nColumn ){
+    return csvColumnHidden( pCsr, ctx, i-pCSV->nColumn );
+  }
+
+  p = csvCell( pCsr, i );
+  if( !p ){
+    sqlite3_result_error_nomem( ctx );
+  }else if( p->eType==SQLITE_TEXT ){
+    sqlite3_result_text( ctx, p->z, p->n, SQLITE_TRANSIENT );
+  }else if( p->eType==SQLITE_INTEGER ){
+    sqlite3_result_int64( ctx, p->iVal );
+  }else if( p->eType==SQLITE_NULL ){
+    sqlite3_result_null( ctx );
+  }else{
+    sqlite3_result_error_toobig( ctx );
+  }
+
+  CSV_PROFILE_END(pCSV, CSV_PHASE_COLUMN, t0);
+  return SQLITE_OK;
+}
+
+
+/* 
+** CSV virtual table module xRowid method.
+** We probably should store a hidden table
+** mapping rowid's to csvpos.
+*/
+static int csvRowid( sqlite3_vtab_cursor* pVtabCursor, sqlite3_int64 *pRowid ){
+  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+
+  *pRowid = pCsr->csvpos;
+
+  return SQLITE_OK;
+}
+
+
+static sqlite3_module csvModule = {
+  3,                        /* iVersion */
+  csvCreate,                /* xCreate - create a table */
+  csvConnect,               /* xConnect - connect to an existing table */
+  csvBestIndex,             /* xBestIndex - Determine search strategy */
+  csvDisconnect,            /* xDisconnect - Disconnect from a table */
+  csvDestroy,               /* xDestroy - Drop a table */
+  csvOpen,                  /* xOpen - open a cursor */
+  csvClose,                 /* xClose - close a cursor */
+  csvFilter,                /* xFilter - configure scan constraints */
+  csvNext,                  /* xNext - advance a cursor */
+  csvEof,                   /* xEof */
+  csvColumn,                /* xColumn - read data */
+  csvRowid,                 /* xRowid - read data */
+  0,                        /* xUpdate - write data */
+  0,                        /* xBegin - begin transaction */
+  0,                        /* xSync - sync transaction */
+  0,                        /* xCommit - commit transaction */
+  0,                        /* xRollback - rollback transaction */
+  0,                        /* xFindFunction - function overloading */
+  csvRename,                /* xRename - rename the table */
+  0,                        /* xSavepoint */
+  0,                        /* xRelease */
+  0,                        /* xRollbackTo */
+  csvShadowName             /* xShadowName */
+};
+
+
+/*
+** The csv_errors eponymous virtual table lists the malformed records
+** logged by the CSV tables of the connection, by table and offset:
+**
+**   SELECT offset, reason FROM csv_errors('t');
+**   SELECT tbl, offset, reason, action FROM csv_errors;
+*/
+typedef struct CSVErrorsVtab CSVErrorsVtab;
+typedef struct CSVErrorsCursor CSVErrorsCursor;
+struct CSVErrorsVtab {
+  sqlite3_vtab base;           /* Must be first */
+  CSVGlobal *pGlobal;          /* Module data shared by the connection */
+};
+struct CSVErrorsCursor {
+  sqlite3_vtab_cursor base;    /* Must be first */
+  CSV *pTab;                   /* Table of the current record, or NULL */
+  int iErr;                    /* Current record in pTab->aErr[] */
+  int bOne;                    /* True if only pTab is listed */
+  sqlite3_int64 iRowid;        /* Rowid of the current record */
+};
+#define CSV_ERRORS_TBL      3      /* Column of the table name */
+
+static int csvErrorsConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  CSVErrorsVtab *pNew;
+  int rc;
+
+  UNUSED_PARAMETER(argc);
+  UNUSED_PARAMETER(argv);
+  UNUSED_PARAMETER(pzErr);
+  rc = sqlite3_declare_vtab(db,
+      "CREATE TABLE x(offset INTEGER, reason TEXT, action TEXT, tbl HIDDEN)");
+  if( rc!=SQLITE_OK ) return rc;
+  pNew = (CSVErrorsVtab *)sqlite3_malloc( sizeof(CSVErrorsVtab) );
+  if( !pNew ) return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(CSVErrorsVtab));
+  pNew->pGlobal = (CSVGlobal *)pAux;
+  *ppVtab = &pNew->base;
+  return SQLITE_OK;
+}
+
+static int csvErrorsDisconnect( sqlite3_vtab *pVtab ){
+  sqlite3_free( pVtab );
+  return SQLITE_OK;
+}
+
+/*
+** An equality on tbl lists the records of that table only.
+*/
+static int csvErrorsBestIndex( sqlite3_vtab *pVtab, sqlite3_index_info *info ){
+  int i;
+  UNUSED_PARAMETER(pVtab);
+  info->estimatedCost = 1000.0;
+  for(i=0; i<info->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &info->aConstraint[i];
+    if( pCons->usable && pCons->iColumn==CSV_ERRORS_TBL
+     && pCons->op==SQLITE_INDEX_CONSTRAINT_EQ
+    ){
+      info->aConstraintUsage[i].argvIndex = 1;
+      info->aConstraintUsage[i].omit = 1;
+      info->idxNum = 1;
+      info->estimatedCost = 10.0;
+      break;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int csvErrorsOpen( sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCsr ){
+  CSVErrorsCursor *pCsr;
+  UNUSED_PARAMETER(pVtab);
+  pCsr = (CSVErrorsCursor *)sqlite3_malloc( sizeof(CSVErrorsCursor) );
+  if( !pCsr ) return SQLITE_NOMEM;
+  memset(pCsr, 0, sizeof(CSVErrorsCursor));
+  *ppCsr = &pCsr->base;
+  return SQLITE_OK;
+}
+
+static int csvErrorsClose( sqlite3_vtab_cursor *pCur ){
+  sqlite3_free( pCur );
+  return SQLITE_OK;
+}
+
+/*
+** Move cursor pCsr to record iErr of its table or, past the last one, to
+** the first record of the tables that follow unless only one is listed.
+** The records of a table are those of the current generation of its file.
+*/
+static void csvErrorsSettle( CSVErrorsCursor *pCsr ){
+  while( pCsr->pTab ){
+    CSV *p = pCsr->pTab;
+    if( p->iErrGeneration==p->iGeneration && pCsr->iErr<p->nErr ) return;
+    pCsr->pTab = pCsr->bOne ? 0 : p->pNext;
+    pCsr->iErr = 0;
+  }
+}
+
+static int csvErrorsFilter(
+  sqlite3_vtab_cursor *pCur,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  CSVErrorsCursor *pCsr = (CSVErrorsCursor *)pCur;
+  CSVGlobal *pGlobal = ((CSVErrorsVtab *)pCur->pVtab)->pGlobal;
+
+  UNUSED_PARAMETER(idxStr);
+  UNUSED_PARAMETER(argc);
+  pCsr->iErr = 0;
+  pCsr->iRowid = 1;
+  pCsr->bOne = idxNum==1;
+  if( pCsr->bOne ){
+    char *zErr = 0;
+    pCsr->pTab = csvFindTable( pGlobal,
+                               (const char *)sqlite3_value_text(argv[0]), &zErr );
+    if( !pCsr->pTab ){
+      sqlite3_free( pCur->pVtab->zErrMsg );
+      pCur->pVtab->zErrMsg = zErr;
+      return SQLITE_ERROR;
+    }
+  }else{
+    pCsr->pTab = pGlobal->pTables;
+  }
+  csvErrorsSettle( pCsr );
+  return SQLITE_OK;
+}
+
+static int csvErrorsNext( sqlite3_vtab_cursor *pCur ){
+  CSVErrorsCursor *pCsr = (CSVErrorsCursor *)pCur;
+  pCsr->iErr++;
+  pCsr->iRowid++;
+  csvErrorsSettle( pCsr );
+  return SQLITE_OK;
+}
+
+static int csvErrorsEof( sqlite3_vtab_cursor *pCur ){
+  return ((CSVErrorsCursor *)pCur)->pTab==0;
+}
+
+static int csvErrorsColumn(
+  sqlite3_vtab_cursor *pCur,
+  sqlite3_context *ctx,
+  int i
+){
+  CSVErrorsCursor *pCsr = (CSVErrorsCursor *)pCur;
+  CSV *p = pCsr->pTab;
+  switch( i ){
+    case 0:
+      sqlite3_result_int64(ctx, p->aErr[pCsr->iErr].iOff);
+      break;
+    case 1:
+      sqlite3_result_text(ctx, p->aErr[pCsr->iErr].zReason, -1, SQLITE_STATIC);
+      break;
+    case 2:
+      sqlite3_result_text(ctx, azOnError[p->eOnError], -1, SQLITE_STATIC);
+      break;
+    default:
+      sqlite3_result_text(ctx, p->zName, -1, SQLITE_TRANSIENT);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int csvErrorsRowid( sqlite3_vtab_cursor *pCur, sqlite3_int64 *pRowid ){
+  *pRowid = ((CSVErrorsCursor *)pCur)->iRowid;
+  return SQLITE_OK;
+}
+
+static sqlite3_module csvErrorsModule = {
+  0,                        /* iVersion */
+  0,                        /* xCreate - eponymous only */
+  csvErrorsConnect,         /* xConnect */
+  csvErrorsBestIndex,       /* xBestIndex */
+  csvErrorsDisconnect,      /* xDisconnect */
+  0,                        /* xDestroy */
+  csvErrorsOpen,            /* xOpen */
+  csvErrorsClose,           /* xClose */
+  csvErrorsFilter,          /* xFilter */
+  csvErrorsNext,            /* xNext */
+  csvErrorsEof,             /* xEof */
+  csvErrorsColumn,          /* xColumn */
+  csvErrorsRowid,           /* xRowid */
+  0, 0, 0, 0, 0, 0, 0,      /* xUpdate ... xRename */
+  0, 0, 0, 0                /* xSavepoint ... xShadowName */
+};
+
+
+/*
+** The csv_aggregate eponymous virtual table runs a GROUP BY on a CSV file
+** straight from disk, without declaring a table on it:
+**
+**   SELECT k1, a1, a2 FROM csv_aggregate('sales.csv',
+**       'USE_HEADER_ROW THREADS=8', 'region', 'count(*), sum(amount)');
+**
+** The options are separated by spaces or commas: USE_HEADER_ROW,
+** DELIMITER=c, ON_ERROR=fail|skip|null, NULLS=('value', ...) and
+** THREADS=N. Columns are named as in the header, as colN without one, or
+** by their number from 1. Each row holds the values of the group columns
+** in k1.. and the results of the aggregates in a1..: count(*), count(x),
+** sum(x), avg(x), min(x), max(x) and approx_distinct(x). As in SQL on a
+** CSV table, values are text compared with BINARY, which sum() and avg()
+** take as numbers, and columns past the end of a row and NULLS sentinels
+** are NULL. Rows come in the order of the group values.
+**
+** The file is split into byte ranges parsed by as many threads, each
+** with its own hash table of the groups, keyed by the bytes of the group
+** values, and partial aggregates for each. The tables are merged into
+** the first once all the threads are done. By default there is a thread
+** per CSV_AGG_RANGE bytes, up to one per processor; THREADS=N always
+** makes N ranges.
+**
+** A range but the first starts at the first line of the file that starts
+** in it, which is a row unless it is in a quoted value. So the ranges are
+** parsed on that guess and checked in order once done: the rows of a
+** range go on to the first that starts past its end, and if that is not
+** where the next range started, the next one is parsed again from there.
+*/
+#define CSV_AGG_MAX_KEY     4      /* Columns k1.. for the group values */
+#define CSV_AGG_MAX_AGG     8      /* Columns a1.. for the aggregates */
+#define CSV_AGG_RANGE       (4*1024*1024)
+#define CSV_AGG_READ        (1024*1024)
+#define CSV_AGG_CHUNK       (256*1024)
+
+#define CSV_AGG_COUNT_ALL   0      /* count(*) */
+#define CSV_AGG_COUNT       1
+#define CSV_AGG_SUM         2
+#define CSV_AGG_AVG         3
+#define CSV_AGG_MIN         4
+#define CSV_AGG_MAX         5
+#define CSV_AGG_DISTINCT    6      /* approx_distinct() */
+static const char *const azAggFunc[] = {
+  "count", "count", "sum", "avg", "min", "max", "approx_distinct"
+};
+
+#define CSV_AGG_PATH        (CSV_AGG_MAX_KEY+CSV_AGG_MAX_AGG)  /* Hidden */
+#define CSV_INT64_MAX       ((sqlite3_int64)(((sqlite3_uint64)1<<63)-1))
+#define CSV_INT64_MIN       (-CSV_INT64_MAX-1)
+
+typedef struct CSVAggSpec CSVAggSpec;
+typedef struct CSVAggAcc CSVAggAcc;
+typedef struct CSVAggGroup CSVAggGroup;
+typedef struct CSVAggSlot CSVAggSlot;
+typedef struct CSVAggChunk CSVAggChunk;
+typedef struct CSVAggRange CSVAggRange;
+typedef struct CSVAggCursor CSVAggCursor;
+
+/*
+** What a csv_aggregate() call computes, shared by its threads.
+*/
+struct CSVAggSpec {
+  char cDelim;                 /* DELIMITER option */
+  int bUseHeaderRow;           /* USE_HEADER_ROW option */
+  int eOnError;                /* ON_ERROR option, one of CSV_ONERR_* */
+  int nThread;                 /* THREADS option, or 0 */
+  CSVNullSet nulls;            /* NULLS option */
+  int nMaxRow;                 /* Longest row, from SQLITE_LIMIT_LENGTH */
+  int nKey;                    /* Number of group columns */
+  int aKey[CSV_AGG_MAX_KEY];   /* Group columns */
+  int nAgg;                    /* Number of aggregates */
+  int aFunc[CSV_AGG_MAX_AGG];  /* Aggregate functions, CSV_AGG_* */
+  int aCol[CSV_AGG_MAX_AGG];   /* Their columns, or -1 for count(*) */
+  int nNeed;                   /* Columns parsed: up to the last one used */
+};
+
+/*
+** Partial result of an aggregate for a group. n counts the values seen,
+** which sum() adds in iSum while they are integers and do not overflow,
+** and in rSum otherwise.
+*/
+struct CSVAggAcc {
+  sqlite3_int64 n;             /* Number of values */
+  sqlite3_int64 iSum;          /* Sum of the integer values */
+  double rSum;                 /* Sum of the other values */
+  int bReal;                   /* True if rSum is part of the sum */
+  int nVal;                    /* Length of zVal in bytes */
+  int nValAlloc;               /* Room at zVal */
+  char *zVal;                  /* Value of min() or max() so far */
+  unsigned char *aReg;         /* HyperLogLog registers of approx_distinct */
+};
+
+/*
+** A group, keyed by a byte 0 for each group column the row does not have,
+** or 1 followed by the length of the value (an int) and the value. Groups
+** and the values of their aggregates are allocated from chunks of
+** CSV_AGG_CHUNK bytes, all freed at once, and groups are found through an open-addressing hash table whose slots hold the
+** hash of their key, so that most probes do not touch the group.
+*/
+struct CSVAggGroup {
+  int nKey;                    /* Size of the key in bytes */
+  char *zKey;                  /* The key, after the accumulators */
+  CSVAggAcc aAcc[1];           /* One per aggregate */
+};
+struct CSVAggSlot {
+  sqlite3_uint64 h;            /* Hash of the key of pGroup */
+  CSVAggGroup *pGroup;         /* The group, or NULL if the slot is free */
+};
+struct CSVAggChunk {
+  CSVAggChunk *pNext;          /* Next chunk of the list */
+};
+
+/*
+** A byte range of the file and the groups of its rows. The rows of the
+** range are those that start from iStart to iEnd (excluded); iStop is
+** where the first row past them starts.
+*/
+struct CSVAggRange {
+  const CSVAggSpec *pSpec;     /* What to compute */
+  int fd;                      /* File read, shared by the ranges */
+  sqlite3_int64 nFile;         /* Size of the file */
+  sqlite3_int64 iStart;        /* Offset of the first row */
+  sqlite3_int64 iEnd;          /* Offset where the next range starts */
+  sqlite3_int64 iStop;         /* Offset of the first row after the range */
+  int bSync;                   /* True if iStart is only where to look */
+  char *aBuf;                  /* Read buffer, nAlloc bytes */
+  int nAlloc;
+  int nData;                   /* Bytes read in aBuf */
+  int iPos;                    /* Offset of the next row in aBuf */
+  sqlite3_int64 iBufOff;       /* Offset of aBuf in the file */
+  const char *zRow;            /* The row split, in aBuf */
+  int nCol;                    /* Number of values split, up to nNeed */
+  int nColAlloc;               /* Size of the arrays below */
+  int *aOff;                   /* Offset of each value in zRow */
+  int *aLen;                   /* Length of each value */
+  unsigned char *aFlag;        /* CSV_CELL_ESCAPED or 0 for each */
+  int nNeed;                   /* Values to split from each row */
+  char *zTmp;                  /* Unescaped value, or key being built */
+  int nTmp;
+  char *zVal;                  /* Unescaped value */
+  int nVal;
+  CSVAggSlot *aSlot;           /* Hash table of the groups */
+  int nSlot;                   /* Size of aSlot[], a power of 2 */
+  int nGroup;                  /* Number of groups in aSlot[] */
+  CSVAggChunk *pChunk;         /* Memory of the groups */
+  char *zFree;                 /* Free space in pChunk */
+  int nFree;
+  int rc;                      /* Result of the parse */
+  sqlite3_int64 iBad;          /* Offset of the malformed record */
+  const char *zBad;            /* Why it is malformed */
+  pthread_t thread;            /* Thread parsing the range */
+};
+
+typedef struct CSVAggVtab CSVAggVtab;
+struct CSVAggVtab {
+  sqlite3_vtab base;           /* Must be first */
+  sqlite3 *db;                 /* Host database connection */
+};
+struct CSVAggCursor {
+  sqlite3_vtab_cursor base;    /* Must be first */
+  CSVAggSpec spec;             /* What the last xFilter computed */
+  int nGroup;                  /* Number of groups in aGroup[] */
+  CSVAggGroup **aGroup;        /* Groups, in order */
+  int iGroup;                  /* Current group */
+  CSVAggChunk *pChunk;         /* Memory of the groups */
+};
+
+static void csvAggChunkFree( CSVAggChunk *pChunk ){
+  while( pChunk ){
+    CSVAggChunk *pNext = pChunk->pNext;
+    sqlite3_free( pChunk );
+    pChunk = pNext;
+  }
+}
+
+/*
+** Move the chunks of range p to the front of list *ppChunk.
+*/
+static void csvAggChunkMove( CSVAggRange *p, CSVAggChunk **ppChunk ){
+  CSVAggChunk **pp = &p->pChunk;
+  while( *pp ) pp = &(*pp)->pNext;
+  *pp = *ppChunk;
+  *ppChunk = p->pChunk;
+  p->pChunk = 0;
+  p->nFree = 0;
+}
+
+/*
+** Free the groups of range p, keeping its buffers.
+*/
+static void csvAggReset( CSVAggRange *p ){
+  sqlite3_free( p->aSlot );
+  p->aSlot = 0;
+  p->nSlot = 0;
+  p->nGroup = 0;
+  csvAggChunkFree( p->pChunk );
+  p->pChunk = 0;
+  p->nFree = 0;
+}
+
+static void csvAggRangeFree( CSVAggRange *p ){
+  csvAggReset( p );
+  sqlite3_free( p->aBuf );
+  sqlite3_free( p->aOff );
+  sqlite3_free( p->aLen );
+  sqlite3_free( p->aFlag );
+  sqlite3_free( p->zTmp );
+  sqlite3_free( p->zVal );
+}
+
+/*
+** Make sure that buffer *pz holds at least n bytes.
+*/
+static int csvAggReserve( char **pz, int *pnAlloc, int n ){
+  if( n>*pnAlloc ){
+    int nNew = n + n/2 + 64;
+    char *z = sqlite3_realloc( *pz, nNew );
+    if( !z ) return SQLITE_NOMEM;
+    *pz = z;
+    *pnAlloc = nNew;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Read more of the file into the buffer of range p, after the bytes not
+** used yet, which move to its start. Return the number of bytes read,
+** 0 at end of file, or -1 on error. The buffer always has a spare byte.
+*/
+static int csvAggFill( CSVAggRange *p ){
+  sqlite3_int64 iOff = p->iBufOff + p->nData;
+  int nRead;
+  int n;
+
+  if( iOff>=p->nFile ) return 0;
+  if( p->iPos>0 ){
+    memmove(p->aBuf, &p->aBuf[p->iPos], p->nData - p->iPos);
+    p->iBufOff += p->iPos;
+    p->nData -= p->iPos;
+    p->iPos = 0;
+  }
+  if( csvAggReserve( &p->aBuf, &p->nAlloc, p->nData+CSV_AGG_READ+1 ) ){
+    p->rc = SQLITE_NOMEM;
+    return -1;
+  }
+  nRead = CSV_AGG_READ;
+  if( iOff+nRead>p->nFile ) nRead = (int)(p->nFile - iOff);
+  n = csv_read( p->fd, &p->aBuf[p->nData], nRead, iOff );
+  if( n<0 ){
+    p->rc = SQLITE_IOERR;
+    return -1;
+  }
+  if( n==0 ) p->nFile = iOff;  /* the file was truncated */
+  p->nData += n;
+  return n;
+}
+
+/*
+** Move range p past the next newline, or to the end of the file.
+*/
+static int csvAggSkipLine( CSVAggRange *p ){
+  while( p->iPos<p->nData || csvAggFill( p )>0 ){
+    const char *pEol = memchr(&p->aBuf[p->iPos], '\n', p->nData - p->iPos);
+    if( pEol ){
+      p->iPos = (int)(pEol - p->aBuf) + 1;
+      return SQLITE_OK;
+    }
+    p->iPos = p->nData;
+  }
+  return p->rc;
+}
+
+/*
+** Return the length of the row at a, up to and including the first
+** newline that is not in a quoted value, or -1 if the n bytes at a do not
+** hold all of it. Quotes are dealt with as by csv_readline().
+*/
+static int csvAggRowEnd( const char *a, int n, char cDelim ){
+  int bQuotedCol = 0;
+  int bClosed = 0;
+  char cPrev = cDelim;
+  int j;
+
+  for(j=0; j<n; j++){
+    char c;
+    if( bQuotedCol ){
+      const char *pQuote = memchr(&a[j], '\"', n-j);
+      if( !pQuote ) return -1;
+      j = (int)(pQuote-a);
+    }else if( !bClosed ){
+      const char *pEol = memchr(&a[j], '\n', n-j);
+      int iEnd = pEol ? (int)(pEol-a) : n;
+      const char *pQuote = memchr(&a[j], '\"', iEnd-j);
+      if( !pQuote ) return pEol ? iEnd+1 : -1;
+      if( pQuote>&a[j] ) cPrev = pQuote[-1];
+      j = (int)(pQuote-a);
+    }
+    c = a[j];
+    if( c=='\"' ){
+      if( bQuotedCol ){
+        bQuotedCol = 0;
+        bClosed = 1;
+      }else if( bClosed ){
+        bQuotedCol = 1;
+        bClosed = 0;
+      }else if( cPrev==cDelim ){
+        bQuotedCol = 1;
+      }
+    }else{
+      bClosed = 0;
+      if( c=='\n' && !bQuotedCol ) return j+1;
+    }
+    cPrev = c;
+  }
+  return -1;
+}
+
+/*
+** Split the first p->nNeed values of row z, which ends with the newline
+** at z[n-1], as csvBatchRow() does. The rest of the row is only checked
+** if it has quotes. Return why the row is malformed, or NULL.
+*/
+static const char *csvAggSplit( CSVAggRange *p, const char *z, int n ){
+  const char cDelim = p->pSpec->cDelim;
+  int i = 0;
+  int iCol = 0;
 
+  p->zRow = z;
+  p->nCol = 0;
+  while( 1 ){
+    int iOff, nVal;
+    unsigned char f = 0;
+    if( iCol==p->nNeed && !memchr(&z[i], '\"', n-i) ) break;
+    if( z[i]=='\"' ){
+      iOff = ++i;
+      while( 1 ){
+        const char *pQuote = memchr(&z[i], '\"', n-i);
+        if( !pQuote ) return "unclosed quote";
+        i = (int)(pQuote-z);
+        if( z[i+1]!='\"' ) break;
+        f = CSV_CELL_ESCAPED;
+        i += 2;
+      }
+      nVal = i-iOff;
+      i++;
+      if( z[i]!=cDelim && z[i]!='\n' ) return "missing delimiter";
+    }else{
+      iOff = i;
+      while( z[i]!=cDelim && z[i]!='\n' ) i++;
+      nVal = i-iOff;
+      if( p->pSpec->nulls.mNullLen
+       && csvIsNull( &p->pSpec->nulls, &z[iOff], nVal )
+      ){
+        f = CSV_CELL_NULL;
+      }
+    }
+    if( iCol<p->nNeed ){
+      if( iCol>=p->nColAlloc ){
+        int nNew = p->nColAlloc*2 + 8;
+        int *aOff = sqlite3_realloc( p->aOff, nNew*sizeof(int) );
+        int *aLen = aOff ? sqlite3_realloc( p->aLen, nNew*sizeof(int) ) : 0;
+        unsigned char *aFlag = aLen ? sqlite3_realloc( p->aFlag, nNew ) : 0;
+        if( aOff ) p->aOff = aOff;
+        if( aLen ) p->aLen = aLen;
+        if( !aFlag ){
+          p->rc = SQLITE_NOMEM;
+          return "out of memory";
+        }
+        p->aFlag = aFlag;
+        p->nColAlloc = nNew;
+      }
+      p->aOff[iCol] = iOff;
+      p->aLen[iCol] = nVal;
+      p->aFlag[iCol] = f;
+      p->nCol = iCol+1;
+    }
+    iCol++;
+    if( z[i++]=='\n' ) break;
+  }
+  return 0;
+}
 
-/* 
-** CSV virtual table module xDestroy method.
+/*
+** Read and split the next row of range p. Return SQLITE_ROW, SQLITE_OK if
+** a malformed record was skipped, SQLITE_DONE at end of file, or an
+** error code. A malformed record is dealt with as by csvMalformed(): a
+** row of NULLs with ON_ERROR=null has no values at all.
 */
-static int csvDestroy( sqlite3_vtab *pVtab ){
-  return csvDisconnect( pVtab );
+static int csvAggRow( CSVAggRange *p ){
+  const CSVAggSpec *pSpec = p->pSpec;
+  sqlite3_int64 iRow = p->iBufOff + p->iPos;
+  const char *zBad = 0;
+  char *z;
+  int n, iEnd;
+
+  while( 1 ){
+    z = &p->aBuf[p->iPos];
+    n = p->nData - p->iPos;
+    iEnd = csvAggRowEnd( z, n, pSpec->cDelim );
+    if( iEnd>=0 ) break;
+    if( n>pSpec->nMaxRow ){
+      zBad = "row too long";
+      break;
+    }
+    if( csvAggFill( p )<=0 ){
+      if( p->rc ) return p->rc;
+      if( p->iPos>=p->nData ) return SQLITE_DONE;
+      /* unterminated last row, which the spare byte ends */
+      z = &p->aBuf[p->iPos];
+      n = p->nData - p->iPos;
+      z[n] = '\n';
+      iEnd = n+1;
+      break;
+    }
+  }
+  if( !zBad ){
+    int nRow = iEnd;
+    if( nRow>1 && z[nRow-2]=='\r' ) z[--nRow - 1] = '\n';
+    zBad = csvAggSplit( p, z, nRow );
+    if( p->rc ) return p->rc;
+    if( !zBad ){
+      p->iPos += iEnd;
+      if( p->iPos>p->nData ) p->iPos = p->nData;
+      return SQLITE_ROW;
+    }
+  }
+  if( pSpec->eOnError==CSV_ONERR_FAIL ){
+    p->iBad = iRow;
+    p->zBad = zBad;
+    return SQLITE_ERROR;
+  }
+  if( csvAggSkipLine( p ) ) return p->rc;
+  p->nCol = 0;
+  return pSpec->eOnError==CSV_ONERR_NULL ? SQLITE_ROW : SQLITE_OK;
 }
 
+/*
+** Return value iCol of the row split in range p and set *pn to its
+** length, or return NULL if the row has no such value. Escaped quotes are
+** unescaped into p->zVal, which the next call may reuse.
+*/
+static const char *csvAggValue( CSVAggRange *p, int iCol, int *pn ){
+  const char *z;
+  int i, j;
 
-/* 
-** CSV virtual table module xOpen method.
+  if( iCol>=p->nCol || (p->aFlag[iCol] & CSV_CELL_NULL) ) return 0;
+  z = &p->zRow[p->aOff[iCol]];
+  *pn = p->aLen[iCol];
+  if( !(p->aFlag[iCol] & CSV_CELL_ESCAPED) ) return z;
+  if( csvAggReserve( &p->zVal, &p->nVal, *pn ) ){
+    p->rc = SQLITE_NOMEM;
+    return 0;
+  }
+  for(i=j=0; i<*pn; i++){
+    p->zVal[j++] = z[i];
+    if( z[i]=='\"' ) i++;
+  }
+  *pn = j;
+  return p->zVal;
+}
+
+/*
+** Return the slot of the group with key zKey (nKey bytes, hash h) in the
+** hash table of range p, or the free slot where it belongs.
 */
-static int csvOpen( sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppVtabCursor ){
-  int rc = SQLITE_NOMEM;
-  CSVCursor *pCsr;
+static CSVAggSlot *csvAggSlot(
+  CSVAggRange *p,
+  sqlite3_uint64 h,
+  const char *zKey, int nKey
+){
+  int i = (int)(h & (sqlite3_uint64)(p->nSlot-1));
+  while( p->aSlot[i].pGroup ){
+    if( p->aSlot[i].h==h && (!zKey
+     || (p->aSlot[i].pGroup->nKey==nKey
+         && (nKey==0 || memcmp(p->aSlot[i].pGroup->zKey, zKey, nKey)==0)))
+    ){
+      break;
+    }
+    i = (i+1) & (p->nSlot-1);
+  }
+  return &p->aSlot[i];
+}
 
-  /* create a new cursor object */
-  pCsr = (CSVCursor *)sqlite3_malloc(sizeof(CSVCursor));
-  if( pCsr ){
-    memset(pCsr, 0, sizeof(CSVCursor));
-    pCsr->base.pVtab = pVtab;
-    rc = SQLITE_OK;
+/*
+** Make room for one more group in the hash table of range p, which is
+** kept no more than half full.
+*/
+static int csvAggGrow( CSVAggRange *p ){
+  CSVAggSlot *aOld = p->aSlot;
+  int nOld = p->nSlot;
+  int i;
+
+  if( (p->nGroup+1)*2<=p->nSlot ) return SQLITE_OK;
+  p->nSlot = nOld ? nOld*2 : 64;
+  p->aSlot = (CSVAggSlot *)sqlite3_malloc64( sizeof(CSVAggSlot)*p->nSlot );
+  if( !p->aSlot ){
+    p->aSlot = aOld;
+    p->nSlot = nOld;
+    return SQLITE_NOMEM;
   }
-  *ppVtabCursor = (sqlite3_vtab_cursor *)pCsr;
+  memset(p->aSlot, 0, sizeof(CSVAggSlot)*p->nSlot);
+  for(i=0; i<nOld; i++){
+    if( aOld[i].pGroup ){
+      /* keys are all distinct: any free slot will do */
+      *csvAggSlot( p, aOld[i].h, 0, 0 ) = aOld[i];
+    }
+  }
+  sqlite3_free( aOld );
+  return SQLITE_OK;
+}
+
+/*
+** Allocate n bytes from the chunks of range p, or return NULL if out of
+** memory. A value moved to a group of another range stays in the chunks
+** of its own, which are kept as long.
+*/
+static char *csvAggAlloc( CSVAggRange *p, int n ){
+  char *z;
+  n = (n + 7) & ~7;
+  if( n>p->nFree ){
+    int nChunk = n>CSV_AGG_CHUNK ? n : CSV_AGG_CHUNK;
+    CSVAggChunk *pChunk = (CSVAggChunk *)sqlite3_malloc(
+        (int)sizeof(CSVAggChunk) + nChunk );
+    if( !pChunk ) return 0;
+    pChunk->pNext = p->pChunk;
+    p->pChunk = pChunk;
+    p->zFree = (char *)&pChunk[1];
+    p->nFree = nChunk;
+  }
+  z = p->zFree;
+  p->zFree += n;
+  p->nFree -= n;
+  return z;
+}
+
+/*
+** Return the group with key zKey (nKey bytes, hash h) of range p, added
+** if there is none yet, or NULL if out of memory.
+*/
+static CSVAggGroup *csvAggGroup(
+  CSVAggRange *p,
+  sqlite3_uint64 h,
+  const char *zKey, int nKey
+){
+  CSVAggSlot *pSlot;
+  CSVAggGroup *pGroup;
+  int nAcc = p->pSpec->nAgg>1 ? p->pSpec->nAgg : 1;
+  int nByte = (int)sizeof(CSVAggGroup) + (nAcc-1)*(int)sizeof(CSVAggAcc);
+
+  if( p->nSlot ){
+    pSlot = csvAggSlot( p, h, zKey, nKey );
+    if( pSlot->pGroup ) return pSlot->pGroup;
+  }
+  if( csvAggGrow( p ) ) return 0;
+  pGroup = (CSVAggGroup *)csvAggAlloc( p, nByte + nKey );
+  if( !pGroup ) return 0;
+  memset(pGroup, 0, nByte);
+  pGroup->nKey = nKey;
+  pGroup->zKey = &((char *)pGroup)[nByte];
+  if( nKey>0 ) memcpy(pGroup->zKey, zKey, nKey);
+  pSlot = csvAggSlot( p, h, zKey, nKey );
+  pSlot->h = h;
+  pSlot->pGroup = pGroup;
+  p->nGroup++;
+  return pGroup;
+}
+
+/*
+** Take text z of n bytes as a number, as SQLite does for sum(): set *piVal
+** and return 1 if it is an integer, or set *prVal to the value of the
+** number it starts with (0.0 if none) and return 0.
+*/
+static int csvAggNumber(
+  const char *z, int n,
+  sqlite3_int64 *piVal,
+  double *prVal
+){
+  char zBuf[64];
+  int i = 0;
+
+  while( n>0 && (z[n-1]==' ' || (z[n-1]>='\t' && z[n-1]<='\r')) ) n--;
+  while( i<n && (z[i]==' ' || (z[i]>='\t' && z[i]<='\r')) ) i++;
+  z += i;
+  n -= i;
+  if( n>=(int)sizeof(zBuf) ) n = (int)sizeof(zBuf)-1;
+  memcpy(zBuf, z, n);
+  zBuf[n] = 0;
+  i = (zBuf[0]=='-' || zBuf[0]=='+');
+  if( zBuf[i]>='0' && zBuf[i]<='9' && n-i<=19 ){
+    while( zBuf[i]>='0' && zBuf[i]<='9' ) i++;
+    if( zBuf[i]==0 ){
+      errno = 0;
+      *piVal = strtoll(zBuf, 0, 10);
+      if( errno==0 ) return 1;
+    }
+    i = (zBuf[0]=='-' || zBuf[0]=='+');
+  }
+  /* only the decimal number it starts with: strtod() would also take
+  ** hexadecimal, infinity and NaN */
+  {
+    int nDigit = 0;
+    while( zBuf[i]>='0' && zBuf[i]<='9' ){ i++; nDigit++; }
+    if( zBuf[i]=='.' ){
+      i++;
+      while( zBuf[i]>='0' && zBuf[i]<='9' ){ i++; nDigit++; }
+    }
+    if( nDigit>0 && (zBuf[i]=='e' || zBuf[i]=='E') ){
+      int j = i+1;
+      if( zBuf[j]=='-' || zBuf[j]=='+' ) j++;
+      if( zBuf[j]>='0' && zBuf[j]<='9' ){
+        while( zBuf[j]>='0' && zBuf[j]<='9' ) j++;
+        i = j;
+      }
+    }
+    zBuf[i] = 0;
+    *prVal = nDigit>0 ? strtod(zBuf, 0) : 0.0;
+  }
+  return 0;
+}
+
+/*
+** Add the row split in range p to its group.
+*/
+static int csvAggStep( CSVAggRange *p ){
+  const CSVAggSpec *pSpec = p->pSpec;
+  CSVAggGroup *pGroup;
+  int nKey = 0;
+  int i;
+
+  for(i=0; i<pSpec->nKey; i++){
+    int n = 0;
+    const char *z = csvAggValue( p, pSpec->aKey[i], &n );
+    if( p->rc ) return p->rc;
+    if( csvAggReserve( &p->zTmp, &p->nTmp, nKey+1+(int)sizeof(int)+n ) ){
+      return SQLITE_NOMEM;
+    }
+    if( !z ){
+      p->zTmp[nKey++] = 0;
+    }else{
+      p->zTmp[nKey++] = 1;
+      memcpy(&p->zTmp[nKey], &n, sizeof(int));
+      memcpy(&p->zTmp[nKey+sizeof(int)], z, n);
+      nKey += (int)sizeof(int) + n;
+    }
+  }
+  pGroup = csvAggGroup( p, csvMix( csvHash( CSV_HASH_INIT, p->zTmp, nKey ) ),
+                        p->zTmp, nKey );
+  if( !pGroup ) return SQLITE_NOMEM;
+
+  for(i=0; i<pSpec->nAgg; i++){
+    CSVAggAcc *pAcc = &pGroup->aAcc[i];
+    const char *z;
+    int n = 0;
+    if( pSpec->aFunc[i]==CSV_AGG_COUNT_ALL ){
+      pAcc->n++;
+      continue;
+    }
+    z = csvAggValue( p, pSpec->aCol[i], &n );
+    if( !z ){
+      if( p->rc ) return p->rc;
+      continue;
+    }
+    switch( pSpec->aFunc[i] ){
+      case CSV_AGG_SUM:
+      case CSV_AGG_AVG: {
+        sqlite3_int64 iVal;
+        double rVal;
+        if( !csvAggNumber( z, n, &iVal, &rVal ) ){
+          pAcc->rSum += rVal;
+          pAcc->bReal = 1;
+        }else if( (iVal>0 && pAcc->iSum>CSV_INT64_MAX-iVal)
+               || (iVal<0 && pAcc->iSum<CSV_INT64_MIN-iVal) ){
+          /* the sum goes on as a real, where SQLite would fail */
+          pAcc->rSum += (double)iVal;
+          pAcc->bReal = 1;
+        }else{
+          pAcc->iSum += iVal;
+        }
+        break;
+      }
+      case CSV_AGG_MIN:
+      case CSV_AGG_MAX: {
+        int c = pAcc->zVal ? csvTextCmp(z, n, pAcc->zVal, pAcc->nVal) : 0;
+        if( !pAcc->zVal || (pSpec->aFunc[i]==CSV_AGG_MIN ? c<0 : c>0) ){
+          if( n>pAcc->nValAlloc ){
+            pAcc->zVal = csvAggAlloc( p, n );
+            if( !pAcc->zVal ) return SQLITE_NOMEM;
+            pAcc->nValAlloc = n;
+          }
+          memcpy(pAcc->zVal, z, n);
+          pAcc->nVal = n;
+        }
+        break;
+      }
+      case CSV_AGG_DISTINCT: {
+        if( !pAcc->aReg ){
+          pAcc->aReg = (unsigned char *)csvAggAlloc( p, 1<<CSV_HLL_BITS );
+          if( !pAcc->aReg ) return SQLITE_NOMEM;
+          memset(pAcc->aReg, 0, 1<<CSV_HLL_BITS);
+        }
+        csvHllAdd( pAcc->aReg, csvHash( CSV_HASH_INIT, z, n ) );
+        break;
+      }
+    }
+    pAcc->n++;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Parse the rows of range p into its groups. With p->bSync set, the range
+** starts with the first line that starts from iStart on, and iStart is
+** moved there.
+*/
+static void csvAggRun( CSVAggRange *p ){
+  int rc = SQLITE_OK;
+
+  p->iBufOff = p->iStart;
+  p->iPos = p->nData = 0;
+  p->rc = SQLITE_OK;
+  p->zBad = 0;
+  if( p->bSync ){
+    p->iBufOff = p->iStart-1;
+    rc = csvAggSkipLine( p );
+    p->iStart = p->iBufOff + p->iPos;
+  }
+  while( rc==SQLITE_OK ){
+    p->iStop = p->iBufOff + p->iPos;
+    if( p->iStop>=p->iEnd ) break;
+    rc = csvAggRow( p );
+    if( rc==SQLITE_ROW ){
+      rc = csvAggStep( p );
+    }else if( rc==SQLITE_DONE ){
+      p->iStop = p->nFile;
+      rc = SQLITE_OK;
+      break;
+    }
+  }
+  p->rc = rc;
+}
+
+static void *csvAggWorker( void *pArg ){
+  csvAggRun( (CSVAggRange *)pArg );
+  return 0;
+}
+
+/*
+** Merge the group of slot pFrom of another range into range p, which
+** takes it over unless it has the same group already. Partial aggregates
+** add up as the aggregates do. The chunks of the other range must then
+** be kept as long as those of p.
+*/
+static int csvAggMerge( CSVAggRange *p, CSVAggSlot *pFrom ){
+  const CSVAggSpec *pSpec = p->pSpec;
+  CSVAggSlot *pSlot;
+  CSVAggGroup *pTo;
+  int i;
+
+  if( csvAggGrow( p ) ) return SQLITE_NOMEM;
+  pSlot = csvAggSlot( p, pFrom->h, pFrom->pGroup->zKey, pFrom->pGroup->nKey );
+  if( !pSlot->pGroup ){
+    *pSlot = *pFrom;
+    pFrom->pGroup = 0;
+    p->nGroup++;
+    return SQLITE_OK;
+  }
+  pTo = pSlot->pGroup;
+  for(i=0; i<pSpec->nAgg; i++){
+    CSVAggAcc *pA = &pTo->aAcc[i];
+    CSVAggAcc *pB = &pFrom->pGroup->aAcc[i];
+    int j;
+    if( pB->n==0 ) continue;
+    if( (pB->iSum>0 && pA->iSum>CSV_INT64_MAX-pB->iSum)
+     || (pB->iSum<0 && pA->iSum<CSV_INT64_MIN-pB->iSum) ){
+      pA->rSum += (double)pB->iSum;
+      pA->bReal = 1;
+    }else{
+      pA->iSum += pB->iSum;
+    }
+    pA->rSum += pB->rSum;
+    pA->bReal |= pB->bReal;
+    if( pB->zVal ){
+      int c = pA->zVal ? csvTextCmp(pB->zVal, pB->nVal, pA->zVal, pA->nVal) : 0;
+      if( !pA->zVal || (pSpec->aFunc[i]==CSV_AGG_MIN ? c<0 : c>0) ){
+        pA->zVal = pB->zVal;
+        pA->nVal = pB->nVal;
+        pA->nValAlloc = pB->nValAlloc;
+      }
+    }
+    if( pB->aReg && !pA->aReg ){
+      pA->aReg = pB->aReg;
+    }else if( pB->aReg ){
+      for(j=0; j<(1<<CSV_HLL_BITS); j++){
+        if( pB->aReg[j]>pA->aReg[j] ) pA->aReg[j] = pB->aReg[j];
+      }
+    }
+    pA->n += pB->n;
+  }
+  pFrom->pGroup = 0;
+  return SQLITE_OK;
+}
+
+/*
+** Order groups by their values, NULL first, as ORDER BY k1, k2.. would.
+** They are radix-sorted on the first bytes of their key, kept with them,
+** and only groups with the same first bytes are compared.
+*/
+typedef struct CSVAggSort CSVAggSort;
+struct CSVAggSort {
+  sqlite3_uint64 iPrefix;      /* First 8 bytes of the key, but the length */
+  CSVAggGroup *pGroup;
+};
+static int csvAggGroupCmp( const void *a, const void *b ){
+  const CSVAggSort *pA = (const CSVAggSort *)a;
+  const CSVAggSort *pB = (const CSVAggSort *)b;
+  const CSVAggGroup *x = pA->pGroup;
+  const CSVAggGroup *y = pB->pGroup;
+  int i = 0;
+  if( pA->iPrefix!=pB->iPrefix ) return pA->iPrefix<pB->iPrefix ? -1 : 1;
+  while( i<x->nKey ){
+    int nx, ny, c;
+    if( x->zKey[i]!=y->zKey[i] ) return x->zKey[i] - y->zKey[i];
+    if( x->zKey[i++]==0 ) continue;
+    memcpy(&nx, &x->zKey[i], sizeof(int));
+    memcpy(&ny, &y->zKey[i], sizeof(int));
+    i += (int)sizeof(int);
+    c = csvTextCmp(&x->zKey[i], nx, &y->zKey[i], ny);
+    if( c ) return c;
+    i += nx;
+  }
+  return 0;
+}
+
+/*
+** Take the groups of range p into cursor pCsr, in order.
+*/
+static int csvAggSort( CSVAggCursor *pCsr, CSVAggRange *p ){
+  CSVAggSort *a, *aTmp;
+  int n = 0;
+  int i, j, iShift;
+
+  a = (CSVAggSort *)sqlite3_malloc64( sizeof(CSVAggSort)*(p->nGroup+1)*2 );
+  pCsr->aGroup = (CSVAggGroup **)sqlite3_malloc64(
+      sizeof(CSVAggGroup*)*(p->nGroup+1) );
+  if( !a || !pCsr->aGroup ){
+    sqlite3_free( a );
+    return SQLITE_NOMEM;
+  }
+  aTmp = &a[p->nGroup+1];
+  for(i=0; i<p->nSlot; i++){
+    CSVAggGroup *pGroup = p->aSlot[i].pGroup;
+    if( pGroup ){
+      const unsigned char *z = (const unsigned char *)pGroup->zKey;
+      sqlite3_uint64 x = 0;
+      int nVal = 0;
+      int j;
+      if( pGroup->nKey>0 && z[0] ){
+        memcpy(&nVal, &z[1], sizeof(int));
+        if( nVal>7 ) nVal = 7;
+        x = 1;
+      }
+      for(j=0; j<7; j++){
+        x = (x<<8) | (j<nVal ? z[1+sizeof(int)+j] : 0);
+      }
+      a[n].iPrefix = x;
+      a[n++].pGroup = pGroup;
+      p->aSlot[i].pGroup = 0;
+    }
+  }
+
+  /* least significant byte first, skipping the bytes all prefixes share */
+  for(iShift=0; iShift<64; iShift+=8){
+    int aCount[256];
+    CSVAggSort *aSwap;
+    memset(aCount, 0, sizeof(aCount));
+    for(i=0; i<n; i++) aCount[(a[i].iPrefix>>iShift) & 0xff]++;
+    if( n==0 || aCount[(a[0].iPrefix>>iShift) & 0xff]==n ) continue;
+    for(i=j=0; i<256; i++){
+      int nByte = aCount[i];
+      aCount[i] = j;
+      j += nByte;
+    }
+    for(i=0; i<n; i++) aTmp[aCount[(a[i].iPrefix>>iShift) & 0xff]++] = a[i];
+    aSwap = a;
+    a = aTmp;
+    aTmp = aSwap;
+  }
+  for(i=0; i<n; i=j){
+    for(j=i+1; j<n && a[j].iPrefix==a[i].iPrefix; j++);
+    if( j-i>1 ) qsort(&a[i], j-i, sizeof(CSVAggSort), csvAggGroupCmp);
+  }
+  for(i=0; i<n; i++) pCsr->aGroup[i] = a[i].pGroup;
+  if( aTmp<a ) a = aTmp;
+  pCsr->nGroup = n;
+  sqlite3_free( a );
+  return SQLITE_OK;
+}
+
+/*
+** Return the number of column zName (n bytes, maybe in double quotes) for
+** csv_aggregate(), given the nName column names of the header, or -1.
+*/
+static int csvAggFindColumn(
+  const char *zName, int n,
+  char **azName, int nName
+){
+  int i;
+  if( n>=2 && zName[0]=='\"' && zName[n-1]=='\"' ){
+    zName++;
+    n -= 2;
+  }
+  for(i=0; i<nName; i++){
+    if( (int)strlen(azName[i])==n && sqlite3_strnicmp(azName[i], zName, n)==0 ){
+      return i;
+    }
+  }
+  i = 0;
+  if( !azName && n>3 && sqlite3_strnicmp(zName, "col", 3)==0 ) i = 3;
+  if( i<n && zName[i]>='1' && zName[i]<='9' ){
+    int iCol = 0;
+    for(; i<n && zName[i]>='0' && zName[i]<='9' && iCol<=32767; i++){
+      iCol = iCol*10 + zName[i]-'0';
+    }
+    if( i==n ) return iCol-1;
+  }
+  return -1;
+}
+
+/*
+** Return the next item of comma-separated list z, set *pz and *pn to it
+** without the spaces around, and return where the one after starts, or
+** NULL at the end of the list. Commas in double quotes or parentheses do
+** not separate items.
+*/
+static const char *csvAggItem( const char *z, const char **pz, int *pn ){
+  int bQuoted = 0;
+  int nParen = 0;
+  int n;
+  while( *z==' ' ) z++;
+  if( !*z ) return 0;
+  for(n=0; z[n] && (bQuoted || nParen || z[n]!=','); n++){
+    if( z[n]=='\"' ) bQuoted = !bQuoted;
+    else if( !bQuoted && z[n]=='(' ) nParen++;
+    else if( !bQuoted && z[n]==')' && nParen ) nParen--;
+  }
+  *pz = z;
+  *pn = n;
+  while( *pn>0 && z[*pn-1]==' ' ) (*pn)--;
+  return z[n] ? &z[n+1] : &z[n];
+}
+
+/*
+** Set up *pSpec from the options, group columns and aggregates of a
+** csv_aggregate() call, given the column names of the header, if any.
+*/
+static int csvAggParse(
+  CSVAggSpec *pSpec,
+  const char *zKeys,
+  const char *zAggs,
+  char **azName, int nName,
+  char **pzErr
+){
+  const char *z;
+  const char *zItem;
+  int n, i;
+
+  for(z=zKeys; z && (z = csvAggItem( z, &zItem, &n ))!=0; ){
+    if( n==0 ) continue;
+    if( pSpec->nKey>=CSV_AGG_MAX_KEY ){
+      *pzErr = sqlite3_mprintf(aErrMsg[16], "group columns", CSV_AGG_MAX_KEY);
+      return SQLITE_ERROR;
+    }
+    i = csvAggFindColumn( zItem, n, azName, nName );
+    if( i<0 ){
+      *pzErr = sqlite3_mprintf(aErrMsg[14], n, zItem);
+      return SQLITE_ERROR;
+    }
+    pSpec->aKey[pSpec->nKey++] = i;
+    if( i+1>pSpec->nNeed ) pSpec->nNeed = i+1;
+  }
+  for(z=zAggs; z && (z = csvAggItem( z, &zItem, &n ))!=0; ){
+    const char *zArg = memchr(zItem, '(', n);
+    int nFunc, nArg, e;
+    if( n==0 ) continue;
+    if( pSpec->nAgg>=CSV_AGG_MAX_AGG ){
+      *pzErr = sqlite3_mprintf(aErrMsg[16], "aggregates", CSV_AGG_MAX_AGG);
+      return SQLITE_ERROR;
+    }
+    if( !zArg || zItem[n-1]!=')' ){
+      *pzErr = sqlite3_mprintf(aErrMsg[15], n, zItem);
+      return SQLITE_ERROR;
+    }
+    for(nFunc=(int)(zArg-zItem); nFunc>0 && zItem[nFunc-1]==' '; nFunc--);
+    for(e=1; e<=CSV_AGG_DISTINCT; e++){
+      if( (int)strlen(azAggFunc[e])==nFunc
+       && sqlite3_strnicmp(azAggFunc[e], zItem, nFunc)==0
+      ){
+        break;
+      }
+    }
+    zArg++;
+    while( *zArg==' ' ) zArg++;
+    for(nArg=(int)(&zItem[n-1]-zArg); nArg>0 && zArg[nArg-1]==' '; nArg--);
+    if( e>CSV_AGG_DISTINCT
+     || (nArg==1 && zArg[0]=='*' && e!=CSV_AGG_COUNT)
+    ){
+      *pzErr = sqlite3_mprintf(aErrMsg[15], n, zItem);
+      return SQLITE_ERROR;
+    }
+    if( nArg==1 && zArg[0]=='*' ){
+      e = CSV_AGG_COUNT_ALL;
+      i = -1;
+    }else{
+      i = csvAggFindColumn( zArg, nArg, azName, nName );
+      if( i<0 ){
+        *pzErr = sqlite3_mprintf(aErrMsg[14], nArg, zArg);
+        return SQLITE_ERROR;
+      }
+    }
+    pSpec->aFunc[pSpec->nAgg] = e;
+    pSpec->aCol[pSpec->nAgg++] = i;
+    if( i+1>pSpec->nNeed ) pSpec->nNeed = i+1;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Parse the options of a csv_aggregate() call into *pSpec: words
+** separated by spaces or commas, whose value is what follows the '='.
+** The value of DELIMITER is the one character after it, even a space or
+** a comma, or a character in quotes as in the arguments of the csv
+** module: 'USE_HEADER_ROW, DELIMITER=;' and 'USE_HEADER_ROW
+** DELIMITER='';''' are the same. NULLS takes quoted values, as for a
+** table.
+*/
+static int csvAggOptions( CSVAggSpec *pSpec, const char *z, char **pzErr ){
+  while( z && *z ){
+    char *zOpt;
+    int n;
+    if( *z==' ' || *z==',' ){
+      z++;
+      continue;
+    }
+    if( sqlite3_strnicmp(z, "DELIMITER=", 10)==0 && z[10]=='\''
+     && z[11] && z[12]=='\'' && (z[13]==0 || z[13]==' ' || z[13]==',')
+    ){
+      pSpec->cDelim = z[11];
+      z += 13;
+      continue;
+    }
+    if( sqlite3_strnicmp(z, "DELIMITER=", 10)==0 && z[10]
+     && (z[11]==0 || z[11]==' ' || z[11]==',')
+    ){
+      pSpec->cDelim = z[10];
+      z += 11;
+      continue;
+    }
+    if( sqlite3_strnicmp(z, "NULLS=", 6)==0 ){
+      /* quoted values, whose list may hold spaces and commas */
+      int bList = z[6]=='(';
+      int bQuote = 0;
+      int rc;
+      for(n=6; z[n]; n++){
+        if( z[n]=='\'' ){
+          bQuote = !bQuote;
+        }else if( !bQuote && bList && z[n]==')' ){
+          n++;
+          break;
+        }else if( !bQuote && !bList && (z[n]==' ' || z[n]==',') ){
+          break;
+        }
+      }
+      zOpt = sqlite3_mprintf("%.*s", n, z);
+      if( !zOpt ) return SQLITE_NOMEM;
+      rc = csvNullsOption( &pSpec->nulls, zOpt, pzErr );
+      sqlite3_free( zOpt );
+      if( rc!=SQLITE_OK ) return rc;
+      z += n;
+      continue;
+    }
+    n = (int)strcspn(z, " ,");
+    zOpt = sqlite3_mprintf("%.*s", n, z);
+    if( !zOpt ) return SQLITE_NOMEM;
+    if( sqlite3_stricmp(zOpt, "USE_HEADER_ROW")==0 ){
+      pSpec->bUseHeaderRow = 1;
+    }else if( sqlite3_strnicmp(zOpt, "ON_ERROR=", 9)==0 ){
+      int e;
+      for(e=0; e<3 && sqlite3_stricmp(&zOpt[9], azOnError[e]); e++);
+      if( e>=3 ){
+        *pzErr = sqlite3_mprintf(aErrMsg[11], &zOpt[9]);
+        sqlite3_free( zOpt );
+        return SQLITE_ERROR;
+      }
+      pSpec->eOnError = e;
+    }else if( sqlite3_strnicmp(zOpt, "THREADS=", 8)==0 && atoi(&zOpt[8])>0 ){
+      pSpec->nThread = atoi(&zOpt[8]);
+      if( pSpec->nThread>CSV_IO_MAX_THREADS ){
+        pSpec->nThread = CSV_IO_MAX_THREADS;
+      }
+    }else{
+      *pzErr = sqlite3_mprintf(aErrMsg[7], zOpt);
+      sqlite3_free( zOpt );
+      return SQLITE_ERROR;
+    }
+    sqlite3_free( zOpt );
+    z += n;
+  }
+  return SQLITE_OK;
+}
+
+static int csvAggConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  CSVAggVtab *pNew;
+  int rc;
+
+  UNUSED_PARAMETER(pAux);
+  UNUSED_PARAMETER(argc);
+  UNUSED_PARAMETER(argv);
+  UNUSED_PARAMETER(pzErr);
+  /* it reads any file named by its arguments, so not from a view or a
+  ** trigger of the schema */
+#ifdef SQLITE_VTAB_DIRECTONLY
+  rc = sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  if( rc!=SQLITE_OK ) return rc;
+#endif
+  rc = sqlite3_declare_vtab(db,
+      "CREATE TABLE x(k1, k2, k3, k4, a1, a2, a3, a4, a5, a6, a7, a8,"
+      " path HIDDEN, options HIDDEN, group_cols HIDDEN, agg_spec HIDDEN)");
+  if( rc!=SQLITE_OK ) return rc;
+  pNew = (CSVAggVtab *)sqlite3_malloc( sizeof(CSVAggVtab) );
+  if( !pNew ) return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(CSVAggVtab));
+  pNew->db = db;
+  *ppVtab = &pNew->base;
+  return SQLITE_OK;
+}
+
+static int csvAggDisconnect( sqlite3_vtab *pVtab ){
+  sqlite3_free( pVtab );
+  return SQLITE_OK;
+}
+
+/*
+** The arguments are equalities on the hidden columns, in their order,
+** with bit i of idxNum set if argument i is there. The path must be.
+*/
+static int csvAggBestIndex( sqlite3_vtab *pVtab, sqlite3_index_info *info ){
+  int aIdx[4] = {-1, -1, -1, -1};
+  int bUnusable = 0;
+  int nArg = 0;
+  int i;
+
+  UNUSED_PARAMETER(pVtab);
+  for(i=0; i<info->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &info->aConstraint[i];
+    int iArg = pCons->iColumn - CSV_AGG_PATH;
+    if( iArg<0 || pCons->op!=SQLITE_INDEX_CONSTRAINT_EQ ) continue;
+    if( !pCons->usable ){
+      bUnusable = 1;
+    }else{
+      aIdx[iArg] = i;
+    }
+  }
+  if( aIdx[0]<0 && bUnusable ) return SQLITE_CONSTRAINT;
+  info->idxNum = 0;
+  for(i=0; i<4; i++){
+    if( aIdx[i]<0 ) continue;
+    info->aConstraintUsage[aIdx[i]].argvIndex = ++nArg;
+    info->aConstraintUsage[aIdx[i]].omit = 1;
+    info->idxNum |= 1<<i;
+  }
+  info->estimatedCost = 1000000.0;
+  return SQLITE_OK;
+}
 
-  return rc;
+static int csvAggOpen( sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCsr ){
+  CSVAggCursor *pCsr;
+  UNUSED_PARAMETER(pVtab);
+  pCsr = (CSVAggCursor *)sqlite3_malloc( sizeof(CSVAggCursor) );
+  if( !pCsr ) return SQLITE_NOMEM;
+  memset(pCsr, 0, sizeof(CSVAggCursor));
+  *ppCsr = &pCsr->base;
+  return SQLITE_OK;
 }
 
+static void csvAggCursorReset( CSVAggCursor *pCsr ){
+  sqlite3_free( pCsr->aGroup );
+  sqlite3_free( pCsr->spec.nulls.aNull );
+  pCsr->spec.nulls.aNull = 0;
+  csvAggChunkFree( pCsr->pChunk );
+  pCsr->aGroup = 0;
+  pCsr->nGroup = 0;
+  pCsr->iGroup = 0;
+  pCsr->pChunk = 0;
+}
 
-/* 
-** CSV virtual table module xClose method.
-*/
-static int csvClose( sqlite3_vtab_cursor *pVtabCursor ){
-  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+static int csvAggClose( sqlite3_vtab_cursor *pCur ){
+  csvAggCursorReset( (CSVAggCursor *)pCur );
+  sqlite3_free( pCur );
+  return SQLITE_OK;
+}
 
-  sqlite3_free(pCsr);
+/*
+** Read the column names from the header of the file, the first row of
+** range p, into *pazName, and set p->iStart to the row after.
+*/
+static int csvAggHeader( CSVAggRange *p, char ***pazName, int *pnName ){
+  char **azName;
+  int rc;
+  int i;
 
+  p->iBufOff = 0;
+  p->nNeed = 0x7fffffff;
+  rc = csvAggRow( p );
+  p->nNeed = p->pSpec->nNeed;
+  p->iStart = p->iBufOff + p->iPos;
+  if( rc==SQLITE_DONE || rc==SQLITE_OK || p->nCol==0 ){
+    /* no header, or a malformed one that ON_ERROR let go */
+    return rc==SQLITE_ROW || rc==SQLITE_DONE ? SQLITE_OK : rc;
+  }
+  if( rc!=SQLITE_ROW ) return rc;
+  azName = (char **)sqlite3_malloc( sizeof(char*)*p->nCol );
+  if( !azName ) return SQLITE_NOMEM;
+  for(i=0; i<p->nCol; i++){
+    int n = 0;
+    const char *z;
+    p->aFlag[i] &= ~CSV_CELL_NULL;  /* names are never NULL */
+    z = csvAggValue( p, i, &n );
+    azName[i] = z ? sqlite3_mprintf("%.*s", n, z) : 0;
+    if( !azName[i] ){
+      while( i>0 ) sqlite3_free( azName[--i] );
+      sqlite3_free( azName );
+      return SQLITE_NOMEM;
+    }
+  }
+  *pazName = azName;
+  *pnName = p->nCol;
   return SQLITE_OK;
 }
 
-
-/* 
-** CSV virtual table module xFilter method.
+/*
+** Run the aggregation of the nRange ranges of aRange[] (see above) and
+** leave its groups in aRange[0]. Return an error code, with *pzErr set,
+** if a range has a malformed record or any goes wrong.
 */
-static int csvFilter(
-  sqlite3_vtab_cursor *pVtabCursor, 
+static int csvAggRunAll( CSVAggRange *aRange, int nRange, char **pzErr ){
+  int bThread[CSV_IO_MAX_THREADS];
+  int rc = SQLITE_OK;
+  int i;
+
+  for(i=1; i<nRange; i++){
+    bThread[i] = pthread_create( &aRange[i].thread, 0, csvAggWorker,
+                                 (void *)&aRange[i] )==0;
+  }
+  csvAggRun( &aRange[0] );
+  for(i=1; i<nRange; i++){
+    if( bThread[i] ){
+      pthread_join( aRange[i].thread, 0 );
+    }else{
+      csvAggRun( &aRange[i] );
+    }
+  }
+
+  /* a range found where the one before it ended is right, and so are the
+  ** rows it parsed; others are parsed again from there */
+  for(i=0; i<nRange; i++){
+    CSVAggRange *p = &aRange[i];
+    if( i>0 && p->iStart!=p[-1].iStop ){
+      csvAggReset( p );
+      p->iStart = p[-1].iStop;
+      p->bSync = 0;
+      csvAggRun( p );
+    }
+    if( p->rc ){
+      rc = p->rc;
+      if( p->zBad ){
+        *pzErr = sqlite3_mprintf(aErrMsg[12], p->iBad, p->zBad);
+      }
+      break;
+    }
+  }
+
+  for(i=1; i<nRange; i++){
+    int j;
+    for(j=0; rc==SQLITE_OK && j<aRange[i].nSlot; j++){
+      if( aRange[i].aSlot[j].pGroup ){
+        rc = csvAggMerge( &aRange[0], &aRange[i].aSlot[j] );
+      }
+    }
+  }
+  return rc;
+}
+
+static int csvAggFilter(
+  sqlite3_vtab_cursor *pCur,
   int idxNum, const char *idxStr,
   int argc, sqlite3_value **argv
 ){
-  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
+  CSVAggCursor *pCsr = (CSVAggCursor *)pCur;
+  CSVAggSpec *pSpec = &pCsr->spec;
+  const char *azArg[4] = {0, 0, 0, 0};
+  CSVAggRange *aRange = 0;
+  CSVAggRange hdr;
+  char **azName = 0;
+  int nName = 0;
+  char *zErr = 0;
+  int nRange = 1;
+  int fd = -1;
+  struct stat st;
+  sqlite3_int64 iFirst;
   int rc;
+  int i, j;
 
-  UNUSED_PARAMETER(idxNum);
   UNUSED_PARAMETER(idxStr);
-  UNUSED_PARAMETER(argc);
-  UNUSED_PARAMETER(argv);
+  csvAggCursorReset( pCsr );
+  for(i=j=0; i<4 && j<argc; i++){
+    if( idxNum & (1<<i) ){
+      azArg[i] = (const char *)sqlite3_value_text(argv[j++]);
+    }
+  }
+  memset(pSpec, 0, sizeof(CSVAggSpec));
+  pSpec->cDelim = ',';
+  pSpec->nMaxRow = sqlite3_limit(((CSVAggVtab *)pCur->pVtab)->db,
+                                 SQLITE_LIMIT_LENGTH, -1);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.pSpec = pSpec;
 
-  csvReference( pCSV );
+  if( !azArg[0] ){
+    zErr = sqlite3_mprintf("%s", aErrMsg[1]);
+    rc = SQLITE_ERROR;
+    goto agg_done;
+  }
+  rc = csvAggOptions( pSpec, azArg[1], &zErr );
+  if( rc!=SQLITE_OK ) goto agg_done;
+  fd = csv_open( azArg[0] );
+  if( fd<0 || fstat( fd, &st ) ){
+    zErr = sqlite3_mprintf(aErrMsg[2], azArg[0]);
+    rc = SQLITE_ERROR;
+    goto agg_done;
+  }
+  csv_advise( fd, 0, 0, 0 );
+  hdr.fd = fd;
+  hdr.nFile = (sqlite3_int64)st.st_size;
+  if( pSpec->bUseHeaderRow ){
+    rc = csvAggHeader( &hdr, &azName, &nName );
+    if( rc!=SQLITE_OK ){
+      if( hdr.zBad ) zErr = sqlite3_mprintf(aErrMsg[12], hdr.iBad, hdr.zBad);
+      goto agg_done;
+    }
+  }
+  rc = csvAggParse( pSpec, azArg[2], azArg[3], azName, nName, &zErr );
+  if( rc!=SQLITE_OK ) goto agg_done;
 
-  /* seek back to start of first zRow */
-  pCSV->eof = 0;
-  csv_seek( pCSV, pCSV->offsetFirstRow );
-  /* read and parse next line */
-  rc = csvNext( pVtabCursor );
+  /* one range per thread, but none smaller than CSV_AGG_RANGE unless the
+  ** THREADS option says so, nor empty */
+  iFirst = hdr.iStart;
+  if( pSpec->nThread ){
+    nRange = pSpec->nThread;
+  }else{
+    long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+    sqlite3_int64 n = (hdr.nFile - iFirst)/CSV_AGG_RANGE;
+    if( n>nCpu ) n = nCpu;
+    nRange = n<1 ? 1 : n>CSV_IO_MAX_THREADS ? CSV_IO_MAX_THREADS : (int)n;
+  }
+  if( nRange>hdr.nFile-iFirst ) nRange = (int)(hdr.nFile-iFirst);
+  if( nRange<1 ) nRange = 1;
+  aRange = (CSVAggRange *)sqlite3_malloc( sizeof(CSVAggRange)*nRange );
+  if( !aRange ){
+    rc = SQLITE_NOMEM;
+    goto agg_done;
+  }
+  memset(aRange, 0, sizeof(CSVAggRange)*nRange);
+  for(i=0; i<nRange; i++){
+    CSVAggRange *p = &aRange[i];
+    p->pSpec = pSpec;
+    p->fd = fd;
+    p->nFile = hdr.nFile;
+    p->nNeed = pSpec->nNeed;
+    p->iStart = iFirst + (hdr.nFile-iFirst)*i/nRange;
+    p->iEnd = iFirst + (hdr.nFile-iFirst)*(i+1)/nRange;
+    p->bSync = i>0;
+  }
+  rc = csvAggRunAll( aRange, nRange, &zErr );
+  if( rc!=SQLITE_OK ) goto agg_done;
 
-  csvRelease( pCSV );
+  /* without group columns, there is one group even with no rows */
+  if( pSpec->nKey==0 && aRange[0].nGroup==0 && !csvAggGroup( &aRange[0], 0, "", 0 ) ){
+    rc = SQLITE_NOMEM;
+    goto agg_done;
+  }
+  rc = csvAggSort( pCsr, &aRange[0] );
+  if( rc!=SQLITE_OK ) goto agg_done;
+  for(i=0; i<nRange; i++) csvAggChunkMove( &aRange[i], &pCsr->pChunk );
 
+agg_done:
+  for(i=0; aRange && i<nRange; i++) csvAggRangeFree( &aRange[i] );
+  sqlite3_free( aRange );
+  csvAggRangeFree( &hdr );
+  for(i=0; i<nName; i++) sqlite3_free( azName[i] );
+  sqlite3_free( azName );
+  csv_close( fd );
+  if( rc!=SQLITE_OK ){
+    sqlite3_free( pCur->pVtab->zErrMsg );
+    pCur->pVtab->zErrMsg = zErr;
+  }
   return rc;
 }
 
+static int csvAggNext( sqlite3_vtab_cursor *pCur ){
+  ((CSVAggCursor *)pCur)->iGroup++;
+  return SQLITE_OK;
+}
+
+static int csvAggEof( sqlite3_vtab_cursor *pCur ){
+  CSVAggCursor *pCsr = (CSVAggCursor *)pCur;
+  return pCsr->iGroup>=pCsr->nGroup;
+}
 
-/* 
-** CSV virtual table module xNext method.
-*/
-static int csvNext( sqlite3_vtab_cursor* pVtabCursor ){
-  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
-  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
-  int nCol = 0;
-  char *s;
-  char zDelims[3] = ",\n";
-  char cDelim; /* char that delimited current col */
+static int csvAggColumn(
+  sqlite3_vtab_cursor *pCur,
+  sqlite3_context *ctx,
+  int i
+){
+  CSVAggCursor *pCsr = (CSVAggCursor *)pCur;
+  const CSVAggSpec *pSpec = &pCsr->spec;
+  const CSVAggGroup *pGroup = pCsr->aGroup[pCsr->iGroup];
 
-  if( pCSV->eof ){
-    return SQLITE_ERROR;
+  if( i<pSpec->nKey ){
+    /* skip the values of the group columns before */
+    const char *z = pGroup->zKey;
+    int n = 0;
+    while( 1 ){
+      if( *z++ ) memcpy(&n, z, sizeof(int));
+      if( i--==0 ) break;
+      if( z[-1] ) z += sizeof(int) + n;
+    }
+    if( z[-1] ){
+      sqlite3_result_text(ctx, z+sizeof(int), n, SQLITE_TRANSIENT);
+    }
+  }else if( i>=CSV_AGG_MAX_KEY && i-CSV_AGG_MAX_KEY<pSpec->nAgg ){
+    const CSVAggAcc *pAcc = &pGroup->aAcc[i-CSV_AGG_MAX_KEY];
+    switch( pSpec->aFunc[i-CSV_AGG_MAX_KEY] ){
+      case CSV_AGG_COUNT_ALL:
+      case CSV_AGG_COUNT:
+        sqlite3_result_int64(ctx, pAcc->n);
+        break;
+      case CSV_AGG_SUM:
+        if( pAcc->n==0 ) break;
+        if( pAcc->bReal ){
+          sqlite3_result_double(ctx, (double)pAcc->iSum + pAcc->rSum);
+        }else{
+          sqlite3_result_int64(ctx, pAcc->iSum);
+        }
+        break;
+      case CSV_AGG_AVG:
+        if( pAcc->n==0 ) break;
+        sqlite3_result_double(ctx,
+            ((double)pAcc->iSum + pAcc->rSum) / (double)pAcc->n);
+        break;
+      case CSV_AGG_MIN:
+      case CSV_AGG_MAX:
+        if( pAcc->zVal ){
+          sqlite3_result_text(ctx, pAcc->zVal, pAcc->nVal, SQLITE_TRANSIENT);
+        }
+        break;
+      default:
+        sqlite3_result_int64(ctx,
+            pAcc->aReg ? csvHllCount( pAcc->aReg, pAcc->n ) : 0);
+        break;
+    }
   }
+  return SQLITE_OK;
+}
 
-  /* update the cursor */
-  pCsr->csvpos = csv_tell( pCSV );
+static int csvAggRowid( sqlite3_vtab_cursor *pCur, sqlite3_int64 *pRowid ){
+  *pRowid = ((CSVAggCursor *)pCur)->iGroup + 1;
+  return SQLITE_OK;
+}
 
-  /* read the next row of data */
-  s = csv_getline( pCSV );
-  if( !s ){
-    /* and error or eof occured */
-    pCSV->eof = -1;
-    return SQLITE_OK;
-  }
+static sqlite3_module csvAggModule = {
+  0,                        /* iVersion */
+  0,                        /* xCreate - eponymous only */
+  csvAggConnect,            /* xConnect */
+  csvAggBestIndex,          /* xBestIndex */
+  csvAggDisconnect,         /* xDisconnect */
+  0,                        /* xDestroy */
+  csvAggOpen,               /* xOpen */
+  csvAggClose,              /* xClose */
+  csvAggFilter,             /* xFilter */
+  csvAggNext,               /* xNext */
+  csvAggEof,                /* xEof */
+  csvAggColumn,             /* xColumn */
+  csvAggRowid,              /* xRowid */
+  0, 0, 0, 0, 0, 0, 0,      /* xUpdate ... xRename */
+  0, 0, 0, 0                /* xSavepoint ... xShadowName */
+};
 
-  /* allocate initial space for the column pointers */
-  if( pCSV->maxCol < 1 ){
-    /* take a guess */
-    int maxCol = (int)(strlen(pCSV->zRow) / 5 + 1);
-    pCSV->aCols = (char **)sqlite3_malloc( sizeof(char*) * maxCol );
-    pCSV->aEscapedQuotes = (int *)sqlite3_malloc( sizeof(int) * maxCol );
-    if( pCSV->aCols ){
-      pCSV->maxCol = maxCol;
-    }
-  }
-  if( !pCSV->aCols || !pCSV->aEscapedQuotes ) return SQLITE_NOMEM;
+/*
+** Increment the CSV reference count.
+*/
+static void csvReference( CSV *pCSV ){
+  pCSV->nBusy++;
+}
 
-  /* add custom delim character */
-  zDelims[0] = pCSV->cDelim;
 
-  /* parse the zRow into individual columns */
-  do{
-    /* if it begins with a quote, assume it's a quoted col */
-    if( *s=='\"' ){
-      s++;  /* skip quote */
-      pCSV->aCols[nCol] = s; /* save pointer for this col */
-      pCSV->aEscapedQuotes[nCol] = 0;
-      /* find closing quote */
-      while( 1 ){
-        s = strchr(s, '\"');
-        if( !s ){
-          /* no closing quote */
-          pCSV->eof = -1;
-          return SQLITE_ERROR;
-        }else if ( *(s+1)=='\"' ){
-          /* escaped quote */
-          pCSV->aEscapedQuotes[nCol]++;
-          s+=2;
-        }else{
+/*
+** Decrement the CSV reference count. When the reference count reaches
+** zero the structure is deleted.
+*/
+static int csvRelease( CSV *pCSV ){
+  int i;
+  pCSV->nBusy--;
+  if( pCSV->nBusy<1 ){
+
+    /* finalize any prepared statements here */
+    csvFinalizeStmts( pCSV );
+
+    /* remove the table from the list of the connection */
+    if( pCSV->pGlobal ){
+      CSV **pp;
+      for(pp=&pCSV->pGlobal->pTables; *pp; pp=&(*pp)->pNext){
+        if( *pp==pCSV ){
+          *pp = pCSV->pNext;
           break;
         }
       }
-      *s = '\0'; /* null terminate this col */
-      /* fall through and look for following ",\n" */
-      s++;
-    }else{
-      pCSV->aCols[nCol] = s; /* save pointer for this col */
-      pCSV->aEscapedQuotes[nCol] = 0;
     }
-    s = strpbrk(s, zDelims);
-    if( !s ){
-      /* no col delimiter */
-      pCSV->eof = -1;
-      return SQLITE_ERROR;
+
+    csvFileUnref( pCSV->pFile );
+    csvStatFree( pCSV );
+    csvCacheRelease( &pCSV->keyCache );
+    sqlite3_free( pCSV->aErr );
+    sqlite3_free( pCSV->aColIdx );
+    sqlite3_free( pCSV->zJsonKey );
+    sqlite3_free( pCSV->aJsonKey );
+    for(i=0; pCSV->aType && i<pCSV->nColumn; i++){
+      sqlite3_free( pCSV->aType[i].zFmt );
     }
-    // TODO Maybe we should treat empty string as null value (if an option is
-    // activated).
-    cDelim = *s;
-    /* null terminate the column by overwriting the delimiter */
-    *s = '\0';
-    nCol++;
-    /* if end of zRow, stop parsing cols */
-    if( cDelim == '\n' ) break;
-    /* move to start of next col */
-    s++; /* skip delimiter */
-
-    if(nCol >= pCSV->maxCol ){
-      if( nCol>=sqlite3_limit(pCSV->db, SQLITE_LIMIT_COLUMN, -1) ){
-        return SQLITE_ERROR;
-      }
-      /* we need to grow our col pointer array */
-      char **p = (char **)sqlite3_realloc( pCSV->aCols, sizeof(char*) * (nCol+5) );
-      if( !p ){
-        /* out of memory */
-        return SQLITE_ERROR;
-      }
-      pCSV->maxCol = nCol + 5;
-      pCSV->aCols = p;
-      int *p1 = (int *)sqlite3_realloc( pCSV->aEscapedQuotes, sizeof(int) * (nCol+5) );
-      if( !p1 ){
-        /* out of memory */
-        return SQLITE_ERROR;
+    sqlite3_free( pCSV->aType );
+    sqlite3_free( pCSV->nulls.aNull );
+    sqlite3_free( pCSV->aBlock );
+    sqlite3_free( pCSV->aRowOff );
+    sqlite3_free( pCSV );
+  }
+  return 0;
+}
+
+
+/*
+** Return the connected CSV table named zName, which is either "table" or
+** "schema.table". A CSV table that is declared in the schema but not yet
+** connected is connected first, by preparing a statement that reads it.
+** If there is no such CSV table, return NULL and leave an error message
+** in *pzErr.
+*/
+static CSV *csvFindTable( CSVGlobal *pGlobal, const char *zName, char **pzErr ){
+  const char *zDot = zName ? strchr(zName, '.') : 0;
+  const char *zTab = zDot ? zDot+1 : zName;
+  char *zDb = zDot ? sqlite3_mprintf("%.*s", (int)(zDot-zName), zName) : 0;
+  int iAttempt;
+
+  *pzErr = 0;
+  for(iAttempt=0; zTab && iAttempt<2; iAttempt++){
+    CSV *p;
+    char *zSql;
+    for(p=pGlobal->pTables; p; p=p->pNext){
+      if( sqlite3_stricmp(p->zName, zTab)==0
+       && (zDb==0 || sqlite3_stricmp(p->zDb, zDb)==0)
+      ){
+        sqlite3_free(zDb);
+        return p;
       }
-      pCSV->aEscapedQuotes = p1;
     }
+    if( zDb ){
+      zSql = sqlite3_mprintf("SELECT rowid FROM \"%w\".\"%w\"", zDb, zTab);
+    }else{
+      zSql = sqlite3_mprintf("SELECT rowid FROM \"%w\"", zTab);
+    }
+    if( zSql ){
+      sqlite3_stmt *pStmt = 0;
+      sqlite3_prepare_v2(pGlobal->db, zSql, -1, &pStmt, 0);
+      sqlite3_finalize(pStmt);
+      sqlite3_free(zSql);
+    }
+  }
+  sqlite3_free(zDb);
+  *pzErr = sqlite3_mprintf("no such CSV table: %s", zName ? zName : "");
+  return 0;
+}
+
 
-  }while( *s );
+/*
+** Read the first row of the CSV file of table pCSV with cursor pCsr, which
+** holds a handle on the file. The first row gives the number of columns
+** and, with USE_HEADER_ROW, their names. If the table is already declared,
+** the file must still have as many columns as the declaration. On error,
+** leave a message in *pzErr.
+*/
+static int csvOpenFile( CSV *pCSV, CSVCursor *pCsr, char **pzErr ){
+  int nColumn = pCSV->nColumn;
+  int bBatch = pCsr->bBatch;
+  int rc;
 
-  pCSV->nCol = nCol;
+  /* Read first zRow to obtain column names/number. Until the table is
+  ** declared, the batch of the cursor has room for as many columns as
+  ** SQLite allows. */
+  if( nColumn==0 ){
+    pCSV->nColumn = sqlite3_limit(pCSV->db, SQLITE_LIMIT_COLUMN, -1);
+  }
+  csv_seek( pCsr, 0 );
+  pCsr->iLimit = -1;
+  pCsr->eof = 0;
+  pCsr->bBatch = 0;
+  rc = csvNext( (sqlite3_vtab_cursor *)pCsr );
+  pCsr->bBatch = bBatch;
+  pCSV->nColumn = nColumn;
+  if( (SQLITE_OK!=rc) || pCsr->eof || (pCsr->nCol<=0) ){
+    *pzErr = sqlite3_mprintf("%s", aErrMsg[3]);
+    return SQLITE_ERROR;
+  }
+  if( pCSV->nColumn && pCsr->nCol!=pCSV->nColumn ){
+    *pzErr = sqlite3_mprintf(aErrMsg[6], pCSV->zFile, pCsr->nCol, pCSV->nColumn);
+    return SQLITE_ERROR;
+  }
+  pCSV->nFirstRowLen = csv_tell( pCsr );
+  pCSV->offsetFirstRow = pCSV->bUseHeaderRow ? csv_tell( pCsr ) : 0;
+  pCsr->nRow--;  /* the header is not returned by the scan */
   return SQLITE_OK;
 }
 
 
 /*
-** CSV virtual table module xEof method.
-**
-** Return non-zero if the cursor does not currently point to a valid 
-** record (i.e if the scan has finished), or zero otherwise.
+** Save the declaration of table pCSV, and what was learnt from the first
+** row of its file, in the %_schema shadow table. This is done by xCreate
+** so that xConnect can later declare the table without opening the file.
 */
-static int csvEof( sqlite3_vtab_cursor *pVtabCursor )
-{
-  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
+static int csvSaveSchema( CSV *pCSV, const char *zDecl ){
+  char *zSql;
+  int rc;
 
-  return pCSV->eof;
+  zSql = sqlite3_mprintf(
+      "CREATE TABLE \"%w\".\"%w_schema\"(decl TEXT, ncol INTEGER,"
+      " first_row INTEGER, first_row_len INTEGER, file_size INTEGER);"
+      "INSERT INTO \"%w\".\"%w_schema\" VALUES(%Q, %d, %lld, %lld, %lld);",
+      pCSV->zDb, pCSV->zName, pCSV->zDb, pCSV->zName,
+      zDecl, pCSV->nColumn, pCSV->offsetFirstRow, pCSV->nFirstRowLen,
+      pCSV->nFileSize
+  );
+  if( !zSql ) return SQLITE_NOMEM;
+  rc = sqlite3_exec( pCSV->db, zSql, 0, 0, 0 );
+  sqlite3_free( zSql );
+  if( rc==SQLITE_OK ) pCSV->bShadow = 1;
+  return rc;
 }
 
 
-/* 
-** CSV virtual table module xColumn method.
+/*
+** Read the declaration of table pCSV from its %_schema shadow table. If
+** successful, set *pzDecl to the CREATE TABLE statement to declare, in
+** memory obtained from sqlite3_malloc(). Otherwise leave *pzDecl unchanged.
 */
-static int csvColumn(sqlite3_vtab_cursor *pVtabCursor, sqlite3_context *ctx, int i){
-  CSV *pCSV = (CSV *)pVtabCursor->pVtab;
+static void csvLoadSchema( CSV *pCSV, char **pzDecl ){
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
 
-  if( i<0 || i>=pCSV->nCol ){
-    sqlite3_result_null( ctx );
+  zSql = sqlite3_mprintf(
+      "SELECT decl, ncol, first_row, first_row_len, file_size"
+      " FROM \"%w\".\"%w_schema\"", pCSV->zDb, pCSV->zName
+  );
+  if( zSql && sqlite3_prepare_v2( pCSV->db, zSql, -1, &pStmt, 0 )==SQLITE_OK
+   && sqlite3_step( pStmt )==SQLITE_ROW
+   && sqlite3_column_int( pStmt, 1 )>0
+  ){
+    *pzDecl = sqlite3_mprintf("%s", sqlite3_column_text( pStmt, 0 ));
+    pCSV->nColumn = sqlite3_column_int( pStmt, 1 );
+    pCSV->offsetFirstRow = sqlite3_column_int64( pStmt, 2 );
+    pCSV->nFirstRowLen = sqlite3_column_int64( pStmt, 3 );
+    pCSV->nFileSize = sqlite3_column_int64( pStmt, 4 );
+    pCSV->bShadow = 1;
+  }
+  sqlite3_finalize( pStmt );
+  sqlite3_free( zSql );
+}
+
+
+/*
+** Parse the name of the next column of a declaration built by csvInit(),
+** from z, which points to the '(' or ',' before it. Set *pzCol and *pnCol
+** to the name, without its quotes, and return a pointer to where to parse
+** the next one from, or to the closing ')'. Return NULL if the declaration
+** is not as expected.
+*/
+static const char *csvDeclNext( const char *z, const char **pzCol, int *pnCol ){
+  const char *zCol = ++z;
+  int n;
+  if( *z=='"' ){
+    zCol = ++z;
+    z = strchr(z, '"');
+    if( !z ) return 0;
+    n = (int)(z - zCol);
+    z++;
   }else{
-    // TODO SQLite uses dynamic typing...
-    const char *col = pCSV->aCols[i];
-    if( !col ){
-      sqlite3_result_null( ctx );
-    }else if( pCSV->aEscapedQuotes[i] ){
-      char *z;
-
-      int nByte = (int)(strlen(col) - pCSV->aEscapedQuotes[i] + 1);
-      if( nByte>sqlite3_limit(pCSV->db, SQLITE_LIMIT_LENGTH, -1) ){
-        sqlite3_result_error_toobig( ctx );
-        z = 0;
-      }else{
-        z = sqlite3_malloc( nByte );
-        if( !z ){
-          sqlite3_result_error_nomem( ctx );
-        }
-      }
-      if( z ){
-        int j,k;
-        for(j=0, k=0; col[j]; j++){
-          z[k++] = col[j];
-          if( col[j]=='\"' ){
-            /* unescape quote */
-            j++;
-          }
-        }
-        z[k] = 0;
-        sqlite3_result_text( ctx, z, k, sqlite3_free ); // FIXME sqlite3_result_int64/double
-      }
-    }else{
-      sqlite3_result_text( ctx, col, -1, SQLITE_TRANSIENT ); // FIXME sqlite3_result_int64/double
-    }
+    n = (int)strcspn(z, ",)");
+    z += n;
+  }
+  *pzCol = zCol;
+  *pnCol = n;
+  z += strspn(z, " ");
+  if( *z==',' ) z += strspn(z+1, " ");
+  else if( *z!=')' ) return 0;
+  return z;
+}
+
+/*
+** Return the index of the column named zName in declaration zDecl, as
+** built by csvInit(), or -1 if there is no such column. zName may be
+** quoted.
+*/
+static int csvDeclColumn( const char *zDecl, const char *zName ){
+  const char *z = strchr(zDecl, '(');
+  int nName = (int)strlen(zName);
+  int i;
+
+  if( nName>=2 && (zName[0]=='"' || zName[0]=='\'' || zName[0]=='[')
+   && zName[nName-1]==(zName[0]=='[' ? ']' : zName[0])
+  ){
+    zName++;
+    nName -= 2;
   }
+  for(i=0; z && *z!=')'; i++){
+    const char *zCol;
+    int n;
+    z = csvDeclNext( z, &zCol, &n );
+    if( !z ) return -1;
+    if( n==nName && sqlite3_strnicmp(zCol, zName, n)==0 ) return i;
+  }
+  return -1;
+}
 
+/*
+** Build the keys of the _json column from the names of the columns in
+** declaration zDecl: "name": for each, JSON-quoted, in pCSV->zJsonKey.
+*/
+static int csvJsonKeys( CSV *pCSV, const char *zDecl ){
+  const char *z = strchr(zDecl, '(');
+  int n = 0;
+  int i;
+
+  pCSV->zJsonKey = sqlite3_malloc64( strlen(zDecl)*6 + pCSV->nColumn*3 + 1 );
+  pCSV->aJsonKey = sqlite3_malloc64( sizeof(int)*(pCSV->nColumn+1) );
+  if( !pCSV->zJsonKey || !pCSV->aJsonKey ) return SQLITE_NOMEM;
+  for(i=0; i<pCSV->nColumn; i++){
+    const char *zCol = "";
+    int nCol = 0;
+    if( z && *z!=')' ) z = csvDeclNext( z, &zCol, &nCol );
+    pCSV->aJsonKey[i] = n;
+    n += csvJsonQuote( &pCSV->zJsonKey[n], zCol, nCol );
+    pCSV->zJsonKey[n++] = ':';
+  }
+  pCSV->aJsonKey[i] = n;
   return SQLITE_OK;
 }
 
 
-/* 
-** CSV virtual table module xRowid method.
-** We probably should store a hidden table
-** mapping rowid's to csvpos.
+/*
+** Apply option zOpt, "TIMESTAMP=column ['format']" (see csvTimeParse() for
+** the format) or "DECIMAL=column[(p[,s])]", to the columns of declaration
+** zDecl.
 */
-static int csvRowid( sqlite3_vtab_cursor* pVtabCursor, sqlite3_int64 *pRowid ){
-  CSVCursor *pCsr = (CSVCursor *)pVtabCursor;
+static int csvTypeOption( CSV *pCSV, const char *zDecl, const char *zOpt,
+                          char **pzErr ){
+  const char *z = strchr(zOpt, '=') + 1;
+  CSVColType t;
+  char *zCol;
+  int iCol;
+  int n;
 
-  *pRowid = pCsr->csvpos;
+  memset(&t, 0, sizeof(t));
+  t.eType = sqlite3_strnicmp(zOpt, "DECIMAL=", 8)==0 ? CSV_TYPE_DECIMAL
+                                                     : CSV_TYPE_TIMESTAMP;
+  if( *z=='"' ){
+    const char *zEnd = strchr(z+1, '"');
+    n = zEnd ? (int)(zEnd-z)+1 : 0;
+  }else{
+    n = (int)strcspn(z, t.eType==CSV_TYPE_DECIMAL ? " \t(" : " \t");
+  }
+  zCol = sqlite3_mprintf("%.*s", n, z);
+  if( !zCol ) return SQLITE_NOMEM;
+  iCol = n>0 ? csvDeclColumn( zDecl, zCol ) : -1;
+  sqlite3_free( zCol );
+  z += n;
+  z += strspn(z, " \t");
 
+  if( t.eType==CSV_TYPE_DECIMAL ){
+    /* precision and scale, as in the SQL type */
+    t.nPrec = CSV_DECIMAL_MAX;
+    if( *z=='(' ){
+      t.nPrec = (int)strtol(z+1, (char **)&z, 10);
+      z += strspn(z, " \t");
+      if( *z==',' ){
+        t.nScale = (int)strtol(z+1, (char **)&z, 10);
+        z += strspn(z, " \t");
+      }
+      z = *z==')' ? z+1 : zOpt;
+    }
+    if( t.nPrec<1 || t.nPrec>CSV_DECIMAL_MAX || t.nScale<0
+     || t.nScale>t.nPrec
+    ){
+      z = zOpt;
+    }
+  }else{
+    /* the format, a string literal, is copied without its quotes */
+    t.zFmt = sqlite3_malloc64( strlen(z)+1 );
+    if( !t.zFmt ) return SQLITE_NOMEM;
+    n = 0;
+    if( *z=='\'' ){
+      for(z++; *z && (*z!='\'' || z[1]=='\''); z++){
+        if( *z=='\'' ) z++;
+        t.zFmt[n++] = *z;
+      }
+      if( *z=='\'' ) z++;
+      else z = zOpt;
+      if( n==0 ) z = zOpt;
+    }
+    t.zFmt[n] = 0;
+    if( !csvTimeFormatCheck( t.zFmt ) ) z = zOpt;
+  }
+  if( iCol<0 || *z ){
+    *pzErr = sqlite3_mprintf(aErrMsg[17], t.eType==CSV_TYPE_DECIMAL ?
+                             "DECIMAL" : "TIMESTAMP", zOpt);
+    sqlite3_free( t.zFmt );
+    return SQLITE_ERROR;
+  }
+
+  if( !pCSV->aType ){
+    pCSV->aType = sqlite3_malloc64( sizeof(CSVColType)*pCSV->nColumn );
+    if( !pCSV->aType ){
+      sqlite3_free( t.zFmt );
+      return SQLITE_NOMEM;
+    }
+    memset(pCSV->aType, 0, sizeof(CSVColType)*pCSV->nColumn);
+  }
+  sqlite3_free( pCSV->aType[iCol].zFmt );
+  pCSV->aType[iCol] = t;
   return SQLITE_OK;
 }
 
+/*
+** Apply option zOpt, "NULLS='value'" or "NULLS=('value', ...)", the values
+** read as NULL when they are not quoted in the file, to *pSet.
+*/
+static int csvNullsOption( CSVNullSet *pSet, const char *zOpt, char **pzErr ){
+  const char *z = strchr(zOpt, '=') + 1;
+  int bList = *z=='(';
+  char *zBuf;
+  int nBuf = 0;
 
-static sqlite3_module csvModule = {
-  0,                        /* iVersion */
-  csvCreate,                /* xCreate - create a table */
-  csvConnect,               /* xConnect - connect to an existing table */
-  csvBestIndex,             /* xBestIndex - Determine search strategy */
-  csvDisconnect,            /* xDisconnect - Disconnect from a table */
-  csvDestroy,               /* xDestroy - Drop a table */
-  csvOpen,                  /* xOpen - open a cursor */
-  csvClose,                 /* xClose - close a cursor */
-  csvFilter,                /* xFilter - configure scan constraints */
-  csvNext,                  /* xNext - advance a cursor */
-  csvEof,                   /* xEof */
-  csvColumn,                /* xColumn - read data */
-  csvRowid,                 /* xRowid - read data */
-  0,                        /* xUpdate - write data */
-  0,                        /* xBegin - begin transaction */
-  0,                        /* xSync - sync transaction */
-  0,                        /* xCommit - commit transaction */
-  0,                        /* xRollback - rollback transaction */
-  0,                        /* xFindFunction - function overloading */
-  0                         /* xRename - rename the table */
-};
+  sqlite3_free( pSet->aNull );
+  pSet->nNull = 0;
+  pSet->mNullLen = 0;
+  pSet->aNull = sqlite3_malloc64( sizeof(CSVNull)*(strlen(z)/2+1) + strlen(z) );
+  if( !pSet->aNull ) return SQLITE_NOMEM;
+  zBuf = (char *)&pSet->aNull[strlen(z)/2+1];
 
+  if( bList ) z += 1 + strspn(z+1, " \t");
+  while( *z=='\'' ){
+    CSVNull *p = &pSet->aNull[pSet->nNull++];
+    p->z = &zBuf[nBuf];
+    for(z++; *z && (*z!='\'' || z[1]=='\''); z++){
+      if( *z=='\'' ) z++;
+      zBuf[nBuf++] = *z;
+    }
+    p->n = (int)(&zBuf[nBuf] - p->z);
+    if( *z!='\'' || p->n>=CSV_NULL_MAXLEN ) break;
+    pSet->mNullLen |= (sqlite3_uint64)1 << p->n;
+    z++;
+    if( !bList ) break;
+    z += strspn(z, " \t");
+    if( *z!=',' ) break;
+    z += 1 + strspn(z+1, " \t");
+  }
+  if( bList && *z==')' ) z++;
+  if( *z || pSet->nNull==0 ){
+    *pzErr = sqlite3_mprintf(aErrMsg[17], "NULLS", zOpt);
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
 
 /*
-** Increment the CSV reference count.
+** Set *pc to the separator of option zOpt, whose value is a character,
+** quoted or not, or '' for none if bNone is true. Return 0 if it is not
+** a valid separator of numbers.
 */
-static void csvReference( CSV *pCSV ){
-  pCSV->nBusy++;
+static int csvSeparatorOption( const char *zOpt, int bNone, char *pc ){
+  const char *z = strchr(zOpt, '=') + 1;
+  int n = (int)strlen(z);
+  char c;
+  if( n==2 && memcmp(z, "''", 2)==0 ){
+    *pc = 0;
+    return bNone;
+  }
+  if( n==4 && memcmp(z, "''''", 4)==0 ){
+    c = '\'';
+  }else if( n==3 && z[0]=='\'' && z[2]=='\'' ){
+    c = z[1];
+  }else if( n==1 ){
+    c = z[0];
+  }else{
+    return 0;
+  }
+  if( (c>='0' && c<='9') || c=='+' || c=='-' ) return 0;
+  *pc = c;
+  return 1;
 }
 
-
 /*
-** Decrement the CSV reference count. When the reference count reaches
-** zero the structure is deleted.
+** Return a copy of declaration zDecl, as built by csvInit(), in which the
+** typed columns are declared INTEGER, or NULL if out of memory.
 */
-static int csvRelease( CSV *pCSV ){
-  pCSV->nBusy--;
-  if( pCSV->nBusy<1 ){
-
-    /* finalize any prepared statements here */
+static char *csvDeclTyped( CSV *pCSV, const char *zDecl ){
+  const char *z = strchr(zDecl, '(');
+  const char *zDone = zDecl;
+  sqlite3_str *pStr = sqlite3_str_new( pCSV->db );
+  int i;
 
-    csv_close( pCSV );
-    if( pCSV->zRow ) sqlite3_free( pCSV->zRow );
-    if( pCSV->aCols ) sqlite3_free( pCSV->aCols );
-    if( pCSV->aEscapedQuotes ) sqlite3_free( pCSV->aEscapedQuotes );
-    sqlite3_free( pCSV );
+  for(i=0; z && *z!=')' && i<pCSV->nColumn; i++){
+    const char *zCol;
+    int n;
+    z = csvDeclNext( z, &zCol, &n );
+    if( z && csvIsInt(pCSV, i) ){
+      const char *zEnd = &zCol[n] + (zCol[n]=='"');
+      sqlite3_str_append( pStr, zDone, (int)(zEnd-zDone) );
+      sqlite3_str_appendall( pStr, " INTEGER" );
+      zDone = zEnd;
+    }
   }
-  return 0;
+  sqlite3_str_appendall( pStr, zDone );
+  return sqlite3_str_finish( pStr );
 }
 
 
@@ -568,7 +8102,11 @@ static int csvRelease( CSV *pCSV ){
 **   argv[2]   -> table name
 **   argv[3]   -> csv file name
 **   argv[4]   -> custom delimiter
-**   argv[5]   -> optional:  use header row for column names
+**   argv[5..] -> optional:  USE_HEADER_ROW, KEY=column, IO_POLICY=policy,
+**                           HUGE_PAGES=off|on|hugetlb, ON_ERROR=fail|skip|null,
+**                           TIMESTAMP=column ['format'], TIMESTAMP_UNIT=s|ms|us,
+**                           DECIMAL=column[(p,s)], DECIMAL_SEPARATOR=c,
+**                           GROUP_SEPARATOR=c, NULLS=('value', ...)
 **
 ** TODO
 **   File encoding problem
@@ -576,7 +8114,7 @@ static int csvRelease( CSV *pCSV ){
 */
 static int csvInit(
   sqlite3 *db,                        /* Database connection */
-  void *pAux,                         /* Unused */
+  void *pAux,                         /* Pointer to the CSVGlobal object */
   int argc, const char *const*argv,   /* Parameters to CREATE TABLE statement */
   sqlite3_vtab **ppVtab,              /* OUT: New virtual table */
   char **pzErr,                       /* OUT: Error message, if any */
@@ -591,19 +8129,8 @@ static int csvInit(
   size_t nDb;              /* Length of string argv[1] */
   size_t nName;            /* Length of string argv[2] */
   size_t nFile;            /* Length of string argv[3] */
-  CSVCursor csvCsr;        /* Used for calling csvNext */
-
-  const char *aErrMsg[] = {
-    0,                                                    /* 0 */
-    "No CSV file specified",                              /* 1 */
-    "Error opening CSV file: '%s'",                       /* 2 */
-    "No columns found",                                   /* 3 */
-    "No column name found",                               /* 4 */
-    "Out of memory",                                      /* 5 */
-  };
+  const char *zKey = 0;    /* Column of the KEY option */
 
-  UNUSED_PARAMETER(pAux);
-  UNUSED_PARAMETER(isCreate);
 
   if( argc < 4 ){
     *pzErr = sqlite3_mprintf("%s", aErrMsg[1]);
@@ -627,6 +8154,8 @@ static int csvInit(
   pCSV->nBusy = 1;
   pCSV->base.pModule = &csvModule;
   pCSV->cDelim = cDelim;
+  pCSV->keyCache.pCSV = pCSV;
+  pCSV->keyCache.xFree = csvKeyFree;
   pCSV->zDb = (char *)&pCSV[1];
   pCSV->zName = &pCSV->zDb[nDb+1];
   pCSV->zFile = &pCSV->zName[nName+1];
@@ -650,62 +8179,198 @@ static int csvInit(
     }
   }
 
-  /* should the header zRow be used */
-  if( argc > 5 ){
-    if( !strcmp(argv[5], "USE_HEADER_ROW") ){
+  /* options: USE_HEADER_ROW, and NAME=VALUE settings */
+  pCSV->iKeyCol = -1;
+  pCSV->iCheckpoint = -1;
+  pCSV->eTimeUnit = CSV_UNIT_MS;
+  pCSV->cDecimal = '.';
+  for(i=5; i<argc; i++){
+    if( !strcmp(argv[i], "USE_HEADER_ROW") ){
       bUseHeaderRow = -1;
+    }else if( sqlite3_strnicmp(argv[i], "KEY=", 4)==0 ){
+      zKey = &argv[i][4];
+    }else if( sqlite3_strnicmp(argv[i], "IO_POLICY=", 10)==0 ){
+      int e;
+      for(e=0; e<3 && sqlite3_stricmp(&argv[i][10], azIoPolicy[e]); e++);
+      if( e==3 ){
+        *pzErr = sqlite3_mprintf(aErrMsg[9], &argv[i][10]);
+        csvRelease( pCSV );
+        return SQLITE_ERROR;
+      }
+      pCSV->eIoPolicy = e;
+    }else if( sqlite3_strnicmp(argv[i], "HUGE_PAGES=", 11)==0 ){
+      int e;
+      for(e=0; e<3 && sqlite3_stricmp(&argv[i][11], azHugePages[e]); e++);
+      if( e==3 ){
+        *pzErr = sqlite3_mprintf(aErrMsg[10], &argv[i][11]);
+        csvRelease( pCSV );
+        return SQLITE_ERROR;
+      }
+      pCSV->eHugePages = e;
+    }else if( sqlite3_strnicmp(argv[i], "ON_ERROR=", 9)==0 ){
+      int e;
+      for(e=0; e<3 && sqlite3_stricmp(&argv[i][9], azOnError[e]); e++);
+      if( e==3 ){
+        *pzErr = sqlite3_mprintf(aErrMsg[11], &argv[i][9]);
+        csvRelease( pCSV );
+        return SQLITE_ERROR;
+      }
+      pCSV->eOnError = e;
+    }else if( sqlite3_strnicmp(argv[i], "TIMESTAMP_UNIT=", 15)==0 ){
+      int e;
+      for(e=0; e<3 && sqlite3_stricmp(&argv[i][15], azTimeUnit[e]); e++);
+      if( e==3 ){
+        *pzErr = sqlite3_mprintf(aErrMsg[18], &argv[i][15]);
+        csvRelease( pCSV );
+        return SQLITE_ERROR;
+      }
+      pCSV->eTimeUnit = e;
+    }else if( sqlite3_strnicmp(argv[i], "DECIMAL_SEPARATOR=", 18)==0
+           || sqlite3_strnicmp(argv[i], "GROUP_SEPARATOR=", 16)==0
+    ){
+      int bGroup = argv[i][0]=='G' || argv[i][0]=='g';
+      if( !csvSeparatorOption( argv[i], bGroup,
+                               bGroup ? &pCSV->cGroup : &pCSV->cDecimal ) ){
+        *pzErr = sqlite3_mprintf(aErrMsg[17],
+            bGroup ? "GROUP_SEPARATOR" : "DECIMAL_SEPARATOR", argv[i]);
+        csvRelease( pCSV );
+        return SQLITE_ERROR;
+      }
+    }else if( sqlite3_strnicmp(argv[i], "TIMESTAMP=", 10)==0
+           || sqlite3_strnicmp(argv[i], "DECIMAL=", 8)==0
+           || sqlite3_strnicmp(argv[i], "NULLS=", 6)==0
+    ){
+      /* applied once the columns are known */
+    }else if( strchr(argv[i], '=') ){
+      *pzErr = sqlite3_mprintf(aErrMsg[7], argv[i]);
+      csvRelease( pCSV );
+      return SQLITE_ERROR;
     }
   }
-
-  /* open the source csv file */
-  pCSV->f = csv_open( pCSV );
-  if( !pCSV->f ){
-    *pzErr = sqlite3_mprintf(aErrMsg[2], pCSV->zFile);
+  if( pCSV->cGroup==pCSV->cDecimal ){
+    char zSep[2];
+    zSep[0] = pCSV->cGroup;
+    zSep[1] = 0;
+    *pzErr = sqlite3_mprintf(aErrMsg[17], "GROUP_SEPARATOR", zSep);
     csvRelease( pCSV );
     return SQLITE_ERROR;
   }
+  pCSV->bUseHeaderRow = bUseHeaderRow;
 
-  /* Read first zRow to obtain column names/number */
-  csvCsr.base.pVtab = (sqlite3_vtab *)pCSV;
-  rc = csvNext( (sqlite3_vtab_cursor *)&csvCsr );
-  if( (SQLITE_OK!=rc) || (pCSV->nCol<=0) ){
-    *pzErr = sqlite3_mprintf("%s", aErrMsg[3]);
+  pCSV->pFile = csvFileRef( pCSV->zFile );
+  if( !pCSV->pFile ){
+    *pzErr = sqlite3_mprintf("%s", aErrMsg[5]);
     csvRelease( pCSV );
-    return SQLITE_ERROR;
+    return SQLITE_NOMEM;
+  }
+
+  /* An existing table is declared from its %_schema shadow table, without
+  ** touching the file: it is only opened (and checked against the
+  ** declaration) by the first xFilter. Tables created by earlier versions
+  ** of this module have no shadow table and fall back to the header. */
+  zSql = 0;
+  if( !isCreate ){
+    csvLoadSchema( pCSV, &zSql );
   }
-  if( bUseHeaderRow ){
-    pCSV->offsetFirstRow = csv_tell( pCSV );
-  }
-
-  /* Create the underlying relational database schema. If
-  ** that is successful, call sqlite3_declare_vtab() to configure
-  ** the csv table schema.
-  */
-  zSql = sqlite3_mprintf("CREATE TABLE x(");
-  for(i=0; zSql && i<pCSV->nCol; i++){
-    const char *zTail = (i+1<pCSV->nCol) ? ", " : ");";
-    char *zTmp = zSql;
-    if( bUseHeaderRow ){
-      const char *zCol = pCSV->aCols[i];
-      if( !zCol ){
-        *pzErr = sqlite3_mprintf("%s", aErrMsg[4]);
+
+  if( !zSql ){
+    CSVCursor csvCsr;      /* Used for reading the first row */
+
+    memset(&csvCsr, 0, sizeof(csvCsr));
+    csvCsr.base.pVtab = (sqlite3_vtab *)pCSV;
+    rc = csvCursorAcquire( &csvCsr, pzErr );
+    if( rc!=SQLITE_OK ){
+      csvCursorFree( &csvCsr );
+      csvRelease( pCSV );
+      return rc;
+    }
+    pCSV->nColumn = csvCsr.nCol;
+
+    /* Create the underlying relational database schema. If
+    ** that is successful, call sqlite3_declare_vtab() to configure
+    ** the csv table schema.
+    */
+    zSql = sqlite3_mprintf("CREATE TABLE x(");
+    for(i=0; zSql && i<csvCsr.nCol; i++){
+      const char *zTail = (i+1<csvCsr.nCol) ? ", " : ");";
+      char *zTmp = zSql;
+      if( bUseHeaderRow ){
+        int nCol;
+        const char *zCol = csvCursorText( &csvCsr, i, &nCol );
+        if( !zCol ){
+          *pzErr = sqlite3_mprintf("%s", aErrMsg[4]);
+          sqlite3_free(zSql);
+          csvCursorFree( &csvCsr );
+          csvRelease( pCSV );
+          return SQLITE_ERROR;
+        }
+        zSql = sqlite3_mprintf("%s\"%.*s\"%s", zTmp, nCol, zCol, zTail); // FIXME Column type (INT/REAL/TEXT)
+      }else{
+        zSql = sqlite3_mprintf("%scol%d%s", zTmp, i+1, zTail); // FIXME Column type (INT/REAL/TEXT)
+      }
+      sqlite3_free(zTmp);
+    }
+    csvCursorFree( &csvCsr );
+    if( !zSql ){
+      *pzErr = sqlite3_mprintf("%s", aErrMsg[5]);
+      csvRelease( pCSV );
+      return SQLITE_NOMEM;
+    }
+
+    if( isCreate ){
+      rc = csvSaveSchema( pCSV, zSql );
+      if( SQLITE_OK != rc ){
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
         sqlite3_free(zSql);
         csvRelease( pCSV );
-        return SQLITE_ERROR;
+        return rc;
       }
-      zSql = sqlite3_mprintf("%s\"%s\"%s", zTmp, zCol, zTail); // FIXME Column type (INT/REAL/TEXT)
-    }else{
-      zSql = sqlite3_mprintf("%scol%d%s", zTmp, i+1, zTail); // FIXME Column type (INT/REAL/TEXT)
     }
-    sqlite3_free(zTmp);
   }
-  if( !zSql ){
-    *pzErr = sqlite3_mprintf("%s", aErrMsg[5]);
-    csvRelease( pCSV );
-    return SQLITE_NOMEM;
+
+  if( zKey ){
+    pCSV->iKeyCol = csvDeclColumn( zSql, zKey );
+    if( pCSV->iKeyCol<0 ){
+      *pzErr = sqlite3_mprintf(aErrMsg[8], zKey);
+      sqlite3_free(zSql);
+      csvRelease( pCSV );
+      return SQLITE_ERROR;
+    }
+  }
+
+  for(i=5; i<argc; i++){
+    if( sqlite3_strnicmp(argv[i], "TIMESTAMP=", 10)==0
+     || sqlite3_strnicmp(argv[i], "DECIMAL=", 8)==0
+     || sqlite3_strnicmp(argv[i], "NULLS=", 6)==0
+    ){
+      char *zErr = 0;
+      if( sqlite3_strnicmp(argv[i], "NULLS=", 6)==0 ){
+        /* not before the header is read, as its names are never NULL */
+        rc = csvNullsOption( &pCSV->nulls, argv[i], &zErr );
+      }else{
+        rc = csvTypeOption( pCSV, zSql, argv[i], &zErr );
+      }
+      if( rc!=SQLITE_OK ){
+        *pzErr = zErr ? zErr : sqlite3_mprintf("%s", aErrMsg[5]);
+        sqlite3_free(zSql);
+        csvRelease( pCSV );
+        return rc;
+      }
+    }
   }
 
-  rc = sqlite3_declare_vtab( db, zSql );
+  /* the hidden columns (see CSV_HIDDEN_*) and the INTEGER type of the
+  ** typed columns are not part of %_schema */
+  rc = csvJsonKeys( pCSV, zSql );
+  if( rc==SQLITE_OK ){
+    char *zTyped = pCSV->aType ? csvDeclTyped( pCSV, zSql ) : zSql;
+    char *zDecl = zTyped ? sqlite3_mprintf(
+        "%.*s, _resume_from HIDDEN, _raw HIDDEN, _json HIDDEN);",
+        (int)strlen(zTyped)-2, zTyped) : 0;
+    rc = zDecl ? sqlite3_declare_vtab( db, zDecl ) : SQLITE_NOMEM;
+    sqlite3_free(zDecl);
+    if( zTyped!=zSql ) sqlite3_free(zTyped);
+  }
   sqlite3_free(zSql);
   if( SQLITE_OK != rc ){
     *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
@@ -713,23 +8378,619 @@ static int csvInit(
     return SQLITE_ERROR;
   }
 
+  /* the indexes of csv_refresh() and csv_create_index() and column
+  ** statistics, if any */
+  if( !isCreate ){
+    csvIndexLoad( pCSV );
+    csvColIdxLoad( pCSV );
+    csvStatLoad( pCSV );
+  }
+
+  /* make the table visible to the SQL functions of the module */
+  pCSV->pGlobal = (CSVGlobal *)pAux;
+  if( pCSV->pGlobal ){
+    pCSV->pNext = pCSV->pGlobal->pTables;
+    pCSV->pGlobal->pTables = pCSV;
+  }
+
   *ppVtab = (sqlite3_vtab *)pCSV;
   *pzErr  = NULL;
   return SQLITE_OK;
 }
 
 
+/*
+** Implementation of the csv_explain(SQL) SQL function.
+**
+** Run statement SQL to completion, discarding its results, and return a
+** JSON array describing every scan of a CSV table it did: the plan chosen
+** by csvBestIndex() (constraints consumed, columns used, estimated rows)
+** together with the number of xFilter calls, the actual number of rows
+** returned and the number of blocks skipped.
+*/
+static void csvExplainFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  CSVGlobal *pGlobal = (CSVGlobal *)sqlite3_user_data(ctx);
+  const char *zSql = (const char *)sqlite3_value_text(argv[0]);
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_str *pStr;
+  int rc;
+
+  UNUSED_PARAMETER(argc);
+
+  if( pGlobal->pExplain ){
+    sqlite3_result_error(ctx, "csv_explain() calls cannot be nested", -1);
+    return;
+  }
+  rc = sqlite3_prepare_v2(pGlobal->db, zSql ? zSql : "", -1, &pStmt, 0);
+  if( rc!=SQLITE_OK || !pStmt ){
+    sqlite3_result_error(ctx, rc ? sqlite3_errmsg(pGlobal->db) : "no SQL", -1);
+    return;
+  }
+
+  pGlobal->pExplain = sqlite3_str_new(pGlobal->db);
+  pGlobal->nExplain = 0;
+  sqlite3_str_appendchar(pGlobal->pExplain, 1, '[');
+  while( sqlite3_step(pStmt)==SQLITE_ROW ){}
+  rc = sqlite3_finalize(pStmt);
+  pStr = pGlobal->pExplain;
+  pGlobal->pExplain = 0;
+  sqlite3_str_appendchar(pStr, 1, ']');
+
+  if( rc!=SQLITE_OK ){
+    sqlite3_result_error(ctx, sqlite3_errmsg(pGlobal->db), -1);
+    sqlite3_free(sqlite3_str_finish(pStr));
+  }else{
+    sqlite3_result_text(ctx, sqlite3_str_finish(pStr), -1, sqlite3_free);
+  }
+}
+
+
+/*
+** Return the number of bytes of memory held by table pCSV, outside of its
+** cursors: its indexes, statistics, error records and column metadata.
+** Called with csvMem.mutex held, for aKey[].
+*/
+static sqlite3_int64 csvMemUsage( CSV *pCSV ){
+  sqlite3_int64 n = sizeof(CSV);
+  int i;
+  n += pCSV->nKeySlot*(sqlite3_int64)sizeof(sqlite3_uint64);
+  n += pCSV->nBlock*(sqlite3_int64)sizeof(CSVBlock);
+  if( pCSV->aRowOff ){
+    n += SQLITE_CSV_BLOCK_ROWS*(sqlite3_int64)sizeof(sqlite3_int64);
+  }
+  n += pCSV->nColIdx*(sqlite3_int64)sizeof(CSVColIdx);
+  if( pCSV->aErr ) n += SQLITE_CSV_MAX_ERRORS*(sqlite3_int64)sizeof(CSVError);
+  for(i=0; pCSV->aStat && i<pCSV->nColumn; i++){
+    CSVColStat *p = &pCSV->aStat[i];
+    n += sizeof(CSVColStat) + p->nHistByte;
+    if( p->zMin ) n += p->nMin + 1;
+    if( p->zMax ) n += p->nMax + 1;
+  }
+  if( pCSV->aType ) n += pCSV->nColumn*(sqlite3_int64)sizeof(CSVColType);
+  if( pCSV->aJsonKey ){
+    n += (pCSV->nColumn+1)*(sqlite3_int64)sizeof(int);
+    n += pCSV->aJsonKey[pCSV->nColumn] + 1;
+  }
+  return n;
+}
+
+/*
+** Implementation of the csv_stats(TABLE) SQL function.
+**
+** Return a JSON object describing the file of TABLE, the reads done by its
+** scans, its indexes and memory, the process-wide pool of file descriptors,
+** that of the threads reading ahead of lookups, the watcher of the files
+** and the memory budget of the caches.
+*/
+static void csvStatsFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  CSVGlobal *pGlobal = (CSVGlobal *)sqlite3_user_data(ctx);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  char *zErr = 0;
+  CSV *pCSV;
+  sqlite3_str *pStr;
+  int i;
+
+  UNUSED_PARAMETER(argc);
+
+  pCSV = csvFindTable(pGlobal, zTable, &zErr);
+  if( !pCSV ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+
+  pStr = sqlite3_str_new(pGlobal->db);
+  sqlite3_str_appendall(pStr, "{\"file\":");
+  csvJsonString(pStr, pCSV->zFile);
+  pthread_mutex_lock( &csvPool.mutex );
+  pthread_mutex_lock( &csvMem.mutex );
+  sqlite3_str_appendf(pStr,
+      ",\"file_size\":%lld,\"generation\":%lld,\"fd_open\":%s,"
+      "\"io_policy\":\"%s\",\"huge_pages\":\"%s\","
+      "\"on_error\":\"%s\",\"errors\":%d,"
+      "\"scans\":%lld,\"rows_read\":%lld,\"bytes_read\":%lld,"
+      "\"cells\":{\"converted\":%lld,\"cached\":%lld},"
+      "\"index\":{\"blocks\":%d,\"valid\":%s},\"stat_rows\":%lld,"
+      "\"key\":{\"column\":%d,\"entries\":%lld,\"bytes\":%lld,"
+      "\"memory\":\"%s\"},"
+      "\"memory\":{\"bytes\":%lld,\"budgeted\":%lld,\"pinned\":%d},"
+      "\"column_indexes\":[",
+      pCSV->nFileSize, pCSV->iGeneration,
+      pCSV->pFile->pHandle ? "true" : "false", azIoPolicy[pCSV->eIoPolicy],
+      azHugePages[pCSV->eHugePages], azOnError[pCSV->eOnError],
+      pCSV->iErrGeneration==pCSV->iGeneration ? pCSV->nErr : 0,
+      pCSV->nScan, pCSV->nReadRow, pCSV->nReadByte,
+      pCSV->nCellConv, pCSV->nCellHit,
+      pCSV->nBlock, pCSV->bIndexValid ? "true" : "false", pCSV->nStatRow,
+      pCSV->iKeyCol, pCSV->nKeyEntry,
+      pCSV->nKeySlot*(sqlite3_int64)sizeof(sqlite3_uint64),
+      azMap[pCSV->eKeyMap],
+      csvMemUsage(pCSV), pCSV->keyCache.nByte, pCSV->keyCache.nPin);
+  for(i=0; i<pCSV->nColIdx; i++){
+    CSVColIdx *p = &pCSV->aColIdx[i];
+    sqlite3_str_appendf(pStr,
+        "%s{\"column\":%d,\"rows\":%lld,\"nulls\":%lld,\"valid\":%s}",
+        i ? "," : "", p->iCol, p->nRow, p->nNull, p->bValid ? "true" : "false");
+  }
+  sqlite3_str_appendf(pStr,
+      "],\"pool\":{\"open_files\":%d,\"idle_files\":%d,"
+      "\"max_open_files\":%d,\"opens\":%lld,\"reuses\":%lld,"
+      "\"replaced\":%lld,\"evictions\":%lld},"
+      "\"watch\":{\"mode\":%d,\"running\":%s,\"events\":%lld,"
+      "\"unchanged\":%lld,\"prewarmed\":%lld},"
+      "\"memory_budget\":{\"bytes\":%lld,\"used\":%lld,\"caches\":%d,"
+      "\"evictions\":%lld,\"refused\":%lld,\"soft_heap_limit\":%lld}",
+      csvPool.nOpen, csvPool.nIdle, csvPool.nMaxOpen, csvPool.nOpenCall,
+      csvPool.nReuse, csvPool.nReplace, csvPool.nEvict,
+      csvWatch.eMode, csvWatch.fd>=0 ? "true" : "false", csvWatch.nEvent,
+      csvWatch.nSkip, csvWatch.nPrewarm,
+      csvMem.nBudget, csvMem.nUsed, csvMem.nCache, csvMem.nEvict,
+      csvMem.nRefuse, sqlite3_soft_heap_limit64(-1));
+  pthread_mutex_unlock( &csvMem.mutex );
+  pthread_mutex_unlock( &csvPool.mutex );
+  pthread_mutex_lock( &csvIoPool.mutex );
+  sqlite3_str_appendf(pStr,
+      ",\"io\":{\"threads\":%d,\"max_threads\":%d,\"reads\":%lld}}",
+      csvIoPool.nThread, csvIoPool.nMaxThread, csvIoPool.nRead);
+  pthread_mutex_unlock( &csvIoPool.mutex );
+  sqlite3_result_text(ctx, sqlite3_str_finish(pStr), -1, sqlite3_free);
+}
+
+
+/*
+** Implementation of the csv_refresh(TABLE) SQL function.
+**
+** Scan the file of TABLE and store its index in the shadow tables: the
+** offsets of the rows, and per block of rows the min/max values and Bloom
+** filters of the columns, which let scans skip the blocks that cannot
+** match text constraints. Return the number of rows indexed.
+*/
+static void csvRefreshFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  CSVGlobal *pGlobal = (CSVGlobal *)sqlite3_user_data(ctx);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  sqlite3_int64 nRow = 0;
+  char *zErr = 0;
+  CSV *pCSV;
+  int rc;
+
+  UNUSED_PARAMETER(argc);
+
+  pCSV = csvFindTable(pGlobal, zTable, &zErr);
+  if( pCSV && pCSV->nCursor>0 ){
+    zErr = sqlite3_mprintf("CSV table %s is being read", pCSV->zName);
+    pCSV = 0;
+  }
+  if( !pCSV ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  csvReference( pCSV );
+  rc = csvIndexBuild( pCSV, &nRow, &zErr );
+  csvRelease( pCSV );
+  if( rc!=SQLITE_OK ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_result_error_code(ctx, rc);
+  }else{
+    sqlite3_result_int64(ctx, nRow);
+  }
+  sqlite3_free(zErr);
+}
+
+
+/*
+** Implementation of the csv_checkpoint(TABLE) SQL function.
+**
+** Return the offset that a scan of TABLE resumed from its last row would
+** start at: that of the row after the last one returned by a scan in this
+** connection, or the size of the file if a scan reached its end. Passed
+** back as the hidden _resume_from argument, as in
+**
+**   SELECT * FROM t(csv_checkpoint('t'));
+**
+** a later scan carries on from there. NULL if TABLE has not been scanned,
+** which starts from the first row.
+*/
+static void csvCheckpointFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  CSVGlobal *pGlobal = (CSVGlobal *)sqlite3_user_data(ctx);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  char *zErr = 0;
+  CSV *pCSV;
+
+  UNUSED_PARAMETER(argc);
+
+  pCSV = csvFindTable(pGlobal, zTable, &zErr);
+  if( !pCSV ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  if( pCSV->iCheckpoint>=0 ){
+    sqlite3_result_int64(ctx, pCSV->iCheckpoint);
+  }
+}
+
+
+/*
+** Implementation of the csv_analyze(TABLE) SQL function.
+**
+** Scan the file of TABLE and store statistics of its columns in the %_stat
+** shadow table: number of empty values, estimated number of distinct
+** values, min, max and an equi-depth histogram. xBestIndex uses them to
+** estimate the number of rows that satisfy constraints on the columns.
+** csv_refresh() also computes them. Return the number of rows scanned.
+*/
+static void csvAnalyzeFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  CSVGlobal *pGlobal = (CSVGlobal *)sqlite3_user_data(ctx);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  sqlite3_int64 nRow = 0;
+  char *zErr = 0;
+  CSV *pCSV;
+  int rc;
+
+  UNUSED_PARAMETER(argc);
+
+  pCSV = csvFindTable(pGlobal, zTable, &zErr);
+  if( !pCSV ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  csvReference( pCSV );
+  rc = csvStatScan( pCSV, &nRow, &zErr );
+  csvRelease( pCSV );
+  if( rc!=SQLITE_OK ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_result_error_code(ctx, rc);
+  }else{
+    sqlite3_result_int64(ctx, nRow);
+  }
+  sqlite3_free(zErr);
+}
+
+
+/*
+** Implementation of the csv_create_index(TABLE, COLUMN) SQL function.
+**
+** Build a sorted index of column COLUMN of TABLE, (value, offset of the
+** row) pairs stored in the %_colkey shadow table. xBestIndex uses it for
+** =, <, <=, >, >= and BETWEEN constraints on the column and to return the
+** rows in the order of ORDER BY COLUMN, seeking each row of the file in
+** turn. The index is ignored once the file changes, until it is built
+** again. Return the number of rows indexed.
+*/
+static void csvCreateIndexFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  CSVGlobal *pGlobal = (CSVGlobal *)sqlite3_user_data(ctx);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  const char *zCol = (const char *)sqlite3_value_text(argv[1]);
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_int64 nRow = 0;
+  char *zErr = 0;
+  char *zSql;
+  CSV *pCSV;
+  int iCol = -1;
+  int rc;
+
+  UNUSED_PARAMETER(argc);
+
+  pCSV = csvFindTable(pGlobal, zTable, &zErr);
+  if( pCSV && pCSV->nCursor>0 ){
+    zErr = sqlite3_mprintf("CSV table %s is being read", pCSV->zName);
+    pCSV = 0;
+  }
+  if( !pCSV ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+
+  /* find the column by name */
+  zSql = sqlite3_mprintf(
+      "SELECT cid, name FROM pragma_table_info(%Q, %Q) WHERE name=%Q"
+      " COLLATE NOCASE", pCSV->zName, pCSV->zDb, zCol ? zCol : "");
+  rc = zSql ? sqlite3_prepare_v2( pGlobal->db, zSql, -1, &pStmt, 0 )
+            : SQLITE_NOMEM;
+  sqlite3_free( zSql );
+  if( rc==SQLITE_OK && sqlite3_step( pStmt )==SQLITE_ROW ){
+    iCol = sqlite3_column_int( pStmt, 0 );
+    zCol = (const char *)sqlite3_column_text( pStmt, 1 );
+  }
+  if( rc==SQLITE_OK && (iCol<0 || iCol>=pCSV->nColumn) ){
+    sqlite3_finalize( pStmt );
+    zErr = sqlite3_mprintf("no such column: %s", sqlite3_value_text(argv[1]));
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+
+  if( rc==SQLITE_OK ){
+    csvReference( pCSV );
+    rc = csvColIdxBuild( pCSV, iCol, zCol, &nRow, &zErr );
+    csvRelease( pCSV );
+  }
+  sqlite3_finalize( pStmt );
+  if( rc!=SQLITE_OK ){
+    sqlite3_result_error(ctx, zErr ? zErr : sqlite3_errstr(rc), -1);
+    sqlite3_result_error_code(ctx, rc);
+  }else{
+    sqlite3_result_int64(ctx, nRow);
+  }
+  sqlite3_free(zErr);
+}
+
+
+/*
+** Implementation of the csv_config(NAME ?, VALUE?) SQL function.
+**
+** Return the current value of process-wide setting NAME, after setting it
+** to VALUE if there is one. The settings are:
+**
+**   max_open_files   Number of idle file descriptors kept open by the pool
+**                    (default SQLITE_CSV_MAX_OPEN_FILES)
+**   io_threads       Number of threads doing the reads ahead of lookups,
+**                    0 to read in line (default SQLITE_CSV_IO_THREADS)
+**   watch            0 to stat() the files at each scan, 1 to watch them
+**                    for changes instead, 2 to also read rewritten files
+**                    back in the background (default SQLITE_CSV_WATCH).
+**                    Always 0 where inotify is not available.
+**   memory_budget    Bytes the caches of all the tables may use, 0 for no
+**                    limit (default SQLITE_CSV_MEMORY_BUDGET). Lowering it
+**                    evicts the caches that are not in use right away.
+*/
+static void csvConfigFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  const char *zName = (const char *)sqlite3_value_text(argv[0]);
+
+  if( zName && sqlite3_stricmp(zName, "max_open_files")==0 ){
+    int n;
+    pthread_mutex_lock( &csvPool.mutex );
+    if( argc>1 ){
+      n = sqlite3_value_int(argv[1]);
+      csvPool.nMaxOpen = n<0 ? 0 : n;
+      csvPoolEvict();
+    }
+    n = csvPool.nMaxOpen;
+    pthread_mutex_unlock( &csvPool.mutex );
+    sqlite3_result_int(ctx, n);
+  }else if( zName && sqlite3_stricmp(zName, "io_threads")==0 ){
+    int n;
+    if( argc>1 ){
+      n = sqlite3_value_int(argv[1]);
+      n = n<0 ? 0 : n>CSV_IO_MAX_THREADS ? CSV_IO_MAX_THREADS : n;
+      pthread_mutex_lock( &csvIoPool.mutex );
+      csvIoPool.nMaxThread = n;
+      pthread_mutex_unlock( &csvIoPool.mutex );
+      csvIoStop( n );
+    }
+    pthread_mutex_lock( &csvIoPool.mutex );
+    n = csvIoPool.nMaxThread;
+    pthread_mutex_unlock( &csvIoPool.mutex );
+    sqlite3_result_int(ctx, n);
+  }else if( zName && sqlite3_stricmp(zName, "watch")==0 ){
+    int n;
+    if( argc>1 ){
+      n = sqlite3_value_int(argv[1]);
+#ifdef CSV_HAVE_WATCH
+      n = n<0 ? 0 : n>2 ? 2 : n;
+#else
+      n = 0;
+#endif
+      pthread_mutex_lock( &csvPool.mutex );
+      csvWatch.eMode = n;
+      pthread_mutex_unlock( &csvPool.mutex );
+      if( n==0 ) csvWatchStop();
+    }
+    pthread_mutex_lock( &csvPool.mutex );
+    n = csvWatch.eMode;
+    pthread_mutex_unlock( &csvPool.mutex );
+    sqlite3_result_int(ctx, n);
+  }else if( zName && sqlite3_stricmp(zName, "memory_budget")==0 ){
+    sqlite3_int64 n;
+    pthread_mutex_lock( &csvMem.mutex );
+    if( argc>1 ){
+      n = sqlite3_value_int64(argv[1]);
+      csvMem.nBudget = n<0 ? 0 : n;
+      csvCacheEvict( 0 );
+    }
+    n = csvMem.nBudget;
+    pthread_mutex_unlock( &csvMem.mutex );
+    sqlite3_result_int64(ctx, n);
+  }else{
+    char *zErr = sqlite3_mprintf("unknown csv_config setting: %s",
+                                 zName ? zName : "");
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+  }
+}
+
+
+#ifdef SQLITE_ENABLE_CSV_PROFILE
+/*
+** Implementation of the csv_profile(TABLE ?, RESET?) SQL function.
+**
+** Return the timers and histograms collected by the scan loop of TABLE
+** as a JSON object. If RESET is true, they are zeroed afterwards.
+*/
+static void csvProfileFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  static const char *azPhase[CSV_NPHASE] = {
+    "getline", "tokenize", "column", "read"
+  };
+  CSVGlobal *pGlobal = (CSVGlobal *)sqlite3_user_data(ctx);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  char *zErr = 0;
+  CSV *pCSV;
+  CSVProfile *p;
+  sqlite3_str *pStr;
+  int i;
+
+  pCSV = csvFindTable(pGlobal, zTable, &zErr);
+  if( !pCSV ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  p = &pCSV->prof;
+
+  pStr = sqlite3_str_new(pGlobal->db);
+  sqlite3_str_appendf(pStr, "{\"clock\":\"%s\",\"phases\":{",
+      CSV_PROFILE_CLOCK_NAME);
+  for(i=0; i<CSV_NPHASE; i++){
+    sqlite3_str_appendf(pStr,
+        "%s\"%s\":{\"calls\":%llu,\"ticks\":%llu,\"max\":%llu}",
+        i ? "," : "", azPhase[i], p->aCall[i], p->aTick[i], p->aMax[i]);
+  }
+  for(i=0; i<2; i++){
+    sqlite3_uint64 *aHist = i ? p->aRowLen : p->aRowTick;
+    int j, bFirst = 1;
+    sqlite3_str_appendf(pStr, "},\"%s\":{",
+        i ? "row_length" : "row_latency");
+    for(j=0; j<64; j++){
+      if( aHist[j]==0 ) continue;
+      /* bucket j holds the samples below 2^j */
+      sqlite3_str_appendf(pStr, "%s\"%llu\":%llu",
+          bFirst ? "" : ",", (sqlite3_uint64)1<<j, aHist[j]);
+      bFirst = 0;
+    }
+  }
+  sqlite3_str_appendall(pStr, "}}");
+
+  if( argc>1 && sqlite3_value_int(argv[1]) ){
+    memset(p, 0, sizeof(*p));
+  }
+  sqlite3_result_text(ctx, sqlite3_str_finish(pStr), -1, sqlite3_free);
+}
+#endif
+
+
 /*
 ** Register the CSV module with database handle db. This creates the
 ** virtual table module "csv".
 */
 int sqlite3CsvInit(sqlite3 *db){
   int rc = SQLITE_OK;
+  CSVGlobal *pGlobal;
 
+  pGlobal = (CSVGlobal *)sqlite3_malloc(sizeof(CSVGlobal));
+  if( !pGlobal ){
+    return SQLITE_NOMEM;
+  }
+  memset(pGlobal, 0, sizeof(CSVGlobal));
+  pGlobal->db = db;
+
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module_v2(db, "csv", &csvModule, (void *)pGlobal,
+                                  sqlite3_free);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module_v2(db, "csv_errors", &csvErrorsModule,
+                                  (void *)pGlobal, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module_v2(db, "csv_aggregate", &csvAggModule, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_explain", 1,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvExplainFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_stats", 1,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvStatsFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_refresh", 1,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvRefreshFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_checkpoint", 1,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvCheckpointFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_analyze", 1,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvAnalyzeFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_create_index", 2,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvCreateIndexFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_config", 1,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 0, csvConfigFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_config", 2,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 0, csvConfigFunc, 0, 0);
+  }
+#ifdef SQLITE_ENABLE_CSV_PROFILE
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "csv_profile", 1,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvProfileFunc, 0, 0);
+  }
   if( rc==SQLITE_OK ){
-    void *c = (void *)NULL;
-    rc = sqlite3_create_module_v2(db, "csv", &csvModule, c, 0);
+    rc = sqlite3_create_function(db, "csv_profile", 2,
+                                 SQLITE_UTF8|SQLITE_DIRECTONLY,
+                                 (void *)pGlobal, csvProfileFunc, 0, 0);
   }
+#endif
 
   return rc;
 }
@@ -0,0 +1,667 @@
+/*
+** 2026 October 17
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+** This file contains a benchmark program for the CSV virtual table.  It
+** loads the extension, declares a table over a CSV file (typically one
+** written by csvgen.c) and times a fixed set of queries against it with
+** a warm and/or a cold page cache.  Results are written as a single JSON
+** object so that they can be collected and compared over time.
+**
+** The same queries can be run through other engines over the same file,
+** to compare this extension with known baselines:
+**
+**    csv        this extension (the default)
+**    upstream   the csv virtual table of SQLite's ext/misc/csv.c
+**    import     a native table filled by the sqlite3 shell ".import"
+**
+** Each engine is expected to be run in its own process, so that the peak
+** RSS reported in the results is not polluted by another engine.  Heap
+** allocations are counted by a wrapper installed with SQLITE_CONFIG_MALLOC,
+** so they include everything allocated through sqlite3_malloc() by SQLite
+** and by the extension under test.  For the "import" engine, an extra
+** "import" result reports the time and peak RSS of the shell process.
+**
+** Build:
+**
+**    gcc -O2 -fPIC -shared -o csv.so csv.c
+**    gcc -O2 -fPIC -shared -o csv_upstream.so sqlite/ext/misc/csv.c
+**    gcc -O2 -o csvbench tool/csvbench.c -lsqlite3
+**
+** Usage:
+**
+**    csvbench ?OPTIONS? EXTENSION FILE
+**
+** Options:
+**
+**    --delim C          column delimiter (default: ',')
+**    --no-header        FILE has no header row
+**    --query LIST       comma-separated list of queries to run (default: all)
+**    --cache MODE       warm, cold or both (default: both)
+**    --repeat N         number of timed runs per query and cache mode (3)
+**    --lookups N        number of rowid lookups in the "rowid" query (100)
+**    --label TEXT       free-form label copied into the JSON output
+**    --json FILE        write the JSON result to FILE instead of stdout
+**    --engine NAME      csv, upstream or import (default: csv)
+**    --upstream EXT     shared library built from ext/misc/csv.c
+**    --shell PATH       sqlite3 shell used by the import engine (sqlite3)
+**    --db FILE          database written by the import engine (FILE.db)
+**
+** The queries are:
+**
+**    count        SELECT count(*) FROM t
+**    project1     SELECT c2 FROM t
+**    projectall   SELECT * FROM t
+**    filter_key   SELECT * FROM t WHERE c1=?     (one matching row)
+**    filter_pct   SELECT * FROM t WHERE c2=?     (about 1% of the rows)
+**    rowid        SELECT * FROM t WHERE rowid=?  (random sample of rowids)
+**
+** where c1 and c2 are the first two columns of the table.  A cold run
+** evicts the pages of FILE from the OS page cache before it starts (using
+** posix_fadvise(), which does not require any privilege).  A warm run is
+** preceded by one untimed run of the same query.
+*/
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef sqlite3_int64 i64;
+
+/*
+** Global state of the benchmark.
+*/
+typedef struct Bench Bench;
+struct Bench {
+  sqlite3 *db;                 /* Database connection */
+  const char *zFile;           /* CSV file being scanned */
+  const char *zEvict;          /* File evicted from the cache by cold runs */
+  i64 nFileByte;               /* Size of zFile in bytes */
+  i64 nRow;                    /* Number of data rows in zFile */
+  char *zKeyCol;               /* Quoted name of the first column */
+  char *zCatCol;               /* Quoted name of the second column */
+  char *zKey;                  /* Value of zKeyCol in the middle row */
+  char *zCat;                  /* Value of zCatCol in the middle row */
+  i64 *aRowid;                 /* Sample of rowids for the "rowid" query */
+  int nRowid;                  /* Number of entries in aRowid[] */
+  int nRepeat;                 /* Timed runs per query and cache mode */
+  FILE *out;                   /* Where to write the JSON result */
+  int nResult;                 /* Number of results written so far */
+};
+
+/*
+** Print an error message and exit.
+*/
+static void benchFatal(Bench *p, const char *zMsg){
+  fprintf(stderr, "csvbench: %s: %s\n", zMsg, p->db ? sqlite3_errmsg(p->db) : "");
+  exit(1);
+}
+
+static double benchNow(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec*1e-9;
+}
+static double benchCpu(void){
+  struct rusage r;
+  getrusage(RUSAGE_SELF, &r);
+  return (double)(r.ru_utime.tv_sec + r.ru_stime.tv_sec)
+       + (double)(r.ru_utime.tv_usec + r.ru_stime.tv_usec)*1e-6;
+}
+
+/*
+** Wrapper around the default SQLite memory allocator that counts the
+** number of allocations (calls to xMalloc and xRealloc).
+*/
+static sqlite3_mem_methods benchDefaultMem;
+static i64 nBenchAlloc = 0;
+static void *benchMalloc(int n){
+  nBenchAlloc++;
+  return benchDefaultMem.xMalloc(n);
+}
+static void *benchRealloc(void *p, int n){
+  nBenchAlloc++;
+  return benchDefaultMem.xRealloc(p, n);
+}
+static void benchInstallMalloc(void){
+  sqlite3_mem_methods m;
+  sqlite3_config(SQLITE_CONFIG_GETMALLOC, &benchDefaultMem);
+  m = benchDefaultMem;
+  m.xMalloc = benchMalloc;
+  m.xRealloc = benchRealloc;
+  sqlite3_config(SQLITE_CONFIG_MALLOC, &m);
+}
+
+/*
+** Reset the peak resident set size of this process, where the OS allows
+** it (Linux 4.0 and later), and read it back in KiB.
+*/
+static void benchResetPeakRss(void){
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if( f ){
+    fputs("5", f);
+    fclose(f);
+  }
+}
+static i64 benchPeakRss(void){
+  struct rusage r;
+  FILE *f = fopen("/proc/self/status", "r");
+  if( f ){
+    char zLine[256];
+    while( fgets(zLine, sizeof(zLine), f) ){
+      if( strncmp(zLine, "VmHWM:", 6)==0 ){
+        fclose(f);
+        return strtoll(&zLine[6], 0, 10);
+      }
+    }
+    fclose(f);
+  }
+  getrusage(RUSAGE_SELF, &r);
+  return (i64)r.ru_maxrss;
+}
+
+/*
+** Evict the pages of the scanned file from the OS page cache.
+*/
+static void benchEvict(Bench *p){
+  int fd = open(p->zEvict, O_RDONLY);
+  if( fd>=0 ){
+#ifdef POSIX_FADV_DONTNEED
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+  }
+}
+
+/*
+** Step statement pStmt to completion, touching every column of every
+** result row.  Return the number of result rows.
+*/
+static i64 benchStep(Bench *p, sqlite3_stmt *pStmt){
+  i64 nRow = 0;
+  int nCol = sqlite3_column_count(pStmt);
+  int rc;
+  while( (rc = sqlite3_step(pStmt))==SQLITE_ROW ){
+    int i;
+    for(i=0; i<nCol; i++){
+      (void)sqlite3_column_text(pStmt, i);
+    }
+    nRow++;
+  }
+  if( rc!=SQLITE_DONE ) benchFatal(p, "query failed");
+  sqlite3_reset(pStmt);
+  return nRow;
+}
+
+/*
+** Prepare SQL statement zSql, which is obtained from sqlite3_mprintf()
+** and freed by this routine.
+*/
+static sqlite3_stmt *benchPrepare(Bench *p, char *zSql){
+  sqlite3_stmt *pStmt = 0;
+  if( zSql==0 ) benchFatal(p, "out of memory");
+  if( sqlite3_prepare_v2(p->db, zSql, -1, &pStmt, 0) ){
+    fprintf(stderr, "csvbench: %s\n", zSql);
+    benchFatal(p, "cannot prepare");
+  }
+  sqlite3_free(zSql);
+  return pStmt;
+}
+
+/*
+** Run query zQuery once.  Return the number of result rows.
+*/
+static i64 benchRunOnce(Bench *p, const char *zQuery){
+  sqlite3_stmt *pStmt;
+  i64 nRow = 0;
+  if( strcmp(zQuery, "count")==0 ){
+    pStmt = benchPrepare(p, sqlite3_mprintf("SELECT count(*) FROM t"));
+    nRow = benchStep(p, pStmt);
+  }else if( strcmp(zQuery, "project1")==0 ){
+    pStmt = benchPrepare(p, sqlite3_mprintf("SELECT %s FROM t", p->zCatCol));
+    nRow = benchStep(p, pStmt);
+  }else if( strcmp(zQuery, "projectall")==0 ){
+    pStmt = benchPrepare(p, sqlite3_mprintf("SELECT * FROM t"));
+    nRow = benchStep(p, pStmt);
+  }else if( strcmp(zQuery, "filter_key")==0 ){
+    pStmt = benchPrepare(p,
+        sqlite3_mprintf("SELECT * FROM t WHERE %s=?", p->zKeyCol));
+    sqlite3_bind_text(pStmt, 1, p->zKey, -1, SQLITE_STATIC);
+    nRow = benchStep(p, pStmt);
+  }else if( strcmp(zQuery, "filter_pct")==0 ){
+    pStmt = benchPrepare(p,
+        sqlite3_mprintf("SELECT * FROM t WHERE %s=?", p->zCatCol));
+    sqlite3_bind_text(pStmt, 1, p->zCat, -1, SQLITE_STATIC);
+    nRow = benchStep(p, pStmt);
+  }else if( strcmp(zQuery, "rowid")==0 ){
+    int i;
+    pStmt = benchPrepare(p, sqlite3_mprintf("SELECT * FROM t WHERE rowid=?"));
+    for(i=0; i<p->nRowid; i++){
+      sqlite3_bind_int64(pStmt, 1, p->aRowid[i]);
+      nRow += benchStep(p, pStmt);
+    }
+  }else{
+    fprintf(stderr, "csvbench: unknown query: %s\n", zQuery);
+    exit(1);
+  }
+  sqlite3_finalize(pStmt);
+  return nRow;
+}
+
+static int benchCmpDouble(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return x<y ? -1 : x>y;
+}
+
+/*
+** Time query zQuery with a warm (bCold==0) or cold (bCold!=0) cache
+** and append the result to the JSON output.
+*/
+static void benchQuery(Bench *p, const char *zQuery, int bCold){
+  double *aTime = (double *)malloc(sizeof(double)*p->nRepeat);
+  double rCpu = 0.0;
+  double rBest;
+  i64 nRow = 0;
+  i64 nUnit;
+  i64 nAlloc;
+  sqlite3_int64 iCur, iHeapPeak;
+  int i;
+
+  if( !bCold ) benchRunOnce(p, zQuery);
+  benchResetPeakRss();
+  sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &iCur, &iHeapPeak, 1);
+  nAlloc = nBenchAlloc;
+  for(i=0; i<p->nRepeat; i++){
+    double t0, c0;
+    if( bCold ) benchEvict(p);
+    c0 = benchCpu();
+    t0 = benchNow();
+    nRow = benchRunOnce(p, zQuery);
+    aTime[i] = benchNow() - t0;
+    rCpu += benchCpu() - c0;
+  }
+  nAlloc = (nBenchAlloc - nAlloc)/p->nRepeat;
+  sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &iCur, &iHeapPeak, 0);
+  qsort(aTime, p->nRepeat, sizeof(double), benchCmpDouble);
+  rBest = aTime[0]>0.0 ? aTime[0] : 1e-9;
+
+  /* Throughput is expressed in rows of the table visited per second,
+  ** except for rowid lookups, where it is the number of lookups. */
+  nUnit = strcmp(zQuery, "rowid")==0 ? p->nRowid : p->nRow;
+  fprintf(p->out,
+      "%s\n    {\"query\": \"%s\", \"cache\": \"%s\", \"runs\": %d,"
+      " \"result_rows\": %lld,\n     \"best_s\": %.6f, \"median_s\": %.6f,"
+      " \"cpu_s\": %.6f, \"rows_per_s\": %.1f, \"mb_per_s\": ",
+      p->nResult++ ? "," : "", zQuery, bCold ? "cold" : "warm", p->nRepeat,
+      nRow, aTime[0], aTime[p->nRepeat/2], rCpu/p->nRepeat,
+      (double)nUnit/rBest
+  );
+  if( strcmp(zQuery, "rowid")==0 ){
+    fprintf(p->out, "null");
+  }else{
+    fprintf(p->out, "%.2f", (double)p->nFileByte/(1024.0*1024.0)/rBest);
+  }
+  fprintf(p->out,
+      ",\n     \"peak_rss_kb\": %lld, \"heap_peak_bytes\": %lld,"
+      " \"allocs\": %lld}",
+      benchPeakRss(), (i64)iHeapPeak, nAlloc
+  );
+  fflush(p->out);
+  free(aTime);
+}
+
+/*
+** Write string z to the JSON output as a JSON string literal.
+*/
+static void benchJsonString(Bench *p, const char *z){
+  putc('"', p->out);
+  for(; z && *z; z++){
+    if( *z=='"' || *z=='\\' ){
+      fprintf(p->out, "\\%c", *z);
+    }else if( (unsigned char)*z<0x20 ){
+      fprintf(p->out, "\\u%04x", *z);
+    }else{
+      putc(*z, p->out);
+    }
+  }
+  putc('"', p->out);
+}
+
+/*
+** Find the names of the first two columns, count the rows and pick the
+** filter values and the sample of rowids used by the queries.
+*/
+static void benchPrepareData(Bench *p, int nLookup){
+  sqlite3_stmt *pStmt;
+  i64 iMid;
+  sqlite3_uint64 x = 88172645463325252ULL;
+
+  pStmt = benchPrepare(p, sqlite3_mprintf("SELECT * FROM t LIMIT 0"));
+  if( sqlite3_column_count(pStmt)<2 ){
+    fprintf(stderr, "csvbench: the CSV file needs at least two columns\n");
+    exit(1);
+  }
+  p->zKeyCol = sqlite3_mprintf("\"%w\"", sqlite3_column_name(pStmt, 0));
+  p->zCatCol = sqlite3_mprintf("\"%w\"", sqlite3_column_name(pStmt, 1));
+  sqlite3_finalize(pStmt);
+
+  /* Reservoir-sample nLookup rowids (xorshift64 for reproducibility) */
+  p->aRowid = (i64 *)malloc(sizeof(i64)*(nLookup>0 ? nLookup : 1));
+  pStmt = benchPrepare(p, sqlite3_mprintf("SELECT rowid FROM t"));
+  while( sqlite3_step(pStmt)==SQLITE_ROW ){
+    i64 iRowid = sqlite3_column_int64(pStmt, 0);
+    if( p->nRow<nLookup ){
+      p->aRowid[p->nRowid++] = iRowid;
+    }else{
+      i64 j;
+      x ^= x<<13; x ^= x>>7; x ^= x<<17;
+      j = (i64)(x % (sqlite3_uint64)(p->nRow+1));
+      if( j<nLookup ) p->aRowid[j] = iRowid;
+    }
+    p->nRow++;
+  }
+  sqlite3_finalize(pStmt);
+  if( p->nRow==0 ){
+    fprintf(stderr, "csvbench: %s has no data rows\n", p->zFile);
+    exit(1);
+  }
+
+  iMid = p->nRow/2;
+  pStmt = benchPrepare(p, sqlite3_mprintf(
+        "SELECT %s, %s FROM t LIMIT 1 OFFSET %lld",
+        p->zKeyCol, p->zCatCol, iMid));
+  if( sqlite3_step(pStmt)==SQLITE_ROW ){
+    p->zKey = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+    p->zCat = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 1));
+  }
+  sqlite3_finalize(pStmt);
+}
+
+/*
+** Count the columns of the first row of the CSV file.  This is only used
+** to declare the native table when the file has no header row.
+*/
+static int benchCountColumns(Bench *p, char cDelim){
+  FILE *in = fopen(p->zFile, "rb");
+  int nCol = 1;
+  int bQuoted = 0;
+  int c;
+  if( in==0 ) return 0;
+  while( (c = getc(in))!=EOF ){
+    if( c=='"' ){
+      bQuoted = !bQuoted;
+    }else if( !bQuoted && c==cDelim ){
+      nCol++;
+    }else if( !bQuoted && (c=='\n' || c=='\r') ){
+      break;
+    }
+  }
+  fclose(in);
+  return nCol;
+}
+
+/*
+** Import the CSV file into table "t" of database zDb by running the
+** sqlite3 shell ".import" command.  The wall-clock time and the peak RSS
+** of the shell process are returned in *pTime and *pRss.
+*/
+static void benchImport(
+  Bench *p,
+  const char *zShell,
+  const char *zDb,
+  char cDelim,
+  int bHeader,
+  double *pTime,
+  i64 *pRss
+){
+  char *zScript;
+  int aPipe[2];
+  pid_t pid;
+  int status = 0;
+  struct rusage r;
+  double t0;
+
+  unlink(zDb);
+  if( !bHeader ){
+    /* .import only uses the first row as column names if the table does
+    ** not exist yet, so create it with the same names as this extension */
+    sqlite3 *db;
+    sqlite3_str *pStr = sqlite3_str_new(0);
+    int i, nCol = benchCountColumns(p, cDelim);
+    for(i=0; i<nCol; i++){
+      sqlite3_str_appendf(pStr, "%scol%d", i ? ", " : "CREATE TABLE t(", i+1);
+    }
+    sqlite3_str_appendall(pStr, ")");
+    zScript = sqlite3_str_finish(pStr);
+    if( sqlite3_open(zDb, &db) || sqlite3_exec(db, zScript, 0, 0, 0) ){
+      fprintf(stderr, "csvbench: cannot create %s\n", zDb);
+      exit(1);
+    }
+    sqlite3_close(db);
+    sqlite3_free(zScript);
+  }
+
+  zScript = sqlite3_mprintf(
+      ".mode csv\n.separator \"%c\"\n.import \"%w\" t\n", cDelim, p->zFile);
+  if( pipe(aPipe) ){
+    fprintf(stderr, "csvbench: pipe() failed\n");
+    exit(1);
+  }
+  t0 = benchNow();
+  pid = fork();
+  if( pid==0 ){
+    dup2(aPipe[0], 0);
+    close(aPipe[0]);
+    close(aPipe[1]);
+    execlp(zShell, zShell, "-batch", zDb, (char *)0);
+    fprintf(stderr, "csvbench: cannot run %s\n", zShell);
+    _exit(127);
+  }
+  close(aPipe[0]);
+  if( write(aPipe[1], zScript, strlen(zScript))<0 ){
+    fprintf(stderr, "csvbench: cannot write to %s\n", zShell);
+  }
+  close(aPipe[1]);
+  sqlite3_free(zScript);
+  if( pid<0 || wait4(pid, &status, 0, &r)<0 || status!=0 ){
+    fprintf(stderr, "csvbench: .import failed\n");
+    exit(1);
+  }
+  *pTime = benchNow() - t0;
+  *pRss = (i64)r.ru_maxrss;
+}
+
+static void usage(const char *zArgv0){
+  fprintf(stderr,
+    "Usage: %s ?--delim C? ?--no-header? ?--query LIST? ?--cache MODE?\n"
+    "       ?--repeat N? ?--lookups N? ?--label TEXT? ?--json FILE?\n"
+    "       ?--engine NAME? ?--upstream EXT? ?--shell PATH? ?--db FILE?\n"
+    "       EXTENSION FILE\n", zArgv0);
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  static const char *azAllQuery[] = {
+    "count", "project1", "projectall", "filter_key", "filter_pct", "rowid"
+  };
+  Bench b;
+  const char *zExt = 0;
+  const char *zQueryList = 0;
+  const char *zCache = "both";
+  const char *zLabel = "";
+  const char *zJson = 0;
+  const char *zEngine = "csv";
+  const char *zUpstream = 0;
+  const char *zShell = "sqlite3";
+  const char *zDb = 0;
+  double rImportTime = 0.0;
+  i64 iImportRss = 0;
+  char cDelim = ',';
+  int bHeader = 1;
+  int nLookup = 100;
+  char *zErr = 0;
+  char *zSql;
+  struct stat st;
+  time_t now;
+  int i;
+
+  memset(&b, 0, sizeof(b));
+  b.nRepeat = 3;
+  for(i=1; i<argc; i++){
+    const char *z = argv[i];
+    if( z[0]=='-' && z[1]=='-' ) z++;
+    if( strcmp(z, "-no-header")==0 ){
+      bHeader = 0;
+    }else if( z[0]=='-' && i+1<argc ){
+      const char *zArg = argv[++i];
+      if( strcmp(z, "-delim")==0 ){
+        cDelim = zArg[0];
+      }else if( strcmp(z, "-query")==0 ){
+        zQueryList = zArg;
+      }else if( strcmp(z, "-cache")==0 ){
+        zCache = zArg;
+      }else if( strcmp(z, "-repeat")==0 ){
+        b.nRepeat = atoi(zArg);
+      }else if( strcmp(z, "-lookups")==0 ){
+        nLookup = atoi(zArg);
+      }else if( strcmp(z, "-label")==0 ){
+        zLabel = zArg;
+      }else if( strcmp(z, "-json")==0 ){
+        zJson = zArg;
+      }else if( strcmp(z, "-engine")==0 ){
+        zEngine = zArg;
+      }else if( strcmp(z, "-upstream")==0 ){
+        zUpstream = zArg;
+      }else if( strcmp(z, "-shell")==0 ){
+        zShell = zArg;
+      }else if( strcmp(z, "-db")==0 ){
+        zDb = zArg;
+      }else{
+        usage(argv[0]);
+      }
+    }else if( zExt==0 ){
+      zExt = argv[i];
+    }else if( b.zFile==0 ){
+      b.zFile = argv[i];
+    }else{
+      usage(argv[0]);
+    }
+  }
+  if( b.zFile==0 ) usage(argv[0]);
+  if( b.nRepeat<1 ) b.nRepeat = 1;
+  if( strcmp(zCache, "warm") && strcmp(zCache, "cold") && strcmp(zCache, "both") ){
+    usage(argv[0]);
+  }
+  if( stat(b.zFile, &st) ){
+    fprintf(stderr, "csvbench: cannot stat %s\n", b.zFile);
+    return 1;
+  }
+  b.nFileByte = (i64)st.st_size;
+  b.out = zJson ? fopen(zJson, "w") : stdout;
+  if( b.out==0 ){
+    fprintf(stderr, "csvbench: cannot open %s\n", zJson);
+    return 1;
+  }
+
+  benchInstallMalloc();
+  b.zEvict = b.zFile;
+  if( strcmp(zEngine, "import")==0 ){
+    if( zDb==0 ) zDb = sqlite3_mprintf("%s.db", b.zFile);
+    benchImport(&b, zShell, zDb, cDelim, bHeader, &rImportTime, &iImportRss);
+    if( sqlite3_open(zDb, &b.db) ) benchFatal(&b, "cannot open database");
+    b.zEvict = zDb;
+  }else{
+    const char *zLoad = zExt;
+    const char *zProc = 0;
+    if( strcmp(zEngine, "upstream")==0 ){
+      if( zUpstream==0 || cDelim!=',' ){
+        fprintf(stderr, "csvbench: the upstream engine needs --upstream "
+                        "and only supports ',' as delimiter\n");
+        return 1;
+      }
+      zLoad = zUpstream;
+      zProc = "sqlite3_csv_init";
+      zSql = sqlite3_mprintf(
+          "CREATE VIRTUAL TABLE temp.t USING csv(filename='%q', header=%s)",
+          b.zFile, bHeader ? "YES" : "NO");
+    }else if( strcmp(zEngine, "csv")==0 ){
+      zSql = sqlite3_mprintf(
+          "CREATE VIRTUAL TABLE temp.t USING csv('%q', '%c'%s)",
+          b.zFile, cDelim, bHeader ? ", USE_HEADER_ROW" : "");
+    }else{
+      usage(argv[0]);
+    }
+    if( sqlite3_open(":memory:", &b.db) ) benchFatal(&b, "cannot open database");
+    sqlite3_enable_load_extension(b.db, 1);
+    if( sqlite3_load_extension(b.db, zLoad, zProc, &zErr) ){
+      fprintf(stderr, "csvbench: cannot load %s: %s\n", zLoad, zErr);
+      return 1;
+    }
+    if( sqlite3_exec(b.db, zSql, 0, 0, 0) ) benchFatal(&b, "cannot create table");
+    sqlite3_free(zSql);
+  }
+  benchPrepareData(&b, nLookup);
+
+  time(&now);
+  fprintf(b.out, "{\"tool\": \"csvbench\", \"format\": 2, \"engine\": ");
+  benchJsonString(&b, zEngine);
+  fprintf(b.out, ", \"label\": ");
+  benchJsonString(&b, zLabel);
+  fprintf(b.out, ", \"time\": %lld, \"sqlite_version\": \"%s\",\n \"file\": ",
+      (i64)now, sqlite3_libversion());
+  benchJsonString(&b, b.zFile);
+  fprintf(b.out, ", \"file_bytes\": %lld, \"rows\": %lld, \"results\": [",
+      b.nFileByte, b.nRow);
+  if( rImportTime>0.0 ){
+    fprintf(b.out,
+        "\n    {\"query\": \"import\", \"cache\": \"cold\", \"runs\": 1,"
+        " \"result_rows\": %lld,\n     \"best_s\": %.6f, \"median_s\": %.6f,"
+        " \"cpu_s\": null, \"rows_per_s\": %.1f, \"mb_per_s\": %.2f,\n"
+        "     \"peak_rss_kb\": %lld, \"heap_peak_bytes\": null,"
+        " \"allocs\": null}",
+        b.nRow, rImportTime, rImportTime, (double)b.nRow/rImportTime,
+        (double)b.nFileByte/(1024.0*1024.0)/rImportTime, iImportRss
+    );
+    b.nResult++;
+  }
+
+  for(i=0; i<(int)(sizeof(azAllQuery)/sizeof(azAllQuery[0])); i++){
+    const char *zQuery = azAllQuery[i];
+    if( zQueryList ){
+      /* Only run the queries named in the --query list */
+      int n = (int)strlen(zQuery);
+      const char *z = zQueryList;
+      while( z && (strncmp(z, zQuery, n) || (z[n] && z[n]!=',')) ){
+        z = strchr(z, ',');
+        if( z ) z++;
+      }
+      if( z==0 ) continue;
+    }
+    if( strcmp(zCache, "warm") ) benchQuery(&b, zQuery, 1);
+    if( strcmp(zCache, "cold") ) benchQuery(&b, zQuery, 0);
+  }
+  fprintf(b.out, "\n]}\n");
+
+  if( b.out!=stdout ) fclose(b.out);
+  sqlite3_free(b.zKeyCol);
+  sqlite3_free(b.zCatCol);
+  sqlite3_free(b.zKey);
+  sqlite3_free(b.zCat);
+  free(b.aRowid);
+  sqlite3_close(b.db);
+  return 0;
+}
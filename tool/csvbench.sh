@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Run csvbench over a matrix of generated datasets and write one JSON
+# object per line (JSON Lines) to stdout, ready to be appended to a
+# trend file.
+#
+# Usage:
+#
+#    tool/csvbench.sh ?-d DATADIR? ?-s SIZE? ?-x EXTENSION? ?-e ENGINES?
+#                     ?-u UPSTREAM? ?SHAPE ...?
+#
+# The datasets are written by csvgen into DATADIR (default: bench-data)
+# and are only generated if missing, so successive runs reuse them.
+# SIZE is passed to "csvgen --size" (default: 100M).  Any extra arguments
+# in CSVBENCH_ARGS are passed to csvbench, e.g. CSVBENCH_ARGS="--cache warm".
+#
+# ENGINES is a quoted list of csvbench engines to compare on every dataset
+# (default: "csv").  The "upstream" engine needs UPSTREAM, the shared
+# library built from SQLite's ext/misc/csv.c.  Each engine runs in its own
+# csvbench process, so that peak RSS figures are comparable.
+#
+set -e
+
+datadir=bench-data
+size=100M
+ext=./csv.so
+engines=csv
+upstream=./csv_upstream.so
+while getopts "d:s:x:e:u:" opt; do
+  case $opt in
+    d) datadir=$OPTARG ;;
+    s) size=$OPTARG ;;
+    x) ext=$OPTARG ;;
+    e) engines=$OPTARG ;;
+    u) upstream=$OPTARG ;;
+    *) exit 1 ;;
+  esac
+done
+shift $((OPTIND-1))
+shapes=${*:-"narrow wide numeric text quoted newlines crlf long"}
+
+tooldir=$(dirname "$0")
+[ -x ./csvgen ] || gcc -O2 -o csvgen "$tooldir/csvgen.c"
+[ -x ./csvbench ] || gcc -O2 -o csvbench "$tooldir/csvbench.c" -lsqlite3
+
+mkdir -p "$datadir"
+for shape in $shapes; do
+  file="$datadir/$shape-$size.csv"
+  [ -f "$file" ] || ./csvgen --shape "$shape" --size "$size" "$file"
+  for engine in $engines; do
+    # shellcheck disable=SC2086
+    ./csvbench $CSVBENCH_ARGS --engine "$engine" --upstream "$upstream" \
+        --db "$datadir/$shape-$size.db" --label "$shape-$size" \
+        "$ext" "$file" | tr -d '\n'
+    echo
+  done
+done
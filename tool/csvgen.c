@@ -0,0 +1,274 @@
+/*
+** 2026 October 17
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+** This file contains a generator of synthetic CSV files used to
+** benchmark the CSV virtual table (see csvbench.c).  The output is fully
+** determined by the command-line options and the seed, so the same
+** dataset can be regenerated on any machine.
+**
+** Build:
+**
+**    gcc -O2 -o csvgen tool/csvgen.c
+**
+** Usage:
+**
+**    csvgen ?OPTIONS? FILE
+**
+** Options:
+**
+**    --shape NAME       narrow, wide, numeric, text, quoted, newlines,
+**                       crlf or long (default: narrow)
+**    --size N[KMG]      stop once at least N bytes have been written
+**    --rows N           stop after N data rows
+**    --cols N           number of columns (overrides the shape)
+**    --field-len N      average length of text fields (overrides the shape)
+**    --quote PCT        percentage of text fields that are quoted with
+**                       embedded delimiters and escaped quotes
+**    --newline PCT      percentage of quoted fields with an embedded newline
+**    --crlf             terminate rows with CR LF
+**    --delim C          column delimiter (default: ',')
+**    --no-header        do not write the "c1,c2,..." header row
+**    --seed N           seed for the pseudo-random generator (default: 1)
+**
+** Whatever the shape, column c1 holds the 1-based row number and column
+** c2 one of 100 category keys ("k00" .. "k99"), so that the benchmark can
+** run selective filters and grouped aggregates with known selectivity.
+** The remaining columns are numeric or text depending on the shape.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned long long u64;
+
+/*
+** Parameters of a generated dataset.
+*/
+typedef struct GenShape GenShape;
+struct GenShape {
+  const char *zName;           /* Name of the shape preset */
+  int nCol;                    /* Number of columns, including c1 and c2 */
+  int pctNumeric;              /* Percentage of numeric columns */
+  int nFieldLen;               /* Average length of text fields */
+  int pctQuote;                /* Percentage of quoted text fields */
+  int pctNewline;              /* Percentage of quoted fields with a newline */
+  int bCrlf;                   /* True to end rows with CR LF */
+};
+
+static const GenShape aShape[] = {
+  /* zName       nCol  pctNumeric  nFieldLen  pctQuote  pctNewline  bCrlf */
+  { "narrow",      4,       50,        8,        0,        0,        0 },
+  { "wide",      200,       50,        8,        0,        0,        0 },
+  { "numeric",    16,      100,        0,        0,        0,        0 },
+  { "text",       16,        0,       24,        0,        0,        0 },
+  { "quoted",     16,        0,       24,       60,        0,        0 },
+  { "newlines",   16,        0,       24,       60,       30,        0 },
+  { "crlf",       16,       50,       12,       10,        0,        1 },
+  { "long",        8,        0,     4096,       10,        0,        0 },
+};
+
+/*
+** SplitMix64 pseudo-random generator.  It is fast, has a 64-bit state
+** and is trivially reproducible across platforms.
+*/
+static u64 genState = 1;
+static u64 genRandom(void){
+  u64 z = (genState += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+  return z ^ (z>>31);
+}
+static int genPercent(int pct){
+  return (int)(genRandom() % 100) < pct;
+}
+
+/*
+** Output routines.  They keep count of the bytes written so far so that
+** the --size limit also works when writing to a pipe.
+*/
+static u64 genBytes = 0;
+static void genPutc(int c, FILE *out){
+  putc(c, out);
+  genBytes++;
+}
+static void genPuts(const char *z, FILE *out){
+  genBytes += strlen(z);
+  fputs(z, out);
+}
+#define genPrintf(out, ...) (genBytes += (u64)fprintf(out, __VA_ARGS__))
+
+/*
+** Append a text field of about p->nFieldLen characters to FILE out.
+** Unquoted fields never contain a delimiter, quote or newline.
+*/
+static const char zAlpha[] =
+  "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789    ";
+static void genText(FILE *out, const GenShape *p, char cDelim){
+  int n = p->nFieldLen/2 + (int)(genRandom() % (u64)(p->nFieldLen+1));
+  int i;
+  if( n<1 ) n = 1;
+  if( genPercent(p->pctQuote) ){
+    int iSpecial = (int)(genRandom() % (u64)n);
+    int bNewline = genPercent(p->pctNewline);
+    genPutc('"', out);
+    for(i=0; i<n; i++){
+      if( i==iSpecial ){
+        /* one embedded delimiter, escaped quote or newline per field */
+        if( bNewline ){
+          if( p->bCrlf ) genPutc('\r', out);
+          genPutc('\n', out);
+        }else if( genRandom() & 1 ){
+          genPutc(cDelim, out);
+        }else{
+          genPuts("\"\"", out);
+        }
+      }else{
+        genPutc(zAlpha[genRandom() % (sizeof(zAlpha)-1)], out);
+      }
+    }
+    genPutc('"', out);
+  }else{
+    for(i=0; i<n; i++){
+      genPutc(zAlpha[genRandom() % (sizeof(zAlpha)-5)], out);
+    }
+  }
+}
+
+/*
+** Parse a size such as "100M" or "20G" into a number of bytes.
+*/
+static u64 genParseSize(const char *z){
+  char *zEnd;
+  u64 n = strtoull(z, &zEnd, 10);
+  switch( *zEnd ){
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+    case 't': case 'T': n <<= 40; break;
+  }
+  return n;
+}
+
+static void usage(const char *zArgv0){
+  fprintf(stderr,
+    "Usage: %s ?--shape NAME? ?--size N[KMG]? ?--rows N? ?--cols N?\n"
+    "       ?--field-len N? ?--quote PCT? ?--newline PCT? ?--crlf?\n"
+    "       ?--delim C? ?--no-header? ?--seed N? FILE\n", zArgv0);
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  GenShape shape = aShape[0];
+  u64 nMaxByte = 0;
+  u64 nMaxRow = 0;
+  u64 iRow;
+  int bHeader = 1;
+  char cDelim = ',';
+  const char *zFile = 0;
+  char *aNumeric;
+  FILE *out;
+  int i;
+
+  for(i=1; i<argc; i++){
+    const char *z = argv[i];
+    if( z[0]=='-' && z[1]=='-' ) z++;
+    if( strcmp(z, "-")==0 && zFile==0 ){
+      zFile = "-";
+    }else if( strcmp(z, "-crlf")==0 ){
+      shape.bCrlf = 1;
+    }else if( strcmp(z, "-no-header")==0 ){
+      bHeader = 0;
+    }else if( z[0]=='-' && i+1<argc ){
+      const char *zArg = argv[++i];
+      if( strcmp(z, "-shape")==0 ){
+        int j;
+        for(j=0; j<(int)(sizeof(aShape)/sizeof(aShape[0])); j++){
+          if( strcmp(aShape[j].zName, zArg)==0 ) break;
+        }
+        if( j>=(int)(sizeof(aShape)/sizeof(aShape[0])) ){
+          fprintf(stderr, "unknown shape: %s\n", zArg);
+          return 1;
+        }
+        shape = aShape[j];
+      }else if( strcmp(z, "-size")==0 ){
+        nMaxByte = genParseSize(zArg);
+      }else if( strcmp(z, "-rows")==0 ){
+        nMaxRow = strtoull(zArg, 0, 10);
+      }else if( strcmp(z, "-cols")==0 ){
+        shape.nCol = atoi(zArg);
+      }else if( strcmp(z, "-field-len")==0 ){
+        shape.nFieldLen = atoi(zArg);
+      }else if( strcmp(z, "-quote")==0 ){
+        shape.pctQuote = atoi(zArg);
+      }else if( strcmp(z, "-newline")==0 ){
+        shape.pctNewline = atoi(zArg);
+      }else if( strcmp(z, "-delim")==0 ){
+        cDelim = zArg[0];
+      }else if( strcmp(z, "-seed")==0 ){
+        genState = strtoull(zArg, 0, 10);
+      }else{
+        usage(argv[0]);
+      }
+    }else if( z[0]!='-' && zFile==0 ){
+      zFile = argv[i];
+    }else{
+      usage(argv[0]);
+    }
+  }
+  if( zFile==0 ) usage(argv[0]);
+  if( nMaxByte==0 && nMaxRow==0 ) nMaxRow = 100000;
+  if( shape.nCol<2 ) shape.nCol = 2;
+  if( shape.nFieldLen<1 ) shape.nFieldLen = 8;
+
+  out = strcmp(zFile, "-")==0 ? stdout : fopen(zFile, "wb");
+  if( out==0 ){
+    fprintf(stderr, "cannot open %s\n", zFile);
+    return 1;
+  }
+  setvbuf(out, 0, _IOFBF, 1<<20);
+
+  /* Decide once which of the columns c3..cN are numeric */
+  aNumeric = (char *)malloc(shape.nCol);
+  for(i=0; i<shape.nCol; i++){
+    aNumeric[i] = (char)(i<2 || genPercent(shape.pctNumeric));
+  }
+
+  if( bHeader ){
+    for(i=0; i<shape.nCol; i++){
+      if( i ) genPutc(cDelim, out);
+      genPrintf(out, "c%d", i+1);
+    }
+    genPuts(shape.bCrlf ? "\r\n" : "\n", out);
+  }
+
+  for(iRow=1; (nMaxRow==0 || iRow<=nMaxRow); iRow++){
+    genPrintf(out, "%llu%ck%02d", iRow, cDelim, (int)(genRandom() % 100));
+    for(i=2; i<shape.nCol; i++){
+      genPutc(cDelim, out);
+      if( aNumeric[i] ){
+        u64 r = genRandom();
+        if( r & 1 ){
+          genPrintf(out, "%lld", (long long)(r>>40) - (1LL<<22));
+        }else{
+          genPrintf(out, "%.4f", (double)(r>>11) / (double)(1ULL<<40));
+        }
+      }else{
+        genText(out, &shape, cDelim);
+      }
+    }
+    genPuts(shape.bCrlf ? "\r\n" : "\n", out);
+    if( nMaxByte && genBytes>=nMaxByte ) break;
+  }
+
+  free(aNumeric);
+  if( out!=stdout ) fclose(out);
+  return 0;
+}